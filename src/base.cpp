@@ -18,36 +18,67 @@
 
 #include <cstring>
 
+#include <sys/file.h>
+
+#include <algorithm>
 #include <mutex>
+#include <utility>
 
 #include "storage_file.hpp"
+#include "storage_uring.hpp"
 #include "storage_memory.hpp"
 #include "storage_mmap.hpp"
 #include "base.hpp"
 #include "encrypt.hpp"
+#include "compress.hpp"
 #include "logger.hpp"
+#include "stats.hpp"
 #include "emergency.hpp"
+#include "index.hpp"
 
 
-Base::Base(Storage::Type type, const std::string& dirName, uint64_t maxSize,
-        const std::vector<unsigned char>& key, bool punchHoles) :
-    _type(type),
-    _dirName(dirName),
-    _maxSize(maxSize),
-    _key(key),
-    _punchHoles(punchHoles),
+Base::Base(const Options& options) :
+    _type(options.type),
+    _dirName(options.dirName),
+    _dataDirNames(options.dataDirNames),
+    _maxSize(options.maxSize),
+    _key(options.key),
+    _cipher(options.cipher),
+    _punchHoles(options.punchHoles),
+    _directIO(options.directIO),
+    _indirectionBlockCacheSize(options.indirectionBlockCacheSize),
+    _dataBlockCacheSize(options.dataBlockCacheSize),
+    _cryptoThreads(options.cryptoThreads),
+    _durability(options.durability),
+    _syncInterval(options.syncInterval),
+    _compressionLevel(options.compressionLevel),
+    _newBlockSize(options.blockSize),
+    _blockSize(Block::MinSize),
+    _formatStorage(nullptr),
     _inodeMapStorage(nullptr),
     _inodeChunkStorage(nullptr),
     _direntMapStorage(nullptr),
     _direntChunkStorage(nullptr),
-    _blockMapStorage(nullptr),
-    _blockChunkStorage(nullptr),
     _inodeMap(nullptr),
     _direntMap(nullptr),
-    _blockMap(nullptr),
     _inodeMgr(nullptr),
     _direntMgr(nullptr),
-    _blockMgr(nullptr)
+    _indirectionBlockCache(nullptr),
+    _dataBlockCache(nullptr),
+    _cryptoPool(nullptr),
+    _cblockMapStorage { nullptr, nullptr, nullptr },
+    _cblockChunkStorage { nullptr, nullptr, nullptr },
+    _cblockMap { nullptr, nullptr, nullptr },
+    _cblockMgr { nullptr, nullptr, nullptr },
+    _nextStripe(0),
+    _nameIndexMemoryLimit(options.nameIndexMemoryLimit),
+    _nameIndexMemory(0),
+    _syncThreadStop(false),
+    _reclaimRate(options.reclaimRate),
+    _orphanMapStorage(nullptr),
+    _orphanMap(nullptr),
+    _reclaimThreadStop(false),
+    _streamThreadStop(false)
 {
 }
 
@@ -56,11 +87,30 @@ bool Base::encrypt() const
     return _key.size() == crypto_secretbox_KEYBYTES;
 }
 
+Storage* Base::newStorage(const std::string& dirName, const std::string& fileName, bool directIO) const
+{
+    switch (_type) {
+    case Storage::TypeMmap:
+        return new StorageMmap(dirName + '/' + fileName);
+    case Storage::TypeFile:
+        return new StorageFile(dirName + '/' + fileName, directIO);
+    case Storage::TypeUring:
+        return new StorageUring(dirName + '/' + fileName, directIO);
+    case Storage::TypeMem:
+        break;
+    }
+    return new StorageMemory;
+}
+
 uint64_t Base::storageSizeInBytes() const
 {
-    return _inodeMgr->storageSizeInBytes()
-        + _direntMgr->storageSizeInBytes()
-        + _blockMgr->storageSizeInBytes();
+    uint64_t size = _inodeMgr->storageSizeInBytes()
+        + _direntMgr->storageSizeInBytes();
+    for (size_t s = 0; s < _blockMgr.size(); s++)
+        size += _blockMgr[s]->storageSizeInBytes();
+    for (int c = 0; c < CompressedClasses; c++)
+        size += _cblockMgr[c]->storageSizeInBytes();
+    return size;
 }
 
 int Base::checkWriteAction(uint64_t additionalBytes) const
@@ -69,7 +119,7 @@ int Base::checkWriteAction(uint64_t additionalBytes) const
     if (emergencyType != EmergencyNone) {
         r = -EROFS;
     } else if (_maxSize > 0 && additionalBytes > 0) {
-        additionalBytes += 4 * sizeof(Block); // for additional indirection blocks
+        additionalBytes += 4 * _blockSize; // for additional indirection blocks
         if (storageSizeInBytes() + additionalBytes > _maxSize)
             r = -ENOSPC;
     }
@@ -143,103 +193,422 @@ int Base::direntWriteRaw(uint64_t index, const unsigned char* rawDirent)
     return entityWriteRaw(_direntMgr, index, rawDirent);
 }
 
-int Base::blockAddRaw(uint64_t* index, const unsigned char* rawBlock)
+bool Base::blockStripeIsValid(uint64_t index) const
 {
-    return entityAddRaw(_blockMgr, index, rawBlock);
+    if (blockStripe(index) < _blockMgr.size())
+        return true;
+    logger.log(Logger::Error, "block %lu is in stripe %zu, but there are only %zu stripes",
+            index, blockStripe(index), _blockMgr.size());
+    emergency(EmergencyBug);
+    return false;
+}
+
+int Base::blockAddRaw(uint64_t* index, const unsigned char* rawBlock, uint64_t hint)
+{
+    int r;
+    uint64_t chunk;
+    size_t stripe;
+    // a new run may leave a gap in the storage, so do not start one close to the size limit
+    if (hint == InvalidIndex || blockClass(hint) != 0 || blockStripe(hint) >= _blockMgr.size()
+            || (_maxSize > 0 && storageSizeInBytes() + blockRunLength() * _blockSize > _maxSize)) {
+        stripe = _nextStripe.fetch_add(1, std::memory_order_relaxed) % _blockMgr.size();
+        r = entityAddRaw(_blockMgr[stripe], &chunk, rawBlock);
+    } else {
+        // a file continues in the stripe of its preceding block, and each new run
+        // goes to the next stripe so that large files are spread over all of them
+        stripe = blockStripe(hint);
+        chunk = stripeChunk(hint);
+        if (chunk % blockRunLength() == 0 && _blockMgr.size() > 1) {
+            stripe = (stripe + 1) % _blockMgr.size();
+            // the position in the previous stripe means nothing here; do not leave a gap
+            uint64_t end = _blockMgr[stripe]->chunksInStorage();
+            chunk = std::min(chunk, (end + blockRunLength() - 1) / blockRunLength() * blockRunLength());
+        }
+        r = checkWriteAction(_blockMgr[stripe]->chunkSize());
+        if (r == 0)
+            r = _blockMgr[stripe]->addNear(chunk, blockRunLength(), &chunk, rawBlock);
+    }
+    if (r == 0)
+        *index = stripeIndex(stripe, chunk);
+    return r;
 }
 
 int Base::blockRemove(uint64_t index)
 {
-    return entityRemove(_blockMgr, index);
+    bool wasShared = false;
+    int r = checkWriteAction(0);
+    if (r == 0 && (blockClass(index) > CompressedClasses || (blockClass(index) == 0 && !blockStripeIsValid(index))))
+        r = -EIO;
+    if (r == 0 && blockClass(index) == 0)
+        r = blockRefs(index)->releaseRef(stripeChunk(index), &wasShared);
+    if (r < 0 || wasShared)
+        return r;
+    if (_indirectionBlockCache)
+        _indirectionBlockCache->remove(index);
+    if (_dataBlockCache)
+        _dataBlockCache->remove(index);
+    if (blockClass(index) != 0)
+        return entityRemove(_cblockMgr[blockClass(index) - 1], blockChunk(index));
+    return entityRemove(blockMgr(index), stripeChunk(index));
+}
+
+int Base::blockShare(uint64_t index)
+{
+    int r = checkWriteAction(0);
+    if (r == 0 && blockClass(index) != 0)
+        r = -ENOTSUP;
+    if (r == 0 && !blockStripeIsValid(index))
+        r = -EIO;
+    if (r == 0)
+        r = blockRefs(index)->addRef(stripeChunk(index));
+    return r;
+}
+
+bool Base::blockIsShared(uint64_t index)
+{
+    return blockClass(index) == 0 && blockStripeIsValid(index) && blockRefs(index)->isShared(stripeChunk(index));
+}
+
+bool Base::blockNeedsCopy(uint64_t index)
+{
+    return _compressionLevel > 0 || blockClass(index) != 0 || blockIsShared(index);
 }
 
 int Base::blockReadRaw(uint64_t index, unsigned char* rawBlock)
 {
-    return entityReadRaw(_blockMgr, index, rawBlock);
+    ChunkManager* mgr = blockMgr(index);
+    return mgr ? entityReadRaw(mgr, stripeChunk(index), rawBlock) : -EIO;
 }
 
 int Base::blockWriteRaw(uint64_t index, const unsigned char* rawBlock)
 {
-    return entityWriteRaw(_blockMgr, index, rawBlock);
+    ChunkManager* mgr = blockMgr(index);
+    return mgr ? entityWriteRaw(mgr, stripeChunk(index), rawBlock) : -EIO;
+}
+
+static const char FormatMagic[8] = { '6', 'f', 's', 'f', 'o', 'r', 'm', 't' };
+static constexpr uint64_t FormatVersion = 1;
+
+int Base::initializeFormat(std::string& errStr)
+{
+    FormatRecord record;
+    uint64_t formatBytes;
+    const uint64_t stripes = _blockChunkStorage.size();
+    uint64_t oldStripes = 1;
+    bool newId = false;
+    bool recordChanged = false;
+    _formatStorage->setChunkSize(sizeof(FormatRecord));
+    int r = _formatStorage->sizeInBytes(&formatBytes);
+    if (r == 0 && formatBytes > 0) {
+        r = _formatStorage->read(0, 1, &record);
+        if (r == 0 && (memcmp(record.magic, FormatMagic, sizeof(FormatMagic)) != 0
+                    || record.version != FormatVersion || !Block::isValidSize(record.blockSize)
+                    || record.stripes > MaxStripes || (record.flags & ~uint64_t(FormatFlagsKnown)) != 0)) {
+            errStr = "invalid or unsupported format.6fs";
+            r = -EINVAL;
+        }
+        if (r == 0) {
+            _blockSize = record.blockSize;
+            oldStripes = std::max(record.stripes, uint64_t(1));
+        }
+        if (r == 0 && oldStripes > stripes) {
+            errStr = "the file system has " + std::to_string(oldStripes - 1) + " data directories";
+            r = -EINVAL;
+        }
+        if (r == 0 && oldStripes < stripes) {
+            // new data directories add empty stripes
+            record.stripes = stripes;
+            recordChanged = true;
+        }
+        if (r == 0 && record.id[0] == 0 && record.id[1] == 0) {
+            randombytes_buf(record.id, sizeof(record.id));
+            newId = true;
+            recordChanged = true;
+        }
+    } else if (r == 0) {
+        // A new file system gets the requested block size. An existing one
+        // without format record was created with the minimum block size.
+        uint64_t inodeBytes;
+        r = _inodeChunkStorage->sizeInBytes(&inodeBytes);
+        if (r == 0) {
+            _blockSize = (inodeBytes == 0 && _newBlockSize != 0 ? _newBlockSize : Block::MinSize);
+            memset(&record, 0, sizeof(record));
+            memcpy(record.magic, FormatMagic, sizeof(FormatMagic));
+            record.version = FormatVersion;
+            record.blockSize = _blockSize;
+            record.stripes = stripes;
+            randombytes_buf(record.id, sizeof(record.id));
+            newId = true;
+            recordChanged = true;
+        }
+    }
+    if (r == 0 && _newBlockSize != 0 && _newBlockSize != _blockSize) {
+        errStr = "the file system has block size " + std::to_string(_blockSize);
+        r = -EINVAL;
+    }
+    // refuse the mount instead of failing to read data later
+    if (r == 0 && (record.flags & FormatFlagAES256GCM) && !cipherAvailable(CipherAES256GCM)) {
+        errStr = "the file system uses cipher aes256gcm, which is not supported by this CPU";
+        r = -ENOTSUP;
+    }
+    if (r == 0 && encrypt() && _cipher == CipherAES256GCM && !(record.flags & FormatFlagAES256GCM)) {
+        record.flags |= FormatFlagAES256GCM;
+        recordChanged = true;
+    }
+    // the stripe records come first, so that the format record never counts a stripe without one
+    if (r == 0)
+        r = initializeStripes(record, oldStripes, newId, errStr);
+    if (r == 0 && recordChanged) {
+        r = _formatStorage->write(0, 1, &record);
+        if (r == 0 && _durability != DurabilityNone)
+            r = _formatStorage->sync();
+    }
+    return r;
+}
+
+static const char StripeMagic[8] = { '6', 'f', 's', 's', 't', 'r', 'i', 'p' };
+
+int Base::initializeStripes(const FormatRecord& record, uint64_t oldStripes, bool newId, std::string& errStr)
+{
+    int r = 0;
+    for (uint64_t s = 1; r == 0 && s < _blockChunkStorage.size(); s++) {
+        const std::string& dirName = _dataDirNames[s - 1];
+        Storage* storage = newStorage(dirName, "stripe.6fs", false);
+        storage->setChunkSize(sizeof(StripeRecord));
+        StripeRecord stripeRecord;
+        uint64_t stripeBytes = 0;
+        r = storage->open();
+        if (r == 0)
+            r = storage->sizeInBytes(&stripeBytes);
+        if (r == 0 && s >= oldStripes) {
+            uint64_t dataBytes;
+            r = _blockChunkStorage[s]->sizeInBytes(&dataBytes);
+            if (r == 0 && dataBytes > 0) {
+                errStr = "the new data directory " + dirName + " is not empty";
+                r = -EINVAL;
+            }
+        }
+        if (r == 0 && (s >= oldStripes || newId)) {
+            // a new stripe or file system id: a record from an interrupted
+            // earlier mount is overwritten
+            memset(&stripeRecord, 0, sizeof(stripeRecord));
+            memcpy(stripeRecord.magic, StripeMagic, sizeof(StripeMagic));
+            memcpy(stripeRecord.id, record.id, sizeof(record.id));
+            stripeRecord.stripe = s;
+            r = storage->write(0, 1, &stripeRecord);
+            if (r == 0 && _durability != DurabilityNone)
+                r = storage->sync();
+        } else if (r == 0 && stripeBytes > 0) {
+            r = storage->read(0, 1, &stripeRecord);
+            if (r == 0 && memcmp(stripeRecord.magic, StripeMagic, sizeof(StripeMagic)) != 0) {
+                errStr = "invalid stripe.6fs in data directory " + dirName;
+                r = -EINVAL;
+            }
+            if (r == 0 && memcmp(stripeRecord.id, record.id, sizeof(record.id)) != 0) {
+                errStr = "data directory " + dirName + " belongs to another file system";
+                r = -EINVAL;
+            }
+            if (r == 0 && stripeRecord.stripe != s) {
+                errStr = "data directory " + dirName + " must be data directory number "
+                    + std::to_string(stripeRecord.stripe) + ", not " + std::to_string(s);
+                r = -EINVAL;
+            }
+        } else if (r == 0) {
+            errStr = "data directory " + dirName + " has no stripe.6fs";
+            r = -EINVAL;
+        }
+        int r2 = storage->close();
+        if (r == 0)
+            r = r2;
+        delete storage;
+    }
+    return r;
 }
 
 int Base::initialize(std::string& errStr, bool* needsRootNode)
 {
-    switch (_type) {
-    case Storage::TypeMmap:
-        _inodeMapStorage    = new StorageMmap(_dirName + '/' + "inodemap.6fs");
-        _inodeChunkStorage  = new StorageMmap(_dirName + '/' + "inodedat.6fs");
-        _direntMapStorage   = new StorageMmap(_dirName + '/' + "direnmap.6fs");
-        _direntChunkStorage = new StorageMmap(_dirName + '/' + "direndat.6fs");
-        _blockMapStorage    = new StorageMmap(_dirName + '/' + "blockmap.6fs");
-        _blockChunkStorage  = new StorageMmap(_dirName + '/' + "blockdat.6fs");
-        break;
-    case Storage::TypeFile:
-        _inodeMapStorage    = new StorageFile(_dirName + '/' + "inodemap.6fs");
-        _inodeChunkStorage  = new StorageFile(_dirName + '/' + "inodedat.6fs");
-        _direntMapStorage   = new StorageFile(_dirName + '/' + "direnmap.6fs");
-        _direntChunkStorage = new StorageFile(_dirName + '/' + "direndat.6fs");
-        _blockMapStorage    = new StorageFile(_dirName + '/' + "blockmap.6fs");
-        _blockChunkStorage  = new StorageFile(_dirName + '/' + "blockdat.6fs");
-        break;
-    case Storage::TypeMem:
-        _inodeMapStorage = new StorageMemory;
-        _inodeChunkStorage = new StorageMemory;
-        _direntMapStorage = new StorageMemory;
-        _direntChunkStorage = new StorageMemory;
-        _blockMapStorage = new StorageMemory;
-        _blockChunkStorage = new StorageMemory;
-        break;
+    _formatStorage      = newStorage(_dirName, "format.6fs", false);
+    _inodeMapStorage    = newStorage(_dirName, "inodemap.6fs", false);
+    _inodeChunkStorage  = newStorage(_dirName, "inodedat.6fs", false);
+    _direntMapStorage   = newStorage(_dirName, "direnmap.6fs", false);
+    _direntChunkStorage = newStorage(_dirName, "direndat.6fs", false);
+    for (size_t s = 0; s <= _dataDirNames.size(); s++) {
+        const std::string& dirName = (s == 0 ? _dirName : _dataDirNames[s - 1]);
+        _blockMapStorage.push_back(newStorage(dirName, "blockmap.6fs", false));
+        _blockChunkStorage.push_back(newStorage(dirName, "blockdat.6fs", _directIO));
+        _blockRefStorage.push_back(newStorage(dirName, "blockref.6fs", false));
+    }
+    _orphanMapStorage   = newStorage(_dirName, "orphans.6fs", false);
+    // The files of the compressed classes are named after the class sizes for
+    // the minimum block size, whatever the block size of the file system is
+    // (which is not known yet anyway)
+    for (int c = 0; c < CompressedClasses; c++) {
+        std::string suffix = '-' + std::to_string(Block::MinSize >> (CompressedClasses - c)) + ".6fs";
+        _cblockMapStorage[c]   = newStorage(_dirName, "blockmap" + suffix, false);
+        _cblockChunkStorage[c] = newStorage(_dirName, "blockdat" + suffix, false);
     }
 
     int r;
-    r = _inodeMapStorage->open();
+    r = _formatStorage->open();
+    // Only one process may use the file system at a time, e.g. a compaction
+    // must not run while it is mounted. The lock lasts until cleanup() closes
+    // format.6fs.
+    if (r == 0 && _formatStorage->fileDescriptor() >= 0
+            && flock(_formatStorage->fileDescriptor(), LOCK_EX | LOCK_NB) < 0) {
+        r = -errno;
+        errStr = (r == -EWOULDBLOCK ? std::string("the file system is in use by another process")
+                : std::string("cannot lock format.6fs: ") + strerror(-r));
+    }
+    if (r == 0)
+        r = _inodeMapStorage->open();
     if (r == 0)
         r = _inodeChunkStorage->open();
     if (r == 0)
         r = _direntMapStorage->open();
     if (r == 0)
         r = _direntChunkStorage->open();
+    for (size_t s = 0; r == 0 && s < _blockChunkStorage.size(); s++) {
+        r = _blockMapStorage[s]->open();
+        if (r == 0)
+            r = _blockChunkStorage[s]->open();
+        if (r == 0)
+            r = _blockRefStorage[s]->open();
+    }
     if (r == 0)
-        r = _blockMapStorage->open();
+        r = _orphanMapStorage->open();
+    for (int c = 0; r == 0 && c < CompressedClasses; c++) {
+        r = _cblockMapStorage[c]->open();
+        if (r == 0)
+            r = _cblockChunkStorage[c]->open();
+    }
     if (r == 0)
-        r = _blockChunkStorage->open();
+        r = initializeFormat(errStr);
     if (r == 0) {
         _inodeMap  = new Map(_inodeMapStorage);
         _direntMap = new Map(_direntMapStorage);
-        _blockMap  = new Map(_blockMapStorage);
         _inodeMgr  = new ChunkManager(_inodeMap,  _inodeChunkStorage,  encrypt() ? EncInodeSize  : sizeof(Inode),  false);
         _direntMgr = new ChunkManager(_direntMap, _direntChunkStorage, encrypt() ? EncDirentSize : sizeof(Dirent), false);
-        _blockMgr  = new ChunkManager(_blockMap,  _blockChunkStorage,  encrypt() ? EncBlockSize  : sizeof(Block),  _punchHoles);
+        for (size_t s = 0; s < _blockChunkStorage.size(); s++) {
+            _blockMap.push_back(new Map(_blockMapStorage[s]));
+            _blockMgr.push_back(new ChunkManager(_blockMap[s], _blockChunkStorage[s],
+                        encrypt() ? encBlockSize() : _blockSize, _punchHoles));
+            _blockRefs.push_back(new RefCountTable(_blockRefStorage[s]));
+        }
+        _orphanMap = new Map(_orphanMapStorage);
+        for (int c = 0; c < CompressedClasses; c++) {
+            _cblockMap[c] = new Map(_cblockMapStorage[c]);
+            _cblockMgr[c] = new ChunkManager(_cblockMap[c], _cblockChunkStorage[c],
+                    compressedClassSize(c) + (encrypt() ? EncOverhead : 0), _punchHoles);
+        }
     }
     if (r == 0)
         r = _inodeMgr->initialize();
     if (r == 0)
         r = _direntMgr->initialize();
+    for (size_t s = 0; r == 0 && s < _blockMgr.size(); s++) {
+        r = _blockMgr[s]->initialize();
+        if (r == 0)
+            r = _blockRefs[s]->initialize();
+    }
+    for (int c = 0; r == 0 && c < CompressedClasses; c++)
+        r = _cblockMgr[c]->initialize();
+    // compressed blocks could not be read later; refuse the mount instead
+    for (int c = 0; r == 0 && !compressionAvailable() && c < CompressedClasses; c++) {
+        uint64_t i;
+        r = _cblockMap[c]->nextOne(0, &i);
+        if (r == 0 && i != InvalidIndex) {
+            errStr = "the file system contains compressed blocks, but 6fs was built without zstd support";
+            r = -ENOTSUP;
+        }
+    }
     if (r == 0)
-        r = _blockMgr->initialize();
+        r = _orphanMap->initialize();
+    for (uint64_t i = 0; r == 0; i++) {
+        r = _orphanMap->nextOne(i, &i);
+        if (r < 0 || i == InvalidIndex)
+            break;
+        try { _orphanQueue.push_back(i); }
+        catch (...) { r = -ENOMEM; }
+    }
 
     if (r == 0) {
         *needsRootNode = (_inodeMgr->chunksInStorage() == 0);
     }
 
+    if (r == 0 && _indirectionBlockCacheSize >= _blockSize) {
+        try {
+            _indirectionBlockCache = new BlockCache(_blockSize, _indirectionBlockCacheSize / _blockSize,
+                    [this](uint64_t index, const Block* block) { return blockWriteNow(index, block); });
+        }
+        catch (...) {
+            r = -ENOMEM;
+        }
+    }
+    if (r == 0 && _dataBlockCacheSize >= _blockSize) {
+        try {
+            _dataBlockCache = new BlockCache(_blockSize, _dataBlockCacheSize / _blockSize,
+                    [this](uint64_t index, const Block* block) { return blockWriteNow(index, block); });
+        }
+        catch (...) {
+            r = -ENOMEM;
+        }
+    }
+    if (r == 0 && encrypt()) {
+        try {
+            _cryptoPool = new WorkerPool(_cryptoThreads);
+        }
+        catch (...) {
+            r = -ENOMEM;
+        }
+    }
+
     if (r < 0) {
-        delete _blockMgr;
-        _blockMgr = nullptr;
+        delete _cryptoPool;
+        _cryptoPool = nullptr;
+        delete _dataBlockCache;
+        _dataBlockCache = nullptr;
+        delete _indirectionBlockCache;
+        _indirectionBlockCache = nullptr;
+        for (int c = 0; c < CompressedClasses; c++) {
+            delete _cblockMgr[c];
+            _cblockMgr[c] = nullptr;
+            delete _cblockMap[c];
+            _cblockMap[c] = nullptr;
+            delete _cblockChunkStorage[c];
+            _cblockChunkStorage[c] = nullptr;
+            delete _cblockMapStorage[c];
+            _cblockMapStorage[c] = nullptr;
+        }
+        _orphanQueue.clear();
+        delete _orphanMap;
+        _orphanMap = nullptr;
+        for (size_t s = 0; s < _blockRefs.size(); s++)
+            delete _blockRefs[s];
+        _blockRefs.clear();
+        for (size_t s = 0; s < _blockMgr.size(); s++)
+            delete _blockMgr[s];
+        _blockMgr.clear();
         delete _direntMgr;
         _direntMgr = nullptr;
         delete _inodeMgr;
         _inodeMgr = nullptr;
-        delete _blockMap;
-        _blockMap = nullptr;
+        for (size_t s = 0; s < _blockMap.size(); s++)
+            delete _blockMap[s];
+        _blockMap.clear();
         delete _direntMap;
         _direntMap = nullptr;
         delete _inodeMap;
         _inodeMap = nullptr;
-        delete _blockChunkStorage;
-        _blockChunkStorage = nullptr;
-        delete _blockMapStorage;
-        _blockMapStorage = nullptr;
+        delete _orphanMapStorage;
+        _orphanMapStorage = nullptr;
+        for (size_t s = 0; s < _blockChunkStorage.size(); s++) {
+            delete _blockRefStorage[s];
+            delete _blockChunkStorage[s];
+            delete _blockMapStorage[s];
+        }
+        _blockRefStorage.clear();
+        _blockChunkStorage.clear();
+        _blockMapStorage.clear();
         delete _direntChunkStorage;
         _direntChunkStorage = nullptr;
         delete _direntMapStorage;
@@ -248,22 +617,342 @@ int Base::initialize(std::string& errStr, bool* needsRootNode)
         _inodeChunkStorage = nullptr;
         delete _inodeMapStorage;
         _inodeMapStorage = nullptr;
-        errStr = strerror(-r);
+        delete _formatStorage;
+        _formatStorage = nullptr;
+        if (errStr.empty())
+            errStr = strerror(-r);
     }
 
     return r;
 }
 
-int Base::createRootNode()
+int Base::createRootNode(uint64_t dirFormat)
 {
     uint64_t rootIndex;
-    Inode root = Inode::directory(nullptr, ModeRWXU);
+    Inode root = Inode::directory(nullptr, ModeRWXU, dirFormat);
     return inodeAdd(&rootIndex, &root);
 }
 
+void Base::startThreads()
+{
+    if (!_syncThread.joinable()) {
+        try {
+            _syncThread = std::thread(&Base::syncThreadLoop, this);
+        }
+        catch (...) {
+            logger.log(Logger::Error, "cannot start sync thread; pending changes will only be written when files are changed or closed");
+        }
+    }
+    if (!_reclaimThread.joinable()) {
+        try {
+            _reclaimThread = std::thread(&Base::reclaimThreadLoop, this);
+        }
+        catch (...) {
+            logger.log(Logger::Error, "cannot start reclaim thread; data of removed files will be reclaimed immediately");
+        }
+    }
+    if (!_streamThread.joinable()) {
+        try {
+            _streamThread = std::thread(&Base::streamThreadLoop, this);
+        }
+        catch (...) {
+            logger.log(Logger::Error, "cannot start streaming thread; there will be no readahead and write-behind");
+        }
+    }
+}
+
+void Base::syncThreadLoop()
+{
+    // wake up often enough for the inode write back and, if enabled, the periodic sync
+    std::chrono::seconds interval(Handle::InodeWriteBackInterval);
+    if (_durability == DurabilityPeriodic && _syncInterval > 0)
+        interval = std::min(interval, std::chrono::seconds(_syncInterval));
+    std::chrono::steady_clock::time_point nextCommit = std::chrono::steady_clock::now() + std::chrono::seconds(_syncInterval);
+
+    std::unique_lock<std::mutex> lock(_syncThreadMutex);
+    while (!_syncThreadCond.wait_for(lock, interval, [this] { return _syncThreadStop; })) {
+        lock.unlock();
+        int r = forEachHandle([](Handle* handle) { return handle->writeInodeIfStale(); });
+        if (r < 0)
+            logger.log(Logger::Error, "inode write back failed: %s", strerror(-r));
+        if (_durability == DurabilityPeriodic && std::chrono::steady_clock::now() >= nextCommit) {
+            // pending changes of open files must be in the 6fs files before these are flushed
+            r = forEachHandle([](Handle* handle) { return handle->sync(); });
+            int r2 = flushCaches();
+            int r3 = commit();
+            r = (r != 0 ? r : r2 != 0 ? r2 : r3);
+            if (r < 0)
+                logger.log(Logger::Error, "periodic sync failed: %s", strerror(-r));
+            nextCommit = std::chrono::steady_clock::now() + std::chrono::seconds(_syncInterval);
+        }
+        lock.lock();
+    }
+}
+
+int Base::forEachHandle(const std::function<int (Handle* handle)>& f)
+{
+    std::vector<Handle*> handles;
+    for (size_t i = 0; i < HandleMapShards; i++) {
+        HandleMapShard& shard = _handleMap[i];
+        std::unique_lock<std::mutex> handleMapLock(shard.mutex, std::defer_lock);
+        lockRecordingWait(handleMapLock, Stats::WaitHandleMapLock);
+        try {
+            handles.reserve(handles.size() + shard.handles.size());
+        }
+        catch (...) {
+            break; // handles that are left out are visited again next time
+        }
+        for (auto it = shard.handles.begin(); it != shard.handles.end(); it++) {
+            it->second->refCount()++;
+            handles.push_back(it->second);
+        }
+    }
+    int ret = 0;
+    for (size_t i = 0; i < handles.size(); i++) {
+        int r = f(handles[i]);
+        int r2 = handleRelease(handles[i]);
+        if (ret == 0)
+            ret = (r < 0 ? r : r2);
+    }
+    return ret;
+}
+
+int Base::orphanAdd(uint64_t inodeIndex)
+{
+    int r;
+    {
+        std::lock_guard<std::mutex> lock(_reclaimMutex);
+        r = _orphanMap->setOne(inodeIndex);
+        if (r == 0) {
+            try { _orphanQueue.push_back(inodeIndex); }
+            catch (...) { r = -ENOMEM; }
+            if (r < 0) // the caller removes the inode itself
+                _orphanMap->setZero(inodeIndex);
+        }
+    }
+    if (r == 0)
+        _reclaimCond.notify_all();
+    else
+        logger.log(Logger::Error, "cannot add orphan inode %lu: %s", inodeIndex, strerror(-r));
+    return r;
+}
+
+void Base::reclaimThreadLoop()
+{
+    std::unique_lock<std::mutex> lock(_reclaimMutex);
+    for (;;) {
+        _reclaimCond.wait(lock, [this] { return _reclaimThreadStop || !_orphanQueue.empty(); });
+        if (_reclaimThreadStop)
+            break;
+        uint64_t inodeIndex = _orphanQueue.front();
+        lock.unlock();
+        int r = reclaimOrphan(inodeIndex);
+        if (r < 0)
+            logger.log(Logger::Error, "cannot reclaim orphan inode %lu: %s", inodeIndex, strerror(-r));
+        lock.lock();
+        // an unfinished orphan stays in the map for the next mount
+        if (!_reclaimThreadStop && !_orphanQueue.empty())
+            _orphanQueue.pop_front();
+    }
+}
+
+int Base::reclaimOrphan(uint64_t inodeIndex)
+{
+    Inode inode;
+    int r = inodeRead(inodeIndex, &inode);
+    if (r == 0 && (inode.type() != TypeREG || inode.nlink != 0)) {
+        logger.log(Logger::Error, "orphan inode %lu is not an unlinked regular file; ignoring it", inodeIndex);
+        std::lock_guard<std::mutex> lock(_reclaimMutex);
+        return _orphanMap->setZero(inodeIndex);
+    }
+    if (r < 0)
+        return r;
+
+    Handle handle(this, inodeIndex, inode);
+    uint64_t slot = 0;
+    while (r == 0 && slot != InvalidIndex) {
+        uint64_t freedBlocks;
+        r = handle.reclaim(&slot, ReclaimBatchBlocks, &freedBlocks);
+        if (r == 0) {
+            // throttle to the reclaim rate; stop early on unmount
+            auto pause = std::chrono::microseconds(_reclaimRate == 0 ? 0
+                    : freedBlocks * _blockSize * 1000000 / _reclaimRate);
+            std::unique_lock<std::mutex> lock(_reclaimMutex);
+            if (_reclaimCond.wait_for(lock, pause, [this] { return _reclaimThreadStop; }))
+                break;
+        }
+    }
+    if (r == 0)
+        r = handle.cleanup();
+    int r2 = flushCaches(inodeIndex);
+    if (r == 0)
+        r = r2;
+    if (r == 0 && slot == InvalidIndex) {
+        // durably forget the orphan before its inode can be reused
+        std::lock_guard<std::mutex> lock(_reclaimMutex);
+        r = _orphanMap->setZero(inodeIndex);
+        if (r == 0)
+            r = _orphanMap->sync();
+        if (r == 0 && _durability != DurabilityNone)
+            r = _orphanMap->syncStorage();
+    }
+    if (r == 0 && slot == InvalidIndex)
+        r = inodeRemove(inodeIndex);
+    return r;
+}
+
+void Base::streamThreadLoop()
+{
+    std::unique_lock<std::mutex> lock(_streamMutex);
+    for (;;) {
+        _streamCond.wait(lock, [this] { return _streamThreadStop || !_streamQueue.empty(); });
+        if (_streamThreadStop)
+            break;
+        StreamRequest req = _streamQueue.front();
+        _streamQueue.pop_front();
+        lock.unlock();
+        int r = 0;
+        if (req.count > 0)
+            r = req.handle->prefetch(req.slot, req.count);
+        else if (_dataBlockCache)
+            r = _dataBlockCache->flush(req.handle->inodeIndex());
+        // errors of write-behind are reported again when the blocks are written on close
+        if (r < 0)
+            logger.log(Logger::Warning, "%s of inode %lu failed: %s", req.count > 0 ? "prefetching" : "write-behind",
+                    req.handle->inodeIndex(), strerror(-r));
+        r = handleRelease(req.handle);
+        if (r < 0)
+            logger.log(Logger::Error, "cannot release inode %lu after streaming: %s", req.handle->inodeIndex(), strerror(-r));
+        lock.lock();
+    }
+}
+
+void Base::streamRequest(Handle* handle, uint64_t slot, uint64_t count)
+{
+    if (!_streamThread.joinable())
+        return;
+    {
+        HandleMapShard& shard = handleMapShard(handle->inodeIndex());
+        std::unique_lock<std::mutex> handleMapLock(shard.mutex, std::defer_lock);
+        lockRecordingWait(handleMapLock, Stats::WaitHandleMapLock);
+        handle->refCount()++;
+    }
+    bool queued = false;
+    {
+        std::lock_guard<std::mutex> lock(_streamMutex);
+        if (_streamQueue.size() < MaxStreamRequests) {
+            try {
+                _streamQueue.push_back(StreamRequest { handle, slot, count });
+                queued = true;
+            }
+            catch (...) {
+            }
+        }
+    }
+    if (queued)
+        _streamCond.notify_one();
+    else
+        handleRelease(handle); // cannot be the last reference since the caller holds one
+}
+
+void Base::prefetch(Handle* handle, uint64_t slot, uint64_t count)
+{
+    if (count > 0)
+        streamRequest(handle, slot, count);
+}
+
+void Base::writeBehind(Handle* handle)
+{
+    if (_dataBlockCache)
+        streamRequest(handle, 0, 0);
+}
+
+int Base::commit()
+{
+    // data first, so that durable metadata does not refer to data that is not;
+    // the files of each step are synced together, see Storage::syncMany()
+    std::vector<Storage*> storages;
+    int r = 0;
+    for (size_t s = 0; s < _blockMgr.size(); s++) {
+        int rs = _blockMgr[s]->sync();
+        if (rs == 0)
+            _blockMgr[s]->appendStorages(storages);
+        else if (r == 0)
+            r = rs;
+    }
+    for (int c = 0; c < CompressedClasses; c++) {
+        int rc = _cblockMgr[c]->sync();
+        if (rc == 0)
+            _cblockMgr[c]->appendStorages(storages);
+        else if (r == 0)
+            r = rc;
+    }
+    int rd = Storage::syncMany(storages);
+    if (r == 0)
+        r = rd;
+    // then the metadata
+    storages.clear();
+    for (size_t s = 0; s < _blockRefStorage.size(); s++)
+        storages.push_back(_blockRefStorage[s]);
+    int r2 = _direntMgr->sync();
+    if (r2 == 0)
+        _direntMgr->appendStorages(storages);
+    int r3 = _inodeMgr->sync();
+    if (r3 == 0)
+        _inodeMgr->appendStorages(storages);
+    int rm = Storage::syncMany(storages);
+    if (r == 0)
+        r = (r2 != 0 ? r2 : r3 != 0 ? r3 : rm);
+    // orphans last, so that each refers to a durable inode
+    int r4;
+    {
+        std::lock_guard<std::mutex> lock(_reclaimMutex);
+        r4 = _orphanMap->sync();
+        if (r4 == 0)
+            r4 = _orphanMap->syncStorage();
+    }
+    return (r != 0 ? r : r4);
+}
+
+int Base::fsync()
+{
+    return (_durability == DurabilityFsync ? commit() : 0);
+}
+
 int Base::cleanup()
 {
-    if (!_blockMgr && !_direntMgr && !_inodeMgr)
+    if (_streamThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(_streamMutex);
+            _streamThreadStop = true;
+        }
+        _streamCond.notify_all();
+        _streamThread.join();
+        for (size_t i = 0; i < _streamQueue.size(); i++)
+            handleRelease(_streamQueue[i].handle);
+        _streamQueue.clear();
+    }
+    if (_syncThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(_syncThreadMutex);
+            _syncThreadStop = true;
+        }
+        _syncThreadCond.notify_all();
+        _syncThread.join();
+    }
+    if (_reclaimThread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(_reclaimMutex);
+            _reclaimThreadStop = true;
+        }
+        _reclaimCond.notify_all();
+        _reclaimThread.join();
+    }
+    for (size_t i = 0; i < _slotBlockPool.size(); i++)
+        delete[] _slotBlockPool[i];
+    _slotBlockPool.clear();
+
+    if (_blockMgr.empty() && !_direntMgr && !_inodeMgr)
         return 0;
 
     // Statistics
@@ -273,38 +962,103 @@ int Base::cleanup()
     uint64_t direntSize = 0, direntsIn = 0, direntsOut = 0, direntsPunchedHole = 0;
     uint64_t blockBitSetSize = 0, blockBitSetsIn = 0, blockBitSetsOut = 0, blockBitSetsPunchedHole = 0;
     uint64_t blockSize = 0, blocksIn = 0, blocksOut = 0, blocksPunchedHole = 0;
+    uint64_t cblockBitSetBytesIn = 0, cblockBitSetBytesOut = 0, cblockBytesIn = 0, cblockBytesOut = 0;
+
+    uint64_t indirectionBlockCacheHits = 0, indirectionBlockCacheMisses = 0;
+    uint64_t dataBlockCacheHits = 0, dataBlockCacheMisses = 0;
 
     // Shutdown / cleanup
-    int r[9] = { 0, 0, 0, 0, 0, 0, 0, 0, 0 };
-    if (_blockMgr) {
-        r[0] = _blockMgr->sync();
-        if (_blockChunkStorage) {
-            blockSize = _blockChunkStorage->chunkSize();
-            blocksIn = _blockChunkStorage->chunksIn();
-            blocksOut = _blockChunkStorage->chunksOut();
-            blocksPunchedHole = _blockChunkStorage->chunksPunchedHole();
-            r[1] = _blockChunkStorage->close();
-            delete _blockChunkStorage;
-            _blockChunkStorage = nullptr;
-        }
-        if (_blockMapStorage) {
-            blockBitSetSize = _blockMapStorage->chunkSize();
-            blockBitSetsIn = _blockMapStorage->chunksIn();
-            blockBitSetsOut = _blockMapStorage->chunksOut();
-            blockBitSetsPunchedHole = _blockMapStorage->chunksPunchedHole();
-            r[2] = _blockMapStorage->close();
-            delete _blockMapStorage;
-            _blockMapStorage = nullptr;
-        }
-        if (_blockMap) {
-            delete _blockMap;
-            _blockMap = nullptr;
-        }
-        delete _blockMgr;
-        _blockMgr = nullptr;
+    int r[19] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+    delete _cryptoPool;
+    _cryptoPool = nullptr;
+    if (_dataBlockCache) {
+        r[10] = _dataBlockCache->flush();
+        dataBlockCacheHits = _dataBlockCache->hits();
+        dataBlockCacheMisses = _dataBlockCache->misses();
+        delete _dataBlockCache;
+        _dataBlockCache = nullptr;
+    }
+    if (_indirectionBlockCache) {
+        r[9] = _indirectionBlockCache->flush();
+        indirectionBlockCacheHits = _indirectionBlockCache->hits();
+        indirectionBlockCacheMisses = _indirectionBlockCache->misses();
+        delete _indirectionBlockCache;
+        _indirectionBlockCache = nullptr;
+    }
+    for (size_t s = 0; s < _blockMgr.size(); s++) {
+        int rs = (_durability == DurabilityNone ? _blockMgr[s]->sync() : _blockMgr[s]->commit());
+        if (r[0] == 0)
+            r[0] = rs;
+        blockSize = _blockChunkStorage[s]->chunkSize();
+        blocksIn += _blockChunkStorage[s]->chunksIn();
+        blocksOut += _blockChunkStorage[s]->chunksOut();
+        blocksPunchedHole += _blockChunkStorage[s]->chunksPunchedHole();
+        rs = _blockChunkStorage[s]->close();
+        if (r[1] == 0)
+            r[1] = rs;
+        delete _blockChunkStorage[s];
+        blockBitSetSize = _blockMapStorage[s]->chunkSize();
+        blockBitSetsIn += _blockMapStorage[s]->chunksIn();
+        blockBitSetsOut += _blockMapStorage[s]->chunksOut();
+        blockBitSetsPunchedHole += _blockMapStorage[s]->chunksPunchedHole();
+        rs = _blockMapStorage[s]->close();
+        if (r[2] == 0)
+            r[2] = rs;
+        delete _blockMapStorage[s];
+        delete _blockMap[s];
+        delete _blockMgr[s];
+    }
+    _blockChunkStorage.clear();
+    _blockMapStorage.clear();
+    _blockMap.clear();
+    _blockMgr.clear();
+    for (int c = 0; c < CompressedClasses; c++) {
+        if (!_cblockMgr[c])
+            continue;
+        int rc = (_durability == DurabilityNone ? _cblockMgr[c]->sync() : _cblockMgr[c]->commit());
+        if (r[13] == 0)
+            r[13] = rc;
+        if (_cblockChunkStorage[c]) {
+            cblockBytesIn += _cblockChunkStorage[c]->chunksIn() * _cblockChunkStorage[c]->chunkSize();
+            cblockBytesOut += _cblockChunkStorage[c]->chunksOut() * _cblockChunkStorage[c]->chunkSize();
+            rc = _cblockChunkStorage[c]->close();
+            if (r[14] == 0)
+                r[14] = rc;
+            delete _cblockChunkStorage[c];
+            _cblockChunkStorage[c] = nullptr;
+        }
+        if (_cblockMapStorage[c]) {
+            cblockBitSetBytesIn += _cblockMapStorage[c]->chunksIn() * _cblockMapStorage[c]->chunkSize();
+            cblockBitSetBytesOut += _cblockMapStorage[c]->chunksOut() * _cblockMapStorage[c]->chunkSize();
+            rc = _cblockMapStorage[c]->close();
+            if (r[15] == 0)
+                r[15] = rc;
+            delete _cblockMapStorage[c];
+            _cblockMapStorage[c] = nullptr;
+        }
+        delete _cblockMap[c];
+        _cblockMap[c] = nullptr;
+        delete _cblockMgr[c];
+        _cblockMgr[c] = nullptr;
     }
+    for (size_t s = 0; s < _blockRefs.size(); s++) {
+        if (_durability != DurabilityNone) {
+            int rs = _blockRefs[s]->sync();
+            if (r[11] == 0)
+                r[11] = rs;
+        }
+        delete _blockRefs[s];
+    }
+    _blockRefs.clear();
+    for (size_t s = 0; s < _blockRefStorage.size(); s++) {
+        int rs = _blockRefStorage[s]->close();
+        if (r[12] == 0)
+            r[12] = rs;
+        delete _blockRefStorage[s];
+    }
+    _blockRefStorage.clear();
     if (_direntMgr) {
-        r[3] = _direntMgr->sync();
+        r[3] = (_durability == DurabilityNone ? _direntMgr->sync() : _direntMgr->commit());
         if (_direntChunkStorage) {
             direntSize = _direntChunkStorage->chunkSize();
             direntsIn = _direntChunkStorage->chunksIn();
@@ -331,7 +1085,7 @@ int Base::cleanup()
         _direntMgr = nullptr;
     }
     if (_inodeMgr) {
-        r[6] = _inodeMgr->sync();
+        r[6] = (_durability == DurabilityNone ? _inodeMgr->sync() : _inodeMgr->commit());
         if (_inodeChunkStorage) {
             inodeSize = _inodeChunkStorage->chunkSize();
             inodesIn = _inodeChunkStorage->chunksIn();
@@ -357,6 +1111,24 @@ int Base::cleanup()
         delete _inodeMgr;
         _inodeMgr = nullptr;
     }
+    if (_orphanMap) {
+        r[17] = _orphanMap->sync();
+        if (r[17] == 0 && _durability != DurabilityNone)
+            r[17] = _orphanMap->syncStorage();
+        _orphanQueue.clear();
+        delete _orphanMap;
+        _orphanMap = nullptr;
+    }
+    if (_orphanMapStorage) {
+        r[18] = _orphanMapStorage->close();
+        delete _orphanMapStorage;
+        _orphanMapStorage = nullptr;
+    }
+    if (_formatStorage) {
+        r[16] = _formatStorage->close();
+        delete _formatStorage;
+        _formatStorage = nullptr;
+    }
 
     // log statistics
     logger.log(Logger::Info, "inode bit sets in/out:  %lu/%lu (%lu/%lu bytes)",
@@ -377,13 +1149,19 @@ int Base::cleanup()
     logger.log(Logger::Info, "blocks in/out:          %lu/%lu (%lu/%lu bytes)",
             blocksIn, blocksOut,
             blocksIn * blockSize, blocksOut * blockSize);
+    logger.log(Logger::Info, "compressed blocks in/out: %lu/%lu bytes (bit sets: %lu/%lu bytes)",
+            cblockBytesIn, cblockBytesOut, cblockBitSetBytesIn, cblockBitSetBytesOut);
+    logger.log(Logger::Info, "block cache hits/misses: %lu/%lu",
+            dataBlockCacheHits, dataBlockCacheMisses);
     logger.log(Logger::Info, "grand total in/out:     %lu/%lu bytes",
               inodeBitSetsIn * inodeBitSetSize + inodesIn * inodeSize
             + direntBitSetsIn * direntBitSetSize + direntsIn * direntSize
-            + blockBitSetsIn * blockBitSetSize + blocksIn * blockSize,
+            + blockBitSetsIn * blockBitSetSize + blocksIn * blockSize
+            + cblockBitSetBytesIn + cblockBytesIn,
               inodeBitSetsOut * inodeBitSetSize + inodesOut * inodeSize
             + direntBitSetsOut * direntBitSetSize + direntsOut * direntSize
-            + blockBitSetsOut * blockBitSetSize + blocksOut * blockSize);
+            + blockBitSetsOut * blockBitSetSize + blocksOut * blockSize
+            + cblockBitSetBytesOut + cblockBytesOut);
     logger.log(Logger::Info, "punched holes: %lu inode bit sets, %lu inodes, "
             "%lu dirent bit sets, %lu dirents, "
             "%lu block bit sets, %lu blocks",
@@ -391,9 +1169,12 @@ int Base::cleanup()
             direntBitSetsPunchedHole, direntsPunchedHole,
             blockBitSetsPunchedHole, blocksPunchedHole);
 
+    logger.log(Logger::Info, "indirection block cache hits/misses: %lu/%lu",
+            indirectionBlockCacheHits, indirectionBlockCacheMisses);
+
     // return
     int ret = 0;
-    for (int i = 0; i < 9; i++) {
+    for (int i = 0; i < 19; i++) {
         if (r[i] < 0) {
             ret = r[i];
             break;
@@ -402,40 +1183,27 @@ int Base::cleanup()
     return ret;
 }
 
-void Base::structureLockExclusive()
-{
-    _structureMutex.lock();
-}
-
-void Base::structureUnlockExclusive()
-{
-    _structureMutex.unlock();
-}
-
-void Base::structureLockShared()
-{
-    _structureMutex.lock_shared();
-}
-
-void Base::structureUnlockShared()
-{
-    _structureMutex.unlock_shared();
-}
-
 int Base::statfs(size_t* blockSize, size_t* maxNameLen,
         uint64_t* maxBlockCount, uint64_t* freeBlockCount,
         uint64_t* maxInodeCount, uint64_t* freeInodeCount)
 {
-    *blockSize = sizeof(Block);
+    *blockSize = _blockSize;
     *maxNameLen = sizeof(Dirent::name) - 1;
     *maxBlockCount = 0;
     *freeBlockCount = 0;
     *maxInodeCount = 0;
     *freeInodeCount = 0;
 
-    uint64_t storageMaxSize;
-    uint64_t storageAvailableSize;
-    int r = _blockChunkStorage->stat(&storageMaxSize, &storageAvailableSize);
+    // the stripes are meant to be on different devices, so their space adds up
+    uint64_t storageMaxSize = 0;
+    uint64_t storageAvailableSize = 0;
+    int r = 0;
+    for (size_t s = 0; r == 0 && s < _blockChunkStorage.size(); s++) {
+        uint64_t stripeMaxSize, stripeAvailableSize;
+        r = _blockChunkStorage[s]->stat(&stripeMaxSize, &stripeAvailableSize);
+        storageMaxSize += stripeMaxSize;
+        storageAvailableSize += stripeAvailableSize;
+    }
     if (r == 0) {
         uint64_t maxSize = _maxSize;
         uint64_t currentSize = storageSizeInBytes();
@@ -444,8 +1212,8 @@ int Base::statfs(size_t* blockSize, size_t* maxNameLen,
             maxSize = storageMaxSize;
             availableSize = storageAvailableSize;
         }
-        *maxBlockCount = maxSize / sizeof(Block);
-        *freeBlockCount = availableSize / sizeof(Block);
+        *maxBlockCount = maxSize / _blockSize;
+        *freeBlockCount = availableSize / _blockSize;
         *maxInodeCount = maxSize / (sizeof(Inode) + sizeof(Dirent));
         *freeInodeCount = availableSize / (sizeof(Inode) + sizeof(Dirent));
     }
@@ -453,13 +1221,49 @@ int Base::statfs(size_t* blockSize, size_t* maxNameLen,
     return r;
 }
 
+Block* Base::slotBlocksAcquire()
+{
+    {
+        std::lock_guard<std::mutex> lock(_slotBlockPoolMutex);
+        if (_slotBlockPool.size() > 0) {
+            Block* blocks = _slotBlockPool.back();
+            _slotBlockPool.pop_back();
+            return blocks;
+        }
+    }
+    Block* blocks = nullptr;
+    try { blocks = new Block[4]; }
+    catch (...) { }
+    return blocks;
+}
+
+void Base::slotBlocksRelease(Block* blocks)
+{
+    if (!blocks)
+        return;
+    size_t maxPoolSize = std::max(SlotBlockPoolBytes / (4 * blockSize()), uint64_t(1));
+    {
+        std::lock_guard<std::mutex> lock(_slotBlockPoolMutex);
+        if (_slotBlockPool.size() < maxPoolSize) {
+            try {
+                _slotBlockPool.push_back(blocks);
+                return;
+            }
+            catch (...) { }
+        }
+    }
+    delete[] blocks;
+}
+
 int Base::handleGet(uint64_t inodeIndex, Handle** handle)
 {
-    std::unique_lock<std::shared_mutex> handleMapLock(_handleMapMutex);
+    HandleMapShard& shard = handleMapShard(inodeIndex);
+    std::unique_lock<std::mutex> handleMapLock(shard.mutex, std::defer_lock);
+    lockRecordingWait(handleMapLock, Stats::WaitHandleMapLock);
     *handle = nullptr;
-    auto it = _handleMap.find(inodeIndex);
+    auto it = shard.handles.find(inodeIndex);
     int r = 0;
-    if (it != _handleMap.end()) {
+    if (it != shard.handles.end()) {
         *handle = it->second;
     } else {
         Inode inode;
@@ -469,7 +1273,7 @@ int Base::handleGet(uint64_t inodeIndex, Handle** handle)
             catch (...) { r = -ENOMEM; }
         }
         if (r == 0) {
-            try { _handleMap.insert(std::pair<uint64_t, Handle*>(inodeIndex, *handle)); }
+            try { shard.handles.insert(std::pair<uint64_t, Handle*>(inodeIndex, *handle)); }
             catch (...) { r = -ENOMEM; }
         }
         if (r < 0) {
@@ -485,32 +1289,104 @@ int Base::handleGet(uint64_t inodeIndex, Handle** handle)
     return r;
 }
 
+void Base::handleGetIfExists(uint64_t inodeIndex, Handle** handle)
+{
+    HandleMapShard& shard = handleMapShard(inodeIndex);
+    std::unique_lock<std::mutex> handleMapLock(shard.mutex, std::defer_lock);
+    lockRecordingWait(handleMapLock, Stats::WaitHandleMapLock);
+    auto it = shard.handles.find(inodeIndex);
+    if (it != shard.handles.end()) {
+        *handle = it->second;
+        (*handle)->refCount()++;
+    } else {
+        *handle = nullptr;
+    }
+}
+
 int Base::handleRelease(Handle* handle)
 {
-    std::unique_lock<std::shared_mutex> handleMapLock(_handleMapMutex);
+    if (!handle)
+        return 0;
+    HandleMapShard& shard = handleMapShard(handle->inodeIndex());
+    std::unique_lock<std::mutex> handleMapLock(shard.mutex, std::defer_lock);
+    lockRecordingWait(handleMapLock, Stats::WaitHandleMapLock);
     int r = 0;
-    if (handle) {
+    {
         handle->refCount()--;
         bool dead = (handle->refCount() == 0);
         if (dead) {
-            _handleMap.erase(handle->inodeIndex());
+            shard.handles.erase(handle->inodeIndex());
             if (handle->removeOnceUnused())
                 r = handle->remove();
             int r1 = handle->cleanup();
             if (r == 0)
                 r = r1;
+            int r2 = flushCaches(handle->inodeIndex());
+            if (r == 0)
+                r = r2;
             delete handle;
         }
     }
     return r;
 }
 
+void Base::logCacheStats()
+{
+    if (_indirectionBlockCache)
+        logger.log(Logger::Info, "indirection block cache hits/misses: %lu/%lu",
+                _indirectionBlockCache->hits(), _indirectionBlockCache->misses());
+    if (_dataBlockCache)
+        logger.log(Logger::Info, "block cache hits/misses: %lu/%lu",
+                _dataBlockCache->hits(), _dataBlockCache->misses());
+}
+
+int Base::flushCaches(uint64_t inodeIndex)
+{
+    int r = 0;
+    if (_indirectionBlockCache)
+        r = _indirectionBlockCache->flush(inodeIndex);
+    if (_dataBlockCache) {
+        int r2 = _dataBlockCache->flush(inodeIndex);
+        if (r == 0)
+            r = r2;
+    }
+    return r;
+}
+
+int Base::flushCaches()
+{
+    int r = 0;
+    if (_indirectionBlockCache)
+        r = _indirectionBlockCache->flush();
+    if (_dataBlockCache) {
+        int r2 = _dataBlockCache->flush();
+        if (r == 0)
+            r = r2;
+    }
+    return r;
+}
+
+bool Base::nameIndexMemoryReserve(uint64_t bytes)
+{
+    uint64_t m = _nameIndexMemory.load();
+    do {
+        if (m + bytes > _nameIndexMemoryLimit)
+            return false;
+    } while (!_nameIndexMemory.compare_exchange_weak(m, m + bytes));
+    return true;
+}
+
+void Base::nameIndexMemoryRelease(uint64_t bytes)
+{
+    _nameIndexMemory -= bytes;
+}
+
 int Base::inodeAdd(uint64_t* index, const Inode* inode)
 {
     int r;
     if (encrypt()) {
         unsigned char buf[EncInodeSize];
-        enc(_key.data(), reinterpret_cast<const unsigned char*>(inode), sizeof(Inode), buf);
+        enc(_cipher, _key.data(), reinterpret_cast<const unsigned char*>(inode), sizeof(Inode), buf);
         r = inodeAddRaw(index, buf);
     } else {
         r = inodeAddRaw(index, reinterpret_cast<const unsigned char*>(inode));
@@ -532,12 +1408,17 @@ int Base::inodeRead(uint64_t index, Inode* inode)
     return r;
 }
 
+int Base::inodeReadMany(const uint64_t* indices, size_t count, Inode* const* inodes)
+{
+    return entityReadMany(_inodeMgr, indices, count, sizeof(Inode), reinterpret_cast<unsigned char* const*>(inodes));
+}
+
 int Base::inodeWrite(uint64_t index, const Inode* inode)
 {
     int r;
     if (encrypt()) {
         unsigned char buf[EncInodeSize];
-        enc(_key.data(), reinterpret_cast<const unsigned char*>(inode), sizeof(Inode), buf);
+        enc(_cipher, _key.data(), reinterpret_cast<const unsigned char*>(inode), sizeof(Inode), buf);
         r = inodeWriteRaw(index, buf);
     } else {
         r = inodeWriteRaw(index, reinterpret_cast<const unsigned char*>(inode));
@@ -550,7 +1431,7 @@ int Base::direntAdd(uint64_t* index, const Dirent* dirent)
     int r;
     if (encrypt()) {
         unsigned char buf[EncDirentSize];
-        enc(_key.data(), reinterpret_cast<const unsigned char*>(dirent), sizeof(Dirent), buf);
+        enc(_cipher, _key.data(), reinterpret_cast<const unsigned char*>(dirent), sizeof(Dirent), buf);
         r = direntAddRaw(index, buf);
     } else {
         r = direntAddRaw(index, reinterpret_cast<const unsigned char*>(dirent));
@@ -572,12 +1453,17 @@ int Base::direntRead(uint64_t index, Dirent* dirent)
     return r;
 }
 
+int Base::direntReadMany(const uint64_t* indices, size_t count, Dirent* const* dirents)
+{
+    return entityReadMany(_direntMgr, indices, count, sizeof(Dirent), reinterpret_cast<unsigned char* const*>(dirents));
+}
+
 int Base::direntWrite(uint64_t index, const Dirent* dirent)
 {
     int r;
     if (encrypt()) {
         unsigned char buf[EncDirentSize];
-        enc(_key.data(), reinterpret_cast<const unsigned char*>(dirent), sizeof(Dirent), buf);
+        enc(_cipher, _key.data(), reinterpret_cast<const unsigned char*>(dirent), sizeof(Dirent), buf);
         r = direntWriteRaw(index, buf);
     } else {
         r = direntWriteRaw(index, reinterpret_cast<const unsigned char*>(dirent));
@@ -585,42 +1471,464 @@ int Base::direntWrite(uint64_t index, const Dirent* dirent)
     return r;
 }
 
-int Base::blockAdd(uint64_t* index, const Block* block)
+int Base::blockAdd(uint64_t* index, const Block* block, uint64_t hint)
 {
     int r;
     if (encrypt()) {
-        unsigned char buf[EncBlockSize];
-        enc(_key.data(), reinterpret_cast<const unsigned char*>(block), sizeof(Block), buf);
-        r = blockAddRaw(index, buf);
+        std::vector<unsigned char> buf;
+        try {
+            buf.resize(encBlockSize());
+        }
+        catch (...) {
+            return -ENOMEM;
+        }
+        enc(_cipher, _key.data(), block->data, _blockSize, buf.data());
+        r = blockAddRaw(index, buf.data(), hint);
     } else {
-        r = blockAddRaw(index, reinterpret_cast<const unsigned char*>(block));
+        r = blockAddRaw(index, block->data, hint);
     }
     return r;
 }
 
-int Base::blockRead(uint64_t index, Block* block)
+int Base::blockAddCompressed(uint64_t* index, const Block* block, uint64_t hint)
+{
+    if (_compressionLevel <= 0)
+        return blockAdd(index, block, hint);
+
+    // compress into the smallest size class that fits, including the size header
+    const size_t headerSize = compressedHeaderSize();
+    const size_t maxClassSize = compressedClassSize(CompressedClasses - 1);
+    std::vector<unsigned char> buf;
+    std::vector<unsigned char> encBuf;
+    try {
+        buf.resize(maxClassSize);
+        if (encrypt())
+            encBuf.resize(maxClassSize + EncOverhead);
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    size_t size = compressBlock(_compressionLevel, block->data, _blockSize, buf.data() + headerSize, maxClassSize - headerSize);
+    if (size == 0)
+        return blockAdd(index, block, hint);
+    int c = 0;
+    while (size + headerSize > compressedClassSize(c))
+        c++;
+    for (size_t i = 0; i < headerSize; i++)
+        buf[i] = (size >> (8 * i)) & 0xff;
+    memset(buf.data() + headerSize + size, 0, compressedClassSize(c) - headerSize - size);
+    const unsigned char* rawData = buf.data();
+    if (encrypt()) {
+        enc(_cipher, _key.data(), buf.data(), compressedClassSize(c), encBuf.data());
+        rawData = encBuf.data();
+    }
+    uint64_t chunkIndex;
+    int r = entityAddRaw(_cblockMgr[c], &chunkIndex, rawData);
+    if (r == 0)
+        *index = (uint64_t(c + 1) << BlockClassShift) | chunkIndex;
+    return r;
+}
+
+int Base::compressedBlockRead(uint64_t index, unsigned char* blockData)
+{
+    int c = blockClass(index) - 1;
+    if (c >= CompressedClasses) {
+        logger.log(Logger::Error, "block %lu has invalid size class", index);
+        return -EIO;
+    }
+    const size_t headerSize = compressedHeaderSize();
+    std::vector<unsigned char> buf;
+    std::vector<unsigned char> decBuf;
+    try {
+        buf.resize(compressedClassSize(c) + (encrypt() ? EncOverhead : 0));
+        if (encrypt())
+            decBuf.resize(compressedClassSize(c));
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    const unsigned char* data = buf.data();
+    int r = entityReadRaw(_cblockMgr[c], blockChunk(index), buf.data());
+    if (r == 0 && encrypt()) {
+        r = dec(_key.data(), buf.data(), buf.size(), decBuf.data(), decBuf.size());
+        data = decBuf.data();
+    }
+    if (r == 0) {
+        size_t size = 0;
+        for (size_t i = 0; i < headerSize; i++)
+            size |= size_t(data[i]) << (8 * i);
+        if (size + headerSize > compressedClassSize(c))
+            r = -EIO;
+        else
+            r = decompressBlock(data + headerSize, size, blockData, _blockSize);
+    }
+    return r;
+}
+
+int Base::blockReadNow(uint64_t index, Block* block)
 {
+    if (blockClass(index) != 0)
+        return compressedBlockRead(index, block->data);
     int r;
     if (encrypt()) {
-        unsigned char buf[EncBlockSize];
-        r = blockReadRaw(index, buf);
+        std::vector<unsigned char> buf;
+        try {
+            buf.resize(encBlockSize());
+        }
+        catch (...) {
+            return -ENOMEM;
+        }
+        r = blockReadRaw(index, buf.data());
         if (r == 0)
-            r = dec(_key.data(), buf, EncBlockSize, reinterpret_cast<unsigned char*>(block), sizeof(Block));
+            r = dec(_key.data(), buf.data(), encBlockSize(), block->data, _blockSize);
     } else {
-        r = blockReadRaw(index, reinterpret_cast<unsigned char*>(block));
+        r = blockReadRaw(index, block->data);
     }
     return r;
 }
 
-int Base::blockWrite(uint64_t index, const Block* block)
+int Base::blockWriteNow(uint64_t index, const Block* block)
 {
+    if (blockClass(index) != 0) {
+        logger.log(Logger::Error, "Base::blockWriteNow(%lu) failed because the block is compressed", index);
+        emergency(EmergencyBug);
+        return -ENOTRECOVERABLE;
+    }
     int r;
     if (encrypt()) {
-        unsigned char buf[EncBlockSize];
-        enc(_key.data(), reinterpret_cast<const unsigned char*>(block), sizeof(Block), buf);
-        r = blockWriteRaw(index, buf);
+        std::vector<unsigned char> buf;
+        try {
+            buf.resize(encBlockSize());
+        }
+        catch (...) {
+            return -ENOMEM;
+        }
+        enc(_cipher, _key.data(), block->data, _blockSize, buf.data());
+        r = blockWriteRaw(index, buf.data());
     } else {
-        r = blockWriteRaw(index, reinterpret_cast<const unsigned char*>(block));
+        r = blockWriteRaw(index, block->data);
+    }
+    return r;
+}
+
+int Base::blockRead(uint64_t index, Block* block)
+{
+    if (_dataBlockCache && _dataBlockCache->get(index, block))
+        return 0;
+    int r = blockReadNow(index, block);
+    if (r == 0 && _dataBlockCache)
+        r = _dataBlockCache->put(index, block, false, InvalidIndex);
+    return r;
+}
+
+int Base::blockWrite(uint64_t index, const Block* block, uint64_t inodeIndex)
+{
+    if (_dataBlockCache)
+        return _dataBlockCache->put(index, block, true, inodeIndex);
+    else
+        return blockWriteNow(index, block);
+}
+
+int Base::indirectionBlockRead(uint64_t index, Block* block)
+{
+    if (!_indirectionBlockCache)
+        return blockRead(index, block);
+    if (_indirectionBlockCache->get(index, block))
+        return 0;
+    int r = blockReadNow(index, block);
+    if (r == 0)
+        r = _indirectionBlockCache->put(index, block, false, InvalidIndex);
+    return r;
+}
+
+int Base::indirectionBlockWrite(uint64_t index, const Block* block, uint64_t inodeIndex)
+{
+    if (!_indirectionBlockCache)
+        return blockWrite(index, block, inodeIndex);
+    return _indirectionBlockCache->put(index, block, true, inodeIndex);
+}
+
+int Base::blockReserve(uint64_t* index, uint64_t hint)
+{
+    return blockAddRaw(index, nullptr, hint);
+}
+
+int Base::blockLocate(uint64_t index, int* fd, uint64_t* pos)
+{
+    // direct transfers would bypass the data block cache
+    if (encrypt() || _dataBlockCache || blockClass(index) != 0)
+        return -ENOTSUP;
+    ChunkManager* mgr = blockMgr(index);
+    return mgr ? mgr->locate(stripeChunk(index), fd, pos) : -EIO;
+}
+
+// Returns the length of the run of consecutive indices starting at indices[0]
+static size_t consecutiveIndices(const uint64_t* indices, size_t count)
+{
+    size_t n = 1;
+    while (n < count && indices[n] == indices[0] + n)
+        n++;
+    return n;
+}
+
+int Base::blockReadMany(const uint64_t* indices, size_t count, unsigned char* const* blockData)
+{
+    if (!_dataBlockCache)
+        return blockReadManyNow(indices, count, blockData);
+
+    // read only the blocks that are not cached
+    std::vector<uint64_t> missingIndices;
+    std::vector<unsigned char*> missingBlockData;
+    Block block;
+    if (block.allocate(_blockSize) < 0)
+        return -ENOMEM;
+    try {
+        for (size_t i = 0; i < count; i++) {
+            if (_dataBlockCache->get(indices[i], &block)) {
+                memcpy(blockData[i], block.data, _blockSize);
+            } else {
+                missingIndices.push_back(indices[i]);
+                missingBlockData.push_back(blockData[i]);
+            }
+        }
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    return blockReadManyNow(missingIndices.data(), missingIndices.size(), missingBlockData.data());
+}
+
+// Split count blocks into segments of consecutive indices with at most maxLen blocks each.
+// Each segment is given by its first block (the first element of the pair) and its length.
+static void segments(const uint64_t* indices, size_t count, size_t maxLen, std::vector<std::pair<size_t, size_t>>& segs)
+{
+    for (size_t i = 0; i < count; ) {
+        size_t n = std::min(consecutiveIndices(indices + i, count - i), maxLen);
+        segs.push_back(std::make_pair(i, n));
+        i += n;
+    }
+}
+
+int Base::entityReadMany(ChunkManager* mgr, const uint64_t* indices, size_t count, size_t size, unsigned char* const* data)
+{
+    // Sort by index so that runs of consecutive indices are found even if the
+    // caller's order differs, e.g. for the entries of a hashed directory
+    const size_t rawSize = size + (encrypt() ? EncOverhead : 0);
+    std::vector<size_t> order;
+    std::vector<uint64_t> sortedIndices;
+    std::vector<unsigned char> rawBuf;
+    std::vector<void*> bufs;
+    std::vector<std::pair<size_t, size_t>> segs;
+    try {
+        order.resize(count);
+        sortedIndices.resize(count);
+        if (encrypt())
+            rawBuf.resize(count * rawSize);
+        bufs.resize(count);
+        for (size_t i = 0; i < count; i++)
+            order[i] = i;
+        std::sort(order.begin(), order.end(), [&](size_t i, size_t j) { return indices[i] < indices[j]; });
+        for (size_t i = 0; i < count; i++)
+            sortedIndices[i] = indices[order[i]];
+        segments(sortedIndices.data(), count, std::max(CryptoSegmentBlocks * _blockSize / rawSize, size_t(1)), segs);
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < count; i++)
+        bufs[i] = (encrypt() ? rawBuf.data() + i * rawSize : data[order[i]]);
+    if (!encrypt()) {
+        int r = 0;
+        for (size_t s = 0; r == 0 && s < segs.size(); s++)
+            r = mgr->readRange(sortedIndices[segs[s].first], segs[s].second, bufs.data() + segs[s].first);
+        return r;
+    }
+    // Like blockReadManyNow(): each segment is read and decrypted by one task
+    return _cryptoPool->run(segs.size(), [&](size_t s) {
+            size_t i = segs[s].first;
+            size_t n = segs[s].second;
+            int r = mgr->readRange(sortedIndices[i], n, bufs.data() + i);
+            for (size_t j = 0; r == 0 && j < n; j++)
+                r = dec(_key.data(), rawBuf.data() + (i + j) * rawSize, rawSize, data[order[i + j]], size);
+            return r;
+        });
+}
+
+int Base::blockReadManyNow(const uint64_t* indices, size_t count, unsigned char* const* blockData)
+{
+    // compressed blocks are read one by one, the others in ranges below
+    size_t compressedBlocks = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (blockClass(indices[i]) != 0)
+            compressedBlocks++;
+        else if (!blockStripeIsValid(indices[i]))
+            return -EIO;
+    }
+    if (compressedBlocks > 0) {
+        std::vector<uint64_t> otherIndices;
+        std::vector<unsigned char*> otherBlockData;
+        try {
+            otherIndices.reserve(count - compressedBlocks);
+            otherBlockData.reserve(count - compressedBlocks);
+        }
+        catch (...) {
+            return -ENOMEM;
+        }
+        int r = 0;
+        for (size_t i = 0; r == 0 && i < count; i++) {
+            if (blockClass(indices[i]) != 0) {
+                r = compressedBlockRead(indices[i], blockData[i]);
+            } else {
+                otherIndices.push_back(indices[i]);
+                otherBlockData.push_back(blockData[i]);
+            }
+        }
+        if (r == 0 && otherIndices.size() > 0)
+            r = blockReadManyNow(otherIndices.data(), otherIndices.size(), otherBlockData.data());
+        return r;
+    }
+
+    if (!encrypt()) {
+        int r = 0;
+        std::vector<void*> bufs;
+        try {
+            bufs.resize(count);
+        }
+        catch (...) {
+            r = -ENOMEM;
+        }
+        for (size_t i = 0; r == 0 && i < count; ) {
+            size_t n = consecutiveIndices(indices + i, count - i);
+            for (size_t j = 0; j < n; j++)
+                bufs[j] = blockData[i + j];
+            r = blockMgr(indices[i])->readRange(stripeChunk(indices[i]), n, bufs.data());
+            i += n;
+        }
+        return r;
+    }
+
+    // Each segment is read and decrypted by one task, so that the tasks of the
+    // crypto pool overlap storage access and decryption.
+    std::vector<unsigned char> encBuf;
+    std::vector<void*> bufs;
+    std::vector<std::pair<size_t, size_t>> segs;
+    try {
+        encBuf.resize(count * encBlockSize());
+        bufs.resize(count);
+        segments(indices, count, CryptoSegmentBlocks, segs);
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    return _cryptoPool->run(segs.size(), [&](size_t s) {
+            size_t i = segs[s].first;
+            size_t n = segs[s].second;
+            for (size_t j = 0; j < n; j++)
+                bufs[i + j] = encBuf.data() + (i + j) * encBlockSize();
+            int r = blockMgr(indices[i])->readRange(stripeChunk(indices[i]), n, bufs.data() + i);
+            for (size_t j = 0; r == 0 && j < n; j++)
+                r = dec(_key.data(), encBuf.data() + (i + j) * encBlockSize(), encBlockSize(), blockData[i + j], _blockSize);
+            return r;
+        });
+}
+
+int Base::blockWriteMany(const uint64_t* indices, size_t count, const unsigned char* const* blockData)
+{
+    for (size_t i = 0; i < count; i++) {
+        if (blockClass(indices[i]) != 0) {
+            logger.log(Logger::Error, "Base::blockWriteMany() failed because block %lu is compressed", indices[i]);
+            emergency(EmergencyBug);
+            return -ENOTRECOVERABLE;
+        }
+        if (!blockStripeIsValid(indices[i]))
+            return -EIO;
+    }
+
+    // all blocks are overwritten, so cached versions are obsolete
+    if (_dataBlockCache) {
+        for (size_t i = 0; i < count; i++)
+            _dataBlockCache->remove(indices[i]);
+    }
+
+    if (!encrypt()) {
+        int r = 0;
+        std::vector<const void*> bufs;
+        try {
+            bufs.resize(count);
+        }
+        catch (...) {
+            r = -ENOMEM;
+        }
+        for (size_t i = 0; r == 0 && i < count; ) {
+            size_t n = consecutiveIndices(indices + i, count - i);
+            for (size_t j = 0; j < n; j++)
+                bufs[j] = blockData[i + j];
+            r = blockMgr(indices[i])->writeRange(stripeChunk(indices[i]), n, bufs.data());
+            i += n;
+        }
+        return r;
+    }
+
+    // Each segment is encrypted and written by one task, see blockReadManyNow()
+    std::vector<unsigned char> encBuf;
+    std::vector<const void*> bufs;
+    std::vector<std::pair<size_t, size_t>> segs;
+    try {
+        encBuf.resize(count * encBlockSize());
+        bufs.resize(count);
+        segments(indices, count, CryptoSegmentBlocks, segs);
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    return _cryptoPool->run(segs.size(), [&](size_t s) {
+            size_t i = segs[s].first;
+            size_t n = segs[s].second;
+            for (size_t j = 0; j < n; j++) {
+                enc(_cipher, _key.data(), blockData[i + j], _blockSize, encBuf.data() + (i + j) * encBlockSize());
+                bufs[i + j] = encBuf.data() + (i + j) * encBlockSize();
+            }
+            return blockMgr(indices[i])->writeRange(stripeChunk(indices[i]), n, bufs.data() + i);
+        });
+}
+
+int Base::blockPrefetch(const uint64_t* indices, size_t count)
+{
+    // let the storage read ahead; with O_DIRECT, that would only fill the page cache in vain
+    if (!_directIO) {
+        for (size_t i = 0; i < count; ) {
+            size_t n = consecutiveIndices(indices + i, count - i);
+            ChunkManager* mgr = (blockClass(indices[i]) == 0 ? blockMgr(indices[i]) : nullptr);
+            if (mgr)
+                mgr->adviseWillNeed(stripeChunk(indices[i]), n);
+            i += n;
+        }
+    }
+    if (!_dataBlockCache)
+        return 0;
+
+    // read the blocks that are not cached yet, and add them to the cache
+    std::vector<uint64_t> missingIndices;
+    std::vector<unsigned char> missingData;
+    std::vector<unsigned char*> missingBlockData;
+    Block block;
+    if (block.allocate(_blockSize) < 0)
+        return -ENOMEM;
+    try {
+        for (size_t i = 0; i < count; i++)
+            if (!_dataBlockCache->contains(indices[i]))
+                missingIndices.push_back(indices[i]);
+        missingData.resize(missingIndices.size() * _blockSize);
+        for (size_t i = 0; i < missingIndices.size(); i++)
+            missingBlockData.push_back(missingData.data() + i * _blockSize);
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    int r = blockReadManyNow(missingIndices.data(), missingIndices.size(), missingBlockData.data());
+    for (size_t i = 0; r == 0 && i < missingIndices.size(); i++) {
+        memcpy(block.data, missingBlockData[i], _blockSize);
+        r = _dataBlockCache->put(missingIndices[i], &block, false, InvalidIndex);
     }
     return r;
 }
@@ -18,42 +18,180 @@
 
 #pragma once
 
+#include <algorithm>
 #include <string>
 #include <vector>
-#include <map>
+#include <deque>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <functional>
 
 #include "chunk.hpp"
+#include "refcount.hpp"
 #include "inode.hpp"
 #include "dirent.hpp"
 #include "block.hpp"
 #include "handle.hpp"
+#include "block_cache.hpp"
+#include "encrypt.hpp"
+#include "worker_pool.hpp"
 
 
 class Base
 {
+public:
+    typedef enum {
+        DurabilityNone,    // never flush to disk; the OS writes data back eventually
+        DurabilityFsync,   // fsync() and unmount flush to disk
+        DurabilityPeriodic // flush to disk at fixed intervals and on unmount; fsync() does not wait for it
+    } Durability;
+
+    /* The parameters of a Base. The defaults disable all caches, threads
+     * and optional features, which suits tools that work on the storage
+     * files directly; see main.cpp for the defaults of mounts. */
+    class Options
+    {
+    public:
+        Storage::Type type = Storage::TypeFile;
+        std::string dirName;
+        std::vector<std::string> dataDirNames;  // directories of the block stripes 1, 2, ...
+        uint64_t maxSize = 0;                   // 0 means unlimited
+        std::vector<unsigned char> key;         // empty for no encryption
+        Cipher cipher = CipherXSalsa20Poly1305; // for new encrypted chunks
+        bool punchHoles = false;
+        bool directIO = false;
+        uint64_t indirectionBlockCacheSize = 0;
+        uint64_t dataBlockCacheSize = 0;
+        unsigned int cryptoThreads = 0;
+        Durability durability = DurabilityNone;
+        unsigned int syncInterval = 0;          // seconds, for DurabilityPeriodic
+        uint64_t nameIndexMemoryLimit = 0;
+        int compressionLevel = 0;
+        size_t blockSize = 0;                   // for new file systems; 0 for the default
+        uint64_t reclaimRate = 0;               // bytes per second for background reclamation; 0 means unlimited
+    };
+
 private:
     const Storage::Type _type;
     const std::string _dirName;
+    const std::vector<std::string> _dataDirNames; // directories of the block stripes 1, 2, ...
     const uint64_t _maxSize;
     const std::vector<unsigned char> _key;
+    const Cipher _cipher;
     const bool _punchHoles;
+    const bool _directIO; // O_DIRECT for block data, see StorageFile
+    const uint64_t _indirectionBlockCacheSize;
+    const uint64_t _dataBlockCacheSize;
+    const unsigned int _cryptoThreads;
+    const Durability _durability;
+    const unsigned int _syncInterval; // seconds, for DurabilityPeriodic
+    const int _compressionLevel;      // zstd level for new data blocks; 0 disables compression
+    const size_t _newBlockSize;       // block size for new file systems; 0 for the default
+    size_t _blockSize;                // block size of this file system, see initializeFormat()
+
+    /* The format record in format.6fs stores the parameters of the file
+     * system format. It is not encrypted since it holds no secrets. File
+     * systems without it were created before it existed. */
+    class FormatRecord
+    {
+    public:
+        char magic[8];
+        uint64_t version;
+        uint64_t blockSize;
+        uint64_t stripes; // 0 in records written before striping existed, meaning 1
+        uint64_t id[2];   // random; 0 in records written before it existed
+        uint64_t flags;   // see FormatFlags
+        uint64_t reserved[1];
+    };
+    enum FormatFlags {
+        // chunks might be encrypted with AES-256-GCM, so CPU support is required
+        FormatFlagAES256GCM = 1,
+        FormatFlagsKnown = FormatFlagAES256GCM
+    };
+    Storage* _formatStorage;
+    int initializeFormat(std::string& errStr);
+
+    /* Each data directory holds a stripe record in stripe.6fs with the id of
+     * the file system and the number of its stripe, so that mounting with a
+     * data directory of another file system or in the wrong order fails
+     * instead of corrupting data. */
+    class StripeRecord
+    {
+    public:
+        char magic[8];
+        uint64_t id[2];
+        uint64_t stripe;
+        uint64_t reserved[4];
+    };
+    // oldStripes is the number of stripes before this mount; newId is set if
+    // the file system id did not exist before
+    int initializeStripes(const FormatRecord& record, uint64_t oldStripes, bool newId, std::string& errStr);
 
     Storage* _inodeMapStorage;
     Storage* _inodeChunkStorage;
     Storage* _direntMapStorage;
     Storage* _direntChunkStorage;
-    Storage* _blockMapStorage;
-    Storage* _blockChunkStorage;
     Map* _inodeMap;
     Map* _direntMap;
-    Map* _blockMap;
     ChunkManager* _inodeMgr;
     ChunkManager* _direntMgr;
-    ChunkManager* _blockMgr;
+    BlockCache* _indirectionBlockCache; // shared by all handles; nullptr if disabled
+    BlockCache* _dataBlockCache;        // cache of decrypted blocks; nullptr if disabled
+    WorkerPool* _cryptoPool;            // encrypts / decrypts multi-block transfers; nullptr if not encrypted
+
+    /* Compressed data blocks are kept in separate chunk stores, one for each
+     * size class. The class is stored in the topmost bits of the block index;
+     * class 0 is the normal block store, see below. The classes hold 1/8, 1/4 and 1/2 of the block size.
+     * Each compressed chunk starts with the size of the compressed data, in 16
+     * bits or, for block sizes above 128K, in 32 bits (all of it is encrypted if
+     * encryption is on). Compressed blocks are never modified in place, see
+     * blockNeedsCopy(). */
+    static constexpr int CompressedClasses = 3;
+    static constexpr int BlockClassShift = 60;
+    size_t compressedClassSize(int c) const { return _blockSize >> (CompressedClasses - c); }
+    size_t compressedHeaderSize() const { return (_blockSize <= 128 * 1024 ? 2 : 4); }
+    Storage* _cblockMapStorage[CompressedClasses];
+    Storage* _cblockChunkStorage[CompressedClasses];
+    Map* _cblockMap[CompressedClasses];
+    ChunkManager* _cblockMgr[CompressedClasses];
+    static int blockClass(uint64_t index) { return index >> BlockClassShift; }
+    static uint64_t blockChunk(uint64_t index) { return index & ((uint64_t(1) << BlockClassShift) - 1); }
+    int compressedBlockRead(uint64_t index, unsigned char* blockData);
 
-    std::shared_mutex _structureMutex; // rw lock for the node/dirent structure
+    /* Uncompressed data blocks are striped over the main directory (stripe 0)
+     * and the data directories (stripes 1, 2, ...), each with its own block
+     * map and block data file. The stripe is stored in the bits below the
+     * class bits of the block index, so that consecutive indices are always
+     * in the same stripe and range transfers stay within one storage. Runs of
+     * new blocks go to the stripes in turn, see blockAddRaw(). Stripes can be
+     * added to an existing file system but not removed. */
+    static constexpr int BlockStripeShift = 52;
+    static constexpr size_t MaxStripes = 256;
+    static size_t blockStripe(uint64_t index) { return (index >> BlockStripeShift) & (MaxStripes - 1); }
+    static uint64_t stripeChunk(uint64_t index) { return index & ((uint64_t(1) << BlockStripeShift) - 1); }
+    static uint64_t stripeIndex(size_t stripe, uint64_t chunk) { return (uint64_t(stripe) << BlockStripeShift) | chunk; }
+    std::vector<Storage*> _blockMapStorage;
+    std::vector<Storage*> _blockChunkStorage;
+    std::vector<Map*> _blockMap;
+    std::vector<ChunkManager*> _blockMgr;
+    // reference counts of shared data blocks, indexed by their chunk in the stripe
+    std::vector<Storage*> _blockRefStorage;
+    std::vector<RefCountTable*> _blockRefs;
+    std::atomic<size_t> _nextStripe; // for blocks without placement hint
+    // The stripe of a block index read from storage might not exist if the file
+    // system is corrupt; these return nullptr then (and trigger an emergency)
+    bool blockStripeIsValid(uint64_t index) const;
+    ChunkManager* blockMgr(uint64_t index) const { return blockStripeIsValid(index) ? _blockMgr[blockStripe(index)] : nullptr; }
+    RefCountTable* blockRefs(uint64_t index) const { return blockStripeIsValid(index) ? _blockRefs[blockStripe(index)] : nullptr; }
 
     bool encrypt() const;
+    size_t encBlockSize() const { return _blockSize + EncOverhead; }
+    // data blocks placed near a hint start runs of 1 MiB (at least 64 blocks), see ChunkManager::addNear()
+    uint64_t blockRunLength() const { return std::max(uint64_t(1 << 20) / _blockSize, uint64_t(64)); }
+    Storage* newStorage(const std::string& dirName, const std::string& fileName, bool directIO) const;
 
     uint64_t storageSizeInBytes() const;
     int checkWriteAction(uint64_t additionalBytes) const;
@@ -61,6 +199,8 @@ private:
     int entityAddRaw(ChunkManager* mgr, uint64_t* index, const unsigned char* rawData);
     int entityRemove(ChunkManager* mgr, uint64_t index);
     int entityReadRaw(ChunkManager* mgr, uint64_t index, unsigned char* rawData);
+    // read runs of consecutive indices at once and decrypt the entities of the given size
+    int entityReadMany(ChunkManager* mgr, const uint64_t* indices, size_t count, size_t size, unsigned char* const* data);
     int entityWriteRaw(ChunkManager* mgr, uint64_t index, const unsigned char* rawData);
 
     int inodeAddRaw(uint64_t* index, const unsigned char* rawInode);
@@ -69,45 +209,184 @@ private:
     int direntAddRaw(uint64_t* index, const unsigned char* rawDirent);
     int direntReadRaw(uint64_t index, unsigned char* rawDirent);
     int direntWriteRaw(uint64_t index, const unsigned char* rawDirent);
-    int blockAddRaw(uint64_t* index, const unsigned char* rawBlock);
+    int blockAddRaw(uint64_t* index, const unsigned char* rawBlock, uint64_t hint);
     int blockReadRaw(uint64_t index, unsigned char* rawBlock);
     int blockWriteRaw(uint64_t index, const unsigned char* rawBlock);
+    int blockReadNow(uint64_t index, Block* block);        // bypasses the data block cache
+    int blockWriteNow(uint64_t index, const Block* block); // bypasses the data block cache
+    int blockReadManyNow(const uint64_t* indices, size_t count, unsigned char* const* blockData);
+    // Number of blocks per task when the crypto pool works on multi-block transfers
+    static constexpr size_t CryptoSegmentBlocks = 8;
+
+    /* The handles in use, in shards by inode index so that operations on
+     * different inodes rarely contend for the same lock. The reference count
+     * of a handle is modified under the lock of its shard. */
+    static constexpr size_t HandleMapShards = 64;
+    class alignas(64) HandleMapShard
+    {
+    public:
+        std::mutex mutex;
+        std::unordered_map<uint64_t, Handle*> handles;
+    };
+    HandleMapShard _handleMap[HandleMapShards];
+    HandleMapShard& handleMapShard(uint64_t inodeIndex) { return _handleMap[inodeIndex % HandleMapShards]; }
 
-    std::shared_mutex _handleMapMutex;
-    std::map<uint64_t, Handle*> _handleMap;
+    /* Handles need one indirection block for each level of their slot trees
+     * (see Handle::cacheBlock() and Handle::LookupCache), but only once they
+     * use their slot trees, and many handles never do. These sets of blocks
+     * are taken from this pool when needed and returned when done, so that
+     * their memory is reused. The pool keeps at most SlotBlockPoolBytes. */
+    static constexpr uint64_t SlotBlockPoolBytes = 4 * 1024 * 1024;
+    std::mutex _slotBlockPoolMutex;
+    std::vector<Block*> _slotBlockPool;
+
+    const uint64_t _nameIndexMemoryLimit;
+    std::atomic<uint64_t> _nameIndexMemory;
+
+    // Background thread for the inode write back of handles and for DurabilityPeriodic
+    std::thread _syncThread;
+    std::mutex _syncThreadMutex;
+    std::condition_variable _syncThreadCond;
+    bool _syncThreadStop;
+    void syncThreadLoop();
+    // Call f for each handle in use while holding a reference to it, but no
+    // lock; returns the first error
+    int forEachHandle(const std::function<int (Handle* handle)>& f);
+
+    /* Orphans are regular files whose data is reclaimed in the background,
+     * see Handle::reclaimInBackgroundNow(). The orphan map has one bit for
+     * each inode that is an orphan, so that the reclaimer finds them again
+     * after a crash or unmount. It is committed last, and the bit of a
+     * finished orphan is committed before its inode is removed. */
+    const uint64_t _reclaimRate; // bytes per second; 0 means unlimited
+    Storage* _orphanMapStorage;
+    Map* _orphanMap;
+    std::deque<uint64_t> _orphanQueue;
+    std::thread _reclaimThread;
+    std::mutex _reclaimMutex; // protects the orphan map and queue
+    std::condition_variable _reclaimCond;
+    bool _reclaimThreadStop;
+    static constexpr uint64_t ReclaimBatchBlocks = 1024;
+    void reclaimThreadLoop();
+    int reclaimOrphan(uint64_t inodeIndex);
+
+    /* Sequential access to open files (see Handle::read() and Handle::write()):
+     * a background thread prefetches the blocks that a sequential reader will
+     * need next, and writes the modified cached blocks of a sequential writer
+     * back behind it. Each queued request holds a reference to its handle. */
+    class StreamRequest
+    {
+    public:
+        Handle* handle;
+        uint64_t slot;  // prefetch count slots starting at this one,
+        uint64_t count; // or write behind if count is 0
+    };
+    static constexpr size_t MaxStreamRequests = 64;
+    std::deque<StreamRequest> _streamQueue;
+    std::thread _streamThread;
+    std::mutex _streamMutex; // protects the queue
+    std::condition_variable _streamCond;
+    bool _streamThreadStop;
+    void streamThreadLoop();
+    void streamRequest(Handle* handle, uint64_t slot, uint64_t count);
 
 public:
-    Base(Storage::Type type, const std::string& dirName, uint64_t maxSize,
-            const std::vector<unsigned char>& key, bool punchHoles);
+    Base(const Options& options);
 
     int initialize(std::string& errStr, bool* needsRootNode);
-    int createRootNode();
+    int createRootNode(uint64_t dirFormat);
+    bool compression() const { return _compressionLevel > 0; }
+    Durability durability() const { return _durability; }
+    // The size of all blocks; only valid after initialize()
+    size_t blockSize() const { return _blockSize; }
+    // Start background threads; must be called after the process daemonized
+    void startThreads();
     int cleanup();
 
-    void structureLockExclusive();
-    void structureUnlockExclusive();
-    void structureLockShared();
-    void structureUnlockShared();
+    // Make everything that was written to the storage durable
+    int commit();
+    // Called for fsync() of any file or directory after its pending changes
+    // were written: commits if the durability mode says so
+    int fsync();
 
     int inodeAdd(uint64_t* index, const Inode* inode);
     int inodeRemove(uint64_t index);
     int inodeRead(uint64_t index, Inode* inode);
+    int inodeReadMany(const uint64_t* indices, size_t count, Inode* const* inodes);
     int inodeWrite(uint64_t index, const Inode* inode);
     int direntAdd(uint64_t* index, const Dirent* dirent);
     int direntRemove(uint64_t index);
     int direntRead(uint64_t index, Dirent* dirent);
+    int direntReadMany(const uint64_t* indices, size_t count, Dirent* const* dirents);
     int direntWrite(uint64_t index, const Dirent* dirent);
-    int blockAdd(uint64_t* index, const Block* block);
-    int blockRemove(uint64_t index);
+    // New data blocks are placed at the hint if possible so that files are stored contiguously;
+    // pass the index following the block of the preceding slot, or InvalidIndex for no preference
+    int blockAdd(uint64_t* index, const Block* block, uint64_t hint);
+    // Add a data block that is compressed if compression is enabled and if that saves space
+    int blockAddCompressed(uint64_t* index, const Block* block, uint64_t hint);
+    int blockRemove(uint64_t index); // only drops a reference if the block is shared
+    // Data blocks can be shared by several files. Returns -ENOTSUP for compressed blocks.
+    int blockShare(uint64_t index);
+    bool blockIsShared(uint64_t index);
+    // Whether a data block must be replaced by a new one instead of being modified in place:
+    // shared and compressed blocks, and all blocks if compression is enabled so that
+    // modified data is compressed
+    bool blockNeedsCopy(uint64_t index);
     int blockRead(uint64_t index, Block* block);
-    int blockWrite(uint64_t index, const Block* block);
+    // The inode index is needed to write modified cached blocks back when the inode's handle is released
+    int blockWrite(uint64_t index, const Block* block, uint64_t inodeIndex);
+    // Reserve a new block without writing its data; the caller must write it
+    int blockReserve(uint64_t* index, uint64_t hint);
+    // Locate the data of a block in the block data file so that the caller can
+    // transfer it without copies. Returns -ENOTSUP if that is not possible
+    // because of encryption or compression or because the storage is not file based.
+    int blockLocate(uint64_t index, int* fd, uint64_t* pos);
+    // Indirection blocks of slot trees go through the indirection block cache
+    int indirectionBlockRead(uint64_t index, Block* block);
+    int indirectionBlockWrite(uint64_t index, const Block* block, uint64_t inodeIndex);
+    // Read / write the data of count blocks with the given indices; runs of
+    // consecutive indices are transferred with a single storage access.
+    // Such transfers typically stream large amounts of data; they use blocks in the
+    // data block cache but do not add new blocks to it.
+    int blockReadMany(const uint64_t* indices, size_t count, unsigned char* const* blockData);
+    int blockWriteMany(const uint64_t* indices, size_t count, const unsigned char* const* blockData);
+    // Hint the storage that the data blocks will be read soon, and read them
+    // into the data block cache if there is one. The caller must hold a lock
+    // of the handle that uses the blocks, as for blockRead().
+    int blockPrefetch(const uint64_t* indices, size_t count);
+
+    // A set of four blocks for the levels of a slot tree, see _slotBlockPool;
+    // nullptr if out of memory. The blocks are allocated when first needed.
+    Block* slotBlocksAcquire();
+    void slotBlocksRelease(Block* blocks);
 
     int handleGet(uint64_t inodeIndex, Handle** handle);
+    void handleGetIfExists(uint64_t inodeIndex, Handle** handle); // *handle is nullptr if there is none
     int handleRelease(Handle* handle); // might return errors associated with the inode
+    // Let the background thread prefetch count slots of the handle starting at slot,
+    // or write back its modified cached data blocks. These requests are dropped
+    // if the thread is busy or not running. The caller must not hold the handle's lock.
+    void prefetch(Handle* handle, uint64_t slot, uint64_t count);
+    void writeBehind(Handle* handle);
+    int flushCaches(uint64_t inodeIndex); // write back modified cached blocks of the inode
+    int flushCaches();                    // write back all modified cached blocks
+    void logCacheStats(); // log the hits and misses of the block caches
+
+    // Whether the data of removed files can be reclaimed in the background
+    bool reclaimsInBackground() const { return _reclaimThread.joinable(); }
+    // Let the reclaimer remove the data of the inode and then the inode itself.
+    // The inode must have nlink 0 and must not be used by any handle.
+    int orphanAdd(uint64_t inodeIndex);
+
+    // Memory budget shared by the name indices of all directory handles
+    bool nameIndexMemoryReserve(uint64_t bytes);
+    void nameIndexMemoryRelease(uint64_t bytes);
 
     int statfs(size_t* blockSize, size_t* maxNameLen,
             uint64_t* maxBlockCount, uint64_t* freeBlockCount,
             uint64_t* maxInodeCount, uint64_t* freeInodeCount);
 
     friend class Handle;
+    // offline compaction rewrites the storage below the level of handles, see compact.cpp
+    friend class Compactor;
 };
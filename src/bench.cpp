@@ -0,0 +1,505 @@
+/*
+ * Copyright (C) 2023, 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* 6fs-bench measures the performance of 6fs without FUSE and the kernel: it
+ * calls SixFS (and with it Base and Handle) and ChunkManager directly. Each
+ * benchmark prints one line of JSON with its throughput and latency
+ * percentiles, so that results can be compared between versions. */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+#include <functional>
+#include <initializer_list>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <unistd.h>
+#include <dirent.h>
+
+#include <sodium.h>
+
+#include "index.hpp"
+#include "logger.hpp"
+#include "stats.hpp"
+#include "storage_memory.hpp"
+#include "map.hpp"
+#include "chunk.hpp"
+#include "block.hpp"
+#include "inode.hpp"
+#include "sixfs.hpp"
+
+
+typedef struct
+{
+    Storage::Type type;
+    std::string typeName;
+    std::string dirName;
+    bool encrypt;
+    unsigned int threads;
+    uint64_t fileSize;  // per thread, for the read and write benchmarks
+    size_t ioSize;      // for sequential reads and writes
+    uint64_t count;     // operations per thread for the other benchmarks
+    uint64_t depth;     // of the path for the lookup benchmark
+    size_t blockSize;
+    std::string only;   // run only the benchmarks whose names contain this
+} BenchOptions;
+
+// The work of one thread: it records the latency of each operation in ns
+// and the number of bytes transferred
+typedef std::function<int (unsigned int thread, std::vector<uint64_t>& latencies, uint64_t* bytes)> BenchFunction;
+
+static void report(const char* name, const BenchOptions& o, std::vector<uint64_t>& latencies, uint64_t bytes, double seconds)
+{
+    std::sort(latencies.begin(), latencies.end());
+    auto percentile = [&](double q) {
+        if (latencies.empty())
+            return 0.0;
+        return latencies[std::min(size_t(q * latencies.size()), latencies.size() - 1)] / 1e3;
+    };
+    printf("{\"bench\": \"%s\", \"type\": \"%s\", \"encrypted\": %s, \"block_size\": %zu, \"threads\": %u, "
+            "\"ops\": %zu, \"bytes\": %lu, \"seconds\": %.6f, \"ops_per_s\": %.1f, \"mib_per_s\": %.2f, "
+            "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}\n",
+            name, o.typeName.c_str(), o.encrypt ? "true" : "false", o.blockSize, o.threads,
+            latencies.size(), bytes, seconds, latencies.size() / seconds, bytes / seconds / (1024 * 1024),
+            percentile(0.5), percentile(0.9), percentile(0.99), percentile(1.0));
+    fflush(stdout);
+}
+
+static bool selected(const char* name, const BenchOptions& o)
+{
+    return o.only.empty() || std::string(name).find(o.only) != std::string::npos;
+}
+
+static bool anySelected(std::initializer_list<const char*> names, const BenchOptions& o)
+{
+    for (const char* name : names)
+        if (selected(name, o))
+            return true;
+    return false;
+}
+
+/* Run f in o.threads threads at the same time and report the combined result.
+ * A benchmark that is not selected is skipped, unless later benchmarks need
+ * its effects (setup), in which case it runs without a report. */
+static int run(const char* name, const BenchOptions& o, bool setup, const BenchFunction& f)
+{
+    if (!setup && !selected(name, o))
+        return 0;
+    std::vector<std::vector<uint64_t>> latencies(o.threads);
+    std::vector<uint64_t> bytes(o.threads, 0);
+    std::vector<int> results(o.threads, 0);
+    std::vector<std::thread> threads;
+    uint64_t start = Stats::now();
+    for (unsigned int t = 0; t < o.threads; t++)
+        threads.push_back(std::thread([&, t]() { results[t] = f(t, latencies[t], &bytes[t]); }));
+    for (unsigned int t = 0; t < o.threads; t++)
+        threads[t].join();
+    double seconds = (Stats::now() - start) / 1e9;
+    for (unsigned int t = 0; t < o.threads; t++) {
+        if (results[t] < 0) {
+            fprintf(stderr, "%s failed: %s\n", name, strerror(-results[t]));
+            return results[t];
+        }
+    }
+    std::vector<uint64_t> all;
+    uint64_t allBytes = 0;
+    for (unsigned int t = 0; t < o.threads; t++) {
+        all.insert(all.end(), latencies[t].begin(), latencies[t].end());
+        allBytes += bytes[t];
+    }
+    if (selected(name, o))
+        report(name, o, all, allBytes, seconds);
+    return 0;
+}
+
+static std::string threadPath(const char* prefix, unsigned int t)
+{
+    return std::string(prefix) + '-' + std::to_string(t);
+}
+
+// Read or write a file of o.fileSize bytes, sequentially in o.ioSize pieces or
+// at random offsets in pieces of the block size
+static int transferFile(SixFS* fs, const BenchOptions& o, unsigned int t, bool write, bool random,
+        std::vector<uint64_t>& latencies, uint64_t* bytes)
+{
+    std::string path = threadPath("/file", t);
+    size_t size = (random ? o.blockSize : o.ioSize);
+    uint64_t ops = o.fileSize / size;
+    std::vector<unsigned char> buf(size);
+    std::mt19937_64 rng(t);
+    for (size_t i = 0; i < size; i++)
+        buf[i] = rng();
+    Handle* handle;
+    int r = fs->open(path.c_str(), !write, false, false, &handle);
+    for (uint64_t i = 0; r >= 0 && i < ops; i++) {
+        uint64_t offset = (random ? rng() % ops : i) * size;
+        uint64_t start = Stats::now();
+        r = (write ? fs->write(handle, offset, buf.data(), size) : fs->read(handle, offset, buf.data(), size));
+        latencies.push_back(Stats::now() - start);
+        *bytes += size;
+    }
+    if (r >= 0)
+        r = fs->close(handle);
+    return (r < 0 ? r : 0);
+}
+
+static int benchFiles(SixFS* fs, const BenchOptions& o)
+{
+    if (!anySelected({ "seq-write", "seq-read", "rand-write", "rand-read" }, o))
+        return 0;
+    int r = 0;
+    for (unsigned int t = 0; r == 0 && t < o.threads; t++)
+        r = fs->mknod(threadPath("/file", t).c_str(), TypeREG | ModeRWXU, 0);
+    if (r == 0)
+        r = run("seq-write", o, true, [&](unsigned int t, std::vector<uint64_t>& l, uint64_t* b) { return transferFile(fs, o, t, true, false, l, b); });
+    if (r == 0)
+        r = run("seq-read", o, false, [&](unsigned int t, std::vector<uint64_t>& l, uint64_t* b) { return transferFile(fs, o, t, false, false, l, b); });
+    if (r == 0)
+        r = run("rand-write", o, false, [&](unsigned int t, std::vector<uint64_t>& l, uint64_t* b) { return transferFile(fs, o, t, true, true, l, b); });
+    if (r == 0)
+        r = run("rand-read", o, false, [&](unsigned int t, std::vector<uint64_t>& l, uint64_t* b) { return transferFile(fs, o, t, false, true, l, b); });
+    for (unsigned int t = 0; r == 0 && t < o.threads; t++)
+        r = fs->unlink(threadPath("/file", t).c_str());
+    return r;
+}
+
+static int benchSmallFiles(SixFS* fs, const BenchOptions& o)
+{
+    if (!anySelected({ "small-create", "small-unlink" }, o))
+        return 0;
+    const size_t size = 1000;
+    std::vector<unsigned char> buf(size, 42);
+    int r = 0;
+    for (unsigned int t = 0; r == 0 && t < o.threads; t++)
+        r = fs->mkdir(threadPath("/small", t).c_str(), TypeDIR | ModeRWXU);
+    if (r == 0) {
+        r = run("small-create", o, true, [&](unsigned int t, std::vector<uint64_t>& latencies, uint64_t* bytes) {
+                int r = 0;
+                for (uint64_t i = 0; r >= 0 && i < o.count; i++) {
+                    std::string path = threadPath("/small", t) + '/' + std::to_string(i);
+                    Handle* handle;
+                    uint64_t start = Stats::now();
+                    r = fs->mknod(path.c_str(), TypeREG | ModeRWXU, 0);
+                    if (r == 0)
+                        r = fs->open(path.c_str(), false, false, false, &handle);
+                    if (r == 0) {
+                        r = fs->write(handle, 0, buf.data(), size);
+                        int r2 = fs->close(handle);
+                        if (r >= 0)
+                            r = r2;
+                    }
+                    latencies.push_back(Stats::now() - start);
+                    *bytes += size;
+                }
+                return (r < 0 ? r : 0);
+            });
+    }
+    if (r == 0) {
+        r = run("small-unlink", o, true, [&](unsigned int t, std::vector<uint64_t>& latencies, uint64_t*) {
+                int r = 0;
+                for (uint64_t i = 0; r == 0 && i < o.count; i++) {
+                    std::string path = threadPath("/small", t) + '/' + std::to_string(i);
+                    uint64_t start = Stats::now();
+                    r = fs->unlink(path.c_str());
+                    latencies.push_back(Stats::now() - start);
+                }
+                return r;
+            });
+    }
+    for (unsigned int t = 0; r == 0 && t < o.threads; t++)
+        r = fs->rmdir(threadPath("/small", t).c_str());
+    return r;
+}
+
+static int benchLargeDir(SixFS* fs, const BenchOptions& o)
+{
+    if (!selected("large-dir-insert", o))
+        return 0;
+    // all threads insert into the same directory
+    int r = fs->mkdir("/large", TypeDIR | ModeRWXU);
+    if (r == 0) {
+        r = run("large-dir-insert", o, false, [&](unsigned int t, std::vector<uint64_t>& latencies, uint64_t*) {
+                int r = 0;
+                for (uint64_t i = 0; r == 0 && i < o.count; i++) {
+                    std::string path = threadPath("/large/entry", t) + '-' + std::to_string(i);
+                    uint64_t start = Stats::now();
+                    r = fs->mknod(path.c_str(), TypeREG | ModeRWXU, 0);
+                    latencies.push_back(Stats::now() - start);
+                }
+                return r;
+            });
+    }
+    for (unsigned int t = 0; r == 0 && t < o.threads; t++) {
+        for (uint64_t i = 0; r == 0 && i < o.count; i++)
+            r = fs->unlink((threadPath("/large/entry", t) + '-' + std::to_string(i)).c_str());
+    }
+    if (r == 0)
+        r = fs->rmdir("/large");
+    return r;
+}
+
+static int benchDeepLookup(SixFS* fs, const BenchOptions& o)
+{
+    if (!selected("deep-lookup", o))
+        return 0;
+    std::string path;
+    int r = 0;
+    for (uint64_t d = 0; r == 0 && d < o.depth; d++) {
+        path += "/dir" + std::to_string(d);
+        r = fs->mkdir(path.c_str(), TypeDIR | ModeRWXU);
+    }
+    if (r == 0) {
+        r = run("deep-lookup", o, false, [&](unsigned int, std::vector<uint64_t>& latencies, uint64_t*) {
+                int r = 0;
+                for (uint64_t i = 0; r == 0 && i < o.count; i++) {
+                    uint64_t inodeIndex;
+                    Inode inode;
+                    uint64_t start = Stats::now();
+                    r = fs->getAttr(nullptr, path.c_str(), &inodeIndex, &inode);
+                    latencies.push_back(Stats::now() - start);
+                }
+                return r;
+            });
+    }
+    while (r == 0 && !path.empty()) {
+        r = fs->rmdir(path.c_str());
+        path.resize(path.rfind('/'));
+    }
+    return r;
+}
+
+static int benchChunks(const BenchOptions& o)
+{
+    if (!anySelected({ "chunk-add", "chunk-remove" }, o))
+        return 0;
+    StorageMemory mapStorage;
+    StorageMemory chunkStorage;
+    Map map(&mapStorage);
+    ChunkManager mgr(&map, &chunkStorage, o.blockSize, false);
+    int r = mapStorage.open();
+    if (r == 0)
+        r = chunkStorage.open();
+    if (r == 0)
+        r = mgr.initialize();
+    std::vector<std::vector<uint64_t>> indices(o.threads);
+    if (r == 0) {
+        r = run("chunk-add", o, true, [&](unsigned int t, std::vector<uint64_t>& latencies, uint64_t*) {
+                int r = 0;
+                for (uint64_t i = 0; r == 0 && i < o.count; i++) {
+                    uint64_t index;
+                    uint64_t start = Stats::now();
+                    r = mgr.add(&index, nullptr);
+                    latencies.push_back(Stats::now() - start);
+                    indices[t].push_back(index);
+                }
+                return r;
+            });
+    }
+    if (r == 0) {
+        r = run("chunk-remove", o, true, [&](unsigned int t, std::vector<uint64_t>& latencies, uint64_t*) {
+                int r = 0;
+                for (size_t i = 0; r == 0 && i < indices[t].size(); i++) {
+                    uint64_t start = Stats::now();
+                    r = mgr.remove(indices[t][i]);
+                    latencies.push_back(Stats::now() - start);
+                }
+                return r;
+            });
+    }
+    int r2 = mgr.sync();
+    if (r == 0)
+        r = r2;
+    return r;
+}
+
+static int getSize(const char* s, uint64_t* val)
+{
+    char* endptr;
+    errno = 0;
+    unsigned long long v = strtoull(s, &endptr, 10);
+    if (errno != 0 || endptr == s)
+        return -EINVAL;
+    if (*endptr == 'K')
+        v <<= 10;
+    else if (*endptr == 'M')
+        v <<= 20;
+    else if (*endptr == 'G')
+        v <<= 30;
+    else if (*endptr != '\0')
+        return -EINVAL;
+    *val = v;
+    return 0;
+}
+
+static void printHelp(const char* progname)
+{
+    printf("usage: %s [options]\n\n", progname);
+    printf("Options:\n"
+            "    --type=<mem|mmap|file> storage type (default mem)\n"
+            "    --dir=<dir>            the directory for the 6fs files (required for types mmap and file);\n"
+            "                           it must not contain a 6fs file system yet\n"
+            "    --encrypt              use encryption with a random key\n"
+            "    --threads=<n>          number of threads for each benchmark (default 1)\n"
+            "    --file-size=<size>     file size per thread for the read and write benchmarks (default 64M)\n"
+            "    --io-size=<size>       size of sequential reads and writes (default 128K)\n"
+            "    --count=<n>            operations per thread for the other benchmarks (default 10000)\n"
+            "    --depth=<n>            path depth for the lookup benchmark (default 16)\n"
+            "    --block-size=<size>    block size of the file system (default 4K)\n"
+            "    --only=<name>          run only the benchmarks whose names contain this\n"
+            "The chunk-add and chunk-remove benchmarks always use memory storage.\n"
+            "Each benchmark prints one line of JSON with its results. The files in the\n"
+            "directory are removed at the end.\n");
+}
+
+int main(int argc, char* argv[])
+{
+    BenchOptions o = {
+        .type = Storage::TypeMem,
+        .typeName = "mem",
+        .dirName = std::string(),
+        .encrypt = false,
+        .threads = 1,
+        .fileSize = 64 << 20,
+        .ioSize = 128 << 10,
+        .count = 10000,
+        .depth = 16,
+        .blockSize = Block::MinSize,
+        .only = std::string()
+    };
+    for (int i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        const char* val = strchr(arg, '=');
+        std::string name = (val ? std::string(arg, val - arg) : std::string(arg));
+        if (val)
+            val++;
+        uint64_t v = 0;
+        bool ok = true;
+        if (name == "--help") {
+            printHelp(argv[0]);
+            return 0;
+        } else if (name == "--type" && val) {
+            o.typeName = val;
+            if (o.typeName == "mem")
+                o.type = Storage::TypeMem;
+            else if (o.typeName == "mmap")
+                o.type = Storage::TypeMmap;
+            else if (o.typeName == "file")
+                o.type = Storage::TypeFile;
+            else
+                ok = false;
+        } else if (name == "--dir" && val) {
+            o.dirName = val;
+        } else if (name == "--encrypt" && !val) {
+            o.encrypt = true;
+        } else if (name == "--threads" && val) {
+            ok = (getSize(val, &v) == 0 && v > 0 && v <= 1024);
+            o.threads = v;
+        } else if (name == "--file-size" && val) {
+            ok = (getSize(val, &o.fileSize) == 0);
+        } else if (name == "--io-size" && val) {
+            ok = (getSize(val, &v) == 0 && v > 0);
+            o.ioSize = v;
+        } else if (name == "--count" && val) {
+            ok = (getSize(val, &o.count) == 0);
+        } else if (name == "--depth" && val) {
+            ok = (getSize(val, &o.depth) == 0);
+        } else if (name == "--block-size" && val) {
+            ok = (getSize(val, &v) == 0 && Block::isValidSize(v));
+            o.blockSize = v;
+        } else if (name == "--only" && val) {
+            o.only = val;
+        } else {
+            ok = false;
+        }
+        if (!ok) {
+            fprintf(stderr, "Invalid argument %s\n", arg);
+            return 1;
+        }
+    }
+    if (o.type != Storage::TypeMem && o.dirName.empty()) {
+        fprintf(stderr, "Option --dir is missing\n");
+        return 1;
+    }
+    // the files are removed at the end, so never use an existing file system
+    if (o.type != Storage::TypeMem && ::access((o.dirName + "/inodemap.6fs").c_str(), F_OK) == 0) {
+        fprintf(stderr, "Directory %s already contains a 6fs file system\n", o.dirName.c_str());
+        return 1;
+    }
+    if (sodium_init() < 0) {
+        fprintf(stderr, "Cannot initialize libsodium\n");
+        return 1;
+    }
+    logger.setArgv0(argv[0]);
+    logger.setOutput("/dev/stderr");
+
+    std::vector<unsigned char> key;
+    if (o.encrypt) {
+        key.resize(crypto_stream_salsa20_KEYBYTES);
+        randombytes_buf(key.data(), key.size());
+    }
+    Cipher cipher = (cipherAvailable(CipherAES256GCM) ? CipherAES256GCM : CipherXSalsa20Poly1305);
+    SixFS::Options options;
+    options.type = o.type;
+    options.dirName = o.dirName;
+    options.key = key;
+    options.cipher = cipher;
+    options.indirectionBlockCacheSize = 4 << 20;
+    options.cryptoThreads = 4;
+    options.syncInterval = 5;
+    options.nameIndexMemoryLimit = 16 << 20;
+    options.blockSize = o.blockSize;
+    options.dentryCacheSize = 65536;
+    SixFS fs(options);
+    std::string errStr;
+    int r = fs.mount(errStr);
+    if (r < 0) {
+        fprintf(stderr, "Cannot initialize 6fs: %s\n", errStr.c_str());
+        return 1;
+    }
+    fs.startThreads();
+    r = benchFiles(&fs, o);
+    if (r == 0)
+        r = benchSmallFiles(&fs, o);
+    if (r == 0)
+        r = benchLargeDir(&fs, o);
+    if (r == 0)
+        r = benchDeepLookup(&fs, o);
+    if (r == 0)
+        r = benchChunks(o);
+    int r2 = fs.unmount();
+    if (r == 0)
+        r = r2;
+    if (o.type != Storage::TypeMem) {
+        // the directory contained no file system before, so all 6fs files are ours
+        DIR* dir = opendir(o.dirName.c_str());
+        for (struct dirent* e = (dir ? readdir(dir) : nullptr); e; e = readdir(dir)) {
+            std::string name = e->d_name;
+            if (name.size() > 4 && name.compare(name.size() - 4, 4, ".6fs") == 0)
+                ::remove((o.dirName + '/' + name).c_str());
+        }
+        if (dir)
+            closedir(dir);
+    }
+    return (r == 0 ? 0 : 1);
+}
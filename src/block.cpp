@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -17,27 +17,53 @@
  */
 
 #include <cstring>
+#include <cerrno>
+#include <new>
 
 #include "index.hpp"
 #include "block.hpp"
 
 
-Block::Block()
+bool Block::isValidSize(size_t size)
 {
+    return size >= MinSize && size <= MaxSize && (size & (size - 1)) == 0;
+}
+
+Block::Block() : _memory(nullptr), size(0), data(nullptr), indices(nullptr), target(nullptr)
+{
+}
+
+Block::~Block()
+{
+    delete[] _memory;
+}
+
+int Block::allocate(size_t s)
+{
+    if (_memory)
+        return 0;
+    _memory = new (std::nothrow) uint64_t[s / sizeof(uint64_t)];
+    if (!_memory)
+        return -ENOMEM;
+    size = s;
+    data = reinterpret_cast<unsigned char*>(_memory);
+    indices = _memory;
+    target = reinterpret_cast<char*>(_memory);
+    return 0;
 }
 
 void Block::initializeData()
 {
-    memset(data, 0, sizeof(data));
+    memset(data, 0, size);
 }
 
 void Block::initializeIndices()
 {
-    for (size_t i = 0; i < (sizeof(indices) / sizeof(indices[0])); i++)
+    for (size_t i = 0; i < size / sizeof(uint64_t); i++)
         indices[i] = InvalidIndex;
 }
 
 void Block::initializeTarget()
 {
-    memset(data, 0, sizeof(data));
+    memset(data, 0, size);
 }
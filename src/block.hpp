@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -24,22 +24,40 @@
 
 // A block can hold
 // - either file data
-// - or directory entry indices
+// - or slot indices (in indirection blocks)
 // - or a symbolic link target name
+//
+// The block size is a parameter of the file system format (see Base::blockSize()),
+// so the memory is allocated at runtime with allocate(). The data, indices and
+// target pointers all refer to the same memory.
 class Block
 {
+private:
+    uint64_t* _memory;
+
 public:
-    static constexpr size_t size = 4096;
+    // The minimum block size is also the block size of file systems
+    // that were created before the block size became configurable.
+    static constexpr size_t MinSize = 4096;
+    static constexpr size_t MaxSize = 1024 * 1024;
+    static bool isValidSize(size_t size); // a power of two between MinSize and MaxSize
+
+    size_t size;
+    unsigned char* data; // for file data
+    uint64_t* indices;   // for slot indices
+    char* target;        // for symlinks
 
     Block();
+    Block(const Block&) = delete;
+    Block& operator=(const Block&) = delete;
+    ~Block();
+
+    // Allocate memory for a block of the given size, unless that already happened.
+    // Returns 0 or -ENOMEM. The content is undefined until initialized.
+    int allocate(size_t size);
+    bool isAllocated() const { return _memory; }
 
     void initializeData();
     void initializeIndices();
     void initializeTarget();
-
-    union {
-        unsigned char data[size];                       // for file data
-        uint64_t indices[size / sizeof(uint64_t)];      // for directory entries
-        char target[size];                              // for symlinks
-    };
 };
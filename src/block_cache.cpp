@@ -0,0 +1,247 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+#include <vector>
+
+#include "block_cache.hpp"
+#include "logger.hpp"
+
+
+BlockCache::BlockCache(size_t blockSize, size_t maxBlocks, std::function<int (uint64_t index, const Block* block)> writeBack) :
+    _blockSize(blockSize),
+    _maxBlocksPerShard(std::max(maxBlocks / ShardCount, size_t(1))),
+    _writeBack(writeBack),
+    _hits(0),
+    _misses(0)
+{
+}
+
+BlockCache::~BlockCache()
+{
+}
+
+BlockCache::Shard& BlockCache::shard(uint64_t index)
+{
+    return _shards[index % ShardCount];
+}
+
+int BlockCache::writeBack(Shard& shard, std::unique_lock<std::mutex>& lock, Entry& e)
+{
+    e.isWritingBack = true;
+    lock.unlock();
+    int r = _writeBack(e.index, &(e.block));
+    lock.lock();
+    e.isWritingBack = false;
+    if (r < 0) {
+        logger.log(Logger::Error, "BlockCache: cannot write back block %lu: %s", e.index, strerror(-r));
+    } else {
+        e.isModified = false;
+        shard.modifiedEntries.erase(e.index);
+    }
+    shard.writtenBack.notify_all();
+    return r;
+}
+
+bool BlockCache::get(uint64_t index, Block* block)
+{
+    Shard& s = shard(index);
+    std::unique_lock<std::mutex> lock(s.mutex);
+    auto it = s.entries.find(index);
+    if (it == s.entries.end()) {
+        _misses++;
+        return false;
+    }
+    // this is fine even if the entry is being written back: that only reads it, too
+    s.lru.splice(s.lru.begin(), s.lru, it->second);
+    memcpy(block->data, it->second->block.data, _blockSize);
+    _hits++;
+    return true;
+}
+
+bool BlockCache::contains(uint64_t index)
+{
+    Shard& s = shard(index);
+    std::unique_lock<std::mutex> lock(s.mutex);
+    return s.entries.find(index) != s.entries.end();
+}
+
+int BlockCache::put(uint64_t index, const Block* block, bool isModified, uint64_t owner)
+{
+    Shard& s = shard(index);
+    std::unique_lock<std::mutex> lock(s.mutex);
+    int r = 0;
+    for (;;) {
+        auto it = s.entries.find(index);
+        if (it != s.entries.end()) {
+            // if the new block is unmodified, the cached block is at least as recent
+            Entry& e = *(it->second);
+            if (e.isWritingBack) {
+                s.writtenBack.wait(lock);
+                continue;
+            }
+            s.lru.splice(s.lru.begin(), s.lru, it->second);
+            if (isModified) {
+                memcpy(e.block.data, block->data, _blockSize);
+                try { s.modifiedEntries.insert(index); }
+                catch (...) { return _writeBack(index, block); }
+                e.isModified = true;
+                e.owner = owner;
+            }
+            return 0;
+        }
+        // evict the least recently used entry that is not being written back, and reuse it
+        auto last = s.lru.end();
+        if (s.lru.size() >= _maxBlocksPerShard) {
+            for (auto e = s.lru.end(); e != s.lru.begin(); ) {
+                e--;
+                if (!e->isWritingBack) {
+                    last = e;
+                    break;
+                }
+            }
+        }
+        if (last != s.lru.end()) {
+            if (last->isModified) {
+                r = writeBack(s, lock, *last);
+                if (r < 0) {
+                    // the victim stays modified, so the next flush writes it
+                    // again and reports the error if it persists; move it
+                    // away from the tail so that the next eviction tries
+                    // another entry, and do not cache the new block
+                    s.lru.splice(s.lru.begin(), s.lru, last);
+                    return (isModified ? _writeBack(index, block) : 0);
+                }
+                // the shard might have changed while it was unlocked
+                continue;
+            }
+            s.entries.erase(last->index);
+            s.lru.splice(s.lru.begin(), s.lru, last);
+        } else {
+            // the shard is not full, or all its entries are being written back
+            try { s.lru.emplace_front(); }
+            catch (...) { return (isModified ? _writeBack(index, block) : 0); }
+            if (s.lru.front().block.allocate(_blockSize) < 0) {
+                s.lru.pop_front();
+                return (isModified ? _writeBack(index, block) : 0);
+            }
+        }
+        break;
+    }
+    Entry& e = s.lru.front();
+    e.index = index;
+    e.owner = owner;
+    e.isModified = false;
+    e.isWritingBack = false;
+    memcpy(e.block.data, block->data, _blockSize);
+    try {
+        s.entries.insert(std::pair<uint64_t, std::list<Entry>::iterator>(index, s.lru.begin()));
+        if (isModified) {
+            s.modifiedEntries.insert(index);
+            e.isModified = true;
+        }
+    }
+    catch (...) {
+        // we cannot keep this entry; write it back directly if necessary
+        s.entries.erase(index);
+        s.lru.pop_front();
+        r = (isModified ? _writeBack(index, block) : 0);
+    }
+    return r;
+}
+
+void BlockCache::remove(uint64_t index)
+{
+    Shard& s = shard(index);
+    std::unique_lock<std::mutex> lock(s.mutex);
+    auto it = s.entries.find(index);
+    // wait for a write back so that it cannot overwrite a later use of the block
+    while (it != s.entries.end() && it->second->isWritingBack) {
+        s.writtenBack.wait(lock);
+        it = s.entries.find(index);
+    }
+    if (it != s.entries.end()) {
+        s.modifiedEntries.erase(index);
+        s.lru.erase(it->second);
+        s.entries.erase(it);
+    }
+}
+
+int BlockCache::flush(Shard& s, bool allOwners, uint64_t owner)
+{
+    std::unique_lock<std::mutex> lock(s.mutex);
+    std::vector<uint64_t> indices;
+    try {
+        indices.assign(s.modifiedEntries.begin(), s.modifiedEntries.end());
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    int ret = 0;
+    for (size_t i = 0; i < indices.size(); i++) {
+        auto it = s.entries.find(indices[i]);
+        // wait for a concurrent write back; the entry might be modified again if it failed
+        while (it != s.entries.end() && it->second->isWritingBack) {
+            s.writtenBack.wait(lock);
+            it = s.entries.find(indices[i]);
+        }
+        if (it == s.entries.end() || !it->second->isModified)
+            continue;
+        if (allOwners || it->second->owner == owner) {
+            int r = writeBack(s, lock, *(it->second));
+            if (r < 0 && ret == 0)
+                ret = r;
+        }
+    }
+    return ret;
+}
+
+int BlockCache::flush()
+{
+    int ret = 0;
+    for (size_t i = 0; i < ShardCount; i++) {
+        int r = flush(_shards[i], true, 0);
+        if (r < 0 && ret == 0)
+            ret = r;
+    }
+    return ret;
+}
+
+int BlockCache::flush(uint64_t owner)
+{
+    int ret = 0;
+    for (size_t i = 0; i < ShardCount; i++) {
+        int r = flush(_shards[i], false, owner);
+        if (r < 0 && ret == 0)
+            ret = r;
+    }
+    return ret;
+}
+
+uint64_t BlockCache::hits() const
+{
+    return _hits;
+}
+
+uint64_t BlockCache::misses() const
+{
+    return _misses;
+}
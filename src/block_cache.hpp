@@ -0,0 +1,98 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+
+#include "block.hpp"
+
+
+// A thread-safe LRU cache of blocks. Modified blocks are written back
+// using the given function when they are evicted or flushed.
+// The cache is split into shards with separate locks so that
+// concurrent accesses rarely contend. Blocks are written back without
+// holding the lock of their shard, so that a slow device does not stall
+// the other accesses to the shard.
+class BlockCache
+{
+private:
+    class Entry
+    {
+    public:
+        uint64_t index;
+        uint64_t owner; // the inode this block belongs to, or InvalidIndex
+        bool isModified;
+        // While an entry is written back, it stays in place: it is not
+        // evicted, and put() and remove() wait until the write is done.
+        bool isWritingBack;
+        Block block;
+    };
+
+    class Shard
+    {
+    public:
+        std::mutex mutex;
+        std::list<Entry> lru; // the most recently used entry first
+        std::unordered_map<uint64_t, std::list<Entry>::iterator> entries;
+        std::unordered_set<uint64_t> modifiedEntries;
+        std::condition_variable writtenBack;
+    };
+
+    static constexpr size_t ShardCount = 16;
+
+    const size_t _blockSize;
+    const size_t _maxBlocksPerShard;
+    const std::function<int (uint64_t index, const Block* block)> _writeBack;
+    Shard _shards[ShardCount];
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+
+    Shard& shard(uint64_t index);
+    // Write back a modified entry; unlocks the shard while writing
+    int writeBack(Shard& shard, std::unique_lock<std::mutex>& lock, Entry& e);
+    int flush(Shard& shard, bool allOwners, uint64_t owner);
+
+public:
+    BlockCache(size_t blockSize, size_t maxBlocks, std::function<int (uint64_t index, const Block* block)> writeBack);
+    ~BlockCache();
+
+    // Get a copy of a cached block; returns false if the block is not cached
+    bool get(uint64_t index, Block* block);
+    // Whether a block is cached; does not count as a use of the block
+    bool contains(uint64_t index);
+    // Put a block into the cache; this might write back an evicted block
+    int put(uint64_t index, const Block* block, bool isModified, uint64_t owner);
+    // Drop a block from the cache without writing it back
+    void remove(uint64_t index);
+    // Write back all modified blocks, or only those of the given owner
+    int flush();
+    int flush(uint64_t owner);
+
+    // Statistics
+    uint64_t hits() const;
+    uint64_t misses() const;
+};
@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -17,12 +17,17 @@
  */
 
 #include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <functional>
 
 #include <cerrno>
 #include <cstring>
 
 #include "logger.hpp"
+#include "stats.hpp"
 #include "emergency.hpp"
+#include "index.hpp"
 #include "chunk.hpp"
 
 
@@ -54,107 +59,337 @@ int ChunkManager::initialize()
 
 uint64_t ChunkManager::chunksInStorage() const
 {
+    std::shared_lock<std::shared_mutex> lock(_rwMutex);
     uint64_t ret = _chunksInStorage;
     return ret;
 }
 
+ChunkManager::Pool& ChunkManager::pool()
+{
+    // threads are assigned to pools round robin on first use
+    static std::atomic<unsigned int> nextPoolIndex(0);
+    static thread_local unsigned int poolIndex = nextPoolIndex++;
+    return _pools[poolIndex % PoolCount];
+}
+
+std::unique_lock<std::shared_mutex> ChunkManager::exclusiveLock()
+{
+    std::unique_lock<std::shared_mutex> lock(_rwMutex, std::defer_lock);
+    lockRecordingWait(lock, Stats::WaitChunkLock);
+    return lock;
+}
+
+std::shared_lock<std::shared_mutex> ChunkManager::sharedLock()
+{
+    std::shared_lock<std::shared_mutex> lock(_rwMutex, std::defer_lock);
+    lockRecordingWait(lock, Stats::WaitChunkLock);
+    return lock;
+}
+
+int ChunkManager::refillPool(Pool& p)
+{
+    int r = 0;
+    try {
+        p.indices.reserve(2 * PoolBatch + 1);
+    }
+    catch (...) {
+        r = -ENOMEM;
+    }
+    if (r < 0)
+        return r;
+
+    std::unique_lock<std::shared_mutex> lock = exclusiveLock();
+
+    // reserve a batch of free chunks in ascending order
+    uint64_t reserved[PoolBatch];
+    size_t reservedCount = 0;
+    for (size_t i = 0; r == 0 && i < PoolBatch; i++) {
+        r = _map->firstZero(&(reserved[i]));
+        if (r == 0)
+            r = _map->setOne(reserved[i]);
+        if (r == 0)
+            reservedCount++;
+    }
+    if (r == 0 && reserved[reservedCount - 1] >= _chunksInStorage) {
+        r = _chunks->setSize(reserved[reservedCount - 1] + 1);
+        if (r == 0)
+            _chunksInStorage = reserved[reservedCount - 1] + 1;
+    }
+    // the chunks must be marked as used in storage before anything refers to them
+    if (r == 0)
+        r = _map->writeBack(reserved, reservedCount);
+    if (r < 0) {
+        for (size_t i = 0; i < reservedCount; i++) {
+            int r2 = _map->setZero(reserved[i]);
+            if (r2 < 0) {
+                logger.log(Logger::Error, "ChunkManager::add(): cannot recover from failure to reserve chunks; a dead chunk remains: %s", strerror(-r2));
+            }
+        }
+    } else {
+        for (size_t i = 0; i < reservedCount; i++)
+            p.indices.push_back(reserved[reservedCount - 1 - i]);
+    }
+    return r;
+}
+
+int ChunkManager::drainPool(Pool& p, size_t keep)
+{
+    if (p.indices.size() <= keep)
+        return 0;
+
+    std::unique_lock<std::shared_mutex> lock = exclusiveLock();
+
+    // return the highest indices to the map so that the storage can shrink
+    std::sort(p.indices.begin(), p.indices.end(), std::greater<uint64_t>());
+    size_t returnCount = p.indices.size() - keep;
+    int r = 0;
+    for (size_t i = 0; i < returnCount; i++) {
+        int r2 = _map->setZero(p.indices[i]);
+        if (r2 < 0) {
+            logger.log(Logger::Error, "ChunkManager::remove(): cannot return chunk to map; a dead chunk remains: %s", strerror(-r2));
+            r = r2;
+        }
+    }
+    p.indices.erase(p.indices.begin(), p.indices.begin() + returnCount);
+
+    // remove all empty chunks at the end of the storage to save storage space
+    uint64_t lastUsedIndex;
+    int r2 = _map->lastOne(&lastUsedIndex);
+    if (r2 < 0) {
+        logger.log(Logger::Error, "ChunkManager::remove(): cannot determine how many empty chunks to remove: %s", strerror(-r2));
+        emergency(EmergencySystemFailure);
+        return -ENOTRECOVERABLE;
+    }
+    uint64_t chunksInStorage = (lastUsedIndex == InvalidIndex ? 0 : lastUsedIndex + 1);
+    if (chunksInStorage < _chunksInStorage) {
+        _chunksInStorage = chunksInStorage;
+        r2 = _chunks->setSize(_chunksInStorage);
+        if (r2 < 0) {
+            logger.log(Logger::Error, "ChunkManager::remove(): cannot remove empty chunks: %s", strerror(-r2));
+            emergency(EmergencySystemFailure);
+            return -ENOTRECOVERABLE;
+        }
+    }
+    return r;
+}
+
 int ChunkManager::sync()
 {
-    std::unique_lock<std::shared_mutex> lock(_rwMutex);
-    int r = _map->sync();
+    int r = 0;
+    for (size_t i = 0; i < PoolCount; i++) {
+        std::lock_guard<std::mutex> poolLock(_pools[i].mutex);
+        int r2 = drainPool(_pools[i], 0);
+        if (r == 0)
+            r = r2;
+    }
+    std::unique_lock<std::shared_mutex> lock = exclusiveLock();
+    int r2 = _map->sync();
+    if (r == 0)
+        r = r2;
     return r;
 }
 
+int ChunkManager::commit()
+{
+    int r = sync();
+    // No lock needed: the storage handles concurrent syncs and writes
+    if (r == 0)
+        r = _map->syncStorage();
+    if (r == 0)
+        r = _chunks->sync();
+    return r;
+}
+
+void ChunkManager::appendStorages(std::vector<Storage*>& storages) const
+{
+    storages.push_back(_map->storage());
+    storages.push_back(_chunks);
+}
+
 int ChunkManager::add(uint64_t* index, const void* buf)
 {
-    std::unique_lock<std::shared_mutex> lock(_rwMutex);
+    Pool& p = pool();
+    std::unique_lock<std::mutex> poolLock(p.mutex);
 
-    int r = _map->firstZero(index);
-    if (r == 0)
-        r = _map->setOne(*index);
-    if (r == 0 && *index >= _chunksInStorage) {
-        _chunksInStorage = *index + 1;
-        r = _chunks->setSize(_chunksInStorage);
+    int r = 0;
+    if (p.indices.empty())
+        r = refillPool(p);
+    if (r == 0) {
+        *index = p.indices.back();
+        p.indices.pop_back();
+    }
+    if (r == 0 && buf) {
+        std::shared_lock<std::shared_mutex> lock = sharedLock();
+        r = _chunks->write(*index, 1, buf);
         if (r < 0) {
-            int r2 = _map->setZero(*index);
-            if (r2 < 0) {
-                logger.log(Logger::Error, "ChunkManager::add(): cannot recover from failure to set storage size; a dead chunk remains: %s", strerror(-r2));
+            // the pool has room for it since we just took it from there
+            p.indices.push_back(*index);
+        }
+    }
+
+    return r;
+}
+
+int ChunkManager::addNear(uint64_t hint, uint64_t runLength, uint64_t* index, const void* buf)
+{
+    // Search at most this many chunks for a free run before falling back
+    // to the first free chunk, so that a fragmented map stays cheap
+    constexpr uint64_t MaxRunSearch = 1 << 18;
+
+    int r = 0;
+    {
+        std::unique_lock<std::shared_mutex> lock = exclusiveLock();
+        bool used;
+        r = _map->get(hint, &used);
+        if (r == 0 && used) {
+            // Prefer a free run inside the storage over growing it, first after
+            // the hint and then from the start. Partially used runs are skipped
+            // since other files may be growing into them.
+            uint64_t found = InvalidIndex;
+            if (hint < _chunksInStorage)
+                r = _map->firstZeroRun(hint, runLength, std::min(MaxRunSearch, _chunksInStorage - hint), &found);
+            if (r == 0 && (found == InvalidIndex || found >= _chunksInStorage))
+                r = _map->firstZeroRun(0, runLength, std::min(MaxRunSearch, _chunksInStorage), &found);
+            if (r == 0 && (found == InvalidIndex || found >= _chunksInStorage))
+                found = (_chunksInStorage + runLength - 1) / runLength * runLength;
+            hint = found;
+        }
+        if (r == 0)
+            r = _map->setOne(hint);
+        if (r == 0 && hint >= _chunksInStorage) {
+            r = _chunks->setSize(hint + 1);
+            if (r == 0) {
+                _chunksInStorage = hint + 1;
+            } else {
+                int r2 = _map->setZero(hint);
+                if (r2 < 0) {
+                    logger.log(Logger::Error, "ChunkManager::addNear(): cannot recover from failure to reserve chunk; a dead chunk remains: %s", strerror(-r2));
+                }
             }
         }
+        if (r == 0) {
+            // the chunk must be marked as used in storage before anything refers to it
+            r = _map->writeBack(&hint, 1);
+            if (r < 0)
+                _map->setZero(hint);
+        }
     }
     if (r == 0) {
-        r = _chunks->write(*index, 1, buf);
+        *index = hint;
+        if (buf) {
+            std::shared_lock<std::shared_mutex> lock = sharedLock();
+            r = _chunks->write(*index, 1, buf);
+        }
         if (r < 0) {
+            std::unique_lock<std::shared_mutex> lock = exclusiveLock();
             int r2 = _map->setZero(*index);
-            if (r2 == 0 && *index + 1 == _chunksInStorage) {
-                _chunksInStorage--;
-                r2 = _chunks->setSize(_chunksInStorage);
-            }
             if (r2 < 0) {
-                logger.log(Logger::Error, "ChunkManager::add(): cannot recover from failure to write chunk; a dead chunk remains: %s", strerror(-r2));
+                logger.log(Logger::Error, "ChunkManager::addNear(): cannot recover from failure to write chunk; a dead chunk remains: %s", strerror(-r2));
             }
         }
     }
-
     return r;
 }
 
 int ChunkManager::remove(uint64_t index)
 {
-    std::unique_lock<std::shared_mutex> lock(_rwMutex);
+    {
+        std::shared_lock<std::shared_mutex> lock = sharedLock();
 
-    if (index >= _chunksInStorage) {
-        logger.log(Logger::Error, "ChunkManager::remove(): cannot remove chunk %lu (size %zu) because only %lu are in storage",
-                index, chunkSize(), _chunksInStorage);
-        emergency(EmergencyBug);
-        return -ENOTRECOVERABLE;
-    }
+        if (index >= _chunksInStorage) {
+            logger.log(Logger::Error, "ChunkManager::remove(): cannot remove chunk %lu (size %zu) because only %lu are in storage",
+                    index, chunkSize(), _chunksInStorage);
+            emergency(EmergencyBug);
+            return -ENOTRECOVERABLE;
+        }
 
-    int r = _map->setZero(index);
-    if (r == 0) {
-        if (index + 1 == _chunksInStorage) {
-            // we are at the end of the storage; remove this empty chunk and all
-            // preceding empty chunks to save storage space
-            _chunksInStorage--;
-            while (index > 0) {
-                index--;
-                bool b;
-                int r2 = _map->get(index, &b);
-                if (r2 < 0) {
-                    logger.log(Logger::Error, "ChunkManager::remove(): cannot determine how many empty chunks to remove: %s", strerror(-r2));
-                    emergency(EmergencySystemFailure);
-                    r = -ENOTRECOVERABLE;
-                    break;
-                }
-                if (b)
-                    break;
-                _chunksInStorage--;
+        // punch a hole for the empty chunk; if it ends up at the end of the
+        // storage, it will be removed completely when the pool is drained
+        if (_punchHolesForEmptyChunks) {
+            int r2 = _chunks->punchHole(index, 1);
+            if (r2 < 0) {
+                logger.log(Logger::Error, "ChunkManager::remove(): cannot punch hole; ignoring this error: %s", strerror(-r2));
             }
-            if (r == 0) {
-                int r2 = _chunks->setSize(_chunksInStorage);
-                if (r2 < 0) {
-                    logger.log(Logger::Error, "ChunkManager::remove(): cannot remove empty chunks: %s", strerror(-r2));
-                    emergency(EmergencySystemFailure);
-                    r = -ENOTRECOVERABLE;
-                }
+        }
+    }
+
+    Pool& p = pool();
+    std::unique_lock<std::mutex> poolLock(p.mutex);
+
+    int r = 0;
+    try {
+        p.indices.push_back(index);
+    }
+    catch (...) {
+        r = -ENOMEM;
+    }
+    if (r < 0) {
+        // return the chunk to the map directly
+        std::unique_lock<std::shared_mutex> lock = exclusiveLock();
+        r = _map->setZero(index);
+    } else if (p.indices.size() > 2 * PoolBatch) {
+        r = drainPool(p, PoolBatch);
+    }
+
+    return r;
+}
+
+int ChunkManager::planCompaction(const std::vector<uint64_t>& pinned, std::vector<std::pair<uint64_t, uint64_t>>& moves)
+{
+    std::unique_lock<std::shared_mutex> lock = exclusiveLock();
+
+    // pair the last movable chunks with the first free ones until they meet
+    std::vector<uint64_t> sources;
+    std::vector<uint64_t> targets;
+    uint64_t lastUsedIndex;
+    int r = _map->lastOne(&lastUsedIndex);
+    uint64_t i = (lastUsedIndex == InvalidIndex ? 0 : lastUsedIndex + 1);
+    uint64_t freeIndex = 0;
+    while (r == 0 && i > 0) {
+        i--;
+        bool used;
+        r = _map->get(i, &used);
+        if (r < 0 || !used || std::binary_search(pinned.begin(), pinned.end(), i))
+            continue;
+        r = _map->firstZero(freeIndex, &freeIndex);
+        if (r < 0 || freeIndex >= i)
+            break;
+        r = _map->setOne(freeIndex);
+        if (r == 0) {
+            try {
+                sources.push_back(i);
+                targets.push_back(freeIndex);
             }
-        } else {
-            // we are in the middle of the storage; punch a hole for the empty chunk
-            if (_punchHolesForEmptyChunks) {
-                int r2 = _chunks->punchHole(index, 1);
-                if (r2 < 0) {
-                    logger.log(Logger::Error, "ChunkManager::remove(): cannot punch hole; ignoring this error: %s", strerror(-r2));
-                }
+            catch (...) {
+                _map->setZero(freeIndex);
+                r = -ENOMEM;
             }
         }
     }
 
+    // the moved chunks keep their order so that contiguous files stay contiguous
+    if (r == 0) {
+        try {
+            moves.resize(sources.size());
+        }
+        catch (...) {
+            r = -ENOMEM;
+        }
+    }
+    if (r == 0) {
+        for (size_t j = 0; j < sources.size(); j++)
+            moves[j] = std::make_pair(sources[sources.size() - 1 - j], targets[j]);
+    } else {
+        for (size_t j = 0; j < targets.size(); j++)
+            _map->setZero(targets[j]);
+        moves.clear();
+    }
     return r;
 }
 
 int ChunkManager::read(uint64_t index, void* buf)
 {
-    std::shared_lock<std::shared_mutex> lock(_rwMutex);
+    std::shared_lock<std::shared_mutex> lock = sharedLock();
 
     int r = 0;
     if (index >= _chunksInStorage) {
@@ -170,7 +405,7 @@ int ChunkManager::read(uint64_t index, void* buf)
 
 int ChunkManager::write(uint64_t index, const void* buf)
 {
-    std::shared_lock<std::shared_mutex> lock(_rwMutex);
+    std::shared_lock<std::shared_mutex> lock = sharedLock();
 
     int r = 0;
     if (index >= _chunksInStorage) {
@@ -184,8 +419,64 @@ int ChunkManager::write(uint64_t index, const void* buf)
     return r;
 }
 
+int ChunkManager::readRange(uint64_t index, uint64_t count, void* const* bufs)
+{
+    std::shared_lock<std::shared_mutex> lock = sharedLock();
+
+    int r = 0;
+    if (index + count > _chunksInStorage) {
+        logger.log(Logger::Error, "ChunkManager::readRange(): cannot read chunks %lu-%lu (size %zu) because only %lu are in storage",
+                index, index + count - 1, chunkSize(), _chunksInStorage);
+        emergency(EmergencyBug);
+        r = -ENOTRECOVERABLE;
+    }
+    if (r == 0)
+        r = _chunks->readv(index, count, bufs);
+    return r;
+}
+
+int ChunkManager::writeRange(uint64_t index, uint64_t count, const void* const* bufs)
+{
+    std::shared_lock<std::shared_mutex> lock = sharedLock();
+
+    int r = 0;
+    if (index + count > _chunksInStorage) {
+        logger.log(Logger::Error, "ChunkManager::writeRange(): cannot write chunks %lu-%lu (size %zu) because only %lu are in storage",
+                index, index + count - 1, chunkSize(), _chunksInStorage);
+        emergency(EmergencyBug);
+        r = -ENOTRECOVERABLE;
+    }
+    if (r == 0)
+        r = _chunks->writev(index, count, bufs);
+    return r;
+}
+
+void ChunkManager::adviseWillNeed(uint64_t index, uint64_t count)
+{
+    std::shared_lock<std::shared_mutex> lock = sharedLock();
+    if (index < _chunksInStorage)
+        _chunks->adviseWillNeed(index, std::min(count, _chunksInStorage - index));
+}
+
+int ChunkManager::locate(uint64_t index, int* fd, uint64_t* pos)
+{
+    std::shared_lock<std::shared_mutex> lock = sharedLock();
+
+    int r = 0;
+    if (index >= _chunksInStorage) {
+        logger.log(Logger::Error, "ChunkManager::locate(): cannot locate chunk %lu (size %zu) because only %lu are in storage",
+                index, chunkSize(), _chunksInStorage);
+        emergency(EmergencyBug);
+        r = -ENOTRECOVERABLE;
+    }
+    if (r == 0)
+        r = _chunks->locate(index, fd, pos);
+    return r;
+}
+
 uint64_t ChunkManager::storageSizeInBytes() const
 {
+    std::shared_lock<std::shared_mutex> lock(_rwMutex);
     uint64_t ret = _chunksInStorage * _chunks->chunkSize() + _map->storageSizeInBytes();
     return ret;
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -18,20 +18,49 @@
 
 #pragma once
 
+#include <mutex>
 #include <shared_mutex>
+#include <utility>
+#include <vector>
 
 #include "storage.hpp"
 #include "map.hpp"
 
 
+/* Chunk allocation goes through a small number of pools, and each thread
+ * always uses the same pool. A pool owns a list of free chunk indices that are
+ * already marked as used in the map: they are reserved from the map in
+ * batches, and removed chunks go back to the pool of the removing thread.
+ * Only when a pool runs empty or holds too many indices is the map touched,
+ * so that concurrent writers rarely contend for the exclusive lock.
+ * All pooled indices are returned to the map in sync(). */
 class ChunkManager
 {
 private:
-    std::shared_mutex _rwMutex;
+    class Pool
+    {
+    public:
+        std::mutex mutex;
+        std::vector<uint64_t> indices; // sorted so that the lowest index is at the back after a refill
+    };
+
+    static constexpr size_t PoolCount = 16;
+    static constexpr size_t PoolBatch = 32;
+
+    mutable std::shared_mutex _rwMutex;
     Map* _map;
     Storage* _chunks;
     bool _punchHolesForEmptyChunks;
     uint64_t _chunksInStorage;
+    Pool _pools[PoolCount];
+
+    Pool& pool();
+    // lock _rwMutex and record the wait if it is contended
+    std::unique_lock<std::shared_mutex> exclusiveLock();
+    std::shared_lock<std::shared_mutex> sharedLock();
+    // these must be called with the pool mutex held
+    int refillPool(Pool& p);
+    int drainPool(Pool& p, size_t keep);
 
 public:
     ChunkManager(Map* map, Storage* storage, size_t chunkSize, bool punchHolesForEmptyChunks);
@@ -44,11 +73,32 @@ public:
     uint64_t chunksInStorage() const;
     size_t chunkSize() const;
 
-    int add(uint64_t* index, const void* buf);
+    int add(uint64_t* index, const void* buf); // buf may be nullptr to reserve a chunk without writing it
+    // like add(), but place the chunk at hint if that is free, or else at the start of a free
+    // run of runLength chunks (a multiple of 64), so that successive adds with hint = previous
+    // index + 1 keep a file contiguous even when several files grow at the same time
+    int addNear(uint64_t hint, uint64_t runLength, uint64_t* index, const void* buf);
     int remove(uint64_t index);
+    // For compaction: reserve the first free chunks as targets for the last used chunks
+    // that are not pinned (a sorted list), as long as a target is below its source.
+    // moves gets the (source, target) pairs sorted by source. The caller copies the
+    // chunks and then removes the sources, which lets the storage shrink.
+    int planCompaction(const std::vector<uint64_t>& pinned, std::vector<std::pair<uint64_t, uint64_t>>& moves);
     int read(uint64_t index, void* buf);
     int write(uint64_t index, const void* buf);
+    // read / write count consecutive chunks starting at index, each from / to its own buffer
+    int readRange(uint64_t index, uint64_t count, void* const* bufs);
+    int writeRange(uint64_t index, uint64_t count, const void* const* bufs);
+    // locate a chunk in its storage file for direct transfers, see Storage::locate()
+    int locate(uint64_t index, int* fd, uint64_t* pos);
+    // hint that count consecutive chunks starting at index will be read soon
+    void adviseWillNeed(uint64_t index, uint64_t count);
 
     int sync();
+    // sync() and then make the map and all chunks written so far durable
+    int commit();
+    // append the storages that commit() makes durable, so that the caller can
+    // sync them together with others, see Storage::syncMany()
+    void appendStorages(std::vector<Storage*>& storages) const;
     uint64_t storageSizeInBytes() const;
 };
@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#include <algorithm>
+
+#include "base.hpp"
+#include "index.hpp"
+
+#include "compact.hpp"
+
+
+/* Compaction moves the used chunks at the end of each chunk store (inodes,
+ * dirents, each block stripe and each compressed block class) to the free
+ * chunks at its front, so that the storage files shrink to the used size.
+ * All references to moved chunks are rewritten: the slot trees of inodes and
+ * the inode indices of dirents.
+ *
+ * Some chunks are referenced by index from places that are not rewritten, so
+ * they stay where they are: the root inode, orphans and everything in their
+ * slot trees (the orphan map refers to their inodes), and shared data blocks
+ * (the reference count table refers to them).
+ *
+ * The work is done in steps that keep the file system consistent when it is
+ * interrupted: the targets are reserved and committed first, then the chunks
+ * are copied, then the references are rewritten, and the old chunks are only
+ * removed after all of that was committed. An interruption leaves at most
+ * some unused chunks behind. */
+class Compactor
+{
+private:
+    class Store
+    {
+    public:
+        ChunkManager* mgr;
+        std::vector<uint64_t> pinned;
+        std::vector<std::pair<uint64_t, uint64_t>> moves; // sorted by source, see ChunkManager::planCompaction()
+
+        Store(ChunkManager* m = nullptr) : mgr(m) {}
+
+        uint64_t moved(uint64_t chunk) const
+        {
+            auto it = std::lower_bound(moves.begin(), moves.end(), std::make_pair(chunk, uint64_t(0)));
+            return (it != moves.end() && it->first == chunk ? it->second : chunk);
+        }
+    };
+
+    Base& _base;
+    Store _inodes;
+    Store _dirents;
+    std::vector<Store> _stripes;
+    Store _cblocks[Base::CompressedClasses];
+    Block _blocks[4]; // one for each level of indirection
+
+    std::vector<Store*> allStores();
+    Store& blockStore(uint64_t index, uint64_t* chunk);
+    uint64_t movedBlock(uint64_t index);
+    bool hasSlotTrees(const Inode& inode) const;
+    int pinTree(uint64_t index, int depth, bool isDir);
+    int rewriteTree(uint64_t* index, int depth, bool isDir);
+    int pin();
+    int plan();
+    int copy();
+    int rewrite();
+    int removeSources();
+
+public:
+    Compactor(Base& base);
+    int run(uint64_t* movedChunks, uint64_t* sizeBefore, uint64_t* sizeAfter);
+};
+
+Compactor::Compactor(Base& base) : _base(base), _inodes(base._inodeMgr), _dirents(base._direntMgr)
+{
+    for (size_t s = 0; s < base._blockMgr.size(); s++)
+        _stripes.push_back(Store(base._blockMgr[s]));
+    for (int c = 0; c < Base::CompressedClasses; c++)
+        _cblocks[c].mgr = base._cblockMgr[c];
+}
+
+std::vector<Compactor::Store*> Compactor::allStores()
+{
+    std::vector<Store*> stores = { &_inodes, &_dirents };
+    for (size_t s = 0; s < _stripes.size(); s++)
+        stores.push_back(&(_stripes[s]));
+    for (int c = 0; c < Base::CompressedClasses; c++)
+        stores.push_back(&(_cblocks[c]));
+    return stores;
+}
+
+Compactor::Store& Compactor::blockStore(uint64_t index, uint64_t* chunk)
+{
+    if (Base::blockClass(index) != 0) {
+        *chunk = Base::blockChunk(index);
+        return _cblocks[Base::blockClass(index) - 1];
+    } else {
+        *chunk = Base::stripeChunk(index);
+        return _stripes[Base::blockStripe(index)];
+    }
+}
+
+uint64_t Compactor::movedBlock(uint64_t index)
+{
+    uint64_t chunk;
+    uint64_t newChunk = blockStore(index, &chunk).moved(chunk);
+    return index - chunk + newChunk;
+}
+
+bool Compactor::hasSlotTrees(const Inode& inode) const
+{
+    return (inode.type() == TypeREG || inode.type() == TypeLNK || inode.type() == TypeDIR) && !inode.hasInlineData();
+}
+
+int Compactor::pinTree(uint64_t index, int depth, bool isDir)
+{
+    int r = 0;
+    uint64_t chunk;
+    if (depth == 0) {
+        if (isDir) {
+            _dirents.pinned.push_back(index);
+        } else {
+            Store& store = blockStore(index, &chunk);
+            store.pinned.push_back(chunk);
+        }
+    } else {
+        Store& store = blockStore(index, &chunk);
+        store.pinned.push_back(chunk);
+        Block& block = _blocks[depth - 1];
+        r = _base.indirectionBlockRead(index, &block);
+        for (size_t j = 0; r == 0 && j < block.size / sizeof(uint64_t); j++)
+            if (block.indices[j] != InvalidIndex)
+                r = pinTree(block.indices[j], depth - 1, isDir);
+    }
+    return r;
+}
+
+int Compactor::rewriteTree(uint64_t* index, int depth, bool isDir)
+{
+    int r = 0;
+    if (depth == 0) {
+        if (isDir) {
+            uint64_t newIndex = _dirents.moved(*index);
+            Dirent dirent;
+            r = _base.direntRead(*index, &dirent);
+            if (r == 0) {
+                uint64_t newInodeIndex = _inodes.moved(dirent.inodeIndex);
+                if (newInodeIndex != dirent.inodeIndex) {
+                    dirent.inodeIndex = newInodeIndex;
+                    r = _base.direntWrite(newIndex, &dirent);
+                }
+            }
+            *index = newIndex;
+        } else {
+            *index = movedBlock(*index);
+        }
+    } else {
+        Block& block = _blocks[depth - 1];
+        bool changed = false;
+        r = _base.indirectionBlockRead(*index, &block);
+        for (size_t j = 0; r == 0 && j < block.size / sizeof(uint64_t); j++) {
+            if (block.indices[j] != InvalidIndex) {
+                uint64_t i = block.indices[j];
+                r = rewriteTree(&i, depth - 1, isDir);
+                if (i != block.indices[j]) {
+                    block.indices[j] = i;
+                    changed = true;
+                }
+            }
+        }
+        uint64_t newIndex = movedBlock(*index);
+        if (r == 0 && changed)
+            r = _base.blockWriteNow(newIndex, &block);
+        *index = newIndex;
+    }
+    return r;
+}
+
+int Compactor::pin()
+{
+    int r = 0;
+    try {
+        _inodes.pinned.push_back(0); // the root directory
+        for (size_t s = 0; r == 0 && s < _stripes.size(); s++)
+            r = _base._blockRefs[s]->sharedIndices(_stripes[s].pinned);
+        uint64_t inodeIndex = 0;
+        for (;;) {
+            if (r == 0)
+                r = _base._orphanMap->nextOne(inodeIndex, &inodeIndex);
+            if (r < 0 || inodeIndex == InvalidIndex)
+                break;
+            Inode inode;
+            r = _base.inodeRead(inodeIndex, &inode);
+            if (r == 0)
+                _inodes.pinned.push_back(inodeIndex);
+            for (int t = 0; r == 0 && t < 5 && hasSlotTrees(inode); t++)
+                if (inode.slotTrees[t] != InvalidIndex)
+                    r = pinTree(inode.slotTrees[t], t, inode.type() == TypeDIR);
+            inodeIndex++;
+        }
+    }
+    catch (...) {
+        r = -ENOMEM;
+    }
+    return r;
+}
+
+int Compactor::plan()
+{
+    std::vector<Store*> stores = allStores();
+    int r = 0;
+    for (size_t s = 0; r == 0 && s < stores.size(); s++) {
+        std::sort(stores[s]->pinned.begin(), stores[s]->pinned.end());
+        r = stores[s]->mgr->planCompaction(stores[s]->pinned, stores[s]->moves);
+    }
+    // the reservations must be durable before anything refers to the targets
+    if (r == 0)
+        r = _base.commit();
+    return r;
+}
+
+int Compactor::copy()
+{
+    std::vector<Store*> stores = allStores();
+    int r = 0;
+    std::vector<unsigned char> buf;
+    for (size_t s = 0; r == 0 && s < stores.size(); s++) {
+        try {
+            buf.resize(stores[s]->mgr->chunkSize());
+        }
+        catch (...) {
+            r = -ENOMEM;
+        }
+        // the chunks are copied as they are, still encrypted or compressed
+        for (size_t m = 0; r == 0 && m < stores[s]->moves.size(); m++) {
+            r = stores[s]->mgr->read(stores[s]->moves[m].first, buf.data());
+            if (r == 0)
+                r = stores[s]->mgr->write(stores[s]->moves[m].second, buf.data());
+        }
+    }
+    return r;
+}
+
+int Compactor::rewrite()
+{
+    int r = 0;
+    uint64_t inodeIndex = 0;
+    for (;;) {
+        if (r == 0)
+            r = _base._inodeMap->nextOne(inodeIndex, &inodeIndex);
+        if (r < 0 || inodeIndex == InvalidIndex)
+            break;
+        bool isOrphan;
+        Inode inode;
+        r = _base._orphanMap->get(inodeIndex, &isOrphan);
+        if (r == 0 && !isOrphan)
+            r = _base.inodeRead(inodeIndex, &inode);
+        if (r == 0 && !isOrphan) {
+            bool changed = false;
+            for (int t = 0; r == 0 && t < 5 && hasSlotTrees(inode); t++) {
+                if (inode.slotTrees[t] != InvalidIndex) {
+                    uint64_t i = inode.slotTrees[t];
+                    r = rewriteTree(&i, t, inode.type() == TypeDIR);
+                    if (i != inode.slotTrees[t]) {
+                        inode.slotTrees[t] = i;
+                        changed = true;
+                    }
+                }
+            }
+            // an unchanged inode was already copied to its new place
+            if (r == 0 && changed)
+                r = _base.inodeWrite(_inodes.moved(inodeIndex), &inode);
+        }
+        inodeIndex++;
+    }
+    if (r == 0)
+        r = _base.commit();
+    return r;
+}
+
+int Compactor::removeSources()
+{
+    std::vector<Store*> stores = allStores();
+    int r = 0;
+    for (size_t s = 0; r == 0 && s < stores.size(); s++)
+        for (size_t m = 0; r == 0 && m < stores[s]->moves.size(); m++)
+            r = stores[s]->mgr->remove(stores[s]->moves[m].first);
+    // committing returns all removed chunks to the maps, which truncates the storage
+    if (r == 0)
+        r = _base.commit();
+    return r;
+}
+
+int Compactor::run(uint64_t* movedChunks, uint64_t* sizeBefore, uint64_t* sizeAfter)
+{
+    *sizeBefore = _base.storageSizeInBytes();
+    int r = 0;
+    for (int l = 0; r == 0 && l < 4; l++)
+        r = _blocks[l].allocate(_base.blockSize());
+    if (r == 0)
+        r = pin();
+    if (r == 0)
+        r = plan();
+    if (r == 0)
+        r = copy();
+    // the copies must be durable before any reference is moved to them
+    if (r == 0)
+        r = _base.commit();
+    if (r == 0)
+        r = rewrite();
+    if (r == 0)
+        r = removeSources();
+    *movedChunks = _inodes.moves.size() + _dirents.moves.size();
+    for (size_t s = 0; s < _stripes.size(); s++)
+        *movedChunks += _stripes[s].moves.size();
+    for (int c = 0; c < Base::CompressedClasses; c++)
+        *movedChunks += _cblocks[c].moves.size();
+    *sizeAfter = _base.storageSizeInBytes();
+    return r;
+}
+
+int compact(const std::string& dirName,
+        const std::vector<std::string>& dataDirNames,
+        const std::vector<unsigned char>& key,
+        Cipher cipher,
+        bool punchHoles)
+{
+    Base::Options options;
+    options.dirName = dirName;
+    options.dataDirNames = dataDirNames;
+    options.key = key;
+    options.cipher = cipher;
+    options.punchHoles = punchHoles;
+    options.durability = Base::DurabilityFsync;
+    Base base(options);
+    std::string errStr;
+    bool needsRootNode = false;
+    int r = base.initialize(errStr, &needsRootNode);
+    if (r < 0) {
+        fprintf(stderr, "Cannot initialize 6fs base: %s\n", errStr.c_str());
+        return 1;
+    }
+    if (needsRootNode) {
+        fprintf(stderr, "6fs is empty\n");
+        return 1;
+    }
+
+    uint64_t movedChunks = 0, sizeBefore = 0, sizeAfter = 0;
+    Compactor compactor(base);
+    r = compactor.run(&movedChunks, &sizeBefore, &sizeAfter);
+    int r2 = base.cleanup();
+    if (r == 0)
+        r = r2;
+    if (r < 0) {
+        fprintf(stderr, "Compaction failed: %s\n", strerror(-r));
+        return 1;
+    }
+    printf("Moved %lu chunks; storage size %lu -> %lu bytes\n", movedChunks, sizeBefore, sizeAfter);
+    return 0;
+}
@@ -0,0 +1,31 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "encrypt.hpp"
+
+// Compact the storage of a file system that is not mounted, see compact.cpp
+int compact(const std::string& dirName,
+        const std::vector<std::string>& dataDirNames,
+        const std::vector<unsigned char>& key,
+        Cipher cipher,
+        bool punchHoles);
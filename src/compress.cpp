@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <cerrno>
+
+#ifdef HAVE_LIBZSTD
+# include <zstd.h>
+#endif
+
+#include "compress.hpp"
+
+
+#ifdef HAVE_LIBZSTD
+
+class CompressionContexts
+{
+public:
+    ZSTD_CCtx* cctx;
+    ZSTD_DCtx* dctx;
+
+    CompressionContexts() : cctx(nullptr), dctx(nullptr)
+    {
+    }
+
+    ~CompressionContexts()
+    {
+        ZSTD_freeCCtx(cctx);
+        ZSTD_freeDCtx(dctx);
+    }
+};
+
+static thread_local CompressionContexts contexts;
+
+bool compressionAvailable()
+{
+    return true;
+}
+
+int compressionLevelMax()
+{
+    return ZSTD_maxCLevel();
+}
+
+size_t compressBlock(int level, const unsigned char* blockData, size_t blockSize, unsigned char* dst, size_t dstSize)
+{
+    if (!contexts.cctx) {
+        contexts.cctx = ZSTD_createCCtx();
+        if (!contexts.cctx)
+            return 0;
+    }
+    size_t r = ZSTD_compressCCtx(contexts.cctx, dst, dstSize, blockData, blockSize, level);
+    return (ZSTD_isError(r) ? 0 : r);
+}
+
+int decompressBlock(const unsigned char* src, size_t srcSize, unsigned char* blockData, size_t blockSize)
+{
+    if (!contexts.dctx) {
+        contexts.dctx = ZSTD_createDCtx();
+        if (!contexts.dctx)
+            return -ENOMEM;
+    }
+    size_t r = ZSTD_decompressDCtx(contexts.dctx, blockData, blockSize, src, srcSize);
+    return (ZSTD_isError(r) || r != blockSize ? -EIO : 0);
+}
+
+#else
+
+bool compressionAvailable()
+{
+    return false;
+}
+
+int compressionLevelMax()
+{
+    return 0;
+}
+
+size_t compressBlock(int, const unsigned char*, size_t, unsigned char*, size_t)
+{
+    return 0;
+}
+
+int decompressBlock(const unsigned char*, size_t, unsigned char*, size_t)
+{
+    return -ENOTSUP;
+}
+
+#endif
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+
+/* Compression of data blocks with zstd. Each thread keeps its own
+ * compression and decompression contexts. Without libzstd, nothing can be
+ * compressed or decompressed. */
+
+// Returns false if 6fs was built without libzstd
+bool compressionAvailable();
+
+constexpr int CompressionLevelMin = 1;
+int compressionLevelMax(); // 0 if compression is not available
+
+// Compress the block data into dst, which has room for dstSize bytes. Returns the
+// size of the compressed data, or 0 if it does not fit.
+size_t compressBlock(int level, const unsigned char* blockData, size_t blockSize, unsigned char* dst, size_t dstSize);
+// Returns 0 on success, -EIO if the data does not decompress into exactly blockSize bytes,
+// or -ENOTSUP if compression is not available
+int decompressBlock(const unsigned char* src, size_t srcSize, unsigned char* blockData, size_t blockSize);
@@ -0,0 +1,156 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+
+#include "dentry_cache.hpp"
+
+
+DentryCache::DentryCache(size_t maxEntries) :
+    _maxEntriesPerShard(std::max(maxEntries / ShardCount, size_t(1))),
+    _hits(0),
+    _misses(0)
+{
+}
+
+size_t DentryCache::KeyHash::operator()(const Key& k) const
+{
+    return std::hash<std::string_view>()(k.name) ^ (k.parentIndex * 0x9e3779b97f4a7c15ULL);
+}
+
+DentryCache::Shard& DentryCache::shard(const Key& key)
+{
+    // use other bits than the hash tables of the shards
+    return _shards[(KeyHash()(key) >> 32) % ShardCount];
+}
+
+void DentryCache::removeSlot(Shard& s, size_t slot)
+{
+    Entry& e = s.slots[slot];
+    s.entries.erase(Key { e.parentIndex, e.name });
+    auto dirIt = s.dirs.find(e.parentIndex);
+    if (dirIt != s.dirs.end()) {
+        dirIt->second.erase(slot);
+        if (dirIt->second.empty())
+            s.dirs.erase(dirIt);
+    }
+    e.isUsed = false;
+}
+
+size_t DentryCache::freeSlot(Shard& s)
+{
+    if (s.slots.size() < _maxEntriesPerShard) {
+        s.slots.emplace_back();
+        return s.slots.size() - 1;
+    }
+    // give each referenced entry a second chance; this ends after one round
+    for (;;) {
+        size_t slot = s.clockHand;
+        s.clockHand = (s.clockHand + 1) % s.slots.size();
+        Entry& e = s.slots[slot];
+        if (!e.isUsed) {
+            return slot;
+        } else if (e.isReferenced.load(std::memory_order_relaxed)) {
+            e.isReferenced.store(false, std::memory_order_relaxed);
+        } else {
+            removeSlot(s, slot);
+            return slot;
+        }
+    }
+}
+
+bool DentryCache::get(uint64_t parentIndex, const char* name, size_t nameLen, const std::function<void (uint64_t inodeIndex)>& f)
+{
+    Key key { parentIndex, std::string_view(name, nameLen) };
+    Shard& s = shard(key);
+    std::shared_lock<std::shared_mutex> lock(s.mutex);
+    auto it = s.entries.find(key);
+    if (it != s.entries.end()) {
+        Entry& e = s.slots[it->second];
+        if (!e.isReferenced.load(std::memory_order_relaxed))
+            e.isReferenced.store(true, std::memory_order_relaxed);
+        f(e.inodeIndex);
+        _hits++;
+        return true;
+    }
+    _misses++;
+    return false;
+}
+
+void DentryCache::put(uint64_t parentIndex, const char* name, size_t nameLen, uint64_t inodeIndex)
+{
+    Key key { parentIndex, std::string_view(name, nameLen) };
+    Shard& s = shard(key);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    auto it = s.entries.find(key);
+    if (it != s.entries.end()) {
+        s.slots[it->second].inodeIndex = inodeIndex;
+        return;
+    }
+    size_t slot = s.slots.size();
+    try {
+        slot = freeSlot(s);
+        Entry& e = s.slots[slot];
+        e.parentIndex = parentIndex;
+        e.name.assign(name, nameLen);
+        e.inodeIndex = inodeIndex;
+        e.isUsed = true;
+        e.isReferenced.store(false, std::memory_order_relaxed);
+        s.dirs[parentIndex].insert(slot);
+        s.entries.emplace(Key { parentIndex, e.name }, slot);
+    }
+    catch (...) {
+        // this is only a cache; just do not remember this entry
+        if (slot < s.slots.size() && s.slots[slot].isUsed)
+            removeSlot(s, slot);
+    }
+}
+
+void DentryCache::remove(uint64_t parentIndex, const char* name, size_t nameLen)
+{
+    Key key { parentIndex, std::string_view(name, nameLen) };
+    Shard& s = shard(key);
+    std::unique_lock<std::shared_mutex> lock(s.mutex);
+    auto it = s.entries.find(key);
+    if (it != s.entries.end())
+        removeSlot(s, it->second);
+}
+
+void DentryCache::removeDir(uint64_t parentIndex)
+{
+    // the entries of a directory are spread over all shards
+    for (size_t i = 0; i < ShardCount; i++) {
+        Shard& s = _shards[i];
+        std::unique_lock<std::shared_mutex> lock(s.mutex);
+        auto dirIt = s.dirs.find(parentIndex);
+        while (dirIt != s.dirs.end()) {
+            removeSlot(s, *(dirIt->second.begin()));
+            dirIt = s.dirs.find(parentIndex);
+        }
+    }
+}
+
+uint64_t DentryCache::hits() const
+{
+    return _hits;
+}
+
+uint64_t DentryCache::misses() const
+{
+    return _misses;
+}
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+
+// A thread-safe cache of directory entry lookups: (parent directory inode, name) -> inode.
+// Negative entries (the name does not exist) are stored with InvalidIndex as inode.
+// Entries are spread over the shards by parent directory and name, so that
+// a large directory does not crowd out the entries of other directories.
+// A full shard evicts one entry using the CLOCK algorithm; lookups only set
+// the reference bit of an entry, so they can share the lock of the shard.
+class DentryCache
+{
+private:
+    class Key
+    {
+    public:
+        uint64_t parentIndex;
+        std::string_view name; // refers to the name of the entry
+
+        bool operator==(const Key& k) const { return parentIndex == k.parentIndex && name == k.name; }
+    };
+
+    class KeyHash
+    {
+    public:
+        size_t operator()(const Key& k) const;
+    };
+
+    class Entry
+    {
+    public:
+        uint64_t parentIndex;
+        std::string name;
+        uint64_t inodeIndex;
+        bool isUsed;
+        std::atomic<bool> isReferenced;
+        Entry() : parentIndex(0), inodeIndex(0), isUsed(false), isReferenced(false) {}
+    };
+
+    class Shard
+    {
+    public:
+        std::shared_mutex mutex;
+        std::deque<Entry> slots; // elements do not move, so keys can refer to their names
+        size_t clockHand;
+        std::unordered_map<Key, size_t, KeyHash> entries; // key -> slot
+        std::unordered_map<uint64_t, std::unordered_set<size_t>> dirs; // parent directory -> slots
+        Shard() : clockHand(0) {}
+    };
+
+    static constexpr size_t ShardCount = 16;
+
+    const size_t _maxEntriesPerShard;
+    Shard _shards[ShardCount];
+    std::atomic<uint64_t> _hits;
+    std::atomic<uint64_t> _misses;
+
+    Shard& shard(const Key& key);
+    // Forget the entry in the given slot; the shard must be locked exclusively
+    void removeSlot(Shard& s, size_t slot);
+    // Find a slot for a new entry, evicting an entry if the shard is full
+    size_t freeSlot(Shard& s);
+
+public:
+    DentryCache(size_t maxEntries);
+
+    // Look up a name; returns false if it is not cached.
+    // Otherwise, f is called with the inode or with InvalidIndex if the name does not exist.
+    // The entry cannot be removed while f runs, so f may safely acquire a reference to the inode.
+    bool get(uint64_t parentIndex, const char* name, size_t nameLen, const std::function<void (uint64_t inodeIndex)>& f);
+    // Remember the result of a lookup; inodeIndex may be InvalidIndex
+    void put(uint64_t parentIndex, const char* name, size_t nameLen, uint64_t inodeIndex);
+    // Forget a name
+    void remove(uint64_t parentIndex, const char* name, size_t nameLen);
+    // Forget all names in a directory
+    void removeDir(uint64_t parentIndex);
+
+    // Statistics
+    uint64_t hits() const;
+    uint64_t misses() const;
+};
@@ -41,6 +41,7 @@ static int getIndex(const char* s, uint64_t* index)
 }
 
 int dump(const std::string& dirName,
+        const std::vector<std::string>& dataDirNames,
         const std::vector<unsigned char>& key,
         const char* dumpInode,
         const char* dumpTree,
@@ -48,7 +49,11 @@ int dump(const std::string& dirName,
         const char* dumpSBlock,
         const char* dumpDBlock)
 {
-    Base base(Storage::TypeFile, dirName, 0, key, false);
+    Base::Options options;
+    options.dirName = dirName;
+    options.dataDirNames = dataDirNames;
+    options.key = key;
+    Base base(options);
     std::string errStr;
     bool needsRootNode = false;
     int r = base.initialize(errStr, &needsRootNode);
@@ -90,7 +95,14 @@ int dump(const std::string& dirName,
         printf("  nlink: %d\n", inode.nlink);
         printf("  rdev: %lu\n", inode.rdev);
         printf("  size: %lu\n", inode.size);
-        printf("  slotTrees: %lu %lu %lu %lu %lu\n", inode.slotTrees[0], inode.slotTrees[1], inode.slotTrees[2], inode.slotTrees[3], inode.slotTrees[4]);
+        if (inode.hasInlineData()) {
+            printf("  inline data:");
+            for (size_t i = 0; i < Inode::InlineDataSize; i++)
+                printf(" %02X", inode.inlineData()[i]);
+            printf("\n");
+        } else {
+            printf("  slotTrees: %lu %lu %lu %lu %lu\n", inode.slotTrees[0], inode.slotTrees[1], inode.slotTrees[2], inode.slotTrees[3], inode.slotTrees[4]);
+        }
     }
     if (dumpDirent) {
         uint64_t index;
@@ -137,13 +149,15 @@ int dump(const std::string& dirName,
         if (r < 0)
             return 1;
         Block block;
-        r = base.blockRead(index, &block);
+        r = block.allocate(base.blockSize());
+        if (r == 0)
+            r = base.blockRead(index, &block);
         if (r < 0) {
             fprintf(stderr, "Reading block %lu: %s\n", index, strerror(-r));
             return 1;
         }
         printf("Block %lu indirection indices:\n", index);
-        for (uint64_t i = 0; i < Handle::N; i++) {
+        for (uint64_t i = 0; i < block.size / sizeof(uint64_t); i++) {
             uint64_t j = block.indices[i];
             if (j != InvalidIndex) {
                 printf("  %lu: %lu\n", i, j);
@@ -156,14 +170,16 @@ int dump(const std::string& dirName,
         if (r < 0)
             return 1;
         Block block;
-        r = base.blockRead(index, &block);
+        r = block.allocate(base.blockSize());
+        if (r == 0)
+            r = base.blockRead(index, &block);
         if (r < 0) {
             fprintf(stderr, "Reading block %lu: %s\n", index, strerror(-r));
             return 1;
         }
         printf("Block %lu data bytes:\n", index);
-        for (int j = 0; j < 128; j++) {
-            for (int k = 0; k < 32; k++) {
+        for (size_t j = 0; j < block.size / 32; j++) {
+            for (size_t k = 0; k < 32; k++) {
                 printf("%02X ", block.data[j * 32 + k]);
             }
             printf("\n");
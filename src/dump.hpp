@@ -22,6 +22,7 @@
 #include <vector>
 
 int dump(const std::string& dirName,
+        const std::vector<std::string>& dataDirNames,
         const std::vector<unsigned char>& key,
         const char* dumpInode,
         const char* dumpTree,
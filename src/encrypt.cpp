@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -18,21 +18,71 @@
 
 #include <cstring>
 #include <cerrno>
+#include <atomic>
 
 #include "encrypt.hpp"
+#include "stats.hpp"
 
 
-void enc(const unsigned char* key, const unsigned char* msg, size_t msgSize, unsigned char* out)
+static unsigned char cipherMarker(Cipher cipher)
 {
-    out[0] = 255; // all bits always set in the first byte to be able to detect chunks that were turned into holes
+    return 255 - cipher;
+}
+
+/* Nonces for AES-256-GCM must never repeat for the same key, and the 96 bit nonce is
+ * too short to draw it randomly for every chunk. Instead, each nonce consists of a
+ * 32 bit prefix that is drawn randomly once per process and a 64 bit counter that starts
+ * at a random value. This also avoids an RNG call for every chunk write. */
+class CounterNonce
+{
+private:
+    unsigned char _prefix[4];
+    std::atomic<uint64_t> _counter;
+
+public:
+    CounterNonce()
+    {
+        uint64_t start;
+        randombytes_buf(_prefix, sizeof(_prefix));
+        randombytes_buf(&start, sizeof(start));
+        _counter = start;
+    }
+
+    void next(unsigned char* nonce)
+    {
+        uint64_t c = _counter.fetch_add(1, std::memory_order_relaxed);
+        ::memcpy(nonce, _prefix, sizeof(_prefix));
+        ::memcpy(nonce + sizeof(_prefix), &c, sizeof(c));
+    }
+};
+
+static_assert(4 + sizeof(uint64_t) == crypto_aead_aes256gcm_NPUBBYTES);
+
+bool cipherAvailable(Cipher cipher)
+{
+    return (cipher == CipherXSalsa20Poly1305 || crypto_aead_aes256gcm_is_available());
+}
+
+void enc(Cipher cipher, const unsigned char* key, const unsigned char* msg, size_t msgSize, unsigned char* out)
+{
+    StatsTimer timer(Stats::Encrypt);
+    out[0] = cipherMarker(cipher);
     unsigned char* nonce = out + 1;
     unsigned char* ciphertext = out + 1 + crypto_secretbox_NONCEBYTES;
-    randombytes_buf(nonce, crypto_secretbox_NONCEBYTES);
-    crypto_secretbox_easy(ciphertext, msg, msgSize, nonce, key);
+    if (cipher == CipherAES256GCM) {
+        static CounterNonce counterNonce;
+        counterNonce.next(nonce);
+        ::memset(nonce + crypto_aead_aes256gcm_NPUBBYTES, 0, crypto_secretbox_NONCEBYTES - crypto_aead_aes256gcm_NPUBBYTES);
+        crypto_aead_aes256gcm_encrypt(ciphertext, nullptr, msg, msgSize, nullptr, 0, nullptr, nonce, key);
+    } else {
+        randombytes_buf(nonce, crypto_secretbox_NONCEBYTES);
+        crypto_secretbox_easy(ciphertext, msg, msgSize, nonce, key);
+    }
 }
 
 int dec(const unsigned char* key, const unsigned char* in, size_t inSize, unsigned char* msg, size_t msgSize)
 {
+    StatsTimer timer(Stats::Decrypt);
     const unsigned char* nonce = in + 1;
     const unsigned char* ciphertext = in + 1 + crypto_secretbox_NONCEBYTES;
     const size_t ciphertextLen = inSize - crypto_secretbox_NONCEBYTES - 1;
@@ -40,10 +90,17 @@ int dec(const unsigned char* key, const unsigned char* in, size_t inSize, unsign
     if (in[0] == 0) {
         // this chunk was turned into a hole: the cleartext data is all zero
         ::memset(msg, 0, msgSize);
-    } else {
+    } else if (in[0] == cipherMarker(CipherXSalsa20Poly1305)) {
         if (crypto_secretbox_open_easy(msg, ciphertext, ciphertextLen, nonce, key) != 0) {
             r = -EIO;
         }
+    } else if (in[0] == cipherMarker(CipherAES256GCM) && cipherAvailable(CipherAES256GCM)) {
+        if (crypto_aead_aes256gcm_decrypt(msg, nullptr, nullptr, ciphertext, ciphertextLen, nullptr, 0, nonce, key) != 0) {
+            r = -EIO;
+        }
+    } else {
+        // unknown cipher, or AES-256-GCM on a CPU that does not support it
+        r = -EIO;
     }
     return r;
 }
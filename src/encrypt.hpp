@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -22,12 +22,30 @@
 
 #include "inode.hpp"
 #include "dirent.hpp"
-#include "block.hpp"
+
+/* The ciphers that can be used to encrypt chunks. The first byte of each encrypted
+ * chunk is a marker that identifies the cipher (255 minus the cipher ID); it is
+ * never zero so that chunks that were turned into holes can be detected.
+ * Both ciphers use the same chunk layout: marker, nonce field, ciphertext with tag.
+ * AES-256-GCM only uses the first crypto_aead_aes256gcm_NPUBBYTES bytes of the nonce
+ * field, so that both ciphers can be mixed in one file system. */
+typedef enum {
+    CipherXSalsa20Poly1305 = 0, // secretbox with random nonces; always available
+    CipherAES256GCM = 1         // counter-based nonces; requires AES-NI and PCLMUL
+} Cipher;
+
+static_assert(crypto_aead_aes256gcm_NPUBBYTES <= crypto_secretbox_NONCEBYTES);
+static_assert(crypto_aead_aes256gcm_ABYTES == crypto_secretbox_MACBYTES);
+static_assert(crypto_aead_aes256gcm_KEYBYTES == crypto_secretbox_KEYBYTES);
 
 constexpr size_t EncOverhead = 1 + crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES;
 constexpr size_t EncInodeSize  = sizeof(Inode)  + EncOverhead;
 constexpr size_t EncDirentSize = sizeof(Dirent) + EncOverhead;
-constexpr size_t EncBlockSize  = sizeof(Block)  + EncOverhead;
+// blocks have a runtime size, see Base::encBlockSize()
+
+// Requires sodium_init() to have been called
+bool cipherAvailable(Cipher cipher);
 
-void enc(const unsigned char* key, const unsigned char* msg, size_t msgSize, unsigned char* out);
+void enc(Cipher cipher, const unsigned char* key, const unsigned char* msg, size_t msgSize, unsigned char* out);
+// The cipher is determined from the marker byte
 int dec(const unsigned char* key, const unsigned char* in, size_t inSize, unsigned char* msg, size_t msgSize);
@@ -18,53 +18,169 @@
 
 #include <cstring>
 
+#include <algorithm>
+#include <limits>
+
 #include "handle.hpp"
 #include "base.hpp"
 #include "index.hpp"
 #include "emergency.hpp"
 #include "logger.hpp"
+#include "stats.hpp"
 
 
-static uint64_t slotCount(const Inode& inode)
+static uint64_t slotCount(const Inode& inode, size_t blockSize)
 {
     uint64_t ret;
-    if (inode.type() == TypeREG) {
-        ret = inode.size / sizeof(Block) + (inode.size % sizeof(Block) != 0 ? 1 : 0);
+    if (inode.type() == TypeREG && !inode.hasInlineData()) {
+        ret = inode.size / blockSize + (inode.size % blockSize != 0 ? 1 : 0);
     } else if (inode.type() == TypeDIR) {
-        ret = inode.size;
+        if (inode.dirFormat() == DirFormatHashed)
+            ret = (inode.dirHashBits() == 0 ? 0 : uint64_t(1) << inode.dirHashBits());
+        else
+            ret = inode.size;
     } else {
         ret = 0;
     }
     return ret;
 }
 
+// The number of slots in the five slot trees, limited so that the maximum file size
+// fits into off_t. The limit only applies to large block sizes.
+static uint64_t maxSlotCount(size_t blockSize)
+{
+    const uint64_t slotsPerBlock = blockSize / sizeof(uint64_t);
+    const uint64_t maxFileSlots = uint64_t(std::numeric_limits<int64_t>::max()) / blockSize;
+    uint64_t count = 0;
+    uint64_t treeSlots = 1;
+    for (int tree = 0; tree < 5; tree++) {
+        count += treeSlots;
+        if (count >= maxFileSlots)
+            return maxFileSlots;
+        treeSlots *= slotsPerBlock;
+    }
+    return count;
+}
+
 Handle::Handle(Base* base, uint64_t inodeIndex, const Inode& inode) :
     _base(base),
+    _blockSize(base->blockSize()),
     _inodeIndex(inodeIndex),
     _inode(inode),
-    _slotCount(::slotCount(_inode)),
+    _slotCount(::slotCount(_inode, _blockSize)),
     _readOnly(false),
     _append(false),
     _refCount(0),
     _removeOnceUnused(false),
+    _inodeIsDirty(false),
+    _slotsPerBlock(_blockSize / sizeof(uint64_t)),
+    _maxSlotCount(::maxSlotCount(_blockSize)),
     _cachedBlockIndices { InvalidIndex, InvalidIndex, InvalidIndex, InvalidIndex },
-    _cachedBlockIsModified { false, false, false, false }
+    _cachedBlocks(nullptr),
+    _cachedBlockIsModified { false, false, false, false },
+    _hasNameIndex(false),
+    _nameIndexMemory(0),
+    _deferredBlockRemovals(nullptr),
+    _readAheadNext(0),
+    _readAheadWindow(0),
+    _readAheadEnd(0),
+    _writeBehindNext(0),
+    _writeBehindBytes(0)
+{
+}
+
+Handle::~Handle()
+{
+    _base->slotBlocksRelease(_cachedBlocks);
+}
+
+Handle::LookupCache::LookupCache(Base* base) :
+    base(base),
+    blockIndices { InvalidIndex, InvalidIndex, InvalidIndex, InvalidIndex },
+    blocks(nullptr)
+{
+}
+
+Handle::LookupCache::~LookupCache()
+{
+    base->slotBlocksRelease(blocks);
+}
+
+Handle::DirentCursor::DirentCursor() :
+    startSlot(0),
+    endSlot(0),
+    inodesFrom(0),
+    nextInode(0)
 {
-    static_assert(sizeof(Block) % sizeof(uint64_t) == 0);
 }
 
 int Handle::cleanup()
 {
+    dropNameIndexNow();
     int r0 = saveCachedBlockIfModified(0);
     int r1 = saveCachedBlockIfModified(1);
     int r2 = saveCachedBlockIfModified(2);
     int r3 = saveCachedBlockIfModified(3);
-    return (r0 != 0 ? r0 : r1 != 0 ? r1 : r2 != 0 ? r2 : r3);
+    int r4 = (_inodeIsDirty ? writeInodeNow() : 0);
+    return (r0 != 0 ? r0 : r1 != 0 ? r1 : r2 != 0 ? r2 : r3 != 0 ? r3 : r4);
+}
+
+int Handle::sync()
+{
+    lockExclusive();
+    int r = 0;
+    for (int l = 0; r == 0 && l < 4; l++)
+        r = saveCachedBlockIfModified(l);
+    if (r == 0 && _inodeIsDirty)
+        r = writeInodeNow();
+    unlockExclusive();
+    return r;
+}
+
+int Handle::writeInodeIfStale()
+{
+    lockExclusive();
+    int r = writeInodeIfStaleNow();
+    unlockExclusive();
+    return r;
+}
+
+void Handle::markInodeDirtyNow()
+{
+    if (!_inodeIsDirty) {
+        _inodeIsDirty = true;
+        _inodeDirtySince = Time::now();
+    }
+}
+
+int Handle::writeInodeNow()
+{
+    int r = _base->inodeWrite(_inodeIndex, &_inode);
+    if (r == 0)
+        _inodeIsDirty = false;
+    return r;
+}
+
+int Handle::writeInodeIfStaleNow()
+{
+    int r = 0;
+    if (_inodeIsDirty) {
+        Time staleTime = Time::now();
+        staleTime.seconds -= InodeWriteBackInterval;
+        if (_inodeDirtySince.isOlderThan(staleTime))
+            r = writeInodeNow();
+    }
+    return r;
 }
 
 void Handle::lockExclusive()
 {
-    _mutex.lock();
+    lockRecordingWait(_mutex, Stats::WaitHandleLock);
+}
+
+bool Handle::tryLockExclusive()
+{
+    return _mutex.try_lock();
 }
 
 void Handle::unlockExclusive()
@@ -74,7 +190,7 @@ void Handle::unlockExclusive()
 
 void Handle::lockShared()
 {
-    _mutex.lock_shared();
+    lockSharedRecordingWait(_mutex, Stats::WaitHandleLock);
 }
 
 void Handle::unlockShared()
@@ -97,8 +213,9 @@ bool Handle::updateATime()
     return updated;
 }
 
-void Handle::slotToTreeIndices(uint64_t slot, int* tree, uint64_t ijkl[4])
+void Handle::slotToTreeIndices(uint64_t slot, int* tree, uint64_t ijkl[4]) const
 {
+    const uint64_t N = _slotsPerBlock;
     if (slot == 0) {
         *tree = 0;
         ijkl[0] = InvalidIndex;
@@ -148,13 +265,27 @@ void Handle::slotToTreeIndices(uint64_t slot, int* tree, uint64_t ijkl[4])
     ijkl[3] = slot % N;
 }
 
+int Handle::acquireCachedBlocks()
+{
+    if (!_cachedBlocks) {
+        _cachedBlocks = _base->slotBlocksAcquire();
+        if (!_cachedBlocks)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
 int Handle::cacheBlock(int treeLevel, uint64_t blockIndex)
 {
     int r = 0;
     if (_cachedBlockIndices[treeLevel] != blockIndex) {
         r = saveCachedBlockIfModified(treeLevel);
+        if (r == 0)
+            r = acquireCachedBlocks();
+        if (r == 0)
+            r = _cachedBlocks[treeLevel].allocate(_blockSize);
         if (r == 0) {
-            r = _base->blockRead(blockIndex, &(_cachedBlocks[treeLevel]));
+            r = _base->indirectionBlockRead(blockIndex, &(_cachedBlocks[treeLevel]));
             _cachedBlockIndices[treeLevel] = (r == 0 ? blockIndex : InvalidIndex);
             _cachedBlockIsModified[treeLevel] = false;
         }
@@ -166,7 +297,7 @@ int Handle::saveCachedBlockIfModified(int treeLevel)
 {
     int r = 0;
     if (_cachedBlockIsModified[treeLevel]) {
-        r = _base->blockWrite(_cachedBlockIndices[treeLevel], &(_cachedBlocks[treeLevel]));
+        r = _base->indirectionBlockWrite(_cachedBlockIndices[treeLevel], &(_cachedBlocks[treeLevel]), _inodeIndex);
         _cachedBlockIsModified[treeLevel] = false;
         if (r != 0) {
             logger.log(Logger::Error, "Handle::saveCachedBlockIfModified(%d) failure: %s", treeLevel, strerror(-r));
@@ -218,6 +349,103 @@ int Handle::getSlot(uint64_t slot, uint64_t* index)
     return 0;
 }
 
+int Handle::lookupBlock(int treeLevel, uint64_t blockIndex, LookupCache* lookupCache, const Block** block) const
+{
+    // Prefer the blocks cached by the handle since they might be modified;
+    // read all other blocks into the private lookup cache.
+    if (_cachedBlockIndices[treeLevel] == blockIndex) {
+        *block = &(_cachedBlocks[treeLevel]);
+        return 0;
+    }
+    if (lookupCache->blockIndices[treeLevel] != blockIndex) {
+        if (!lookupCache->blocks) {
+            lookupCache->blocks = _base->slotBlocksAcquire();
+            if (!lookupCache->blocks)
+                return -ENOMEM;
+        }
+        int r = lookupCache->blocks[treeLevel].allocate(_blockSize);
+        if (r == 0)
+            r = _base->indirectionBlockRead(blockIndex, &(lookupCache->blocks[treeLevel]));
+        lookupCache->blockIndices[treeLevel] = (r == 0 ? blockIndex : InvalidIndex);
+        if (r < 0)
+            return r;
+    }
+    *block = &(lookupCache->blocks[treeLevel]);
+    return 0;
+}
+
+int Handle::lookupSlot(uint64_t slot, uint64_t* index, LookupCache* lookupCache) const
+{
+    if (slot >= slotCount()) {
+        logger.log(Logger::Error, "Handle::lookupSlot(%lu) failed because we only have %lu slots", slot, slotCount());
+        emergency(EmergencyBug);
+        return -ENOTRECOVERABLE;
+    }
+
+    int tree;
+    uint64_t ijkl[4];
+    slotToTreeIndices(slot, &tree, ijkl);
+
+    if (tree == 0) {
+        *index = _inode.slotTrees[0];
+        return 0;
+    }
+
+    uint64_t blockIndex = _inode.slotTrees[tree];
+    for (int l = 0; l < tree && blockIndex != InvalidIndex; l++) {
+        const Block* block;
+        int r = lookupBlock(l, blockIndex, lookupCache, &block);
+        if (r < 0)
+            return r;
+        blockIndex = block->indices[ijkl[l]];
+    }
+    *index = blockIndex;
+
+    return 0;
+}
+
+int Handle::findSlot(uint64_t slot, bool data, uint64_t* foundSlot, LookupCache* lookupCache)
+{
+    while (slot < slotCount()) {
+        int tree;
+        uint64_t ijkl[4];
+        slotToTreeIndices(slot, &tree, ijkl);
+
+        // the block at each level covers subtreeSlots slots; our slot is at subtreeOffset
+        uint64_t blockIndex = _inode.slotTrees[tree];
+        uint64_t subtreeSlots = 1;
+        uint64_t subtreeOffset = 0;
+        for (int l = 0; l < tree; l++) {
+            subtreeSlots *= _slotsPerBlock;
+            subtreeOffset = subtreeOffset * _slotsPerBlock + ijkl[l];
+        }
+        for (int l = 0; l < tree && blockIndex != InvalidIndex; l++) {
+            const Block* block;
+            if (lookupCache) {
+                int r = lookupBlock(l, blockIndex, lookupCache, &block);
+                if (r < 0)
+                    return r;
+            } else {
+                int r = cacheBlock(l, blockIndex);
+                if (r < 0)
+                    return r;
+                block = &(_cachedBlocks[l]);
+            }
+            blockIndex = block->indices[ijkl[l]];
+            subtreeSlots /= _slotsPerBlock;
+            subtreeOffset %= subtreeSlots;
+        }
+        if ((blockIndex != InvalidIndex) == data) {
+            *foundSlot = slot;
+            return 0;
+        }
+        // skip the rest of the subtree: it is either empty or we are looking for an empty slot
+        slot += subtreeSlots - subtreeOffset;
+    }
+    *foundSlot = slotCount();
+    return 0;
+}
+
 int Handle::setSlot(uint64_t slot, uint64_t index)
 {
     if (slot >= slotCount()) {
@@ -239,12 +467,18 @@ int Handle::setSlot(uint64_t slot, uint64_t index)
     uint64_t blockIndex = _inode.slotTrees[tree];
     for (int l = 0; l < tree; l++) {
         if (blockIndex == InvalidIndex) {
+            if (index == InvalidIndex) // the slot is empty already
+                return 0;
             r = saveCachedBlockIfModified(l);
+            if (r == 0)
+                r = acquireCachedBlocks();
+            if (r == 0)
+                r = _cachedBlocks[l].allocate(_blockSize);
             if (r < 0)
                 return r;
             _cachedBlocks[l].initializeIndices();
             _cachedBlockIsModified[l] = false;
-            r = _base->blockAdd(&blockIndex, &(_cachedBlocks[l]));
+            r = _base->blockAdd(&blockIndex, &(_cachedBlocks[l]), InvalidIndex);
             if (r < 0) {
                 _cachedBlockIndices[l] = InvalidIndex;
                 return r;
@@ -265,20 +499,20 @@ int Handle::setSlot(uint64_t slot, uint64_t index)
             _cachedBlocks[l].indices[ijkl[l]] = index;
             _cachedBlockIsModified[l] = true;
             bool allEntriesInvalid = (index == InvalidIndex);
-            for (uint64_t j = 0; allEntriesInvalid && j < N; j++)
+            for (uint64_t j = 0; allEntriesInvalid && j < _slotsPerBlock; j++)
                 if (_cachedBlocks[l].indices[j] != InvalidIndex)
                     allEntriesInvalid = false;
             if (allEntriesInvalid) {
                 // delete this indirection block and, if possible, its predecessors
                 for (int ll = l; allEntriesInvalid && ll >= 0; ll--) {
-                    r = _base->blockRemove(_cachedBlockIndices[ll]);
+                    r = blockRemoveNow(_cachedBlockIndices[ll]);
                     _cachedBlockIndices[ll] = InvalidIndex;
                     _cachedBlockIsModified[ll] = false;
                     if (r < 0)
                         return r;
                     if (ll > 0) {
                         _cachedBlocks[ll - 1].indices[ijkl[ll - 1]] = InvalidIndex;
-                        for (uint64_t j = 0; allEntriesInvalid && j < N; j++)
+                        for (uint64_t j = 0; allEntriesInvalid && j < _slotsPerBlock; j++)
                             if (_cachedBlocks[ll - 1].indices[j] != InvalidIndex)
                                 allEntriesInvalid = false;
                         if (!allEntriesInvalid) {
@@ -305,7 +539,7 @@ int Handle::insertSlot(uint64_t slot, uint64_t index)
         return -ENOTRECOVERABLE;
     }
 
-    if (slotCount() == maxSlotCount)
+    if (slotCount() == _maxSlotCount)
         return -ENOSPC;
 
     _slotCount++;
@@ -368,6 +602,263 @@ int Handle::removeSlot(uint64_t slot, bool removeDirentOrBlock)
     return 0;
 }
 
+uint64_t Handle::nameHash(const char* name, size_t nameLen)
+{
+    // 64 bit FNV-1a
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < nameLen; i++) {
+        h ^= static_cast<unsigned char>(name[i]);
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+int Handle::growHashedDirNow()
+{
+    uint64_t capacity = slotCount();
+    if (2 * (_inode.size + 1) <= capacity)
+        return 0;
+
+    uint64_t newHashBits = std::max(_inode.dirHashBits() + 1, uint64_t(4));
+    uint64_t newCapacity = uint64_t(1) << newHashBits;
+    if (newCapacity > _maxSlotCount)
+        return -ENOSPC;
+
+    dropDirentCursorNow();
+
+    // Collect all entries and clear the old table; this also removes its indirection blocks
+    std::vector<uint64_t> direntIndices;
+    try {
+        direntIndices.reserve(_inode.size);
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    int r = 0;
+    for (uint64_t slot = 0; r == 0 && slot < capacity; slot++) {
+        uint64_t direntIndex;
+        r = getSlot(slot, &direntIndex);
+        if (r == 0 && direntIndex != InvalidIndex) {
+            direntIndices.push_back(direntIndex);
+            r = setSlot(slot, InvalidIndex);
+        }
+    }
+
+    // Insert all entries into the new table; the name index has the same size afterwards
+    if (r == 0) {
+        _inode.rdev = DirFormatHashed | (newHashBits << 8);
+        _slotCount = newCapacity;
+        _nameIndex.clear();
+    }
+    for (size_t i = 0; r == 0 && i < direntIndices.size(); i++) {
+        Dirent dirent;
+        r = _base->direntRead(direntIndices[i], &dirent);
+        uint64_t hash = nameHash(dirent.name, strlen(dirent.name));
+        uint64_t slot = hash & (newCapacity - 1);
+        while (r == 0) {
+            uint64_t tmp;
+            r = getSlot(slot, &tmp);
+            if (r == 0 && tmp == InvalidIndex) {
+                r = setSlot(slot, direntIndices[i]);
+                if (_hasNameIndex)
+                    _nameIndex.push_back({ hash, slot });
+                break;
+            }
+            slot = (slot + 1) & (newCapacity - 1);
+        }
+    }
+    if (_hasNameIndex) {
+        if (r == 0)
+            std::sort(_nameIndex.begin(), _nameIndex.end());
+        else
+            dropNameIndexNow();
+    }
+
+    if (r == 0)
+        r = writeInodeNow();
+    if (r < 0) {
+        logger.log(Logger::Error, "Handle::growHashedDirNow(): cannot reorganize directory %lu: %s", _inodeIndex, strerror(-r));
+        emergency(EmergencySystemFailure);
+        r = -ENOTRECOVERABLE;
+    }
+    return r;
+}
+
+int Handle::removeHashedSlot(uint64_t slot, bool removeDirent)
+{
+    // Remove the entry without leaving a tombstone: move following entries of
+    // the same probe sequence backwards so that lookups still find them.
+    const uint64_t mask = slotCount() - 1;
+    uint64_t direntIndex;
+    int r = getSlot(slot, &direntIndex);
+    uint64_t hole = slot;
+    for (uint64_t j = (slot + 1) & mask; r == 0; j = (j + 1) & mask) {
+        uint64_t tmp;
+        r = getSlot(j, &tmp);
+        if (r < 0 || tmp == InvalidIndex)
+            break;
+        Dirent dirent;
+        r = _base->direntRead(tmp, &dirent);
+        if (r < 0)
+            break;
+        uint64_t movedHash = nameHash(dirent.name, strlen(dirent.name));
+        uint64_t home = movedHash & mask;
+        // the entry can move to the hole if its home slot is not cyclically in (hole, j]
+        bool homeInBetween = (hole <= j ? (hole < home && home <= j) : (hole < home || home <= j));
+        if (!homeInBetween) {
+            r = setSlot(hole, tmp);
+            if (r == 0)
+                nameIndexMove(movedHash, j, hole);
+            hole = j;
+        }
+    }
+    if (r == 0)
+        r = setSlot(hole, InvalidIndex);
+    if (r == 0 && removeDirent && direntIndex != InvalidIndex)
+        r = _base->direntRemove(direntIndex);
+    if (r < 0)
+        dropNameIndexNow();
+    return r;
+}
+
+int Handle::addDirentSlot(uint64_t direntSlot, uint64_t direntIndex, const char* name, size_t nameLen)
+{
+    dropDirentCursorNow();
+    uint64_t hash = nameHash(name, nameLen);
+    int r;
+    if (_inode.dirFormat() == DirFormatHashed) {
+        r = setSlot(direntSlot, direntIndex);
+    } else {
+        r = insertSlot(direntSlot, direntIndex);
+        if (r == 0)
+            nameIndexShift(direntSlot, +1);
+    }
+    if (r == 0)
+        nameIndexInsert(hash, direntSlot);
+    else
+        dropNameIndexNow();
+    return r;
+}
+
+int Handle::removeDirentSlot(uint64_t direntSlot, const char* name, size_t nameLen, bool removeDirent)
+{
+    dropDirentCursorNow();
+    uint64_t hash = nameHash(name, nameLen);
+    nameIndexRemove(hash, direntSlot);
+    int r;
+    if (_inode.dirFormat() == DirFormatHashed) {
+        r = removeHashedSlot(direntSlot, removeDirent);
+    } else {
+        r = removeSlot(direntSlot, removeDirent);
+        if (r == 0)
+            nameIndexShift(direntSlot + 1, -1);
+    }
+    if (r < 0)
+        dropNameIndexNow();
+    return r;
+}
+
+int Handle::buildNameIndexNow()
+{
+    if (_hasNameIndex)
+        return 0;
+    uint64_t entries = _inode.size;
+    if (!_base->nameIndexMemoryReserve(entries * sizeof(NameIndexEntry)))
+        return 0; // not an error
+    int r = 0;
+    try {
+        _nameIndex.reserve(entries);
+    }
+    catch (...) {
+        r = -ENOMEM;
+    }
+    for (uint64_t slot = 0; r == 0 && slot < slotCount(); slot++) {
+        uint64_t direntIndex;
+        Dirent dirent;
+        r = getSlot(slot, &direntIndex);
+        if (r == 0 && direntIndex != InvalidIndex) {
+            r = _base->direntRead(direntIndex, &dirent);
+            if (r == 0 && _nameIndex.size() < entries)
+                _nameIndex.push_back({ nameHash(dirent.name, strlen(dirent.name)), slot });
+        }
+    }
+    if (r == 0 && _nameIndex.size() == entries) {
+        std::sort(_nameIndex.begin(), _nameIndex.end());
+        _hasNameIndex = true;
+        _nameIndexMemory = entries * sizeof(NameIndexEntry);
+    } else {
+        std::vector<NameIndexEntry>().swap(_nameIndex);
+        _base->nameIndexMemoryRelease(entries * sizeof(NameIndexEntry));
+    }
+    return r;
+}
+
+void Handle::dropNameIndexNow()
+{
+    if (_hasNameIndex) {
+        _base->nameIndexMemoryRelease(_nameIndexMemory);
+        std::vector<NameIndexEntry>().swap(_nameIndex);
+        _hasNameIndex = false;
+        _nameIndexMemory = 0;
+    }
+}
+
+void Handle::nameIndexInsert(uint64_t hash, uint64_t slot)
+{
+    if (!_hasNameIndex)
+        return;
+    bool ok = _base->nameIndexMemoryReserve(sizeof(NameIndexEntry));
+    if (ok) {
+        _nameIndexMemory += sizeof(NameIndexEntry);
+        NameIndexEntry e = { hash, slot };
+        try {
+            _nameIndex.insert(std::upper_bound(_nameIndex.begin(), _nameIndex.end(), e), e);
+        }
+        catch (...) {
+            ok = false;
+        }
+    }
+    if (!ok)
+        dropNameIndexNow();
+}
+
+void Handle::nameIndexRemove(uint64_t hash, uint64_t slot)
+{
+    if (!_hasNameIndex)
+        return;
+    auto it = std::lower_bound(_nameIndex.begin(), _nameIndex.end(), NameIndexEntry { hash, slot });
+    if (it != _nameIndex.end() && it->hash == hash && it->slot == slot) {
+        _nameIndex.erase(it);
+        _base->nameIndexMemoryRelease(sizeof(NameIndexEntry));
+        _nameIndexMemory -= sizeof(NameIndexEntry);
+    } else {
+        // the index does not match the directory; forget it
+        dropNameIndexNow();
+    }
+}
+
+void Handle::nameIndexMove(uint64_t hash, uint64_t oldSlot, uint64_t newSlot)
+{
+    if (!_hasNameIndex)
+        return;
+    auto it = std::lower_bound(_nameIndex.begin(), _nameIndex.end(), NameIndexEntry { hash, oldSlot });
+    if (it != _nameIndex.end() && it->hash == hash && it->slot == oldSlot) {
+        // keep the order within the run of equal hashes
+        _nameIndex.erase(it);
+        NameIndexEntry e = { hash, newSlot };
+        _nameIndex.insert(std::upper_bound(_nameIndex.begin(), _nameIndex.end(), e), e);
+    } else {
+        dropNameIndexNow();
+    }
+}
+
+void Handle::nameIndexShift(uint64_t firstSlot, int64_t delta)
+{
+    for (size_t i = 0; _hasNameIndex && i < _nameIndex.size(); i++)
+        if (_nameIndex[i].slot >= firstSlot)
+            _nameIndex[i].slot += delta;
+}
+
 uint64_t Handle::inodeIndex() const
 {
     return _inodeIndex;
@@ -383,7 +874,7 @@ bool Handle::removeOnceUnused() const
     return _removeOnceUnused;
 }
 
-int& Handle::refCount()
+std::atomic<int>& Handle::refCount()
 {
     return _refCount;
 }
@@ -396,33 +887,156 @@ void Handle::getAttr(uint64_t* inodeIndex, Inode* inode)
     unlockExclusive();
 }
 
+bool Handle::fitsInlineNow(uint64_t size) const
+{
+    // an empty file has no blocks, so it can switch to inline data
+    return _inode.type() == TypeREG && size <= Inode::InlineDataSize
+        && (_inode.hasInlineData() || _inode.size == 0);
+}
+
+void Handle::makeInlineNow()
+{
+    if (!_inode.hasInlineData()) {
+        memset(_inode.inlineData(), 0, Inode::InlineDataSize);
+        _inode.rdev |= InodeFlagInline;
+    }
+}
+
+int Handle::moveInlineDataNow()
+{
+    if (!_inode.hasInlineData())
+        return 0;
+
+    int r = 0;
+    uint64_t blockIndex = InvalidIndex;
+    if (_inode.size > 0) {
+        Block block;
+        r = block.allocate(_blockSize);
+        if (r == 0) {
+            block.initializeData();
+            memcpy(block.data, _inode.inlineData(), _inode.size);
+            r = _base->blockAddCompressed(&blockIndex, &block, InvalidIndex);
+        }
+    }
+    if (r == 0) {
+        _inode.rdev &= ~InodeFlagInline;
+        for (int i = 0; i < 5; i++)
+            _inode.slotTrees[i] = InvalidIndex;
+        _inode.xattrIndex = InvalidIndex;
+        _inode.slotTrees[0] = blockIndex; // the file has at most one slot
+        _slotCount = ::slotCount(_inode, _blockSize);
+    }
+    return r;
+}
+
+int Handle::writeBlockNow(uint64_t slot, uint64_t blockIndex, const Block* block)
+{
+    if (!_base->blockNeedsCopy(blockIndex))
+        return _base->blockWrite(blockIndex, block, _inodeIndex);
+    // copy on write
+    uint64_t hint;
+    uint64_t newBlockIndex;
+    int r = blockHintNow(slot, &hint);
+    if (r == 0)
+        r = _base->blockAddCompressed(&newBlockIndex, block, hint);
+    if (r == 0)
+        r = replaceBlockNow(slot, blockIndex, newBlockIndex);
+    return r;
+}
+
+int Handle::replaceBlockNow(uint64_t slot, uint64_t oldBlockIndex, uint64_t newBlockIndex)
+{
+    int r = setSlot(slot, newBlockIndex);
+    if (r == 0 && oldBlockIndex != InvalidIndex)
+        r = _base->blockRemove(oldBlockIndex);
+    return r;
+}
+
+int Handle::blockHintNow(uint64_t slot, uint64_t* hint)
+{
+    *hint = InvalidIndex;
+    uint64_t prevBlockIndex = InvalidIndex;
+    int r = 0;
+    if (slot > 0 && slot - 1 < slotCount())
+        r = getSlot(slot - 1, &prevBlockIndex);
+    if (r == 0 && prevBlockIndex != InvalidIndex)
+        *hint = prevBlockIndex + 1;
+    return r;
+}
+
 int Handle::truncateNow(uint64_t length)
 {
     int r = 0;
-    if (length != _inode.size) {
+    if (length != _inode.size && fitsInlineNow(length)) {
+        makeInlineNow();
+        if (length < _inode.size)
+            memset(_inode.inlineData() + length, 0, _inode.size - length);
+        _inode.size = length;
+        return 0;
+    }
+    if (length != _inode.size)
+        r = moveInlineDataNow();
+    if (r == 0 && length == 0 && _inode.size != 0 && reclaimInBackgroundNow()) {
+        // hand the data over to an orphan copy of the inode; if there is no
+        // room for it, remove the blocks here
+        Inode orphan = _inode;
+        orphan.nlink = 0;
+        uint64_t orphanIndex;
+        r = prepareReclaimNow();
+        if (r == 0 && _base->inodeAdd(&orphanIndex, &orphan) == 0) {
+            forgetDataNow();
+            _inode.size = 0;
+            r = writeInodeNow();
+            if (r == 0)
+                r = _base->orphanAdd(orphanIndex);
+            return r;
+        }
+    }
+    if (r == 0 && length != _inode.size) {
         uint64_t origSize = _inode.size;
         uint64_t origBlockCount = slotCount();
         // remove or add blocks until the block count matches the new length
-        uint64_t newBlockCount = length / sizeof(Block) + (length % sizeof(Block) != 0 ? 1 : 0);
-        while (r == 0 && newBlockCount < slotCount()) {
-            r = removeSlot(slotCount() - 1, true);
-        }
-        while (r == 0 && newBlockCount > slotCount()) {
-            r = insertSlot(slotCount(), InvalidIndex);
+        uint64_t newBlockCount = length / _blockSize + (length % _blockSize != 0 ? 1 : 0);
+        if (newBlockCount < slotCount()) {
+            // remove the blocks behind the new end, skipping holes
+            uint64_t slot = newBlockCount;
+            for (;;) {
+                r = findSlot(slot, true, &slot, nullptr);
+                if (r < 0 || slot >= slotCount())
+                    break;
+                uint64_t blockIndex;
+                r = getSlot(slot, &blockIndex);
+                if (r == 0)
+                    r = setSlot(slot, InvalidIndex);
+                if (r == 0)
+                    r = _base->blockRemove(blockIndex);
+                if (r < 0)
+                    break;
+                slot++;
+            }
+            if (r == 0)
+                _slotCount = newBlockCount;
+        } else if (newBlockCount > _maxSlotCount) {
+            r = -ENOSPC;
+        } else {
+            // slots behind the end are always empty
+            _slotCount = newBlockCount;
         }
         // write zeroes where necessary
-        if (r == 0 && length > _inode.size && origSize % sizeof(Block) != 0) {
+        if (r == 0 && length > _inode.size && origSize % _blockSize != 0) {
             uint64_t lastOrigBlockSlot = origBlockCount - 1;
-            uint64_t lastOrigBlockValidDataSize = _inode.size % sizeof(Block);
+            uint64_t lastOrigBlockValidDataSize = _inode.size % _blockSize;
             uint64_t lastOrigBlockIndex;
             r = getSlot(lastOrigBlockSlot, &lastOrigBlockIndex);
             if (r == 0) {
                 if (lastOrigBlockIndex != InvalidIndex) {
                     Block lastOrigBlock;
-                    r = _base->blockRead(lastOrigBlockIndex, &lastOrigBlock);
+                    r = lastOrigBlock.allocate(_blockSize);
+                    if (r == 0)
+                        r = _base->blockRead(lastOrigBlockIndex, &lastOrigBlock);
                     if (r == 0) {
-                        memset(lastOrigBlock.data + lastOrigBlockValidDataSize, 0, sizeof(Block) - lastOrigBlockValidDataSize);
-                        r = _base->blockWrite(lastOrigBlockIndex, &lastOrigBlock);
+                        memset(lastOrigBlock.data + lastOrigBlockValidDataSize, 0, _blockSize - lastOrigBlockValidDataSize);
+                        r = writeBlockNow(lastOrigBlockSlot, lastOrigBlockIndex, &lastOrigBlock);
                     }
                 }
             }
@@ -434,25 +1048,110 @@ int Handle::truncateNow(uint64_t length)
     return r;
 }
 
-int Handle::link()
+bool Handle::reclaimInBackgroundNow() const
 {
-    int r = 0;
+    return _inode.type() == TypeREG && !_inode.hasInlineData()
+        && slotCount() >= ReclaimInBackgroundSlots && _base->reclaimsInBackground();
+}
+
+int Handle::prepareReclaimNow()
+{
+    int r = 0;
+    for (int l = 0; r == 0 && l < 4; l++)
+        r = saveCachedBlockIfModified(l);
+    if (r == 0)
+        r = _base->flushCaches(_inodeIndex);
+    return r;
+}
+
+void Handle::forgetDataNow()
+{
+    for (int i = 0; i < 5; i++)
+        _inode.slotTrees[i] = InvalidIndex;
+    _slotCount = 0;
+    for (int l = 0; l < 4; l++) {
+        _cachedBlockIndices[l] = InvalidIndex;
+        _cachedBlockIsModified[l] = false;
+    }
+}
+
+int Handle::blockRemoveNow(uint64_t blockIndex)
+{
+    if (!_deferredBlockRemovals)
+        return _base->blockRemove(blockIndex);
+    try { _deferredBlockRemovals->push_back(blockIndex); }
+    catch (...) { return -ENOMEM; }
+    return 0;
+}
+
+int Handle::reclaim(uint64_t* slot, uint64_t maxBlocks, uint64_t* freedBlocks)
+{
+    lockExclusive();
+    int r = 0;
+    *freedBlocks = 0;
+    std::vector<uint64_t> blocks;
+    try { blocks.reserve(maxBlocks); }
+    catch (...) { r = -ENOMEM; }
+    // setSlot() removes indirection blocks once they are empty
+    _deferredBlockRemovals = &blocks;
+    while (r == 0 && *freedBlocks < maxBlocks) {
+        r = findSlot(*slot, true, slot, nullptr);
+        if (r < 0 || *slot >= slotCount())
+            break;
+        uint64_t blockIndex;
+        r = getSlot(*slot, &blockIndex);
+        if (r == 0)
+            r = setSlot(*slot, InvalidIndex);
+        if (r == 0)
+            r = blockRemoveNow(blockIndex);
+        if (r < 0)
+            break;
+        (*freedBlocks)++;
+        (*slot)++;
+    }
+    _deferredBlockRemovals = nullptr;
+    if (r == 0 && *slot >= slotCount()) {
+        _slotCount = 0;
+        _inode.size = 0;
+        *slot = InvalidIndex;
+    }
+    for (int l = 0; r == 0 && l < 4; l++)
+        r = saveCachedBlockIfModified(l);
+    if (r == 0)
+        r = writeInodeNow();
+    // make the orphan without these blocks durable before they can be reused;
+    // if that fails, they stay allocated until the orphan is reclaimed again
+    // after the next mount
+    if (r == 0 && _base->durability() != Base::DurabilityNone) {
+        r = _base->flushCaches(_inodeIndex);
+        if (r == 0)
+            r = _base->commit();
+    }
+    for (size_t i = 0; r == 0 && i < blocks.size(); i++)
+        r = _base->blockRemove(blocks[i]);
+    unlockExclusive();
+    return r;
+}
+
+int Handle::link()
+{
+    lockExclusive();
+    int r = 0;
     if (_inode.type() != TypeREG)
         r = -EINVAL;
-    if (_inode.nlink == std::numeric_limits<uint16_t>::max())
+    else if (_inode.nlink == std::numeric_limits<uint16_t>::max())
         r = -EMLINK;
     if (r == 0) {
-        lockExclusive();
         Time oldCtime = _inode.ctime;
         _inode.nlink++;
         _inode.ctime = Time::now();
-        r = _base->inodeWrite(_inodeIndex, &_inode);
+        r = writeInodeNow();
         if (r < 0) {
             _inode.nlink--;
             _inode.ctime = oldCtime;
         }
-        unlockExclusive();
     }
+    unlockExclusive();
     return r;
 }
 
@@ -472,6 +1171,7 @@ int Handle::remove()
 int Handle::removeNow()
 {
     int r = 0;
+    bool inodeRemoved = true;
     if (_inode.type() == TypeREG) {
         if (_inode.nlink == 0) {
             logger.log(Logger::Error, "Handle::removeNow(): inode.nlink was zero before we decreased it");
@@ -479,7 +1179,24 @@ int Handle::removeNow()
             r = -ENOTRECOVERABLE;
         } else {
             _inode.nlink--;
-            if (_inode.nlink == 0) {
+            bool orphaned = false;
+            if (_inode.nlink == 0 && reclaimInBackgroundNow()) {
+                // the orphan keeps the inode and all blocks until the reclaimer is done;
+                // if it cannot be handed over, we remove everything here
+                _inode.ctime = Time::now();
+                int ro = prepareReclaimNow();
+                if (ro == 0)
+                    ro = writeInodeNow();
+                if (ro == 0)
+                    ro = _base->orphanAdd(_inodeIndex);
+                if (ro == 0) {
+                    forgetDataNow();
+                    orphaned = true;
+                }
+            }
+            if (orphaned) {
+                // the reclaimer removes the inode
+            } else if (_inode.nlink == 0) {
                 r = _base->inodeRemove(_inodeIndex);
                 /* The simple and direct way to delete all data blocks and indirection blocks is this:
                  * while (r == 0 && slotCount() > 0) {
@@ -489,8 +1206,16 @@ int Handle::removeNow()
                  * and we never need those blocks again.
                  * So we simply go over all blocks and remove them, and then have to remove
                  * the indirection blocks whenever a new one appears. */
+                // Modifications of cached indirection blocks are irrelevant now and must
+                // not be written back to blocks that were already removed.
+                for (int l = 0; l < 4; l++)
+                    _cachedBlockIsModified[l] = false;
                 uint64_t lastRemovedIndirectionBlock[4] = { InvalidIndex, InvalidIndex, InvalidIndex, InvalidIndex };
-                for (uint64_t slot = 0; r == 0 && slot < slotCount(); slot++) {
+                for (uint64_t slot = 0; r == 0; slot++) {
+                    // Skipping holes only loads indirection blocks on the path to the next block
+                    r = findSlot(slot, true, &slot, nullptr);
+                    if (r < 0 || slot >= slotCount())
+                        break;
                     uint64_t blockIndex;
                     r = getSlot(slot, &blockIndex);
                     if (r == 0 && blockIndex != InvalidIndex)
@@ -501,20 +1226,26 @@ int Handle::removeNow()
                                 r = _base->blockRemove(_cachedBlockIndices[l]);
                             lastRemovedIndirectionBlock[l] = _cachedBlockIndices[l];
                         }
+                        _cachedBlockIsModified[l] = false;
                     }
                 }
+                for (int l = 0; l < 4; l++)
+                    _cachedBlockIndices[l] = InvalidIndex;
             } else {
+                inodeRemoved = false;
                 _inode.ctime = Time::now();
-                r = _base->inodeWrite(_inodeIndex, &_inode);
+                r = writeInodeNow();
             }
         }
     } else if (_inode.type() == TypeLNK) {
         r = _base->inodeRemove(_inodeIndex);
-        if (r == 0)
+        if (r == 0 && !_inode.hasInlineData())
             r = _base->blockRemove(_inode.slotTrees[0]);
     } else {
         r = _base->inodeRemove(_inodeIndex);
     }
+    if (inodeRemoved)
+        _inodeIsDirty = false; // pending changes must not resurrect the inode
     return r;
 }
 
@@ -525,24 +1256,30 @@ int Handle::mkdirent(const char* name, size_t nameLen, uint64_t existingInodeInd
         r = -ENOTDIR;
     if (r == 0 && nameLen >= sizeof(Dirent::name))
         r = -ENAMETOOLONG;
-    if (r == 0 && _inode.nlink == std::numeric_limits<uint16_t>::max())
-        r = -EMLINK;
-    if (r == 0 && slotCount() == maxSlotCount)
-        r = -ENOSPC;
     if (r != 0)
         return r;
 
     lockExclusive();
 
+    if (r == 0 && _removeOnceUnused) // the directory was removed while we looked it up
+        r = -ENOENT;
+    if (r == 0 && _inode.nlink == std::numeric_limits<uint16_t>::max())
+        r = -EMLINK;
+    if (r == 0 && slotCount() == _maxSlotCount)
+        r = -ENOSPC;
+    if (r == 0 && _inode.dirFormat() == DirFormatHashed)
+        r = growHashedDirNow();
+
     uint64_t direntSlot;
     uint64_t tmpDirentIndex;
     Dirent tmpDirent;
-    if (r == 0)
+    if (r == 0) {
         r = findDirentNow(name, nameLen, &direntSlot, &tmpDirentIndex, &tmpDirent);
-    if (r == 0)
-        r = -EEXIST;
-    else if (r == -ENOENT)
-        r = 0;
+        if (r == 0)
+            r = -EEXIST;
+        else if (r == -ENOENT)
+            r = 0;
+    }
 
     uint64_t newInodeIndex = existingInodeIndex;
     if (r == 0 && newInodeIndex == InvalidIndex) {
@@ -560,7 +1297,7 @@ int Handle::mkdirent(const char* name, size_t nameLen, uint64_t existingInodeInd
     }
 
     if (r == 0)
-        r = insertSlot(direntSlot, direntIndex);
+        r = addDirentSlot(direntSlot, direntIndex, name, nameLen);
 
     if (r == 0) {
         _inode.size++;
@@ -568,27 +1305,29 @@ int Handle::mkdirent(const char* name, size_t nameLen, uint64_t existingInodeInd
         _inode.mtime = t;
         _inode.ctime = t;
         _inode.nlink++;
-        r = _base->inodeWrite(_inodeIndex, &_inode);
+        r = writeInodeNow();
     }
 
     unlockExclusive();
     return r;
 }
 
-int Handle::rmdirent(const char* name, size_t nameLen, std::function<int (const Inode& inode)> inodeChecker)
+int Handle::rmdirent(const char* name, size_t nameLen, std::function<int (const Inode& inode)> inodeChecker, Handle** removedHandle)
 {
+    *removedHandle = nullptr;
     int r = 0;
     if (r == 0 && _inode.type() != TypeDIR)
         r = -ENOTDIR;
     if (r == 0 && nameLen >= sizeof(Dirent::name))
         r = -ENAMETOOLONG;
-    if (r == 0 && _inode.nlink == 2 /* minimum for "." and ".." */)
-        r = -ENOENT;
     if (r != 0)
         return r;
 
     lockExclusive();
 
+    if (r == 0 && _inode.nlink == 2 /* minimum for "." and ".." */)
+        r = -ENOENT;
+
     uint64_t direntSlot;
     uint64_t direntIndex;
     Dirent dirent;
@@ -597,24 +1336,39 @@ int Handle::rmdirent(const char* name, size_t nameLen, std::function<int (const
         r = findDirentNow(name, nameLen, &direntSlot, &direntIndex, &dirent);
     if (r == 0)
         r = _base->handleGet(dirent.inodeIndex, &handle);
-    if (r == 0)
+    if (r == 0) {
+        // Lock the child so that checking it and marking it for removal is atomic;
+        // e.g. an empty directory must not gain an entry in between.
+        // Locks are only ever nested from parent to child here; SixFS::rename()
+        // does not wait for a second lock.
+        handle->lockExclusive();
         r = inodeChecker(handle->inode());
-    if (r == 0)
-        r = removeSlot(direntSlot, true);
-    if (r == 0)
-        r = handle->remove();
-    if (handle)
-        r = _base->handleRelease(handle);
+        if (r == 0)
+            r = removeDirentSlot(direntSlot, name, nameLen, true);
+        if (r == 0)
+            r = handle->remove(); // we hold a reference, so this only marks it for removal
+        handle->unlockExclusive();
+    }
     if (r == 0) {
         _inode.size--;
         Time t = Time::now();
         _inode.mtime = t;
         _inode.ctime = t;
         _inode.nlink--;
-        r = _base->inodeWrite(_inodeIndex, &_inode);
+        r = writeInodeNow();
     }
 
     unlockExclusive();
+
+    if (handle) {
+        if (r == 0) {
+            *removedHandle = handle;
+        } else {
+            int r2 = _base->handleRelease(handle);
+            if (r2 < 0)
+                logger.log(Logger::Error, "Handle::rmdirent(): unhandled error after failure: %s", strerror(-r2));
+        }
+    }
     return r;
 }
 
@@ -627,17 +1381,21 @@ int Handle::readlink(char* buf, size_t bufsize)
     if (r == 0) {
         lockExclusive();
         Block block;
-        r = _base->blockRead(_inode.slotTrees[0], &block);
+        const char* target;
+        if (_inode.hasInlineData()) {
+            target = reinterpret_cast<const char*>(_inode.inlineData());
+        } else {
+            r = block.allocate(_blockSize);
+            if (r == 0)
+                r = _base->blockRead(_inode.slotTrees[0], &block);
+            target = block.target;
+        }
         if (r == 0) {
             size_t bytesToCopy = std::min(bufsize - 1, size_t(_inode.size));
-            memcpy(buf, block.target, bytesToCopy);
+            memcpy(buf, target, bytesToCopy);
             buf[bytesToCopy] = '\0';
-            Inode oldInode = _inode;
-            if (updateATime()) {
-                r = _base->inodeWrite(_inodeIndex, &_inode);
-                if (r != 0)
-                    _inode = oldInode;
-            }
+            if (updateATime())
+                markInodeDirtyNow();
         }
         unlockExclusive();
     }
@@ -651,7 +1409,7 @@ int Handle::chmod(uint16_t mode)
     Inode oldInode = _inode;
     _inode.typeAndMode = (_inode.typeAndMode & TypeMask) | mode;
     _inode.ctime = Time::now();
-    int r = _base->inodeWrite(_inodeIndex, &_inode);
+    int r = writeInodeNow();
     if (r != 0)
         _inode = oldInode;
     unlockExclusive();
@@ -666,7 +1424,7 @@ int Handle::chown(uint32_t uid, uint32_t gid)
     _inode.gid = gid;
     _inode.typeAndMode &= ~(ModeSUID | ModeSGID);
     _inode.ctime = Time::now();
-    int r = _base->inodeWrite(_inodeIndex, &_inode);
+    int r = writeInodeNow();
     if (r != 0)
         _inode = oldInode;
     unlockExclusive();
@@ -686,7 +1444,7 @@ int Handle::utimens(bool updateAtime, const Time& atime, bool updateMtime, const
         _inode.mtime = mtime;
     if (updateCtime)
         _inode.ctime = ctime;
-    int r = _base->inodeWrite(_inodeIndex, &_inode);
+    int r = writeInodeNow();
     if (r != 0)
         _inode = oldInode;
     unlockExclusive();
@@ -702,7 +1460,7 @@ int Handle::truncate(uint64_t length)
         Time time = Time::now();
         _inode.mtime = time;
         _inode.ctime = time;
-        r = _base->inodeWrite(_inodeIndex, &_inode);
+        r = writeInodeNow();
     }
     unlockExclusive();
     return r;
@@ -715,12 +1473,9 @@ int Handle::openDir()
         r = -ENOTDIR;
     if (r == 0) {
         lockExclusive();
-        Inode oldInode = _inode;
-        if (updateATime()) {
-            r = _base->inodeWrite(_inodeIndex, &_inode);
-            if (r != 0)
-                _inode = oldInode;
-        }
+        if (updateATime())
+            markInodeDirtyNow();
+        r = buildNameIndexNow();
         unlockExclusive();
     }
     return r;
@@ -740,6 +1495,61 @@ int Handle::findDirentNow(const char* name, size_t nameLen, uint64_t* direntSlot
     strncpy(nameCopy, name, nameLen);
     nameCopy[nameLen] = '\0';
 
+    // This function must not modify the handle since findDirent() only holds the
+    // shared lock, therefore slots are accessed with lookupSlot()
+    LookupCache lookupCache(_base);
+
+    if (_hasNameIndex) {
+        uint64_t hash = nameHash(nameCopy, nameLen);
+        auto it = std::lower_bound(_nameIndex.begin(), _nameIndex.end(), NameIndexEntry { hash, 0 });
+        for (; it != _nameIndex.end() && it->hash == hash; it++) {
+            int r = lookupSlot(it->slot, direntIndex, &lookupCache);
+            if (r == 0)
+                r = _base->direntRead(*direntIndex, dirent);
+            if (r < 0)
+                return r;
+            if (strcmp(nameCopy, dirent->name) == 0) {
+                if (direntSlot)
+                    *direntSlot = it->slot;
+                return 0;
+            }
+        }
+        if (!direntSlot)
+            return -ENOENT;
+        // otherwise we need to search for the slot where the entry would go
+    }
+
+    uint64_t tmpDirentSlot;
+    if (!direntSlot)
+        direntSlot = &tmpDirentSlot;
+
+    if (_inode.dirFormat() == DirFormatHashed) {
+        // Linear probing; the table is never full
+        const uint64_t capacity = slotCount();
+        *direntSlot = InvalidIndex;
+        if (capacity == 0)
+            return -ENOENT;
+        uint64_t slot = nameHash(nameCopy, nameLen) & (capacity - 1);
+        for (uint64_t i = 0; i < capacity; i++) {
+            int r = lookupSlot(slot, direntIndex, &lookupCache);
+            if (r < 0)
+                return r;
+            if (*direntIndex == InvalidIndex) {
+                *direntSlot = slot;
+                return -ENOENT;
+            }
+            r = _base->direntRead(*direntIndex, dirent);
+            if (r < 0)
+                return r;
+            if (strcmp(nameCopy, dirent->name) == 0) {
+                *direntSlot = slot;
+                return 0;
+            }
+            slot = (slot + 1) & (capacity - 1);
+        }
+        return -ENOENT;
+    }
+
     // Binary search
     int r = 0;
     int64_t a = 0;
@@ -747,7 +1557,7 @@ int Handle::findDirentNow(const char* name, size_t nameLen, uint64_t* direntSlot
     bool found = false;
     while (b >= a) {
         int64_t c = (a + b) / 2;
-        r = getSlot(c, direntIndex);
+        r = lookupSlot(c, direntIndex, &lookupCache);
         if (r < 0)
             break;
         r = _base->direntRead(*direntIndex, dirent);
@@ -773,40 +1583,148 @@ int Handle::findDirentNow(const char* name, size_t nameLen, uint64_t* direntSlot
     return r;
 }
 
-int Handle::readDirent(uint64_t direntSlot, Dirent* dirent)
+int Handle::fillDirentCursor(uint64_t slot)
 {
+    DirentCursor& c = _direntCursor;
+    c.startSlot = slot;
+    c.endSlot = slot;
+    c.slots.clear();
+
     int r = 0;
-    if (direntSlot >= slotCount())
-        r = -EINVAL;
-    if (r == 0) {
-        lockExclusive();
+    try {
+        c.slots.reserve(DirentBatchSize);
+        c.dirents.resize(DirentBatchSize);
+    }
+    catch (...) {
+        r = -ENOMEM;
+    }
+
+    // collect the entries of the next slots; hashed directories have empty slots, sorted ones do not
+    LookupCache lookupCache(_base);
+    uint64_t direntIndices[DirentBatchSize];
+    while (r == 0 && c.slots.size() < DirentBatchSize && slot < slotCount()) {
         uint64_t direntIndex;
-        r = getSlot(direntSlot, &direntIndex);
-        if (r == 0)
-            r = _base->direntRead(direntIndex, dirent);
-        unlockExclusive();
+        r = lookupSlot(slot, &direntIndex, &lookupCache);
+        if (r == 0 && direntIndex == InvalidIndex) {
+            r = findSlot(slot, true, &slot, &lookupCache);
+        } else if (r == 0) {
+            direntIndices[c.slots.size()] = direntIndex;
+            c.slots.push_back(slot);
+            slot++;
+        }
     }
+    Dirent* dirents[DirentBatchSize];
+    for (size_t i = 0; i < c.slots.size(); i++)
+        dirents[i] = &(c.dirents[i]);
+    if (r == 0)
+        r = _base->direntReadMany(direntIndices, c.slots.size(), dirents);
+
+    if (r == 0) {
+        c.endSlot = slot;
+    } else {
+        c.slots.clear();
+    }
+    c.inodesFrom = c.slots.size();
     return r;
 }
 
-int Handle::readDirentPlus(uint64_t direntSlot, Dirent* dirent, Inode* inode)
+int Handle::fillDirentCursorInodes(size_t first)
 {
+    DirentCursor& c = _direntCursor;
+    c.inodesFrom = c.slots.size();
+
     int r = 0;
-    if (direntSlot >= slotCount())
-        r = -EINVAL;
+    try {
+        c.inodes.resize(DirentBatchSize);
+    }
+    catch (...) {
+        r = -ENOMEM;
+    }
+
+    // an open handle might have inode changes that are not written yet
+    uint64_t inodeIndices[DirentBatchSize];
+    Inode* inodes[DirentBatchSize];
+    size_t inodeCount = 0;
+    for (size_t i = first; r == 0 && i < c.slots.size(); i++) {
+        Handle* handle;
+        _base->handleGetIfExists(c.dirents[i].inodeIndex, &handle);
+        if (handle) {
+            uint64_t inodeIndex;
+            handle->getAttr(&inodeIndex, &(c.inodes[i]));
+            r = _base->handleRelease(handle);
+        } else {
+            inodeIndices[inodeCount] = c.dirents[i].inodeIndex;
+            inodes[inodeCount] = &(c.inodes[i]);
+            inodeCount++;
+        }
+    }
+    if (r == 0)
+        r = _base->inodeReadMany(inodeIndices, inodeCount, inodes);
+
+    if (r == 0)
+        c.inodesFrom = first;
+    return r;
+}
+
+void Handle::dropDirentCursorNow()
+{
+    _direntCursor.startSlot = 0;
+    _direntCursor.endSlot = 0;
+    _direntCursor.slots.clear();
+    _direntCursor.inodesFrom = 0;
+}
+
+int Handle::readDirentFromCursor(uint64_t* direntSlot, Dirent* dirent, Inode* inode, bool continued)
+{
+    lockShared();
+    std::unique_lock<std::mutex> cursorLock(_direntCursor.mutex);
+
+    DirentCursor& c = _direntCursor;
+    size_t i = 0;
+    int r = 0;
+    for (;;) {
+        if (*direntSlot >= c.startSlot && *direntSlot < c.endSlot) {
+            i = std::lower_bound(c.slots.begin(), c.slots.end(), *direntSlot) - c.slots.begin();
+            if (i < c.slots.size())
+                break;
+            // the rest of the batch is empty
+            *direntSlot = c.endSlot;
+        }
+        if (*direntSlot >= slotCount()) {
+            r = -EINVAL;
+            break;
+        }
+        r = fillDirentCursor(*direntSlot);
+        if (r < 0)
+            break;
+    }
+    // inodes read for an earlier request might be outdated
+    if (r == 0 && inode && !(continued && i == c.nextInode && i >= c.inodesFrom))
+        r = fillDirentCursorInodes(i);
     if (r == 0) {
-        lockExclusive();
-        uint64_t direntIndex;
-        r = getSlot(direntSlot, &direntIndex);
-        if (r == 0)
-            r = _base->direntRead(direntIndex, dirent);
-        if (r == 0)
-            r = _base->inodeRead(dirent->inodeIndex, inode);
-        unlockExclusive();
+        *direntSlot = c.slots[i];
+        *dirent = c.dirents[i];
+        if (inode) {
+            *inode = c.inodes[i];
+            c.nextInode = i + 1;
+        }
     }
+
+    cursorLock.unlock();
+    unlockShared();
     return r;
 }
 
+int Handle::readDirent(uint64_t* direntSlot, Dirent* dirent)
+{
+    return readDirentFromCursor(direntSlot, dirent, nullptr, false);
+}
+
+int Handle::readDirentPlus(uint64_t* direntSlot, Dirent* dirent, Inode* inode, bool continued)
+{
+    return readDirentFromCursor(direntSlot, dirent, inode, continued);
+}
+
 int Handle::open(bool readOnly, bool trunc, bool append)
 {
     int r = 0;
@@ -819,27 +1737,98 @@ int Handle::open(bool readOnly, bool trunc, bool append)
         if (trunc && _inode.size != 0)
             r = truncateNow(0);
         if (r == 0) {
-            bool updated = false;
             if (readOnly) {
-                updated = updateATime();
+                if (updateATime())
+                    markInodeDirtyNow();
             } else {
+                // clearing the SUID and SGID bits must not be deferred
+                bool modeChanged = (_inode.typeAndMode & (ModeSUID | ModeSGID));
                 Time t = Time::now();
                 _inode.mtime = t;
                 _inode.ctime = t;
                 _inode.typeAndMode &= ~(ModeSUID | ModeSGID);
-                updated = true;
+                if (modeChanged)
+                    r = writeInodeNow();
+                else
+                    markInodeDirtyNow();
             }
-            if (updated)
-                r = _base->inodeWrite(_inodeIndex, &_inode);
         }
         unlockExclusive();
     }
     return r;
 }
 
+bool Handle::readAheadNow(uint64_t offset, uint64_t count, uint64_t* prefetchSlot, uint64_t* prefetchCount)
+{
+    uint64_t end = offset + count;
+    if (_readAheadNext.exchange(end, std::memory_order_relaxed) != offset || count == 0) {
+        _readAheadWindow.store(0, std::memory_order_relaxed);
+        _readAheadEnd.store(0, std::memory_order_relaxed);
+        return false;
+    }
+    uint64_t window = _readAheadWindow.load(std::memory_order_relaxed);
+    window = (window == 0 ? std::max(ReadAheadMinBytes / _blockSize, uint64_t(1))
+            : std::min(2 * window, std::max(ReadAheadMaxBytes / _blockSize, uint64_t(1))));
+    _readAheadWindow.store(window, std::memory_order_relaxed);
+    uint64_t endSlot = end / _blockSize + (end % _blockSize != 0 ? 1 : 0);
+    uint64_t prefetchedEnd = _readAheadEnd.load(std::memory_order_relaxed);
+    if (prefetchedEnd > endSlot + window / 2)
+        return false;
+    uint64_t from = std::max(endSlot, prefetchedEnd);
+    uint64_t to = std::min(endSlot + window, slotCount());
+    if (from >= to)
+        return false;
+    _readAheadEnd.store(to, std::memory_order_relaxed);
+    *prefetchSlot = from;
+    *prefetchCount = to - from;
+    return true;
+}
+
+bool Handle::writeBehindNow(uint64_t offset, uint64_t count)
+{
+    if (offset != _writeBehindNext)
+        _writeBehindBytes = 0;
+    _writeBehindNext = offset + count;
+    _writeBehindBytes += count;
+    if (_writeBehindBytes < WriteBehindBytes)
+        return false;
+    _writeBehindBytes = 0;
+    return true;
+}
+
+int Handle::prefetch(uint64_t slot, uint64_t count)
+{
+    lockShared();
+
+    // the file may have shrunk in the meantime
+    uint64_t end = (_inode.hasInlineData() ? 0 : std::min(slot + count, slotCount()));
+    LookupCache lookupCache(_base);
+    uint64_t indices[BatchSize];
+    size_t n = 0;
+    int r = 0;
+    for (uint64_t s = slot; r == 0 && s < end; s++) {
+        uint64_t blockIndex;
+        r = lookupSlot(s, &blockIndex, &lookupCache);
+        if (r == 0 && blockIndex != InvalidIndex) {
+            indices[n++] = blockIndex;
+            if (n == BatchSize) {
+                r = _base->blockPrefetch(indices, n);
+                n = 0;
+            }
+        }
+    }
+    if (r == 0 && n > 0)
+        r = _base->blockPrefetch(indices, n);
+
+    unlockShared();
+    return r;
+}
+
 int Handle::read(uint64_t offset, unsigned char* buf, size_t count)
 {
-    lockExclusive();
+    // Only the shared lock is required since lookupSlot() does not modify
+    // the handle; this allows concurrent readers of the same file.
+    lockShared();
 
     if (offset >= _inode.size)
         count = 0;
@@ -847,33 +1836,90 @@ int Handle::read(uint64_t offset, unsigned char* buf, size_t count)
         count = _inode.size - offset;
     int ret = count;
 
+    if (_inode.hasInlineData()) {
+        if (count > 0)
+            memcpy(buf, _inode.inlineData() + offset, count);
+        unlockShared();
+        return ret;
+    }
+
+    uint64_t prefetchSlot, prefetchCount;
+    bool prefetch = readAheadNow(offset, count, &prefetchSlot, &prefetchCount);
+
+    LookupCache lookupCache(_base);
     Block block;
     int r = 0;
 
+    // Full blocks are collected and then read directly into buf with as few
+    // storage accesses as possible; only partial blocks need the temporary block.
+    uint64_t batchIndices[BatchSize];
+    unsigned char* batchData[BatchSize];
+    size_t batchCount = 0;
+
     while (count > 0) {
-        uint64_t blockSlot = offset / sizeof(block);
+        uint64_t blockSlot = offset / _blockSize;
         uint64_t blockIndex;
-        r = getSlot(blockSlot, &blockIndex);
+        r = lookupSlot(blockSlot, &blockIndex, &lookupCache);
         if (r < 0)
             break;
-        if (blockIndex == InvalidIndex)
-            block.initializeData();
-        else
-            r = _base->blockRead(blockIndex, &block);
+        size_t blockOffset = offset % _blockSize;
+        size_t len = std::min(count, _blockSize - blockOffset);
+        if (blockIndex == InvalidIndex) {
+            // zero the whole hole at once
+            uint64_t dataSlot;
+            r = findSlot(blockSlot, true, &dataSlot, &lookupCache);
+            if (r < 0)
+                break;
+            len = std::min(uint64_t(count), dataSlot * _blockSize - offset);
+            memset(buf, 0, len);
+        } else if (blockOffset == 0 && len == _blockSize) {
+            batchIndices[batchCount] = blockIndex;
+            batchData[batchCount] = buf;
+            batchCount++;
+            if (batchCount == BatchSize) {
+                r = _base->blockReadMany(batchIndices, batchCount, batchData);
+                batchCount = 0;
+            }
+        } else {
+            r = block.allocate(_blockSize);
+            if (r == 0)
+                r = _base->blockRead(blockIndex, &block);
+            if (r == 0)
+                memcpy(buf, block.data + blockOffset, len);
+        }
         if (r < 0)
             break;
-        size_t blockOffset = offset % sizeof(block);
-        size_t len = std::min(count, sizeof(block) - blockOffset);
-        memcpy(buf, block.data + blockOffset, len);
         offset += len;
         buf += len;
         count -= len;
     }
+    if (r == 0 && batchCount > 0)
+        r = _base->blockReadMany(batchIndices, batchCount, batchData);
 
-    unlockExclusive();
+    unlockShared();
+    if (prefetch)
+        _base->prefetch(this, prefetchSlot, prefetchCount);
     return (r < 0 ? r : ret);
 }
 
+int Handle::writeBatchNow(size_t count, const uint64_t* slots, const uint64_t* indices, const bool* isNew,
+        const unsigned char* const* data, uint64_t* firstLostSlot)
+{
+    int r = _base->blockWriteMany(indices, count, data);
+    for (size_t i = 0; r < 0 && i < count; i++) {
+        if (!isNew[i])
+            continue;
+        int r2 = setSlot(slots[i], InvalidIndex);
+        if (r2 == 0)
+            r2 = _base->blockRemove(indices[i]);
+        if (r2 < 0)
+            logger.log(Logger::Error, "Handle::write(): cannot recover from failure; block %lu of slot %lu remains: %s",
+                    indices[i], slots[i], strerror(-r2));
+        *firstLostSlot = std::min(*firstLostSlot, slots[i]);
+    }
+    return r;
+}
+
 int Handle::write(uint64_t offset, const unsigned char* buf, size_t count)
 {
     lockExclusive();
@@ -886,17 +1932,42 @@ int Handle::write(uint64_t offset, const unsigned char* buf, size_t count)
 
     if (_append)
         offset = _inode.size;
+    const uint64_t origOffset = offset;
+
+    if (count > 0 && fitsInlineNow(offset + count)) {
+        makeInlineNow();
+        memcpy(_inode.inlineData() + offset, buf, count);
+        if (offset + count > _inode.size)
+            _inode.size = offset + count;
+        count = 0;
+    } else {
+        r = moveInlineDataNow();
+    }
 
-    if (offset > _inode.size)
+    if (r == 0 && offset > _inode.size)
         r = truncateNow(offset);
 
+    // Full blocks are collected and then written directly from buf with as
+    // few storage accesses as possible: overwrites of existing blocks, and
+    // new blocks unless they need to be compressed. New blocks are linked into
+    // the file before their data is written, so a pending batch must always
+    // be written, even after an error.
+    uint64_t batchSlots[BatchSize];
+    uint64_t batchIndices[BatchSize];
+    bool batchIsNew[BatchSize];
+    const unsigned char* batchData[BatchSize];
+    size_t batchCount = 0;
+    uint64_t firstLostSlot = InvalidIndex;
+
+    if (r == 0 && count > 0)
+        r = block.allocate(_blockSize);
     while (r == 0 && count > 0) {
         uint64_t blockIndex = InvalidIndex;
-        uint64_t blockSlot = offset / sizeof(block);
-        size_t blockOffset = offset % sizeof(block);
-        size_t len = std::min(count, sizeof(block) - blockOffset);
+        uint64_t blockSlot = offset / _blockSize;
+        size_t blockOffset = offset % _blockSize;
+        size_t len = std::min(count, _blockSize - blockOffset);
 
-        if (blockSlot >= maxSlotCount) {
+        if (blockSlot >= _maxSlotCount) {
             r = -ENOSPC;
             break;
         }
@@ -911,11 +1982,42 @@ int Handle::write(uint64_t offset, const unsigned char* buf, size_t count)
             if (r < 0)
                 break;
         }
-        if (blockIndex == InvalidIndex) {
-            if (!(blockOffset == 0 && len == sizeof(block)))
+        if (blockIndex == InvalidIndex && blockOffset == 0 && len == _blockSize && !_base->compression()) {
+            uint64_t hint;
+            r = blockHintNow(blockSlot, &hint);
+            if (r == 0)
+                r = _base->blockReserve(&blockIndex, hint);
+            if (r < 0)
+                break;
+            if (blockSlot == slotCount()) {
+                r = insertSlot(blockSlot, blockIndex);
+            } else {
+                r = setSlot(blockSlot, blockIndex);
+            }
+            if (r < 0) {
+                int r2 = _base->blockRemove(blockIndex);
+                if (r2 < 0) {
+                    logger.log(Logger::Error, "Handle::write(): cannot recover from failure; a dead block remains: %s", strerror(-r2));
+                }
+                break;
+            }
+            batchSlots[batchCount] = blockSlot;
+            batchIndices[batchCount] = blockIndex;
+            batchIsNew[batchCount] = true;
+            batchData[batchCount] = buf;
+            batchCount++;
+            if (batchCount == BatchSize) {
+                r = writeBatchNow(batchCount, batchSlots, batchIndices, batchIsNew, batchData, &firstLostSlot);
+                batchCount = 0;
+            }
+        } else if (blockIndex == InvalidIndex) {
+            if (!(blockOffset == 0 && len == _blockSize))
                 block.initializeData();
             memcpy(block.data + blockOffset, buf, len);
-            r = _base->blockAdd(&blockIndex, &block);
+            uint64_t hint;
+            r = blockHintNow(blockSlot, &hint);
+            if (r == 0)
+                r = _base->blockAddCompressed(&blockIndex, &block, hint);
             if (r == 0) {
                 if (blockSlot == slotCount()) {
                     r = insertSlot(blockSlot, blockIndex);
@@ -923,14 +2025,24 @@ int Handle::write(uint64_t offset, const unsigned char* buf, size_t count)
                     r = setSlot(blockSlot, blockIndex);
                 }
             }
+        } else if (blockOffset == 0 && len == _blockSize && !_base->blockNeedsCopy(blockIndex)) {
+            batchSlots[batchCount] = blockSlot;
+            batchIndices[batchCount] = blockIndex;
+            batchIsNew[batchCount] = false;
+            batchData[batchCount] = buf;
+            batchCount++;
+            if (batchCount == BatchSize) {
+                r = writeBatchNow(batchCount, batchSlots, batchIndices, batchIsNew, batchData, &firstLostSlot);
+                batchCount = 0;
+            }
         } else {
-            if (!(blockOffset == 0 && len == sizeof(block))) {
+            if (!(blockOffset == 0 && len == _blockSize)) {
                 r = _base->blockRead(blockIndex, &block);
                 if (r < 0)
                     break;
             }
             memcpy(block.data + blockOffset, buf, len);
-            r = _base->blockWrite(blockIndex, &block);
+            r = writeBlockNow(blockSlot, blockIndex, &block);
         }
         if (r < 0)
             break;
@@ -942,46 +2054,463 @@ int Handle::write(uint64_t offset, const unsigned char* buf, size_t count)
         buf += len;
         count -= len;
     }
+    if (batchCount > 0) {
+        int rb = writeBatchNow(batchCount, batchSlots, batchIndices, batchIsNew, batchData, &firstLostSlot);
+        if (r == 0)
+            r = rb;
+    }
+    if (firstLostSlot != InvalidIndex) {
+        // the file must not keep a size that covers the lost blocks and whatever followed them
+        uint64_t length = std::max(origInode.size, firstLostSlot * _blockSize);
+        if (length < _inode.size) {
+            int rt = truncateNow(length);
+            if (rt < 0)
+                logger.log(Logger::Error, "Handle::write(): cannot restore the size after a failure: %s", strerror(-rt));
+        }
+    }
 
-    if (memcmp(&_inode, &origInode, sizeof(Inode)) != 0) {
-        r = _base->inodeWrite(_inodeIndex, &_inode);
+    if (memcmp(&_inode, &origInode, sizeof(Inode)) != 0)
+        markInodeDirtyNow();
+    int r2 = writeInodeIfStaleNow();
+    if (r == 0)
+        r = r2;
+    bool writeBehind = (r == 0 && writeBehindNow(origOffset, ret));
+
+    unlockExclusive();
+    if (writeBehind)
+        _base->writeBehind(this);
+    return (r < 0 ? r : ret);
+}
+
+int Handle::writeFrom(uint64_t offset, size_t count, DataSource* source)
+{
+    if (_base->compression()) {
+        // the data must be in memory to be compressed
+        std::vector<unsigned char> buf;
+        try {
+            buf.resize(count);
+        }
+        catch (...) {
+            return -ENOMEM;
+        }
+        int r = source->copyToMemory(buf.data(), count);
+        return (r < 0 ? r : write(offset, buf.data(), count));
+    }
+
+    lockExclusive();
+
+    Inode origInode = _inode;
+    int ret = count;
+
+    Block block;
+    int r = 0;
+
+    if (_append)
+        offset = _inode.size;
+    const uint64_t origOffset = offset;
+
+    if (count > 0 && fitsInlineNow(offset + count)) {
+        makeInlineNow();
+        r = source->copyToMemory(_inode.inlineData() + offset, count);
+        if (r == 0 && offset + count > _inode.size)
+            _inode.size = offset + count;
+        // keep the area beyond the file size zero
+        memset(_inode.inlineData() + _inode.size, 0, Inode::InlineDataSize - _inode.size);
+        count = 0;
+    } else {
+        r = moveInlineDataNow();
+    }
+
+    if (r == 0 && offset > _inode.size)
+        r = truncateNow(offset);
+
+    if (r == 0 && count > 0)
+        r = block.allocate(_blockSize);
+    while (r == 0 && count > 0) {
+        uint64_t blockIndex = InvalidIndex;
+        uint64_t blockSlot = offset / _blockSize;
+        size_t blockOffset = offset % _blockSize;
+        size_t len = std::min(count, _blockSize - blockOffset);
+
+        if (blockSlot >= _maxSlotCount) {
+            r = -ENOSPC;
+            break;
+        }
+        if (blockSlot > slotCount()) {
+            logger.log(Logger::Error, "Handle::writeFrom(): blockSlot %lu is too large for block count %lu", blockSlot, slotCount());
+            emergency(EmergencyBug);
+            r = -ENOTRECOVERABLE;
+            break;
+        }
+        if (blockSlot < slotCount()) {
+            r = getSlot(blockSlot, &blockIndex);
+            if (r < 0)
+                break;
+        }
+        bool isNewBlock = (blockIndex == InvalidIndex);
+        bool haveBlockData = false;
+        uint64_t sharedBlockIndex = InvalidIndex; // copy on write: the shared or compressed block that the new one replaces
+        if (!isNewBlock && _base->blockNeedsCopy(blockIndex)) {
+            if (!(blockOffset == 0 && len == _blockSize)) {
+                r = _base->blockRead(blockIndex, &block);
+                if (r < 0)
+                    break;
+                haveBlockData = true;
+            }
+            sharedBlockIndex = blockIndex;
+            isNewBlock = true;
+        }
+        if (isNewBlock) {
+            uint64_t hint;
+            r = blockHintNow(blockSlot, &hint);
+            if (r == 0)
+                r = _base->blockReserve(&blockIndex, hint);
+            if (r < 0)
+                break;
+        }
+        if (blockOffset == 0 && len == _blockSize) {
+            // try to transfer the data of full blocks directly
+            int fd;
+            uint64_t pos;
+            r = _base->blockLocate(blockIndex, &fd, &pos);
+            if (r == 0) {
+                r = source->copyToFile(fd, pos, len);
+            } else if (r == -ENOTSUP) {
+                r = source->copyToMemory(block.data, len);
+                if (r == 0)
+                    r = _base->blockWrite(blockIndex, &block, _inodeIndex);
+            }
+        } else {
+            if (haveBlockData)
+                ; // already read from the shared block
+            else if (isNewBlock)
+                block.initializeData();
+            else
+                r = _base->blockRead(blockIndex, &block);
+            if (r == 0)
+                r = source->copyToMemory(block.data + blockOffset, len);
+            if (r == 0)
+                r = _base->blockWrite(blockIndex, &block, _inodeIndex);
+        }
+        if (isNewBlock) {
+            if (r == 0) {
+                if (blockSlot == slotCount()) {
+                    r = insertSlot(blockSlot, blockIndex);
+                } else {
+                    r = replaceBlockNow(blockSlot, sharedBlockIndex, blockIndex);
+                }
+            } else {
+                int r2 = _base->blockRemove(blockIndex);
+                if (r2 < 0) {
+                    logger.log(Logger::Error, "Handle::writeFrom(): cannot recover from failure; a dead block remains: %s", strerror(-r2));
+                }
+            }
+        }
+        if (r < 0)
+            break;
+
+        if (offset + len > _inode.size)
+            _inode.size = offset + len;
+
+        offset += len;
+        count -= len;
     }
 
+    if (memcmp(&_inode, &origInode, sizeof(Inode)) != 0)
+        markInodeDirtyNow();
+    int r2 = writeInodeIfStaleNow();
+    if (r == 0)
+        r = r2;
+    bool writeBehind = (r == 0 && writeBehindNow(origOffset, ret));
+
     unlockExclusive();
+    if (writeBehind)
+        _base->writeBehind(this);
     return (r < 0 ? r : ret);
 }
 
-int Handle::renameHelperAdd(uint64_t direntSlot, uint64_t direntIndex)
+int Handle::allocate(uint64_t offset, uint64_t length, bool keepSize)
 {
+    if (length == 0 || offset + length < offset)
+        return -EINVAL;
+
     lockExclusive();
-    int r = insertSlot(direntSlot, direntIndex);
-    if (r == 0) {
-        _inode.size++;
-        r = _base->inodeWrite(_inodeIndex, &_inode);
+    Inode origInode = _inode;
+    int r = 0;
+
+    uint64_t end = offset + length;
+    if (!keepSize && end > _inode.size)
+        r = truncateNow(end);
+    // we cannot allocate blocks behind the end of the file, so
+    // with keepSize, preallocation is limited to the current size
+    end = std::min(end, _inode.size);
+
+    Block block;
+    if (r == 0)
+        r = block.allocate(_blockSize);
+    if (r == 0)
+        block.initializeData();
+    uint64_t endSlot = end / _blockSize + (end % _blockSize != 0 ? 1 : 0);
+    // inline data needs no blocks
+    for (uint64_t slot = offset / _blockSize; r == 0 && !_inode.hasInlineData(); slot++) {
+        r = findSlot(slot, false, &slot, nullptr);
+        if (r < 0 || slot >= endSlot)
+            break;
+        uint64_t hint;
+        uint64_t blockIndex;
+        r = blockHintNow(slot, &hint);
+        if (r == 0)
+            r = _base->blockAdd(&blockIndex, &block, hint);
+        if (r == 0) {
+            r = setSlot(slot, blockIndex);
+            if (r < 0)
+                _base->blockRemove(blockIndex);
+        }
+    }
+
+    if (r == 0 && _inode.size != origInode.size) {
+        Time t = Time::now();
+        _inode.mtime = t;
+        _inode.ctime = t;
+    }
+    if (memcmp(&_inode, &origInode, sizeof(Inode)) != 0) {
+        int r2 = writeInodeNow();
+        if (r == 0)
+            r = r2;
+    }
+    unlockExclusive();
+    return r;
+}
+
+int Handle::zeroRange(uint64_t offset, uint64_t length, bool keepSize)
+{
+    if (length == 0 || offset + length < offset)
+        return -EINVAL;
+
+    lockExclusive();
+    Inode origInode = _inode;
+    int r = 0;
+
+    uint64_t end = offset + length;
+    if (!keepSize && end > _inode.size)
+        r = truncateNow(end); // the new part is a hole already
+    end = std::min(end, _inode.size);
+    bool modified = (r == 0 && offset < end);
+
+    if (r == 0 && _inode.hasInlineData()) {
+        if (offset < end)
+            memset(_inode.inlineData() + offset, 0, end - offset);
+        end = offset; // nothing else to do
+    }
+
+    // The first and last block might only be partially in the range; zero their data.
+    // Freed blocks need no zeroing since nobody reads them anymore.
+    uint64_t partialSlots[2] = { offset / _blockSize, end / _blockSize };
+    int partialSlotCount = (partialSlots[1] == partialSlots[0] ? 1 : 2);
+    for (int i = 0; r == 0 && i < partialSlotCount; i++) {
+        uint64_t slot = partialSlots[i];
+        uint64_t blockStart = slot * _blockSize;
+        uint64_t zeroStart = std::max(offset, blockStart);
+        uint64_t zeroEnd = std::min(end, blockStart + _blockSize);
+        if (zeroStart >= zeroEnd || zeroEnd - zeroStart == _blockSize)
+            continue;
+        uint64_t blockIndex;
+        r = getSlot(slot, &blockIndex);
+        if (r == 0 && blockIndex != InvalidIndex) {
+            Block block;
+            r = block.allocate(_blockSize);
+            if (r == 0)
+                r = _base->blockRead(blockIndex, &block);
+            if (r == 0) {
+                memset(block.data + (zeroStart - blockStart), 0, zeroEnd - zeroStart);
+                r = writeBlockNow(slot, blockIndex, &block);
+            }
+        }
+    }
+
+    // Remove all blocks that are completely inside the range
+    uint64_t endSlot = end / _blockSize;
+    for (uint64_t slot = offset / _blockSize + (offset % _blockSize != 0 ? 1 : 0); r == 0; slot++) {
+        r = findSlot(slot, true, &slot, nullptr);
+        if (r < 0 || slot >= endSlot)
+            break;
+        uint64_t blockIndex;
+        r = getSlot(slot, &blockIndex);
+        if (r == 0)
+            r = setSlot(slot, InvalidIndex);
+        if (r == 0)
+            r = _base->blockRemove(blockIndex);
+    }
+
+    if (r == 0 && modified) {
+        Time t = Time::now();
+        _inode.mtime = t;
+        _inode.ctime = t;
+    }
+    if (memcmp(&_inode, &origInode, sizeof(Inode)) != 0) {
+        int r2 = writeInodeNow();
+        if (r == 0)
+            r = r2;
     }
     unlockExclusive();
     return r;
 }
 
-int Handle::renameHelperRemove(uint64_t direntSlot)
+int Handle::seek(uint64_t offset, bool data, uint64_t* result)
 {
+    lockShared();
+    int r = 0;
+    if (offset >= _inode.size) {
+        r = -ENXIO;
+    } else if (_inode.hasInlineData()) {
+        *result = (data ? offset : _inode.size);
+    } else {
+        LookupCache lookupCache(_base);
+        uint64_t slot;
+        r = findSlot(offset / _blockSize, data, &slot, &lookupCache);
+        if (r == 0) {
+            if (data && slot >= slotCount())
+                r = -ENXIO;
+            else
+                *result = std::min(_inode.size, std::max(offset, slot * _blockSize));
+        }
+    }
+    unlockShared();
+    return r;
+}
+
+int Handle::shareBlocks(Handle* src, uint64_t srcOffset, uint64_t dstOffset, uint64_t length, uint64_t* sharedBytes)
+{
+    *sharedBytes = 0;
+    if (src == this || srcOffset % _blockSize != 0 || dstOffset % _blockSize != 0)
+        return -EINVAL;
+
+    // Lock in the order of the inode indices so that concurrent calls
+    // with swapped source and destination cannot deadlock
+    bool srcFirst = (src->inodeIndex() < inodeIndex());
+    if (srcFirst)
+        src->lockShared();
     lockExclusive();
-    int r = removeSlot(direntSlot, false);
+    if (!srcFirst)
+        src->lockShared();
+
+    Inode origInode = _inode;
+    int r = 0;
+
+    uint64_t srcSize = src->_inode.size;
+    if (srcOffset >= srcSize)
+        length = 0;
+    else if (srcOffset + length > srcSize)
+        length = srcSize - srcOffset;
+    if (_inode.hasInlineData() || src->_inode.hasInlineData())
+        length = 0; // nothing to share; the caller copies the data
+    uint64_t blockCount = length / _blockSize;
+    if (length % _blockSize != 0 && srcOffset + length == srcSize && dstOffset + length >= _inode.size) {
+        // The unused part of the last block will be hidden by our file size;
+        // truncateNow() zeroes it if that grows.
+        blockCount++;
+    }
+
+    if (blockCount > 0 && dstOffset > _inode.size)
+        r = truncateNow(dstOffset);
+
+    LookupCache lookupCache(_base);
+    uint64_t srcSlot = srcOffset / _blockSize;
+    uint64_t dstSlot = dstOffset / _blockSize;
+    for (uint64_t i = 0; r == 0 && i < blockCount; i++) {
+        if (dstSlot + i >= _maxSlotCount) {
+            r = -ENOSPC;
+            break;
+        }
+        uint64_t blockIndex;
+        r = src->lookupSlot(srcSlot + i, &blockIndex, &lookupCache);
+        uint64_t oldBlockIndex = InvalidIndex;
+        if (r == 0 && dstSlot + i < slotCount())
+            r = getSlot(dstSlot + i, &oldBlockIndex);
+        // a hole at the end still needs its slot so that the slot count matches the size
+        if (r == 0 && (blockIndex != oldBlockIndex || dstSlot + i == slotCount())) {
+            if (blockIndex != InvalidIndex)
+                r = _base->blockShare(blockIndex);
+            if (r == -ENOTSUP) {
+                // compressed blocks cannot be shared; the caller copies the rest
+                r = 0;
+                break;
+            }
+            if (r == 0) {
+                if (dstSlot + i == slotCount())
+                    r = insertSlot(dstSlot + i, blockIndex);
+                else
+                    r = replaceBlockNow(dstSlot + i, oldBlockIndex, blockIndex);
+            }
+        }
+        if (r == 0) {
+            *sharedBytes = std::min((i + 1) * _blockSize, length);
+            if (dstOffset + *sharedBytes > _inode.size)
+                _inode.size = dstOffset + *sharedBytes;
+        }
+    }
+
+    if (*sharedBytes > 0) {
+        Time t = Time::now();
+        _inode.mtime = t;
+        _inode.ctime = t;
+    }
+    if (memcmp(&_inode, &origInode, sizeof(Inode)) != 0)
+        markInodeDirtyNow();
+    int r2 = writeInodeIfStaleNow();
+    if (r == 0)
+        r = r2;
+
+    src->unlockShared();
+    unlockExclusive();
+    return r;
+}
+
+int Handle::renameHelperReserve()
+{
+    int r = 0;
+    if (_inode.dirFormat() == DirFormatHashed)
+        r = growHashedDirNow();
+    return r;
+}
+
+int Handle::renameHelperAdd(uint64_t direntSlot, uint64_t direntIndex, const char* name, size_t nameLen)
+{
+    int r = 0;
+    if (_inode.nlink == std::numeric_limits<uint16_t>::max())
+        r = -EMLINK;
+    if (r == 0)
+        r = addDirentSlot(direntSlot, direntIndex, name, nameLen);
+    if (r == 0) {
+        _inode.size++;
+        _inode.nlink++; // like mkdirent()
+        r = writeInodeNow();
+    }
+    return r;
+}
+
+int Handle::renameHelperRemove(uint64_t direntSlot, const char* name, size_t nameLen)
+{
+    int r = removeDirentSlot(direntSlot, name, nameLen, false);
     if (r == 0) {
         _inode.size--;
-        r = _base->inodeWrite(_inodeIndex, &_inode);
+        _inode.nlink--; // like rmdirent()
+        r = writeInodeNow();
     }
-    unlockExclusive();
     return r;
 }
 
 int Handle::renameHelperReplace(uint64_t direntSlot, uint64_t newDirentIndex)
 {
-    lockExclusive();
+    dropDirentCursorNow();
     int r = setSlot(direntSlot, newDirentIndex);
     if (r == 0) {
-        r = _base->inodeWrite(_inodeIndex, &_inode);
+        r = writeInodeNow();
     }
-    unlockExclusive();
     return r;
 }
+
+void Handle::renameHelperChanged()
+{
+    dropDirentCursorNow();
+}
@@ -19,8 +19,11 @@
 #pragma once
 
 #include <cstdint>
+#include <atomic>
 #include <functional>
+#include <mutex>
 #include <shared_mutex>
+#include <vector>
 
 #include "inode.hpp"
 #include "dirent.hpp"
@@ -29,51 +32,221 @@
 
 class Base;
 
+// A sequential source of data for Handle::writeFrom(), e.g. the pipe that FUSE
+// received a write request in
+class DataSource
+{
+public:
+    virtual ~DataSource() {}
+    // Copy the next len bytes to memory
+    virtual int copyToMemory(unsigned char* dst, size_t len) = 0;
+    // Copy the next len bytes to position pos in the file fd, ideally without intermediate copies
+    virtual int copyToFile(int fd, uint64_t pos, size_t len) = 0;
+};
+
 
 class Handle
 {
 private:
     Base* _base;
+    const size_t _blockSize;
     const uint64_t _inodeIndex;
     Inode _inode;
     uint64_t _slotCount;
     bool _readOnly;
     bool _append;
-    int _refCount;
+    std::atomic<int> _refCount; // modified under the lock of its handle map shard, but read without it
     std::shared_mutex _mutex;
     bool _removeOnceUnused;
 
+    /* Changes of the inode that only affect its size and time stamps, e.g. from
+     * appending writes or atime updates, are not written immediately. The inode
+     * is written back on cleanup(), sync(), or when it has been dirty for longer
+     * than InodeWriteBackInterval seconds, either by the next change or by the
+     * sync thread of the Base (see writeInodeIfStale()). All other inode updates
+     * write it immediately, including any pending changes. */
+    bool _inodeIsDirty;
+    Time _inodeDirtySince;
+    void markInodeDirtyNow();
+    int writeInodeNow();
+    int writeInodeIfStaleNow(); // write a dirty inode if its write back interval elapsed
+
     // internal locking helper functions
     void lockExclusive();
+    bool tryLockExclusive();
     void unlockExclusive();
     void lockShared();
     void unlockShared();
 
     /* Slot Management */
 
-    static constexpr uint64_t N = sizeof(Block) / sizeof(uint64_t); // number of indirection slots per block
-    static constexpr uint64_t maxSlotCount = 1 + N + N * N + N * N * N + N * N * N * N;
+    const uint64_t _slotsPerBlock;   // number of indirection slots per block
+    const uint64_t _maxSlotCount;
+    static constexpr size_t BatchSize = 64; // max number of blocks transferred at once by read() and write()
     uint64_t _cachedBlockIndices[4]; // one for each level of indirection
-    Block _cachedBlocks[4];          // one for each level of indirection
+    Block* _cachedBlocks;            // one for each level of indirection; from the pool of the base when first needed
     bool _cachedBlockIsModified[4];  // one for each level of indirection
 
-    static void slotToTreeIndices(uint64_t slot, int* tree, uint64_t ijkl[4]);
+    // A private cache of indirection blocks for slot lookups that must not
+    // modify the handle, so that they can run concurrently under the shared lock
+    class LookupCache
+    {
+    public:
+        Base* base;
+        uint64_t blockIndices[4];    // one for each level of indirection
+        Block* blocks;               // one for each level of indirection; from the pool of the base when first needed
+
+        LookupCache(Base* base);
+        LookupCache(const LookupCache&) = delete;
+        LookupCache& operator=(const LookupCache&) = delete;
+        ~LookupCache();
+    };
+
+    void slotToTreeIndices(uint64_t slot, int* tree, uint64_t ijkl[4]) const;
+    int acquireCachedBlocks(); // make sure that _cachedBlocks exists
     int cacheBlock(int indirectionLevel, uint64_t blockIndex);
+    // Get an indirection block for lookupSlot() and findSlot() without modifying the handle
+    int lookupBlock(int treeLevel, uint64_t blockIndex, LookupCache* lookupCache, const Block** block) const;
     int saveCachedBlockIfModified(int treeLevel);
 
     uint64_t slotCount() const;
     int getSlot(uint64_t slot, uint64_t* i);
+    int lookupSlot(uint64_t slot, uint64_t* i, LookupCache* lookupCache) const; // does not modify the handle
+    // Find the first slot >= slot that refers to a block (data = true) or that is
+    // empty (data = false); *foundSlot is slotCount() if there is none. Empty parts
+    // of the slot trees are skipped without visiting their slots. With a lookup
+    // cache, the handle is not modified; without, the exclusive lock is required.
+    int findSlot(uint64_t slot, bool data, uint64_t* foundSlot, LookupCache* lookupCache);
     int setSlot(uint64_t slot, uint64_t i);
     int insertSlot(uint64_t slot, uint64_t direntOrBlockIndex);
     int removeSlot(uint64_t slot, bool removeDirentOrBlock);
 
+    /* Directory formats (see inode.hpp) */
+
+    static uint64_t nameHash(const char* name, size_t nameLen);
+    int growHashedDirNow(); // make room for one more entry; writes the inode if the table changed
+    int removeHashedSlot(uint64_t slot, bool removeDirent);
+    // These handle all directory formats and keep the name index up to date
+    int addDirentSlot(uint64_t direntSlot, uint64_t direntIndex, const char* name, size_t nameLen);
+    int removeDirentSlot(uint64_t direntSlot, const char* name, size_t nameLen, bool removeDirent);
+
+    /* Name index of open directories: the slots of all entries sorted by
+     * name hash, so that a lookup only needs to read about one dirent.
+     * Its memory is taken from a budget shared by all handles. If anything
+     * goes wrong, the index is simply dropped. */
+
+    class NameIndexEntry
+    {
+    public:
+        uint64_t hash;
+        uint64_t slot;
+
+        bool operator<(const NameIndexEntry& e) const { return hash < e.hash || (hash == e.hash && slot < e.slot); }
+    };
+    std::vector<NameIndexEntry> _nameIndex;
+    bool _hasNameIndex;
+    uint64_t _nameIndexMemory; // bytes taken from the budget
+
+    int buildNameIndexNow();
+    void dropNameIndexNow();
+    void nameIndexInsert(uint64_t hash, uint64_t slot);
+    void nameIndexRemove(uint64_t hash, uint64_t slot);
+    void nameIndexMove(uint64_t hash, uint64_t oldSlot, uint64_t newSlot);
+    void nameIndexShift(uint64_t firstSlot, int64_t delta); // sorted format: add delta to all slots >= firstSlot
+
+    /* Readdir cursor of open directories: readDirent() and readDirentPlus()
+     * read the entries of a batch of consecutive slots at once and serve the
+     * following calls from that batch. Any change of the directory's entries
+     * drops the batch. The plus variant also reads the inodes of the remaining
+     * entries of the batch at once, but these are only used by the calls that
+     * continue the same readdir request, since the inodes can change in the
+     * meantime without any change of the directory. */
+
+    static constexpr size_t DirentBatchSize = 64;
+    class DirentCursor
+    {
+    public:
+        std::mutex mutex;             // the cursor is used under the shared lock
+        uint64_t startSlot;           // the batch covers the slots [startSlot, endSlot)
+        uint64_t endSlot;
+        std::vector<uint64_t> slots;  // the non-empty slots in that range
+        std::vector<Dirent> dirents;
+        std::vector<Inode> inodes;    // valid from inodesFrom to the end of the batch
+        size_t inodesFrom;
+        size_t nextInode;             // entry after the last one returned with its inode
+
+        DirentCursor();
+    };
+    DirentCursor _direntCursor;
+
+    int fillDirentCursor(uint64_t slot);                  // requires the shared lock and the cursor mutex
+    int fillDirentCursorInodes(size_t first);             // requires the shared lock and the cursor mutex
+    void dropDirentCursorNow();                           // requires the exclusive lock
+    int readDirentFromCursor(uint64_t* direntSlot, Dirent* dirent, Inode* inode, bool continued); // inode may be nullptr
+
+    /* Inline data of small regular files, see Inode::hasInlineData().
+     * The inline area beyond the file size is always zero. */
+    bool fitsInlineNow(uint64_t size) const; // whether the file can keep or get inline data of this size
+    void makeInlineNow();                    // requires fitsInlineNow()
+    int moveInlineDataNow();                 // move the data to a block; does nothing without inline data
+
     // internal helper functions
     bool updateATime(); // update atime according to the relatime mount option rules; return true if modified
+    // Write the modified data of the block in the given slot. If the block is shared
+    // with other files or compressed, the data goes to a new block that replaces it
+    // in this file.
+    int writeBlockNow(uint64_t slot, uint64_t blockIndex, const Block* block);
+    // Replace the block in an existing slot and drop this file's reference to the old block
+    int replaceBlockNow(uint64_t slot, uint64_t oldBlockIndex, uint64_t newBlockIndex);
+    // Write a batch of full blocks for write(). If that fails, the blocks that are new
+    // in their slots would expose whatever their storage held before, so they are
+    // unlinked and removed again, and *firstLostSlot is lowered to the first of them.
+    int writeBatchNow(size_t count, const uint64_t* slots, const uint64_t* indices, const bool* isNew,
+            const unsigned char* const* data, uint64_t* firstLostSlot);
+    // The placement hint for a new data block in the given slot (see Base::blockAdd()):
+    // the index following the block of the preceding slot, so that files stay contiguous
+    int blockHintNow(uint64_t slot, uint64_t* hint);
     int truncateNow(uint64_t length);
     int removeNow();
 
+    /* The data of large regular files is reclaimed in the background when the
+     * file is removed or truncated to zero, see Base::orphanAdd(): the inode
+     * is handed over as an orphan with all its blocks, and this handle forgets
+     * the data. The orphan is reclaimed in batches; the blocks of a batch are
+     * removed only once the orphan without them is durable, since the orphan
+     * is reclaimed again from its durable state after a crash. */
+    static constexpr uint64_t ReclaimInBackgroundSlots = 1024;
+    bool reclaimInBackgroundNow() const;
+    int prepareReclaimNow(); // write back everything that the orphan needs
+    void forgetDataNow();    // the handle no longer owns any blocks
+    std::vector<uint64_t>* _deferredBlockRemovals; // if set, blockRemoveNow() collects the blocks here
+    int blockRemoveNow(uint64_t blockIndex);
+
+    /* Sequential access detection: a read that continues where the previous
+     * one ended widens the readahead window, up to ReadAheadMaxBytes, and the
+     * blocks within the window are prefetched in the background (see
+     * Base::prefetch()) once the reader has used half of the previously
+     * prefetched ones. Any other read closes the window. Reads run concurrently
+     * under the shared lock, so this state is atomic; a race only costs a
+     * missed or an extra prefetch. Sequential writers let the background
+     * thread write their cached blocks back every WriteBehindBytes (see
+     * Base::writeBehind()), so that they do not pile up until close. */
+    static constexpr uint64_t ReadAheadMinBytes = 128 * 1024;
+    static constexpr uint64_t ReadAheadMaxBytes = 4 * 1024 * 1024;
+    static constexpr uint64_t WriteBehindBytes = 4 * 1024 * 1024;
+    std::atomic<uint64_t> _readAheadNext;   // the offset that a sequential read continues at
+    std::atomic<uint64_t> _readAheadWindow; // in slots; 0 if reads are not sequential
+    std::atomic<uint64_t> _readAheadEnd;    // the slot after the last prefetched one
+    uint64_t _writeBehindNext;              // the offset that a sequential write continues at
+    uint64_t _writeBehindBytes;             // bytes written sequentially since the last write-behind
+    // Update the detection for a read; returns whether to prefetch the given slots
+    bool readAheadNow(uint64_t offset, uint64_t count, uint64_t* prefetchSlot, uint64_t* prefetchCount);
+    // Update the detection for a write; returns whether to write behind
+    bool writeBehindNow(uint64_t offset, uint64_t count);
+
     // the dump() function may use internals
     friend int ::dump(const std::string& dirName,
+            const std::vector<std::string>& dataDirNames,
             const std::vector<unsigned char>& key,
             const char* dumpInode,
             const char* dumpTree,
@@ -81,12 +254,25 @@ private:
             const char* dumpSBlock,
             const char* dumpDBlock);
 
+    // SixFS locks the handles involved in path lookups and renames itself
+    friend class SixFS;
+
 public:
     Handle(Base* base, uint64_t inodeIndex, const Inode& inode);
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+    ~Handle();
 
     /* Call before destroying the handle; there might be operations pending: */
     int cleanup();
 
+    /* Write pending changes of the inode and its slot tree, e.g. for fsync */
+    int sync();
+
+    /* Write the inode if it has been dirty for longer than InodeWriteBackInterval seconds */
+    static constexpr int64_t InodeWriteBackInterval = 5;
+    int writeInodeIfStale();
+
     /* Get information about this handle */
     uint64_t inodeIndex() const;
     const Inode& inode() const;
@@ -95,7 +281,7 @@ public:
 
     bool removeOnceUnused() const;
 
-    int& refCount();
+    std::atomic<int>& refCount();
 
     void getAttr(uint64_t* inodeIndex, Inode* inode);
 
@@ -105,11 +291,17 @@ public:
     int openDir();
     int findDirent(const char* name, size_t nameLen, uint64_t* direntSlot, uint64_t* direntIndex, Dirent* dirent);
     int findDirentNow(const char* name, size_t nameLen, uint64_t* direntSlot, uint64_t* direntIndex, Dirent* dirent); // no locking!
-    int readDirent(uint64_t direntSlot, Dirent* dirent);
-    int readDirentPlus(uint64_t direntSlot, Dirent* dirent, Inode* inode);
+    // Both functions accept nullptr as direntSlot if the caller does not need the slot;
+    // otherwise the slot in which a missing entry would go is returned with -ENOENT.
+    // Read the first entry in a slot >= *direntSlot; *direntSlot is set to its slot
+    int readDirent(uint64_t* direntSlot, Dirent* dirent);
+    // continued: this call directly follows the previous one in the same readdir request
+    int readDirentPlus(uint64_t* direntSlot, Dirent* dirent, Inode* inode, bool continued);
 
     int mkdirent(const char* name, size_t nameLen, uint64_t existingInodeIndex, std::function<Inode (const Inode& parentInode)> inodeCreator);
-    int rmdirent(const char* name, size_t nameLen, std::function<int (const Inode& inode)> inodeChecker);
+    // On success, *removedHandle is the handle of the removed inode. The caller must release it,
+    // but only after it made sure that nobody can find the inode anymore (e.g. in a cache).
+    int rmdirent(const char* name, size_t nameLen, std::function<int (const Inode& inode)> inodeChecker, Handle** removedHandle);
 
     int readlink(char* buf, size_t bufsize);
 
@@ -121,8 +313,36 @@ public:
     int open(bool readOnly, bool trunc, bool append);
     int read(uint64_t offset, unsigned char* buf, size_t count);
     int write(uint64_t offset, const unsigned char* buf, size_t count);
+    // Variant of write() that avoids copying the data when possible
+    int writeFrom(uint64_t offset, size_t count, DataSource* source);
+    // Prefetch the data blocks of count slots starting at slot, see Base::blockPrefetch()
+    int prefetch(uint64_t slot, uint64_t count);
+    // Allocate blocks for all holes in the range, see fallocate(2)
+    int allocate(uint64_t offset, uint64_t length, bool keepSize);
+    // Let the range read as zeroes. Blocks completely inside it are removed,
+    // so that this punches a hole, see fallocate(2).
+    int zeroRange(uint64_t offset, uint64_t length, bool keepSize);
+    // Find the next data (data = true) or hole at or after the offset, see lseek(2) with SEEK_DATA / SEEK_HOLE
+    int seek(uint64_t offset, bool data, uint64_t* result);
+    // Let the data of this file at the block aligned dstOffset share the blocks of src
+    // at the block aligned srcOffset, for length bytes or until the end of src,
+    // without copying them. Only whole blocks are shared; the last block of src
+    // is included if its unused part would be beyond the end of this file.
+    // On success, *sharedBytes is set to the number of bytes that are now shared;
+    // the caller must copy the rest. Compressed blocks cannot be shared; sharing
+    // stops at the first one. src must be a different regular file.
+    int shareBlocks(Handle* src, uint64_t srcOffset, uint64_t dstOffset, uint64_t length, uint64_t* sharedBytes);
+
+    // Remove up to maxBlocks data blocks of an orphan (see Base::orphanAdd()),
+    // starting at *slot, and write the changes. *slot is set to the slot to
+    // continue with, or to InvalidIndex when all blocks are removed; the file
+    // is empty then. *freedBlocks is the number of removed data blocks.
+    int reclaim(uint64_t* slot, uint64_t maxBlocks, uint64_t* freedBlocks);
 
-    int renameHelperAdd(uint64_t direntSlot, uint64_t direntIndex);
-    int renameHelperRemove(uint64_t direntSlot);
+    // The caller must hold the exclusive lock of this handle, see SixFS::rename()
+    int renameHelperReserve(); // call before finding the slot for renameHelperAdd()
+    int renameHelperAdd(uint64_t direntSlot, uint64_t direntIndex, const char* name, size_t nameLen);
+    int renameHelperRemove(uint64_t direntSlot, const char* name, size_t nameLen);
     int renameHelperReplace(uint64_t direntSlot, uint64_t newDirentIndex);
+    void renameHelperChanged(); // an entry of this directory was modified in place
 };
@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -18,6 +18,8 @@
 
 #include <cerrno>
 #include <cassert>
+#include <cstddef>
+#include <cstring>
 
 #include <unistd.h>
 
@@ -25,6 +27,9 @@
 #include "inode.hpp"
 
 
+static_assert(offsetof(Inode, xattrIndex) == offsetof(Inode, slotTrees) + sizeof(Inode::slotTrees));
+static_assert(offsetof(Inode, xattrIndex) + sizeof(Inode::xattrIndex) - offsetof(Inode, slotTrees) == Inode::InlineDataSize);
+
 Inode::Inode() :
     atime(),
     ctime(),
@@ -53,7 +58,7 @@ Inode Inode::empty()
     return inode;
 }
 
-Inode Inode::directory(const Inode* parent, uint16_t mode)
+Inode Inode::directory(const Inode* parent, uint16_t mode, uint64_t dirFormat)
 {
     Inode inode = empty();
     if (parent && parent->typeAndMode & ModeSGID)
@@ -62,6 +67,7 @@ Inode Inode::directory(const Inode* parent, uint16_t mode)
     if (parent && parent->typeAndMode & ModeSGID)
         inode.typeAndMode |= ModeSGID;
     inode.nlink = 2; // "." and ".."
+    inode.rdev = dirFormat;
     return inode;
 }
 
@@ -69,7 +75,8 @@ Inode Inode::node(uint16_t typeAndMode, uint64_t rdev)
 {
     Inode inode = empty();
     inode.typeAndMode = typeAndMode;
-    inode.rdev = rdev;
+    if (inode.type() == TypeBLK || inode.type() == TypeCHR)
+        inode.rdev = rdev; // other types use it for other purposes
     return inode;
 }
 
@@ -81,3 +88,14 @@ Inode Inode::symlink(size_t targetLen, uint64_t blockIndex)
     inode.slotTrees[0] = blockIndex;
     return inode;
 }
+
+Inode Inode::inlineSymlink(const char* target, size_t targetLen)
+{
+    Inode inode = empty();
+    inode.typeAndMode = TypeLNK;
+    inode.rdev = InodeFlagInline;
+    inode.size = targetLen;
+    memset(inode.inlineData(), 0, InlineDataSize);
+    memcpy(inode.inlineData(), target, targetLen);
+    return inode;
+}
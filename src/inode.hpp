@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -48,6 +48,15 @@ constexpr uint16_t ModeROTH = 00004;
 constexpr uint16_t ModeWOTH = 00002;
 constexpr uint16_t ModeXOTH = 00001;
 
+// Directories do not need rdev, so it stores the format of their slots instead.
+// The lowest 8 bits are the format, the remaining bits are format specific.
+constexpr uint64_t DirFormatSorted = 0; // slots hold dirent indices sorted by name
+constexpr uint64_t DirFormatHashed = 1; // slots form a hash table of dirent indices with linear probing;
+                                        // the remaining bits are log2 of its size (0 for no table)
+
+// Regular files and symbolic links do not need rdev either, so it stores flags.
+constexpr uint64_t InodeFlagInline = 1; // the data is stored in the inode, see Inode::inlineData()
+
 // An inode. This is basically the same as struct stat, but with explicit
 // size of structure members.
 class Inode
@@ -57,9 +66,10 @@ public:
 
     // functions to create specific inode types
     static Inode empty();
-    static Inode directory(const Inode* parent, uint16_t mode);
+    static Inode directory(const Inode* parent, uint16_t mode, uint64_t dirFormat);
     static Inode node(uint16_t typeAndMode, uint64_t rdev);
     static Inode symlink(size_t targetLen, uint64_t blockIndex);
+    static Inode inlineSymlink(const char* target, size_t targetLen); // targetLen <= InlineDataSize
 
     // data fields (see man 3type stat)
     Time atime;
@@ -75,4 +85,14 @@ public:
     uint64_t xattrIndex;        // TODO for xattr support: index of block that stores them, or InvalidIndex
 
     uint16_t type() const { return typeAndMode & TypeMask; }
+    uint64_t dirFormat() const { return rdev & 0xff; }
+    uint64_t dirHashBits() const { return rdev >> 8; }
+
+    // Small regular files and symbolic link targets are stored inline: they
+    // need no data block, and slotTrees and xattrIndex hold the data instead.
+    // This means that an inode with inline data cannot have extended attributes.
+    static constexpr size_t InlineDataSize = 6 * sizeof(uint64_t);
+    bool hasInlineData() const { return (type() == TypeREG || type() == TypeLNK) && (rdev & InodeFlagInline); }
+    unsigned char* inlineData() { return reinterpret_cast<unsigned char*>(slotTrees); }
+    const unsigned char* inlineData() const { return reinterpret_cast<const unsigned char*>(slotTrees); }
 } __attribute__((packed));
@@ -22,17 +22,72 @@
 #include <cstdarg>
 #include <cstring>
 #include <cerrno>
-#include <ctime>
+
+#include <algorithm>
+#include <string>
 
 #include "logger.hpp"
 
 
-Logger::Logger() : _argv0(nullptr), _f(nullptr), _l(Warning)
+/* Interval in which the flusher writes pending messages. Warnings and errors,
+ * and a ring buffer that is half full, wake it up at once. */
+static constexpr long FlushIntervalNs = 100000000;
+
+static uint64_t realtimeNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+Logger::Ring::Ring() : head(0), tail(0), dropped(0), reportedDrops(0)
+{
+}
+
+Logger::RingOwner::RingOwner()
+{
+    // reuse the ring of a finished thread once the flusher has emptied it
+    std::lock_guard<std::mutex> lock(logger._mutex);
+    ring = nullptr;
+    for (size_t i = 0; i < logger._freeRings.size(); i++) {
+        Ring* r = logger._freeRings[i];
+        if (r->head.load(std::memory_order_relaxed) == r->tail.load(std::memory_order_acquire)) {
+            ring = r;
+            logger._freeRings[i] = logger._freeRings.back();
+            logger._freeRings.pop_back();
+            break;
+        }
+    }
+    if (!ring) {
+        ring = new Ring;
+        logger._rings.push_back(ring);
+    }
+}
+
+Logger::RingOwner::~RingOwner()
+{
+    // the flusher still writes the pending messages of this ring
+    std::lock_guard<std::mutex> lock(logger._mutex);
+    logger._freeRings.push_back(ring);
+}
+
+Logger::Ring* Logger::ring()
+{
+    thread_local RingOwner owner;
+    return owner.ring;
+}
+
+Logger::Logger() : _argv0(nullptr), _f(nullptr), _l(Warning), _async(false), _asyncLoggers(0), _flusherStop(false), _cachedTime(-1)
 {
+    sem_init(&_flushRequests, 0, 0);
 }
 
 Logger::~Logger()
 {
+    stopFlusher();
+    sem_destroy(&_flushRequests);
+    for (size_t i = 0; i < _rings.size(); i++)
+        delete _rings[i];
     if (_f)
         fclose(_f);
     else
@@ -68,30 +123,143 @@ void Logger::setOutput(const char* fileNameOrNullptr)
     }
 }
 
-void Logger::log(Level l, const char* fmt, ...)
+const char* Logger::timeStr(time_t t)
+{
+    if (t != _cachedTime) {
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(_cachedTimeStr, sizeof(_cachedTimeStr), "%F %T", &tm);
+        _cachedTime = t;
+    }
+    return _cachedTimeStr;
+}
+
+void Logger::write(Level l, uint64_t t, const char* text)
 {
-    if (l < _l)
-        return;
-    std::unique_lock<std::mutex> lock(_mutex);
     if (_f) {
-        long long pid = getpid();
-        time_t t = time(nullptr);
-        struct tm* tm = localtime(&t);
-        char timeStr[128];
-        strftime(timeStr, sizeof(timeStr), "%F %T", tm);
-        fprintf(_f, "%s %s[%lld] %s: ", timeStr, _argv0, pid,
-                l == Error ? "error" : l == Warning ? "warning" : l == Info ? "info" : "debug");
-        va_list args;
-        va_start(args, fmt);
-        vfprintf(_f, fmt, args);
-        va_end(args);
-        fputc('\n', _f);
+        fprintf(_f, "%s %s[%lld] %s: %s\n", timeStr(t / 1000000000), _argv0, static_cast<long long>(getpid()),
+                l == Error ? "error" : l == Warning ? "warning" : l == Info ? "info" : "debug", text);
     } else {
         int priority = (l == Error ? LOG_ERR : l == Warning ? LOG_WARNING : l == Info ? LOG_INFO : LOG_DEBUG);
-        va_list args;
-        va_start(args, fmt);
-        vsyslog(priority, fmt, args);
-        va_end(args);
+        syslog(priority, "%s", text);
+    }
+}
+
+bool Logger::enterAsync()
+{
+    // stopFlusher() either sees us here and waits, or we see that it cleared _async
+    _asyncLoggers.fetch_add(1, std::memory_order_seq_cst);
+    if (_async.load(std::memory_order_seq_cst))
+        return true;
+    _asyncLoggers.fetch_sub(1, std::memory_order_release);
+    return false;
+}
+
+void Logger::log(Level l, const char* fmt, ...)
+{
+    if (l < _l)
+        return;
+    if (_async.load(std::memory_order_acquire) && enterAsync()) {
+        Ring* r = ring();
+        uint64_t head = r->head.load(std::memory_order_relaxed);
+        uint64_t pending = head - r->tail.load(std::memory_order_acquire);
+        if (pending >= RingSize) {
+            r->dropped.store(r->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        } else {
+            Message& m = r->messages[head % RingSize];
+            m.time = realtimeNs();
+            m.level = l;
+            va_list args;
+            va_start(args, fmt);
+            vsnprintf(m.text, sizeof(m.text), fmt, args);
+            va_end(args);
+            r->head.store(head + 1, std::memory_order_release);
+        }
+        if (l >= Warning || pending == RingSize / 2)
+            sem_post(&_flushRequests);
+        _asyncLoggers.fetch_sub(1, std::memory_order_release);
+        return;
+    }
+    char text[MessageSize];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(text, sizeof(text), fmt, args);
+    va_end(args);
+    std::lock_guard<std::mutex> lock(_mutex);
+    write(l, realtimeNs(), text);
+}
+
+void Logger::flush()
+{
+    std::vector<const Message*> batch;
+    std::vector<std::pair<Ring*, uint64_t>> heads;
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (Ring* r : _rings) {
+        uint64_t tail = r->tail.load(std::memory_order_relaxed);
+        uint64_t head = r->head.load(std::memory_order_acquire);
+        for (uint64_t i = tail; i < head; i++)
+            batch.push_back(&(r->messages[i % RingSize]));
+        heads.push_back(std::make_pair(r, head));
+    }
+    // the messages of different threads are merged in the order of their creation
+    std::stable_sort(batch.begin(), batch.end(), [](const Message* a, const Message* b) { return a->time < b->time; });
+    for (const Message* m : batch)
+        write(m->level, m->time, m->text);
+    uint64_t dropped = 0;
+    for (auto& h : heads) {
+        h.first->tail.store(h.second, std::memory_order_release);
+        uint64_t d = h.first->dropped.load(std::memory_order_relaxed);
+        dropped += d - h.first->reportedDrops;
+        h.first->reportedDrops = d;
+    }
+    if (dropped > 0)
+        write(Warning, realtimeNs(), (std::to_string(dropped) + " log messages dropped").c_str());
+}
+
+void Logger::flusherLoop()
+{
+    while (!_flusherStop) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += FlushIntervalNs;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        sem_timedwait(&_flushRequests, &ts);
+        // a burst of warnings needs only one flush
+        while (sem_trywait(&_flushRequests) == 0)
+            ;
+        flush();
+    }
+}
+
+void Logger::startFlusher()
+{
+    if (_flusher.joinable())
+        return;
+    _flusherStop = false;
+    try {
+        _flusher = std::thread(&Logger::flusherLoop, this);
+    }
+    catch (...) {
+        log(Error, "cannot start log thread; logging synchronously");
+        return;
+    }
+    _async.store(true, std::memory_order_release);
+}
+
+void Logger::stopFlusher()
+{
+    if (_flusher.joinable()) {
+        // messages that are still being added to the rings must be in the final flush
+        _async.store(false, std::memory_order_seq_cst);
+        while (_asyncLoggers.load(std::memory_order_acquire) > 0)
+            std::this_thread::yield();
+        _flusherStop = true;
+        sem_post(&_flushRequests);
+        _flusher.join();
+        flush();
     }
 }
 
@@ -19,10 +19,23 @@
 #pragma once
 
 #include <cstdio>
+#include <cstdint>
+#include <ctime>
 
+#include <atomic>
 #include <mutex>
+#include <thread>
+#include <vector>
 
+#include <semaphore.h>
 
+
+/* By default, log() writes each message immediately under a lock. While the
+ * flusher thread runs (see startFlusher()), log() instead formats the message
+ * into a ring buffer of the calling thread without taking a lock, and the
+ * flusher writes the messages of all threads in batches. Messages that do not
+ * fit into a full ring buffer are dropped and counted; the flusher reports the
+ * number of dropped messages. */
 class Logger
 {
 public:
@@ -34,10 +47,58 @@ public:
     } Level;
 
 private:
+    static constexpr size_t RingSize = 256;      // messages per thread
+    static constexpr size_t MessageSize = 496;   // bytes per message, including the terminating null
+
+    class Message
+    {
+    public:
+        uint64_t time; // ns since the epoch
+        Level level;
+        char text[MessageSize];
+    };
+    // A single-producer single-consumer queue: only its thread appends, only the flusher removes
+    class Ring
+    {
+    public:
+        Message messages[RingSize];
+        std::atomic<uint64_t> head;    // next message to write
+        std::atomic<uint64_t> tail;    // next message to flush
+        std::atomic<uint64_t> dropped; // total number of dropped messages
+        uint64_t reportedDrops;        // only used by the flusher
+        Ring();
+    };
+    class RingOwner
+    {
+    public:
+        Ring* ring;
+        RingOwner();
+        ~RingOwner();
+    };
+
     const char* _argv0;
     FILE* _f;
     Level _l;
-    std::mutex _mutex;
+    std::mutex _mutex; // protects writing to the output and the ring lists
+
+    std::vector<Ring*> _rings;
+    std::vector<Ring*> _freeRings;
+    std::atomic<bool> _async;
+    std::atomic<unsigned int> _asyncLoggers; // threads in the asynchronous part of log(), see stopFlusher()
+    std::thread _flusher;
+    std::atomic<bool> _flusherStop;
+    sem_t _flushRequests;
+
+    // the formatted time of the last message written to a file, reused within the same second
+    time_t _cachedTime;
+    char _cachedTimeStr[32];
+
+    static Ring* ring();
+    bool enterAsync(); // register a thread in the asynchronous part of log(), unless it was stopped
+    const char* timeStr(time_t t);
+    void write(Level l, uint64_t t, const char* text);
+    void flush(); // only called by the flusher thread, or after it stopped
+    void flusherLoop();
 
 public:
     Logger();
@@ -47,7 +108,16 @@ public:
     void setLevel(Level l);
     void setOutput(const char* fileNameOrNullptr);
 
+    // Check this before calling log() if computing its arguments is costly
+    bool enabled(Level l) const { return l >= _l; }
+
     void log(Level l, const char* fmt, ...) __attribute__ ((format (printf, 3, 4)));
+
+    /* Start or stop the asynchronous mode with its flusher thread. Start it only
+     * after the process has daemonized, since threads do not survive fork().
+     * Stopping writes all pending messages. */
+    void startFlusher();
+    void stopFlusher();
 };
 
 extern Logger logger;
@@ -24,6 +24,10 @@
 #include <cstdlib>
 #include <cassert>
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+
 #define FUSE_USE_VERSION FUSE_MAKE_VERSION(3, 14)
 #include <fuse.h>
 #include <fuse_opt.h>
@@ -32,8 +36,11 @@
 
 #include "index.hpp"
 #include "logger.hpp"
+#include "stats.hpp"
 #include "sixfs.hpp"
 #include "dump.hpp"
+#include "compact.hpp"
+#include "compress.hpp"
 
 
 /* Helper functions to convert between SixFS and system types */
@@ -141,7 +148,8 @@ void inodeToStat(uint64_t inodeIndex, const Inode& inode, struct stat* stbuf)
     stbuf->st_nlink = inode.nlink;
     stbuf->st_uid = inode.uid;
     stbuf->st_gid = inode.gid;
-    stbuf->st_rdev = inode.rdev;
+    // only device files use rdev for its original purpose
+    stbuf->st_rdev = (inode.type() == TypeBLK || inode.type() == TypeCHR ? inode.rdev : 0);
     stbuf->st_size = inode.size;
     stbuf->st_blocks = inode.size / 512;
     stbuf->st_atim.tv_sec = inode.atime.seconds;
@@ -153,18 +161,49 @@ void inodeToStat(uint64_t inodeIndex, const Inode& inode, struct stat* stbuf)
 }
 
 
+/* How the kernel may cache file data, set from the --kernel-cache option */
+
+typedef enum {
+    KernelCacheOff,      // every read() and write() goes to us (direct_io)
+    KernelCacheOn,       // reads are served from the page cache, writes go through to us
+    KernelCacheWriteback // additionally, the kernel collects writes and sends them to us later
+} KernelCacheMode;
+
+static KernelCacheMode kernelCacheMode = KernelCacheOff;
+
+
+/* SIGUSR1 logs the statistics, see Stats */
+
+static void sixfsStatsSignalHandler(int)
+{
+    stats.requestReport();
+}
+
+
 /* FUSE Operations */
 
 static void* sixfs_init(struct fuse_conn_info* conn, struct fuse_config* cfg)
 {
-    (void)conn;
-    cfg->direct_io = 1;         // enabled to get sane read() and write() behaviour; I don't understand how the
-                                // alternative should be implemented
+    if (kernelCacheMode == KernelCacheOff) {
+        cfg->direct_io = 1;
+    } else {
+        // All changes to the file data go through this mount, so the page cache
+        // cannot become stale and can be kept across open() calls.
+        cfg->direct_io = 0;
+        if (kernelCacheMode == KernelCacheWriteback) {
+            if (conn->capable & FUSE_CAP_WRITEBACK_CACHE)
+                conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+            else
+                logger.log(Logger::Warning, "kernel does not support writeback caching; using write-through");
+        }
+    }
     cfg->use_ino = 1;
     cfg->kernel_cache = 1;
     cfg->nullpath_ok = 1;
 
-    return fuse_get_context()->private_data;
+    SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
+    sixfs->startThreads(); // FUSE has daemonized by now
+    return sixfs;
 }
 
 static void sixfs_destroy(void* private_data)
@@ -175,6 +214,7 @@ static void sixfs_destroy(void* private_data)
 
 static int sixfs_getattr(const char* path, struct stat* stbuf, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpGetattr);
     logger.log(Logger::Debug, "sixfs_getattr(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     Handle* handle = (fi ? reinterpret_cast<Handle*>(fi->fh) : nullptr);
@@ -191,6 +231,7 @@ static int sixfs_getattr(const char* path, struct stat* stbuf, struct fuse_file_
 
 static int sixfs_opendir(const char* path, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpOpendir);
     logger.log(Logger::Debug, "sixfs_opendir(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
 
@@ -210,11 +251,13 @@ static int sixfs_readdir(const char* path,
         struct fuse_file_info* fi,
         enum fuse_readdir_flags flags)
 {
+    StatsTimer timer(Stats::OpReaddir);
     logger.log(Logger::Debug, "sixfs_readdir(\"%s\") offset=%lu", path, uint64_t(offset));
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     Handle* handle = reinterpret_cast<Handle*>(fi->fh);
 
     if (flags & FUSE_READDIR_PLUS) {
+        bool continued = false;
         for (uint64_t o = offset; ; o++) {
             const char* name;
             struct stat stbuf;
@@ -228,11 +271,14 @@ static int sixfs_readdir(const char* path,
             } else {
                 Dirent dirent;
                 Inode inode;
-                int r = sixfs->readDirentPlus(handle, o - 2, &dirent, &inode);
+                uint64_t direntSlot = o - 2;
+                int r = sixfs->readDirentPlus(handle, &direntSlot, &dirent, &inode, continued);
+                continued = true;
                 if (r == -EINVAL)
                     break;
                 else if (r < 0)
                     return r;
+                o = direntSlot + 2; // skip empty slots
                 name = dirent.name;
                 inodeToStat(dirent.inodeIndex, inode, &stbuf);
             }
@@ -249,11 +295,13 @@ static int sixfs_readdir(const char* path,
                 name = "..";
             } else {
                 Dirent dirent;
-                int r = sixfs->readDirent(handle, o - 2, &dirent);
+                uint64_t direntSlot = o - 2;
+                int r = sixfs->readDirent(handle, &direntSlot, &dirent);
                 if (r == -EINVAL)
                     break;
                 else if (r < 0)
                     return r;
+                o = direntSlot + 2; // skip empty slots
                 name = dirent.name;
             }
             if (filler(buf, name, nullptr, o + 1, static_cast<fuse_fill_dir_flags>(0)) == 1) {
@@ -267,6 +315,7 @@ static int sixfs_readdir(const char* path,
 
 static int sixfs_releasedir(const char* path, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpReleasedir);
     logger.log(Logger::Debug, "sixfs_releasedir(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     Handle* handle = reinterpret_cast<Handle*>(fi->fh);
@@ -275,6 +324,7 @@ static int sixfs_releasedir(const char* path, struct fuse_file_info* fi)
 
 static int sixfs_mkdir(const char* path, mode_t mode)
 {
+    StatsTimer timer(Stats::OpMkdir);
     logger.log(Logger::Debug, "sixfs_mkdir(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     return sixfs->mkdir(path, toTypeAndMode(mode));
@@ -282,6 +332,7 @@ static int sixfs_mkdir(const char* path, mode_t mode)
 
 static int sixfs_rmdir(const char* path)
 {
+    StatsTimer timer(Stats::OpRmdir);
     logger.log(Logger::Debug, "sixfs_rmdir(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     return sixfs->rmdir(path);
@@ -289,6 +340,7 @@ static int sixfs_rmdir(const char* path)
 
 static int sixfs_mknod(const char* path, mode_t mode, dev_t rdev)
 {
+    StatsTimer timer(Stats::OpMknod);
     logger.log(Logger::Debug, "sixfs_mknod(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     return sixfs->mknod(path, toTypeAndMode(mode), rdev);
@@ -296,6 +348,7 @@ static int sixfs_mknod(const char* path, mode_t mode, dev_t rdev)
 
 static int sixfs_unlink(const char* path)
 {
+    StatsTimer timer(Stats::OpUnlink);
     logger.log(Logger::Debug, "sixfs_unlink(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     return sixfs->unlink(path);
@@ -303,6 +356,7 @@ static int sixfs_unlink(const char* path)
 
 static int sixfs_symlink(const char* target, const char* linkpath)
 {
+    StatsTimer timer(Stats::OpSymlink);
     logger.log(Logger::Debug, "sixfs_symlink(\"%s\", \"%s\")", target, linkpath);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     return sixfs->symlink(target, linkpath);
@@ -310,6 +364,7 @@ static int sixfs_symlink(const char* target, const char* linkpath)
 
 static int sixfs_readlink(const char* path, char* buf, size_t bufsize)
 {
+    StatsTimer timer(Stats::OpReadlink);
     logger.log(Logger::Debug, "sixfs_readlink(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     return sixfs->readlink(path, buf, bufsize);
@@ -317,6 +372,7 @@ static int sixfs_readlink(const char* path, char* buf, size_t bufsize)
 
 static int sixfs_link(const char* oldpath, const char* newpath)
 {
+    StatsTimer timer(Stats::OpLink);
     logger.log(Logger::Debug, "sixfs_link(\"%s\", \"%s\")", oldpath, newpath);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     return sixfs->link(oldpath, newpath);
@@ -324,6 +380,7 @@ static int sixfs_link(const char* oldpath, const char* newpath)
 
 static int sixfs_rename(const char* oldpath, const char* newpath, unsigned int flags)
 {
+    StatsTimer timer(Stats::OpRename);
     logger.log(Logger::Debug, "sixfs_rename(\"%s\", \"%s\")", oldpath, newpath);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     return sixfs->rename(oldpath, newpath,
@@ -334,6 +391,7 @@ static int sixfs_rename(const char* oldpath, const char* newpath, unsigned int f
 
 static int sixfs_chmod(const char* path, mode_t mode, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpChmod);
     logger.log(Logger::Debug, "sixfs_chmod(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     Handle* handle = (fi ? reinterpret_cast<Handle*>(fi->fh) : nullptr);
@@ -342,6 +400,7 @@ static int sixfs_chmod(const char* path, mode_t mode, struct fuse_file_info* fi)
 
 static int sixfs_chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpChown);
     logger.log(Logger::Debug, "sixfs_chown(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     Handle* handle = (fi ? reinterpret_cast<Handle*>(fi->fh) : nullptr);
@@ -350,6 +409,7 @@ static int sixfs_chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_
 
 static int sixfs_utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpUtimens);
     logger.log(Logger::Debug, "sixfs_utimens(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     Handle* handle = (fi ? reinterpret_cast<Handle*>(fi->fh) : nullptr);
@@ -374,6 +434,7 @@ static int sixfs_utimens(const char* path, const struct timespec tv[2], struct f
 
 static int sixfs_truncate(const char* path, off_t length, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpTruncate);
     logger.log(Logger::Debug, "sixfs_truncate(\"%s\", %ld)", path, length);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     Handle* handle = (fi ? reinterpret_cast<Handle*>(fi->fh) : nullptr);
@@ -382,12 +443,16 @@ static int sixfs_truncate(const char* path, off_t length, struct fuse_file_info*
 
 static int sixfs_open(const char* path, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpOpen);
     logger.log(Logger::Debug, "sixfs_open(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
 
+    // With writeback caching, the kernel handles O_APPEND itself and may send
+    // reads for write-only files to fill partial pages, which we allow anyway.
+    bool append = (fi->flags & O_APPEND) && kernelCacheMode != KernelCacheWriteback;
     Handle* handle;
     int r = sixfs->open(path, !((fi->flags & O_RDWR) || (fi->flags & O_WRONLY)),
-            (fi->flags & O_TRUNC), (fi->flags & O_APPEND), &handle);
+            (fi->flags & O_TRUNC), append, &handle);
     if (r < 0)
         return r;
 
@@ -395,8 +460,12 @@ static int sixfs_open(const char* path, struct fuse_file_info* fi)
     return 0;
 }
 
+// There is no read_buf: FUSE would transfer the data of fd buffers after we
+// returned and the handle was unlocked, and a concurrent truncate or removal
+// could free the blocks in the meantime and let another file reuse them.
 static int sixfs_read(const char* path, char* buf, size_t count, off_t offset, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpRead);
     logger.log(Logger::Debug, "sixfs_read(\"%s\", offset=%ld, count=%zu)", path, offset, count);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     Handle* handle = reinterpret_cast<Handle*>(fi->fh);
@@ -405,21 +474,130 @@ static int sixfs_read(const char* path, char* buf, size_t count, off_t offset, s
 
 static int sixfs_write(const char* path, const char* buf, size_t count, off_t offset, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpWrite);
     logger.log(Logger::Debug, "sixfs_write(\"%s\", offset=%ld, count=%zu)", path, offset, count);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     Handle* handle = reinterpret_cast<Handle*>(fi->fh);
     return sixfs->write(handle, offset, reinterpret_cast<const unsigned char*>(buf), count);
 }
 
+// Provides the data of a FUSE write_buf request to Handle::writeFrom()
+class FuseBufDataSource : public DataSource
+{
+private:
+    struct fuse_bufvec* _src;
+
+    int copyTo(struct fuse_bufvec* dst, size_t len)
+    {
+        ssize_t r = fuse_buf_copy(dst, _src, static_cast<enum fuse_buf_copy_flags>(0));
+        if (r < 0)
+            return r;
+        else if (size_t(r) != len)
+            return -EIO;
+        return 0;
+    }
+
+public:
+    FuseBufDataSource(struct fuse_bufvec* src) : _src(src)
+    {
+    }
+
+    virtual int copyToMemory(unsigned char* dst, size_t len) override
+    {
+        struct fuse_bufvec dstv = FUSE_BUFVEC_INIT(len);
+        dstv.buf[0].mem = dst;
+        return copyTo(&dstv, len);
+    }
+
+    virtual int copyToFile(int fd, uint64_t pos, size_t len) override
+    {
+        struct fuse_bufvec dstv = FUSE_BUFVEC_INIT(len);
+        dstv.buf[0].flags = static_cast<enum fuse_buf_flags>(FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK);
+        dstv.buf[0].fd = fd;
+        dstv.buf[0].pos = pos;
+        return copyTo(&dstv, len);
+    }
+};
+
+static int sixfs_write_buf(const char* path, struct fuse_bufvec* buf, off_t offset, struct fuse_file_info* fi)
+{
+    StatsTimer timer(Stats::OpWrite);
+    SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
+    Handle* handle = reinterpret_cast<Handle*>(fi->fh);
+    size_t count = fuse_buf_size(buf);
+    logger.log(Logger::Debug, "sixfs_write_buf(\"%s\", offset=%ld, count=%zu)", path, offset, count);
+    if (buf->count == 1 && buf->idx == 0 && buf->off == 0 && !(buf->buf[0].flags & FUSE_BUF_IS_FD)) {
+        // the data is in memory already
+        return sixfs->write(handle, offset, static_cast<const unsigned char*>(buf->buf[0].mem), count);
+    } else {
+        // the data might be in a pipe; let writeFrom() splice it directly where possible
+        FuseBufDataSource source(buf);
+        return sixfs->writeFrom(handle, offset, count, &source);
+    }
+}
+
 static int sixfs_release(const char* path, struct fuse_file_info* fi)
 {
+    StatsTimer timer(Stats::OpRelease);
     logger.log(Logger::Debug, "sixfs_release(\"%s\")", path);
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
     return sixfs->close(reinterpret_cast<Handle*>(fi->fh));
 }
 
+static int sixfs_fsync(const char* path, int /* datasync */, struct fuse_file_info* fi)
+{
+    StatsTimer timer(Stats::OpFsync);
+    logger.log(Logger::Debug, "sixfs_fsync(\"%s\")", path);
+    SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
+    return sixfs->fsync(reinterpret_cast<Handle*>(fi->fh));
+}
+
+static ssize_t sixfs_copy_file_range(const char* pathIn, struct fuse_file_info* fiIn, off_t offsetIn,
+        const char* pathOut, struct fuse_file_info* fiOut, off_t offsetOut, size_t count, int /* flags */)
+{
+    StatsTimer timer(Stats::OpCopyFileRange);
+    logger.log(Logger::Debug, "sixfs_copy_file_range(\"%s\", offset=%ld, \"%s\", offset=%ld, count=%zu)",
+            pathIn, offsetIn, pathOut, offsetOut, count);
+    SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
+    Handle* inHandle = reinterpret_cast<Handle*>(fiIn->fh);
+    Handle* outHandle = reinterpret_cast<Handle*>(fiOut->fh);
+    return sixfs->copyFileRange(inHandle, offsetIn, outHandle, offsetOut, count);
+}
+
+static int sixfs_fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi)
+{
+    StatsTimer timer(Stats::OpFallocate);
+    logger.log(Logger::Debug, "sixfs_fallocate(\"%s\", mode=%d, offset=%ld, length=%ld)", path, mode, offset, length);
+    SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
+    if (!fi)
+        return -EOPNOTSUPP;
+    if (offset < 0 || length <= 0)
+        return -EINVAL;
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE))
+        return -EOPNOTSUPP; // collapsing or inserting ranges is not supported
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && (!(mode & FALLOC_FL_KEEP_SIZE) || (mode & FALLOC_FL_ZERO_RANGE)))
+        return -EOPNOTSUPP;
+    bool zero = (mode & (FALLOC_FL_PUNCH_HOLE | FALLOC_FL_ZERO_RANGE));
+    bool keepSize = (mode & FALLOC_FL_KEEP_SIZE);
+    return sixfs->fallocate(reinterpret_cast<Handle*>(fi->fh), offset, length, zero, keepSize);
+}
+
+static off_t sixfs_lseek(const char* path, off_t offset, int whence, struct fuse_file_info* fi)
+{
+    StatsTimer timer(Stats::OpLseek);
+    logger.log(Logger::Debug, "sixfs_lseek(\"%s\", offset=%ld, whence=%d)", path, offset, whence);
+    SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
+    // the kernel handles all other values of whence itself
+    if (!fi || offset < 0 || (whence != SEEK_DATA && whence != SEEK_HOLE))
+        return -EINVAL;
+    uint64_t result;
+    int r = sixfs->seek(reinterpret_cast<Handle*>(fi->fh), offset, whence == SEEK_DATA, &result);
+    return (r < 0 ? r : off_t(result));
+}
+
 static int sixfs_statfs(const char* /* ignored */, struct statvfs* statfs)
 {
+    StatsTimer timer(Stats::OpStatfs);
     logger.log(Logger::Debug, "sixfs_statfs()");
     SixFS* sixfs = static_cast<SixFS*>(fuse_get_context()->private_data);
 
@@ -448,13 +626,31 @@ static void sixfsPrintHelp(const char *progname)
 {
     printf("usage: %s [options] <mountpoint>\n\n", progname);
     printf("File-system specific options:\n"
-            "    --type=<mmap|file|mem> storage type: mmap'ed files (default), normal files, or memory\n"
+            "    --type=<mmap|file|uring|mem> storage type: mmap'ed files (default), normal files,\n"
+            "                           normal files accessed via io_uring, or memory\n"
             "    --dir=<dir>            the directory containing the 6fs files to mount\n"
+            "    --data-dirs=<d1:d2:..> additional directories to stripe the block data over\n"
             "    --max-size=<size>      max size in bytes; suffixes K, M, G, T are supported\n"
             "    --key=<keyfile>        activate encryption and read key from keyfile\n"
+            "    --cipher=<cipher>      cipher for encryption (xsalsa20poly1305 (default), aes256gcm, auto)\n"
+            "    --crypto-threads=<n>   worker threads for encrypting large transfers (default 4; 0 disables them)\n"
             "    --log=<logfile>        log messages to logfile or to syslog (default) if file name is empty\n"
             "    --log-level=<level>    set minimum level for log messages (debug, info, warning, error)\n"
             "    --punch-holes=0|1      punch holes for unused blocks into the block data file to save disk space\n"
+            "    --direct-io=0|1        bypass the page cache for the block data file (types file and uring, no encryption)\n"
+            "    --durability=<mode>    when to flush data to disk (none, fsync (default), periodic)\n"
+            "    --sync-interval=<s>    seconds between flushes in periodic durability mode (default 5)\n"
+            "    --kernel-cache=<mode>  let the kernel cache file data (off (default), on, writeback)\n"
+            "    --index-cache=<size>   size of the cache for indirection blocks (default 4M; 0 disables it)\n"
+            "    --data-cache=<size>    size of the write-back cache for data blocks (default 0 = disabled)\n"
+            "    --dentry-cache=<n>     max number of cached path lookups (default 65536; 0 disables it)\n"
+            "    --dir-format=<format>  format of new directories (sorted (default), hashed)\n"
+            "    --name-index=<size>    memory for name indices of open directories (default 16M; 0 disables them)\n"
+            "    --compress=<level>     compress new data blocks with this zstd level (default 0 = disabled)\n"
+            "    --block-size=<size>    block size of a new file system (4K (default) to 1M, a power of two)\n"
+            "    --reclaim-rate=<size>  bytes per second for reclaiming removed files in the background (default 0 = unlimited)\n"
+            "    --compact              move used chunks to the front of the 6fs files and truncate them,\n"
+            "                           then exit; the file system must not be mounted\n"
             "  Only for debugging:\n"
             "    --dump-inode=<i>       dump inode\n"
             "    --dump-tree=<i>        dump slot tree of inode\n"
@@ -518,11 +714,27 @@ typedef struct
     int showHelp;
     const char* typeName;
     const char* dirName;
+    const char* dataDirs;
     const char* maxSize;
     const char* keyName;
+    const char* cipherName;
+    const char* cryptoThreads;
     const char* logName;
     const char* logLevel;
     const char* punchHoles;
+    const char* directIO;
+    const char* durability;
+    const char* syncInterval;
+    const char* kernelCache;
+    const char* indexCache;
+    const char* dataCache;
+    const char* dentryCache;
+    const char* dirFormat;
+    const char* nameIndex;
+    const char* compress;
+    const char* blockSize;
+    const char* reclaimRate;
+    int compact;
     const char* dumpInode;
     const char* dumpTree;
     const char* dumpDirent;
@@ -539,11 +751,27 @@ int main(int argc, char *argv[])
         .showHelp = 0,
         .typeName = nullptr,
         .dirName = nullptr,
+        .dataDirs = nullptr,
         .maxSize = nullptr,
         .keyName = nullptr,
+        .cipherName = nullptr,
+        .cryptoThreads = nullptr,
         .logName = nullptr,
         .logLevel = nullptr,
         .punchHoles = nullptr,
+        .directIO = nullptr,
+        .durability = nullptr,
+        .syncInterval = nullptr,
+        .kernelCache = nullptr,
+        .indexCache = nullptr,
+        .dataCache = nullptr,
+        .dentryCache = nullptr,
+        .dirFormat = nullptr,
+        .nameIndex = nullptr,
+        .compress = nullptr,
+        .blockSize = nullptr,
+        .reclaimRate = nullptr,
+        .compact = 0,
         .dumpInode = nullptr,
         .dumpTree = nullptr,
         .dumpDirent = nullptr,
@@ -553,11 +781,27 @@ int main(int argc, char *argv[])
     struct fuse_opt sixfsOptions[] = {
         { "--type=%s",            offsetof(SixfsOptionsStruct, typeName),   1 },
         { "--dir=%s",             offsetof(SixfsOptionsStruct, dirName),    1 },
+        { "--data-dirs=%s",       offsetof(SixfsOptionsStruct, dataDirs),   1 },
         { "--max-size=%s",        offsetof(SixfsOptionsStruct, maxSize),    1 },
         { "--key=%s",             offsetof(SixfsOptionsStruct, keyName),    1 },
+        { "--cipher=%s",          offsetof(SixfsOptionsStruct, cipherName), 1 },
+        { "--crypto-threads=%s",  offsetof(SixfsOptionsStruct, cryptoThreads), 1 },
         { "--log=%s",             offsetof(SixfsOptionsStruct, logName),    1 },
         { "--log-level=%s",       offsetof(SixfsOptionsStruct, logLevel),   1 },
         { "--punch-holes=%s",     offsetof(SixfsOptionsStruct, punchHoles), 1 },
+        { "--direct-io=%s",       offsetof(SixfsOptionsStruct, directIO),   1 },
+        { "--durability=%s",      offsetof(SixfsOptionsStruct, durability), 1 },
+        { "--sync-interval=%s",   offsetof(SixfsOptionsStruct, syncInterval), 1 },
+        { "--kernel-cache=%s",    offsetof(SixfsOptionsStruct, kernelCache), 1 },
+        { "--index-cache=%s",     offsetof(SixfsOptionsStruct, indexCache), 1 },
+        { "--data-cache=%s",      offsetof(SixfsOptionsStruct, dataCache),  1 },
+        { "--dentry-cache=%s",    offsetof(SixfsOptionsStruct, dentryCache), 1 },
+        { "--dir-format=%s",      offsetof(SixfsOptionsStruct, dirFormat),  1 },
+        { "--name-index=%s",      offsetof(SixfsOptionsStruct, nameIndex),  1 },
+        { "--compress=%s",        offsetof(SixfsOptionsStruct, compress),   1 },
+        { "--block-size=%s",      offsetof(SixfsOptionsStruct, blockSize),  1 },
+        { "--reclaim-rate=%s",    offsetof(SixfsOptionsStruct, reclaimRate), 1 },
+        { "--compact",            offsetof(SixfsOptionsStruct, compact),    1 },
         { "--dump-inode=%s",      offsetof(SixfsOptionsStruct, dumpInode),  1 },
         { "--dump-tree=%s",       offsetof(SixfsOptionsStruct, dumpTree),   1 },
         { "--dump-dirent=%s",     offsetof(SixfsOptionsStruct, dumpDirent), 1 },
@@ -627,6 +871,29 @@ int main(int argc, char *argv[])
         }
         fclose(f);
     }
+    bool cipherAuto = false;
+    Cipher cipher = CipherXSalsa20Poly1305;
+    if (sixfsOptionsStruct.cipherName) {
+        if (strcmp(sixfsOptionsStruct.cipherName, "auto") == 0) {
+            cipherAuto = true;
+        } else if (strcmp(sixfsOptionsStruct.cipherName, "aes256gcm") == 0) {
+            cipher = CipherAES256GCM;
+        } else if (strcmp(sixfsOptionsStruct.cipherName, "xsalsa20poly1305") == 0) {
+            // nothing to do
+        } else {
+            fprintf(stderr, "Invalid cipher\n");
+            return 1;
+        }
+    }
+    uint64_t cryptoThreads = 4;
+    if (sixfsOptionsStruct.cryptoThreads) {
+        const char* endptr;
+        if (getUint64(sixfsOptionsStruct.cryptoThreads, &cryptoThreads, &endptr) != 0 || *endptr != '\0'
+                || cryptoThreads > 1024) {
+            fprintf(stderr, "Invalid number of crypto threads\n");
+            return 1;
+        }
+    }
     bool punchHoles = false;
     if (sixfsOptionsStruct.punchHoles) {
         if (strcmp(sixfsOptionsStruct.punchHoles, "0") != 0 && strcmp(sixfsOptionsStruct.punchHoles, "1") != 0) {
@@ -635,6 +902,120 @@ int main(int argc, char *argv[])
         }
         punchHoles = (strcmp(sixfsOptionsStruct.punchHoles, "1") == 0);
     }
+    bool directIO = false;
+    if (sixfsOptionsStruct.directIO) {
+        if (strcmp(sixfsOptionsStruct.directIO, "0") != 0 && strcmp(sixfsOptionsStruct.directIO, "1") != 0) {
+            fprintf(stderr, "Invalid argument to option --direct-io\n");
+            return 1;
+        }
+        directIO = (strcmp(sixfsOptionsStruct.directIO, "1") == 0);
+    }
+    Base::Durability durability = Base::DurabilityFsync;
+    if (sixfsOptionsStruct.durability) {
+        if (strcmp(sixfsOptionsStruct.durability, "none") == 0) {
+            durability = Base::DurabilityNone;
+        } else if (strcmp(sixfsOptionsStruct.durability, "fsync") == 0) {
+            // nothing to do
+        } else if (strcmp(sixfsOptionsStruct.durability, "periodic") == 0) {
+            durability = Base::DurabilityPeriodic;
+        } else {
+            fprintf(stderr, "Invalid durability mode\n");
+            return 1;
+        }
+    }
+    uint64_t syncInterval = 5;
+    if (sixfsOptionsStruct.syncInterval) {
+        const char* endptr;
+        if (getUint64(sixfsOptionsStruct.syncInterval, &syncInterval, &endptr) != 0 || *endptr != '\0'
+                || syncInterval == 0 || syncInterval > 86400) {
+            fprintf(stderr, "Invalid sync interval\n");
+            return 1;
+        }
+    }
+    if (sixfsOptionsStruct.kernelCache) {
+        if (strcmp(sixfsOptionsStruct.kernelCache, "off") == 0) {
+            kernelCacheMode = KernelCacheOff;
+        } else if (strcmp(sixfsOptionsStruct.kernelCache, "on") == 0) {
+            kernelCacheMode = KernelCacheOn;
+        } else if (strcmp(sixfsOptionsStruct.kernelCache, "writeback") == 0) {
+            kernelCacheMode = KernelCacheWriteback;
+        } else {
+            fprintf(stderr, "Invalid kernel cache mode\n");
+            return 1;
+        }
+    }
+    uint64_t indexCacheSize = 4 * 1024 * 1024;
+    if (sixfsOptionsStruct.indexCache) {
+        if (getMaxSize(sixfsOptionsStruct.indexCache, &indexCacheSize) != 0) {
+            fprintf(stderr, "Invalid index cache size\n");
+            return 1;
+        }
+    }
+    uint64_t dataCacheSize = 0;
+    if (sixfsOptionsStruct.dataCache) {
+        if (getMaxSize(sixfsOptionsStruct.dataCache, &dataCacheSize) != 0) {
+            fprintf(stderr, "Invalid data cache size\n");
+            return 1;
+        }
+    }
+    uint64_t dentryCacheSize = 65536;
+    if (sixfsOptionsStruct.dentryCache) {
+        const char* endptr;
+        if (getUint64(sixfsOptionsStruct.dentryCache, &dentryCacheSize, &endptr) != 0 || *endptr != '\0') {
+            fprintf(stderr, "Invalid dentry cache size\n");
+            return 1;
+        }
+    }
+    uint64_t dirFormat = DirFormatSorted;
+    if (sixfsOptionsStruct.dirFormat) {
+        if (strcmp(sixfsOptionsStruct.dirFormat, "sorted") == 0) {
+            // nothing to do
+        } else if (strcmp(sixfsOptionsStruct.dirFormat, "hashed") == 0) {
+            dirFormat = DirFormatHashed;
+        } else {
+            fprintf(stderr, "Invalid directory format\n");
+            return 1;
+        }
+    }
+    uint64_t nameIndexSize = 16 * 1024 * 1024;
+    if (sixfsOptionsStruct.nameIndex) {
+        if (getMaxSize(sixfsOptionsStruct.nameIndex, &nameIndexSize) != 0) {
+            fprintf(stderr, "Invalid name index size\n");
+            return 1;
+        }
+    }
+    int compressionLevel = 0;
+    if (sixfsOptionsStruct.compress) {
+        const char* endptr;
+        uint64_t level;
+        if (getUint64(sixfsOptionsStruct.compress, &level, &endptr) != 0 || *endptr != '\0') {
+            fprintf(stderr, "Invalid compression level\n");
+            return 1;
+        }
+        if (level > 0 && !compressionAvailable()) {
+            fprintf(stderr, "Compression is not supported: 6fs was built without libzstd\n");
+            return 1;
+        }
+        if (level > uint64_t(compressionLevelMax())) {
+            fprintf(stderr, "Invalid compression level\n");
+            return 1;
+        }
+        compressionLevel = level;
+    }
+    uint64_t blockSize = 0;
+    if (sixfsOptionsStruct.blockSize) {
+        if (getMaxSize(sixfsOptionsStruct.blockSize, &blockSize) != 0 || !Block::isValidSize(blockSize)) {
+            fprintf(stderr, "Invalid block size\n");
+            return 1;
+        }
+    }
+    uint64_t reclaimRate = 0;
+    if (sixfsOptionsStruct.reclaimRate) {
+        if (getMaxSize(sixfsOptionsStruct.reclaimRate, &reclaimRate) != 0) {
+            fprintf(stderr, "Invalid reclaim rate\n");
+            return 1;
+        }
+    }
     Storage::Type type = Storage::TypeMmap;
     if (sixfsOptionsStruct.typeName) {
         std::string typeName = std::string(sixfsOptionsStruct.typeName);
@@ -642,6 +1023,8 @@ int main(int argc, char *argv[])
             // nothing to do
         } else if (typeName == "file") {
             type = Storage::TypeFile;
+        } else if (typeName == "uring") {
+            type = Storage::TypeUring;
         } else if (typeName == "mem") {
             type = Storage::TypeMem;
         } else {
@@ -656,6 +1039,23 @@ int main(int argc, char *argv[])
         fprintf(stderr, "Option --dir is missing\n");
         return 1;
     }
+    std::vector<std::string> dataDirNames;
+    if (sixfsOptionsStruct.dataDirs) {
+        std::string dataDirs = std::string(sixfsOptionsStruct.dataDirs);
+        for (size_t i = 0; i <= dataDirs.size(); ) {
+            size_t j = std::min(dataDirs.find(':', i), dataDirs.size());
+            if (j == i) {
+                fprintf(stderr, "Invalid argument to option --data-dirs\n");
+                return 1;
+            }
+            dataDirNames.push_back(dataDirs.substr(i, j - i));
+            i = j + 1;
+        }
+        if (dataDirNames.size() >= 256) {
+            fprintf(stderr, "Too many data directories\n");
+            return 1;
+        }
+    }
 
     /* Handle the debugging options */
     if (!sixfsOptionsStruct.showHelp
@@ -664,7 +1064,7 @@ int main(int argc, char *argv[])
                 || sixfsOptionsStruct.dumpDirent
                 || sixfsOptionsStruct.dumpSBlock
                 || sixfsOptionsStruct.dumpDBlock)) {
-        return dump(dirName, key,
+        return dump(dirName, dataDirNames, key,
                 sixfsOptionsStruct.dumpInode,
                 sixfsOptionsStruct.dumpTree,
                 sixfsOptionsStruct.dumpDirent,
@@ -679,8 +1079,49 @@ int main(int argc, char *argv[])
             fprintf(stderr, "Cannot initialize libsodium\n");
             return 1;
         }
+        if (cipherAuto && cipherAvailable(CipherAES256GCM)) {
+            cipher = CipherAES256GCM;
+        } else if (!cipherAvailable(cipher)) {
+            fprintf(stderr, "Cipher aes256gcm is not supported by this CPU\n");
+            return 1;
+        }
+    }
+
+    /* Handle compaction */
+    if (!sixfsOptionsStruct.showHelp && sixfsOptionsStruct.compact) {
+        return compact(dirName, dataDirNames, key, cipher, punchHoles);
+    }
+
+    if (directIO && type != Storage::TypeFile && type != Storage::TypeUring) {
+        fprintf(stderr, "Option --direct-io requires storage type file or uring\n");
+        return 1;
+    }
+    if (directIO && key.size() > 0) {
+        // encrypted blocks are not multiples of the device block size
+        fprintf(stderr, "Option --direct-io cannot be combined with encryption\n");
+        return 1;
     }
-    SixFS sixfs(type, dirName, maxSize, key, punchHoles);
+    SixFS::Options options;
+    options.type = type;
+    options.dirName = dirName;
+    options.dataDirNames = dataDirNames;
+    options.maxSize = maxSize;
+    options.key = key;
+    options.cipher = cipher;
+    options.punchHoles = punchHoles;
+    options.directIO = directIO;
+    options.indirectionBlockCacheSize = indexCacheSize;
+    options.dataBlockCacheSize = dataCacheSize;
+    options.cryptoThreads = cryptoThreads;
+    options.durability = durability;
+    options.syncInterval = syncInterval;
+    options.nameIndexMemoryLimit = nameIndexSize;
+    options.compressionLevel = compressionLevel;
+    options.blockSize = blockSize;
+    options.reclaimRate = reclaimRate;
+    options.dentryCacheSize = dentryCacheSize;
+    options.dirFormat = dirFormat;
+    SixFS sixfs(options);
     if (!sixfsOptionsStruct.showHelp) {
         std::string errStr;
         int r = sixfs.mount(errStr);
@@ -711,7 +1152,7 @@ int main(int argc, char *argv[])
         .statfs          = sixfs_statfs,
         .flush           = nullptr,              // not needed for us
         .release         = sixfs_release,
-        .fsync           = nullptr,              // not needed for us
+        .fsync           = sixfs_fsync,
         .setxattr        = nullptr,              // xattr support not needed
         .getxattr        = nullptr,              // xattr support not needed
         .listxattr       = nullptr,              // xattr support not needed
@@ -719,7 +1160,7 @@ int main(int argc, char *argv[])
         .opendir         = sixfs_opendir,
         .readdir         = sixfs_readdir,
         .releasedir      = sixfs_releasedir,
-        .fsyncdir        = nullptr,              // not needed for us
+        .fsyncdir        = sixfs_fsync,
         .init            = sixfs_init,
         .destroy         = sixfs_destroy,
         .access          = nullptr,              // not needed because of default_permissions
@@ -729,13 +1170,19 @@ int main(int argc, char *argv[])
         .bmap            = nullptr,              // makes no sense for us
         .ioctl           = nullptr,              // makes no sense for us
         .poll            = nullptr,              // makes no sense for us
-        .write_buf       = nullptr,              // apparently useful for avoiding data copies, but not needed
-        .read_buf        = nullptr,              // apparently useful for avoiding data copies, but not needed
+        .write_buf       = sixfs_write_buf,
+        .read_buf        = nullptr,              // see sixfs_read()
         .flock           = nullptr,              // not needed: kernel handles bsd locks
-        .fallocate       = nullptr,              // TODO: support holes in files
-        .copy_file_range = nullptr,              // TODO: optimized data copy
-        .lseek           = nullptr               // TODO: support holes in files
+        .fallocate       = sixfs_fallocate,
+        .copy_file_range = sixfs_copy_file_range,
+        .lseek           = sixfs_lseek
     };
+    struct sigaction statsAction;
+    memset(&statsAction, 0, sizeof(statsAction));
+    statsAction.sa_handler = sixfsStatsSignalHandler;
+    sigemptyset(&statsAction.sa_mask);
+    statsAction.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &statsAction, nullptr);
     int ret = fuse_main(args.argc, args.argv, &sixfsOperations, &sixfs);
     fuse_opt_free_args(&args);
     return ret;
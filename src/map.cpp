@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -19,8 +19,9 @@
 #include <cerrno>
 #include <cstring>
 
+#include <algorithm>
+
 #include "logger.hpp"
-#include "emergency.hpp"
 #include "index.hpp"
 #include "map.hpp"
 
@@ -28,10 +29,8 @@
 Map::Map(Storage* storage) :
     _storage(storage),
     _bitChunksInStorage(0),
-    _currentBitChunk(0),
-    _currentBitChunkIndex(InvalidIndex),
-    _currentBitChunkModified(false),
-    _firstZeroCandidate(0)
+    _firstZeroCandidate(0),
+    _summaryCapacity(0)
 {
     static_assert(sizeof(uint64_t) == sizeof(unsigned long long));
     _storage->setChunkSize(sizeof(uint64_t));
@@ -53,96 +52,293 @@ int Map::initialize()
     if (r < 0)
         return r;
     if (_bitChunksInStorage == 0) {
-        _currentBitChunk = 0;
+        // leave at least one chunk in storage even if it is empty
         _bitChunksInStorage = 1;
         r = _storage->setSize(_bitChunksInStorage);
-    } else {
-        r = _storage->read(0, 1, &_currentBitChunk);
     }
-    if (r < 0)
+    if (r == 0)
+        r = ensureBitChunks(_bitChunksInStorage);
+    if (r == 0)
+        r = _storage->read(0, _bitChunksInStorage, _bitChunks.data());
+    if (r == 0)
+        r = buildSummaries(_summaryCapacity);
+    if (r < 0) {
+        logger.log(Logger::Error, "Map::initialize() failed: %s", strerror(-r));
         return r;
-    _currentBitChunkIndex = 0;
+    }
     return 0;
 }
 
-int Map::setCurrentBitChunkIndex(uint64_t bitChunkIndex)
+int Map::ensureBitChunks(uint64_t bitChunkCount)
 {
-    if (bitChunkIndex == _currentBitChunkIndex)
+    if (bitChunkCount <= _bitChunks.size())
         return 0;
+    try {
+        _bitChunks.resize(bitChunkCount, 0);
+        _dirtyPages.resize((bitChunkCount + BitChunksPerPage - 1) / BitChunksPerPage, false);
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    // new bit chunks are zero, which the summaries already assume
+    if (bitChunkCount > _summaryCapacity) {
+        uint64_t capacity = std::max(_summaryCapacity, uint64_t(64));
+        while (capacity < bitChunkCount)
+            capacity *= 2;
+        return buildSummaries(capacity);
+    }
+    return 0;
+}
 
-    int r = sync();
-    if (r < 0)
-        return r;
-    if (bitChunkIndex >= _bitChunksInStorage) {
-        _currentBitChunk = 0;
-        _bitChunksInStorage = bitChunkIndex + 1;
-        r = _storage->setSize(_bitChunksInStorage);
-    } else {
-        r = _storage->read(bitChunkIndex, 1, &_currentBitChunk);
+int Map::buildSummaries(uint64_t capacity)
+{
+    std::vector<std::vector<uint64_t>> fullSummary;
+    std::vector<std::vector<uint64_t>> usedSummary;
+    try {
+        uint64_t n = capacity; // number of bits in the current level
+        do {
+            uint64_t words = (n + 63) / 64;
+            fullSummary.emplace_back(words, 0);
+            usedSummary.emplace_back(words, 0);
+            // bits beyond the end are considered full and unused so that searches skip them
+            if (n % 64 != 0)
+                fullSummary.back()[words - 1] = ~0ULL << (n % 64);
+            n = words;
+        } while (n > 1);
     }
-    if (r < 0) {
-        logger.log(Logger::Error, "Map::setCurrentBitChunkIndex(%lu) failed", bitChunkIndex);
-        return r;
+    catch (...) {
+        return -ENOMEM;
     }
-    _currentBitChunkIndex = bitChunkIndex;
+
+    for (uint64_t i = 0; i < _bitChunks.size(); i++) {
+        if (_bitChunks[i] == ~0ULL)
+            fullSummary[0][i / 64] |= 1ULL << (i % 64);
+        if (_bitChunks[i] != 0)
+            usedSummary[0][i / 64] |= 1ULL << (i % 64);
+    }
+    for (size_t l = 1; l < fullSummary.size(); l++) {
+        for (uint64_t i = 0; i < fullSummary[l - 1].size(); i++) {
+            if (fullSummary[l - 1][i] == ~0ULL)
+                fullSummary[l][i / 64] |= 1ULL << (i % 64);
+            if (usedSummary[l - 1][i] != 0)
+                usedSummary[l][i / 64] |= 1ULL << (i % 64);
+        }
+    }
+
+    _fullSummary.swap(fullSummary);
+    _usedSummary.swap(usedSummary);
+    _summaryCapacity = capacity;
     return 0;
 }
 
-int Map::firstZero(uint64_t* index)
+void Map::updateSummaries(uint64_t bitChunkIndex)
+{
+    bool full = (_bitChunks[bitChunkIndex] == ~0ULL);
+    uint64_t i = bitChunkIndex;
+    for (size_t l = 0; l < _fullSummary.size(); l++) {
+        uint64_t& word = _fullSummary[l][i / 64];
+        uint64_t newWord = (full ? word | (1ULL << (i % 64)) : word & ~(1ULL << (i % 64)));
+        if (newWord == word)
+            break;
+        word = newWord;
+        full = (word == ~0ULL);
+        i /= 64;
+    }
+
+    bool used = (_bitChunks[bitChunkIndex] != 0);
+    i = bitChunkIndex;
+    for (size_t l = 0; l < _usedSummary.size(); l++) {
+        uint64_t& word = _usedSummary[l][i / 64];
+        uint64_t newWord = (used ? word | (1ULL << (i % 64)) : word & ~(1ULL << (i % 64)));
+        if (newWord == word)
+            break;
+        word = newWord;
+        used = (word != 0);
+        i /= 64;
+    }
+}
+
+uint64_t Map::findNotFull(uint64_t bitChunkIndex) const
 {
-    int r;
-    uint64_t bitChunkIndex = toBitChunkIndex(_firstZeroCandidate);
-    uint64_t bitIndex = 0;
+    if (bitChunkIndex >= _summaryCapacity)
+        return bitChunkIndex;
+
+    // go up until a level has a zero bit at or after the current position...
+    uint64_t pos = bitChunkIndex;
+    size_t l = 0;
     for (;;) {
-        r = setCurrentBitChunkIndex(bitChunkIndex);
-        if (r < 0) {
-            logger.log(Logger::Error, "Map::firstZero() failed");
-            return r;
+        if (l == _fullSummary.size() || pos / 64 >= _fullSummary[l].size())
+            return _summaryCapacity; // everything is full
+        uint64_t i = pos / 64;
+        uint64_t zeros = ~_fullSummary[l][i] & (~0ULL << (pos % 64));
+        if (zeros != 0) {
+            pos = i * 64 + __builtin_ctzll(zeros);
+            break;
         }
-        if (~_currentBitChunk != 0) {
-            // the index of the first zero is the number of trailing ones
-            // i.e. the number of trailing zeroes in the negated bit chunk
-            bitIndex = __builtin_ctzll(~_currentBitChunk);
+        pos = i + 1;
+        l++;
+    }
+    // ... and then go down to the first zero bit below it
+    while (l > 0) {
+        l--;
+        pos = pos * 64 + __builtin_ctzll(~_fullSummary[l][pos]);
+    }
+    return pos;
+}
+
+uint64_t Map::findUsed(uint64_t bitChunkIndex) const
+{
+    // same as findNotFull(), but on the used summary
+    uint64_t pos = bitChunkIndex;
+    size_t l = 0;
+    for (;;) {
+        if (l == _usedSummary.size() || pos / 64 >= _usedSummary[l].size())
+            return _summaryCapacity; // everything is empty
+        uint64_t i = pos / 64;
+        uint64_t ones = _usedSummary[l][i] & (~0ULL << (pos % 64));
+        if (ones != 0) {
+            pos = i * 64 + __builtin_ctzll(ones);
             break;
         }
-        bitChunkIndex++;
+        pos = i + 1;
+        l++;
+    }
+    while (l > 0) {
+        l--;
+        pos = pos * 64 + __builtin_ctzll(_usedSummary[l][pos]);
+    }
+    return pos;
+}
+
+void Map::markDirty(uint64_t bitChunkIndex)
+{
+    _dirtyPages[bitChunkIndex / BitChunksPerPage] = true;
+}
+
+int Map::firstZero(uint64_t* index)
+{
+    int r = firstZero(_firstZeroCandidate, index);
+    if (r == 0)
+        _firstZeroCandidate = *index;
+    return r;
+}
+
+int Map::firstZero(uint64_t hint, uint64_t* index)
+{
+    uint64_t bitChunkIndex = toBitChunkIndex(hint);
+    uint64_t bitIndex = toBitIndex(hint);
+    if (bitChunkIndex < _bitChunks.size()) {
+        uint64_t zeros = ~_bitChunks[bitChunkIndex] & (~0ULL << bitIndex);
+        if (zeros == 0) {
+            bitChunkIndex = findNotFull(bitChunkIndex + 1);
+            bitIndex = 0;
+            if (bitChunkIndex < _bitChunks.size())
+                zeros = ~_bitChunks[bitChunkIndex];
+        }
+        if (zeros != 0) {
+            // the index of the first zero is the number of trailing zeroes in the negated bit chunk
+            bitIndex = __builtin_ctzll(zeros);
+        }
+    }
+    // bits beyond the end of the map are zero
+    *index = bitChunkIndex * 64 + bitIndex;
+    return 0;
+}
+
+int Map::firstZeroRun(uint64_t hint, uint64_t length, uint64_t searchLength, uint64_t* index)
+{
+    const uint64_t runChunks = length / 64;
+    const uint64_t searchEnd = toBitChunkIndex(hint) + searchLength / 64;
+    uint64_t start = (hint + length - 1) / length * runChunks;
+    uint64_t i = start;
+    while (i < _bitChunks.size() && i < start + runChunks) {
+        if (_bitChunks[i] == 0) {
+            i++;
+        } else {
+            start = (i / runChunks + 1) * runChunks;
+            if (start >= searchEnd) {
+                *index = InvalidIndex;
+                return 0;
+            }
+            i = start;
+        }
+    }
+    // bits beyond the end of the map are zero
+    *index = start * 64;
+    return 0;
+}
+
+int Map::nextOne(uint64_t hint, uint64_t* index)
+{
+    uint64_t bitChunkIndex = toBitChunkIndex(hint);
+    *index = InvalidIndex;
+    if (bitChunkIndex < _bitChunks.size()) {
+        uint64_t ones = _bitChunks[bitChunkIndex] & (~0ULL << toBitIndex(hint));
+        if (ones == 0) {
+            bitChunkIndex = findUsed(bitChunkIndex + 1);
+            if (bitChunkIndex < _bitChunks.size())
+                ones = _bitChunks[bitChunkIndex];
+        }
+        if (ones != 0)
+            *index = bitChunkIndex * 64 + __builtin_ctzll(ones);
     }
-    _firstZeroCandidate = bitChunkIndex * 64 + bitIndex;
-    *index = _firstZeroCandidate;
+    return 0;
+}
+
+int Map::lastOne(uint64_t* index)
+{
+    if (_usedSummary.empty() || _usedSummary.back()[0] == 0) {
+        *index = InvalidIndex;
+        return 0;
+    }
+    uint64_t pos = 63 - __builtin_clzll(_usedSummary.back()[0]);
+    for (size_t l = _usedSummary.size() - 1; l > 0; l--)
+        pos = pos * 64 + 63 - __builtin_clzll(_usedSummary[l - 1][pos]);
+    *index = pos * 64 + 63 - __builtin_clzll(_bitChunks[pos]);
     return 0;
 }
 
 int Map::set(uint64_t index, bool b)
 {
-    int r = setCurrentBitChunkIndex(toBitChunkIndex(index));
-    if (r < 0) {
-        logger.log(Logger::Error, "Map::set(%lu, %d) failed", index, b ? 1 : 0);
-        return r;
+    uint64_t bitChunkIndex = toBitChunkIndex(index);
+    if (b) {
+        int r = ensureBitChunks(bitChunkIndex + 1);
+        if (r < 0) {
+            logger.log(Logger::Error, "Map::set(%lu, %d) failed", index, b ? 1 : 0);
+            return r;
+        }
+    } else if (bitChunkIndex >= _bitChunks.size()) {
+        // bits beyond the end of the map are already zero
+        return 0;
     }
-    uint64_t previousBitChunk = _currentBitChunk;
+    uint64_t& bitChunk = _bitChunks[bitChunkIndex];
+    uint64_t previousBitChunk = bitChunk;
     uint64_t mask = 1ULL << toBitIndex(index);
     if (b) {
-        _currentBitChunk |= mask;
+        bitChunk |= mask;
         if (index == _firstZeroCandidate)
             _firstZeroCandidate++;
     } else {
-        _currentBitChunk &= ~mask;
+        bitChunk &= ~mask;
         if (index < _firstZeroCandidate)
             _firstZeroCandidate = index;
     }
-    _currentBitChunkModified = (previousBitChunk != _currentBitChunk);
+    if (bitChunk != previousBitChunk) {
+        markDirty(bitChunkIndex);
+        updateSummaries(bitChunkIndex);
+    }
     return 0;
 }
 
 int Map::get(uint64_t index, bool* b)
 {
-    int r = setCurrentBitChunkIndex(toBitChunkIndex(index));
-    if (r < 0) {
-        logger.log(Logger::Error, "Map::get(%lu) failed", index);
-        return r;
+    uint64_t bitChunkIndex = toBitChunkIndex(index);
+    if (bitChunkIndex >= _bitChunks.size()) {
+        *b = false;
+    } else {
+        uint64_t mask = 1ULL << toBitIndex(index);
+        *b = (_bitChunks[bitChunkIndex] & mask);
     }
-    uint64_t mask = 1ULL << toBitIndex(index);
-    *b = (_currentBitChunk & mask);
     return 0;
 }
 
@@ -150,39 +346,75 @@ int Map::sync()
 {
     int r = 0;
 
-    if (_currentBitChunkIndex >= _bitChunksInStorage) {
-        logger.log(Logger::Error, "Map::sync(): invalid bit chunk index");
-        emergency(EmergencyBug);
-        return -ENOTRECOVERABLE;
-    }
-
-    if (_currentBitChunk == 0 && _currentBitChunkIndex + 1 == _bitChunksInStorage) {
-        // we are at the end of the storage; remove this empty chunk and all
-        // preceding empty chunks to save storage space
-        // but leave at least one chunk in storage even if it is empty
-        _bitChunksInStorage--;
-        while (_currentBitChunkIndex > 1) {
-            _currentBitChunkIndex--;
-            r = _storage->read(_currentBitChunkIndex, 1, &_currentBitChunk);
-            if (r < 0 || _currentBitChunk != 0)
-                break;
-        }
-        if (r == 0)
-            r = _storage->setSize(_bitChunksInStorage);
-    } else if (_currentBitChunkModified) {
-        r = _storage->write(_currentBitChunkIndex, 1, &_currentBitChunk);
+    // Empty chunks at the end are removed from storage to save space,
+    // but we leave at least one chunk in storage even if it is empty
+    uint64_t lastOneIndex;
+    lastOne(&lastOneIndex);
+    uint64_t bitChunkCount = (lastOneIndex == InvalidIndex ? 1 : toBitChunkIndex(lastOneIndex) + 1);
+
+    if (bitChunkCount > _bitChunksInStorage)
+        r = _storage->setSize(bitChunkCount);
+
+    // Write back runs of consecutive dirty pages
+    uint64_t pageCount = (bitChunkCount + BitChunksPerPage - 1) / BitChunksPerPage;
+    for (uint64_t page = 0; r == 0 && page < pageCount; page++) {
+        if (!_dirtyPages[page])
+            continue;
+        uint64_t firstPage = page;
+        while (page + 1 < pageCount && _dirtyPages[page + 1])
+            page++;
+        uint64_t first = firstPage * BitChunksPerPage;
+        uint64_t end = std::min((page + 1) * BitChunksPerPage, bitChunkCount);
+        r = _storage->write(first, end - first, _bitChunks.data() + first);
     }
 
+    if (r == 0 && bitChunkCount < _bitChunksInStorage)
+        r = _storage->setSize(bitChunkCount);
+
     if (r < 0) {
         logger.log(Logger::Error, "Map::sync() failed: %s", strerror(-r));
         return r;
     }
 
-    _currentBitChunkModified = false;
+    _bitChunksInStorage = bitChunkCount;
+    _bitChunks.resize(bitChunkCount);
+    _dirtyPages.assign(_dirtyPages.size(), false);
+    _dirtyPages.resize((bitChunkCount + BitChunksPerPage - 1) / BitChunksPerPage);
     return 0;
 }
 
+int Map::writeBack(const uint64_t* indices, size_t count)
+{
+    int r = 0;
+    if (count == 0)
+        return 0;
+    uint64_t bitChunkCount = toBitChunkIndex(indices[count - 1]) + 1;
+    if (bitChunkCount > _bitChunksInStorage) {
+        r = _storage->setSize(bitChunkCount);
+        if (r == 0)
+            _bitChunksInStorage = bitChunkCount;
+    }
+
+    // Write runs of consecutive bit chunks; their pages stay dirty for sync()
+    for (size_t i = 0; r == 0 && i < count; ) {
+        uint64_t first = toBitChunkIndex(indices[i]);
+        uint64_t end = first + 1;
+        for (i++; i < count && toBitChunkIndex(indices[i]) <= end; i++)
+            end = toBitChunkIndex(indices[i]) + 1;
+        r = _storage->write(first, end - first, _bitChunks.data() + first);
+    }
+
+    if (r < 0)
+        logger.log(Logger::Error, "Map::writeBack() failed: %s", strerror(-r));
+    return r;
+}
+
+int Map::syncStorage()
+{
+    return _storage->sync();
+}
+
 uint64_t Map::storageSizeInBytes() const
 {
-    return _bitChunksInStorage * _storage->chunkSize();
+    return std::max(uint64_t(_bitChunks.size()), _bitChunksInStorage) * _storage->chunkSize();
 }
@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -19,21 +19,40 @@
 #pragma once
 
 #include <cstdint>
+#include <vector>
 
 #include "storage.hpp"
 
 
+/* A bitmap that is kept completely in memory. Modified pages are tracked
+ * and written back to storage in sync(), with consecutive dirty pages
+ * combined into a single write. Bits that other data depends on, e.g. those
+ * of newly allocated chunks, can be written earlier with writeBack().
+ *
+ * Two summary trees over the bit chunks make searches O(log n): level 0 has
+ * one bit per bit chunk, and each further level has one bit per bit chunk
+ * of the level below, up to a level with a single bit chunk. In the full
+ * summary, a bit is set if everything below it is one; in the used summary,
+ * a bit is set if anything below it is one. */
 class Map {
 private:
+    static constexpr uint64_t BitChunksPerPage = 512; // 4 KiB pages for write-back
+
     Storage* _storage;
     uint64_t _bitChunksInStorage;
-    uint64_t _currentBitChunk;
-    uint64_t _currentBitChunkIndex;
-    bool _currentBitChunkModified;
+    std::vector<uint64_t> _bitChunks;
+    std::vector<bool> _dirtyPages;
     uint64_t _firstZeroCandidate;
-    uint64_t _lastOne;
+    uint64_t _summaryCapacity; // number of bit chunks covered by the summaries
+    std::vector<std::vector<uint64_t>> _fullSummary;
+    std::vector<std::vector<uint64_t>> _usedSummary;
 
-    int setCurrentBitChunkIndex(uint64_t index);
+    int ensureBitChunks(uint64_t bitChunkCount);
+    void markDirty(uint64_t bitChunkIndex);
+    int buildSummaries(uint64_t capacity);
+    void updateSummaries(uint64_t bitChunkIndex);
+    uint64_t findNotFull(uint64_t bitChunkIndex) const; // first bit chunk >= bitChunkIndex that is not all ones
+    uint64_t findUsed(uint64_t bitChunkIndex) const;    // first bit chunk >= bitChunkIndex that is not all zeros
 
 public:
     Map(Storage* storage);
@@ -41,13 +60,24 @@ public:
     int initialize();
 
     int firstZero(uint64_t* index);
+    int firstZero(uint64_t hint, uint64_t* index); // first zero at or after hint
+    // first run of length zeros at or after hint that is aligned to length (a multiple of 64);
+    // InvalidIndex if no such run starts within searchLength bits
+    int firstZeroRun(uint64_t hint, uint64_t length, uint64_t searchLength, uint64_t* index);
+    int nextOne(uint64_t hint, uint64_t* index);   // first one at or after hint; InvalidIndex if there is none
+    int lastOne(uint64_t* index);                  // InvalidIndex if there is none
     int set(uint64_t index, bool b);
     int get(uint64_t index, bool* b);
 
     int setZero(uint64_t index) { return set(index, false); }
     int setOne(uint64_t index) { return set(index, true); }
 
+    // Write the bit chunks that contain the given bits now; the indices must be ascending
+    int writeBack(const uint64_t* indices, size_t count);
+
     int sync();
+    int syncStorage(); // make everything written by sync() and writeBack() durable
+    Storage* storage() const { return _storage; }
 
     uint64_t storageSizeInBytes() const;
 };
@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include <limits>
+#include <vector>
+#include <algorithm>
+
+#include "refcount.hpp"
+#include "logger.hpp"
+
+
+RefCountTable::RefCountTable(Storage* storage) :
+    _storage(storage),
+    _sharedCount(0)
+{
+    _storage->setChunkSize(sizeof(uint32_t));
+}
+
+int RefCountTable::initialize()
+{
+    uint64_t count;
+    int r = _storage->size(&count);
+    std::vector<uint32_t> buf;
+    try {
+        buf.resize(64 * 1024);
+    }
+    catch (...) {
+        r = -ENOMEM;
+    }
+    for (uint64_t i = 0; r == 0 && i < count; i += buf.size()) {
+        uint64_t n = std::min(uint64_t(buf.size()), count - i);
+        r = _storage->read(i, n, buf.data());
+        try {
+            for (uint64_t j = 0; r == 0 && j < n; j++)
+                if (buf[j] != 0)
+                    _extraRefs[i + j] = buf[j];
+        }
+        catch (...) {
+            r = -ENOMEM;
+        }
+    }
+    if (r < 0)
+        logger.log(Logger::Error, "RefCountTable::initialize() failed: %s", strerror(-r));
+    _sharedCount = _extraRefs.size();
+    return r;
+}
+
+int RefCountTable::store(uint64_t index, uint32_t extraRefs)
+{
+    int r = _storage->write(index, 1, &extraRefs);
+    if (r < 0)
+        logger.log(Logger::Error, "RefCountTable: cannot store reference count of block %lu: %s", index, strerror(-r));
+    return r;
+}
+
+bool RefCountTable::isShared(uint64_t index)
+{
+    if (sharedCount() == 0)
+        return false;
+    std::lock_guard<std::mutex> lock(_mutex);
+    return (_extraRefs.find(index) != _extraRefs.end());
+}
+
+int RefCountTable::addRef(uint64_t index)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    uint32_t extraRefs = 1;
+    auto it = _extraRefs.find(index);
+    if (it != _extraRefs.end()) {
+        if (it->second == std::numeric_limits<uint32_t>::max())
+            return -EMLINK;
+        extraRefs = it->second + 1;
+    }
+    int r = store(index, extraRefs);
+    if (r == 0) {
+        if (it != _extraRefs.end()) {
+            it->second = extraRefs;
+        } else {
+            try {
+                _extraRefs[index] = extraRefs;
+            }
+            catch (...) {
+                store(index, 0);
+                return -ENOMEM;
+            }
+            _sharedCount++;
+        }
+    }
+    return r;
+}
+
+int RefCountTable::releaseRef(uint64_t index, bool* wasShared)
+{
+    *wasShared = false;
+    if (sharedCount() == 0)
+        return 0;
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto it = _extraRefs.find(index);
+    if (it == _extraRefs.end())
+        return 0;
+    *wasShared = true;
+    int r = store(index, it->second - 1);
+    if (r == 0) {
+        if (it->second == 1) {
+            _extraRefs.erase(it);
+            _sharedCount--;
+        } else {
+            it->second--;
+        }
+    }
+    return r;
+}
+
+int RefCountTable::sharedIndices(std::vector<uint64_t>& indices)
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    try {
+        for (auto it = _extraRefs.begin(); it != _extraRefs.end(); it++)
+            indices.push_back(it->first);
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+int RefCountTable::sync()
+{
+    return _storage->sync();
+}
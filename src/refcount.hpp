@@ -0,0 +1,66 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "storage.hpp"
+
+
+/* Reference counts of data blocks that are shared by several files, e.g.
+ * after copy_file_range(). A block without an entry has exactly one reference.
+ *
+ * The storage holds one 32 bit count of additional references per block index
+ * (zero for unshared blocks, so that the file stays sparse). Only the nonzero
+ * counts are kept in memory; they are read completely in initialize().
+ * Changes are written through immediately. */
+class RefCountTable
+{
+private:
+    Storage* _storage;
+    std::mutex _mutex;
+    std::unordered_map<uint64_t, uint32_t> _extraRefs;
+    std::atomic<size_t> _sharedCount; // number of entries in _extraRefs, for a lock-free fast path
+
+    int store(uint64_t index, uint32_t extraRefs);
+
+public:
+    RefCountTable(Storage* storage);
+
+    // must be called first; not thread safe
+    int initialize();
+
+    // Number of shared blocks
+    size_t sharedCount() const { return _sharedCount.load(std::memory_order_relaxed); }
+    // Whether the block has more than one reference
+    bool isShared(uint64_t index);
+    // Add a reference to a block
+    int addRef(uint64_t index);
+    // Drop a reference to a block. If the block was shared, *wasShared is set and the
+    // block is still in use; otherwise the caller must remove the block itself.
+    int releaseRef(uint64_t index, bool* wasShared);
+    // Append the indices of all shared blocks
+    int sharedIndices(std::vector<uint64_t>& indices);
+    // Make all changes durable
+    int sync();
+};
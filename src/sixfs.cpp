@@ -16,23 +16,23 @@
  *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <utility>
+#include <algorithm>
+
 #include <cstring>
 
 #include "index.hpp"
 #include "logger.hpp"
+#include "stats.hpp"
 #include "emergency.hpp"
 #include "base.hpp"
 #include "sixfs.hpp"
 
 
-SixFS::SixFS(Storage::Type type, const std::string& dirName, uint64_t maxSize,
-            const std::vector<unsigned char>& key, bool punchHoles) :
-    _type(type),
-    _dirName(dirName),
-    _maxSize(maxSize),
-    _key(key),
-    _punchHoles(punchHoles),
-    _base(nullptr)
+SixFS::SixFS(const Options& options) :
+    _options(options),
+    _base(nullptr),
+    _dentryCache(nullptr)
 {
 }
 
@@ -41,26 +41,6 @@ SixFS::~SixFS()
     unmount();
 }
 
-void SixFS::structureLockExclusive()
-{
-    _base->structureLockExclusive();
-}
-
-void SixFS::structureUnlockExclusive()
-{
-    _base->structureUnlockExclusive();
-}
-
-void SixFS::structureLockShared()
-{
-    _base->structureLockShared();
-}
-
-void SixFS::structureUnlockShared()
-{
-    _base->structureUnlockShared();
-}
-
 int SixFS::getHandle(uint64_t inodeIndex, Handle** handle)
 {
     return _base->handleGet(inodeIndex, handle);
@@ -68,11 +48,10 @@ int SixFS::getHandle(uint64_t inodeIndex, Handle** handle)
 
 int SixFS::getHandle(const char* path, size_t pathLen, Handle** handle)
 {
+    StatsTimer timer(Stats::PathLookup);
     *handle = nullptr;
-    uint64_t inodeIndex;
-    int r = findInode(path, pathLen, &inodeIndex);
-    if (r == 0)
-        r = getHandle(inodeIndex, handle);
+    int r = (path[0] != '/' ? -ENOENT : recursiveFind(path, pathLen, handle));
+    //logger.log(Logger::Debug, "SixFS::getHandle(\"%.*s\"): %s", int(pathLen), path, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
@@ -101,50 +80,74 @@ void SixFS::separate(const char* path, size_t len, size_t* parentLen, size_t* na
     *nameLen = len - *nameOffset;
 }
 
-int SixFS::recursiveFind(const char* path, size_t len, uint64_t* inodeIndex)
+int SixFS::lookup(Handle* parentHandle, const char* name, size_t nameLen, Handle** handle)
 {
-    if (len == 1) {
-        *inodeIndex = 0; // root directory inode
-        return 0;
-    } else {
-        *inodeIndex = InvalidIndex;
-
-        int r;
-
-        size_t parentLen, nameOffset, nameLen;
-        separate(path, len, &parentLen, &nameOffset, &nameLen);
-        if (nameLen >= sizeof(Dirent::name))
-            return -ENAMETOOLONG;
+    *handle = nullptr;
+    uint64_t parentIndex = parentHandle->inodeIndex();
+    int r = 0;
 
-        uint64_t parentIndex;
-        r = recursiveFind(path, parentLen, &parentIndex);
-        if (r < 0)
-            return r;
+    // Entries are only cached for verified directories, so a hit means that
+    // the parent is a directory and we can skip reading it. A cached inode is
+    // not destroyed before its entry is removed, so we can get its handle.
+    if (_dentryCache && _dentryCache->get(parentIndex, name, nameLen, [&](uint64_t inodeIndex) {
+                r = (inodeIndex == InvalidIndex ? -ENOENT : getHandle(inodeIndex, handle)); }))
+        return r;
+
+    // Entries are only added to the cache while we hold the directory lock.
+    // Modifications remove entries after they are done, so no stale entry can remain.
+    parentHandle->lockShared();
+    uint64_t direntIndex;
+    Dirent dirent;
+    if (parentHandle->removeOnceUnused()) {
+        r = -ENOENT; // the directory was removed while we looked it up; it is empty
+    } else {
+        r = parentHandle->findDirentNow(name, nameLen, nullptr, &direntIndex, &dirent);
+        if (_dentryCache && (r == 0 || r == -ENOENT))
+            _dentryCache->put(parentIndex, name, nameLen, r == 0 ? dirent.inodeIndex : InvalidIndex);
+    }
+    if (r == 0)
+        r = getHandle(dirent.inodeIndex, handle);
+    parentHandle->unlockShared();
+    return r;
+}
 
-        Inode parentInode;
-        r = _base->inodeRead(parentIndex, &parentInode);
-        if (r < 0)
-            return r;
-        if (parentInode.type() != TypeDIR)
-            return -ENOTDIR;
-        uint64_t direntSlot;
-        uint64_t direntIndex;
-        Dirent dirent;
-        Handle handle(_base, parentIndex, parentInode);
-        r = handle.findDirentNow(path + nameOffset, nameLen, &direntSlot, &direntIndex, &dirent);
-        if (r < 0)
-            return r;
+int SixFS::recursiveFind(const char* path, size_t len, Handle** handle)
+{
+    if (len == 1)
+        return getHandle(uint64_t(0), handle); // root directory inode
 
-        *inodeIndex = dirent.inodeIndex;
-        return 0;
+    size_t parentLen, nameOffset, nameLen;
+    separate(path, len, &parentLen, &nameOffset, &nameLen);
+    if (nameLen >= sizeof(Dirent::name))
+        return -ENAMETOOLONG;
+
+    Handle* parentHandle;
+    int r = recursiveFind(path, parentLen, &parentHandle);
+    if (r < 0)
+        return r;
+    if (parentHandle->inode().type() != TypeDIR)
+        r = -ENOTDIR;
+    else
+        r = lookup(parentHandle, path + nameOffset, nameLen, handle);
+    int r2 = releaseHandle(parentHandle);
+    if (r == 0 && r2 < 0) {
+        releaseHandle(*handle);
+        *handle = nullptr;
+        r = r2;
     }
+    return r;
 }
 
-int SixFS::findInode(const char* path, size_t pathLen, uint64_t* inodeIndex)
+void SixFS::forgetDentry(uint64_t parentIndex, const char* name, size_t nameLen)
 {
-    int r = (path[0] != '/' ? -ENOENT : recursiveFind(path, pathLen, inodeIndex));
-    //logger.log(Logger::Debug, "SixFS::findInode(\"%.*s\"): %s", int(pathLen), path, (r == 0 ? "success" : strerror(-r)));
-    return r;
+    if (_dentryCache)
+        _dentryCache->remove(parentIndex, name, nameLen);
+}
+
+void SixFS::forgetDir(uint64_t inodeIndex)
+{
+    if (_dentryCache)
+        _dentryCache->removeDir(inodeIndex);
 }
 
 int SixFS::mkdirent(const char* path, uint64_t existingInodeIndex, std::function<Inode (const Inode& parentInode)> inodeCreator)
@@ -159,6 +162,7 @@ int SixFS::mkdirent(const char* path, uint64_t existingInodeIndex, std::function
     if (r == 0)
         r = parentHandle->mkdirent(path + nameOffset, nameLen, existingInodeIndex, inodeCreator);
     if (parentHandle) {
+        forgetDentry(parentHandle->inodeIndex(), path + nameOffset, nameLen);
         int r2 = releaseHandle(parentHandle);
         if (r == 0 && r2 < 0)
             r = r2;
@@ -175,10 +179,23 @@ int SixFS::rmdirent(const char* path, std::function<int (const Inode& inode)> in
     separate(path, pathLen, &parentLen, &nameOffset, &nameLen);
 
     Handle* parentHandle = nullptr;
+    Handle* removedHandle = nullptr;
     r = getHandle(path, parentLen, &parentHandle);
     if (r == 0)
-        r = parentHandle->rmdirent(path + nameOffset, nameLen, inodeChecker);
+        r = parentHandle->rmdirent(path + nameOffset, nameLen, inodeChecker, &removedHandle);
     if (parentHandle) {
+        forgetDentry(parentHandle->inodeIndex(), path + nameOffset, nameLen);
+        if (removedHandle) {
+            // a removed directory inode might be reused, so its cached entries must go, too
+            uint64_t removedIndex;
+            Inode removedInode;
+            removedHandle->getAttr(&removedIndex, &removedInode);
+            if (removedInode.type() == TypeDIR)
+                forgetDir(removedIndex);
+            int r2 = releaseHandle(removedHandle);
+            if (r == 0 && r2 < 0)
+                r = r2;
+        }
         int r2 = releaseHandle(parentHandle);
         if (r == 0 && r2 < 0)
             r = r2;
@@ -189,11 +206,19 @@ int SixFS::rmdirent(const char* path, std::function<int (const Inode& inode)> in
 
 int SixFS::mount(std::string& errStr)
 {
-    _base = new Base(_type, _dirName, _maxSize, _key, _punchHoles);
+    _base = new Base(_options);
     bool needsRootNode = false;
     int r = _base->initialize(errStr, &needsRootNode);
     if (r == 0 && needsRootNode) {
-        r = _base->createRootNode();
+        r = _base->createRootNode(_options.dirFormat);
+    }
+    if (r == 0 && _options.dentryCacheSize > 0) {
+        try {
+            _dentryCache = new DentryCache(_options.dentryCacheSize);
+        }
+        catch (...) {
+            r = -ENOMEM;
+        }
     }
     if (r < 0) {
         delete _base;
@@ -202,14 +227,39 @@ int SixFS::mount(std::string& errStr)
     return r;
 }
 
+void SixFS::startThreads()
+{
+    logger.startFlusher();
+    _base->startThreads();
+    stats.startReporter([this]() { logStats(); });
+}
+
+void SixFS::logStats()
+{
+    stats.log();
+    if (_dentryCache)
+        logger.log(Logger::Info, "dentry cache hits/misses: %lu/%lu", _dentryCache->hits(), _dentryCache->misses());
+    _base->logCacheStats();
+}
+
 int SixFS::unmount()
 {
     int r = 0;
+    stats.stopReporter();
+    if (_base)
+        stats.log();
+    if (_dentryCache) {
+        logger.log(Logger::Info, "dentry cache hits/misses: %lu/%lu", _dentryCache->hits(), _dentryCache->misses());
+        delete _dentryCache;
+        _dentryCache = nullptr;
+    }
     if (_base) {
         r = _base->cleanup();
         delete _base;
         _base = nullptr;
     }
+    // base threads that log are gone now
+    logger.stopFlusher();
     return r;
 }
 
@@ -217,7 +267,8 @@ int SixFS::statfs(size_t* blockSize, size_t* maxNameLen,
         uint64_t* maxBlockCount, uint64_t* freeBlockCount, uint64_t* maxInodeCount, uint64_t* freeInodeCount)
 {
     int r = _base->statfs(blockSize, maxNameLen, maxBlockCount, freeBlockCount, maxInodeCount, freeInodeCount);
-    logger.log(Logger::Debug, "  SixFS::statfs(): %s", r == 0 ? "success" : strerror(-r));
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::statfs(): %s", r == 0 ? "success" : strerror(-r));
     return r;
 }
 
@@ -227,7 +278,6 @@ int SixFS::getAttr(Handle* handle, const char* path, uint64_t* inodeIndex, Inode
     if (handle) {
         handle->getAttr(inodeIndex, inode);
     } else {
-        structureLockShared();
         Handle* h = nullptr;
         if (r == 0)
             r = getHandle(path, &h);
@@ -238,17 +288,16 @@ int SixFS::getAttr(Handle* handle, const char* path, uint64_t* inodeIndex, Inode
             if (r == 0 && r2 < 0)
                 r = r2;
         }
-        structureUnlockShared();
     }
-    logger.log(Logger::Debug, "  SixFS::getAttr(\"%s\"): inode=%lu: %s", path,
-            (r == 0 ? *inodeIndex : InvalidIndex),
-            (r == 0 ? "success" : strerror(-r)));
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::getAttr(\"%s\"): inode=%lu: %s", path,
+                (r == 0 ? *inodeIndex : InvalidIndex),
+                (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::openDir(const char* path, Handle** handle)
 {
-    structureLockShared();
     *handle = nullptr;
     int r = getHandle(path, handle);
     if (r == 0)
@@ -259,62 +308,57 @@ int SixFS::openDir(const char* path, Handle** handle)
             logger.log(Logger::Error, "SixFS::openDir(): unhandled error after failure: %s", strerror(-r2));
         *handle = nullptr;
     }
-    logger.log(Logger::Debug, "  SixFS::openDir(\"%s\"): inode=%lu: %s", path,
-            (r == 0 ? (*handle)->inodeIndex() : InvalidIndex),
-            (r == 0 ? "success" : strerror(-r)));
-    structureUnlockShared();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::openDir(\"%s\"): inode=%lu: %s", path,
+                (r == 0 ? (*handle)->inodeIndex() : InvalidIndex),
+                (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::closeDir(Handle* handle)
 {
-    structureLockExclusive(); // the directory might be deleted on close, therefore we need the exclusive lock
     uint64_t inodeIndex = handle->inodeIndex();
     int r = releaseHandle(handle);
-    logger.log(Logger::Debug, "  SixFS::closeDir(%lu): %s", inodeIndex, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::closeDir(%lu): %s", inodeIndex, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
-int SixFS::readDirent(Handle* handle, uint64_t direntSlot, Dirent* dirent)
+int SixFS::readDirent(Handle* handle, uint64_t* direntSlot, Dirent* dirent)
 {
-    structureLockShared();
     int r = handle->readDirent(direntSlot, dirent);
-    logger.log(Logger::Debug, "  SixFS::readDirent(%lu, %lu): name=\"%s\" inode=%lu: %s",
-            handle->inodeIndex(), direntSlot,
-            (r == 0 ? dirent->name : ""),
-            (r == 0 ? dirent->inodeIndex : InvalidIndex),
-            (r == 0 ? "success" : strerror(-r)));
-    structureUnlockShared();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::readDirent(%lu, %lu): name=\"%s\" inode=%lu: %s",
+                handle->inodeIndex(), *direntSlot,
+                (r == 0 ? dirent->name : ""),
+                (r == 0 ? dirent->inodeIndex : InvalidIndex),
+                (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
-int SixFS::readDirentPlus(Handle* handle, uint64_t direntSlot, Dirent* dirent, Inode* inode)
+int SixFS::readDirentPlus(Handle* handle, uint64_t* direntSlot, Dirent* dirent, Inode* inode, bool continued)
 {
-    structureLockShared();
-    int r = handle->readDirentPlus(direntSlot, dirent, inode);
-    logger.log(Logger::Debug, "  SixFS::readDirentPlus(%lu, %lu): name=\"%s\" inode=%lu: %s",
-            handle->inodeIndex(), direntSlot,
-            (r == 0 ? dirent->name : ""),
-            (r == 0 ? dirent->inodeIndex : InvalidIndex),
-            (r == 0 ? "success" : strerror(-r)));
-    structureUnlockShared();
+    int r = handle->readDirentPlus(direntSlot, dirent, inode, continued);
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::readDirentPlus(%lu, %lu): name=\"%s\" inode=%lu: %s",
+                handle->inodeIndex(), *direntSlot,
+                (r == 0 ? dirent->name : ""),
+                (r == 0 ? dirent->inodeIndex : InvalidIndex),
+                (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::mkdir(const char* path, uint16_t typeAndMode)
 {
-    structureLockExclusive();
     int r = mkdirent(path, InvalidIndex,
-                [&typeAndMode](const Inode& parentInode) { return Inode::directory(&parentInode, typeAndMode); });
-    logger.log(Logger::Debug, "  SixFS::mkdir(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+                [this, &typeAndMode](const Inode& parentInode) { return Inode::directory(&parentInode, typeAndMode, _options.dirFormat); });
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::mkdir(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::rmdir(const char* path)
 {
-    structureLockExclusive();
     int r = rmdirent(path, [](const Inode& inode) {
                 if (inode.type() != TypeDIR)
                     return -ENOTDIR;
@@ -322,52 +366,56 @@ int SixFS::rmdir(const char* path)
                     return -ENOTEMPTY;
                 return 0;
                 });
-    logger.log(Logger::Debug, "  SixFS::rmdir(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::rmdir(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::mknod(const char* path, uint16_t typeAndMode, uint64_t rdev)
 {
-    structureLockExclusive();
     int r = mkdirent(path, InvalidIndex,
                 [&typeAndMode, &rdev](const Inode&) { return Inode::node(typeAndMode, rdev); });
-    logger.log(Logger::Debug, "  SixFS::mknod(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::mknod(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::unlink(const char* path)
 {
-    structureLockExclusive();
     int r = rmdirent(path, [](const Inode& inode) {
                 if (inode.type() == TypeDIR)
                     return -EISDIR;
                 return 0;
                 });
-    logger.log(Logger::Debug, "  SixFS::unlink(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::unlink(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::symlink(const char* target, const char* linkpath)
 {
-    structureLockExclusive();
 
     size_t targetLen = strlen(target);
-    uint64_t blockIndex;
+    bool inlineTarget = (targetLen <= Inode::InlineDataSize);
+    uint64_t blockIndex = InvalidIndex;
 
-    int r = (targetLen > sizeof(Block::target) ? -ENAMETOOLONG : 0);
-    if (r == 0) {
+    // the limit does not depend on the block size of the file system
+    int r = (targetLen > Block::MinSize ? -ENAMETOOLONG : 0);
+    if (r == 0 && !inlineTarget) {
         Block block;
-        block.initializeTarget();
-        memcpy(block.target, target, targetLen);
-        r = _base->blockAdd(&blockIndex, &block);
+        r = block.allocate(_base->blockSize());
+        if (r == 0) {
+            block.initializeTarget();
+            memcpy(block.target, target, targetLen);
+            r = _base->blockAdd(&blockIndex, &block, InvalidIndex);
+        }
     }
     if (r == 0) {
         r = mkdirent(linkpath, InvalidIndex,
-                [&targetLen, &blockIndex](const Inode&) { return Inode::symlink(targetLen, blockIndex); });
-        if (r < 0) {
+                [target, &targetLen, &inlineTarget, &blockIndex](const Inode&) {
+                    return inlineTarget ? Inode::inlineSymlink(target, targetLen) : Inode::symlink(targetLen, blockIndex);
+                });
+        if (r < 0 && !inlineTarget) {
             int r2 = _base->blockRemove(blockIndex);
             if (r2 < 0) {
                 logger.log(Logger::Error, "SixFS::symlink(): cannot recover from failure; a dead block remains: %s", strerror(-r2));
@@ -375,14 +423,13 @@ int SixFS::symlink(const char* target, const char* linkpath)
         }
     }
 
-    logger.log(Logger::Debug, "  SixFS::symlink(\"%s\", \"%s\"): %s", target, linkpath, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::symlink(\"%s\", \"%s\"): %s", target, linkpath, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::readlink(const char* path, char* buf, size_t bufsize)
 {
-    structureLockShared();
     Handle* handle = nullptr;
     int r = getHandle(path, &handle);
     if (r == 0)
@@ -392,14 +439,13 @@ int SixFS::readlink(const char* path, char* buf, size_t bufsize)
         if (r == 0 && r2 < 0)
             r = r2;
     }
-    logger.log(Logger::Debug, "  SixFS::readlink(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockShared();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::readlink(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::link(const char* oldpath, const char* newpath)
 {
-    structureLockExclusive();
 
     Handle* handle;
     int r = getHandle(oldpath, &handle);
@@ -421,14 +467,14 @@ int SixFS::link(const char* oldpath, const char* newpath)
         if (r == 0 && r2 < 0)
             r = r2;
     }
-    logger.log(Logger::Debug, "  SixFS::link(\"%s\", \"%s\"): %s", oldpath, newpath, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::link(\"%s\", \"%s\"): %s", oldpath, newpath, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
-int SixFS::rename(const char* oldPath, const char* newPath, RenameMode mode)
+int SixFS::renameTry(const char* oldPath, const char* newPath, RenameMode mode, bool* retry)
 {
-    structureLockExclusive();
+    *retry = false;
 
     size_t oldPathLen = strlen(oldPath);
     size_t oldParentLen, oldNameOffset, oldNameLen;
@@ -447,45 +493,88 @@ int SixFS::rename(const char* oldPath, const char* newPath, RenameMode mode)
         r = -ENOTDIR;
 
     Handle* newParentHandle = nullptr;
-    uint64_t newParentInodeIndex = InvalidIndex;
     if (r == 0)
-        r = findInode(newPath, newParentLen, &newParentInodeIndex);
-    if (r == 0) {
-        if (newParentInodeIndex == oldParentHandle->inodeIndex())
-            newParentHandle = oldParentHandle;
-        else
-            r = getHandle(newPath, newParentLen, &newParentHandle);
-    }
+        r = getHandle(newPath, newParentLen, &newParentHandle);
     if (r == 0 && newParentHandle->inode().type() != TypeDIR)
         r = -ENOTDIR;
 
+    // Lock both directories, in the order of their inode indices. Only the first
+    // lock is waited for; if another lock is taken, we start over. This way we
+    // cannot deadlock with Handle::rmdirent(), which locks a parent and then a child.
+    // Before starting over, we wait for the contended lock while holding no other
+    // lock, so that we do not spin while its holder is busy.
+    Handle* firstLocked = nullptr;
+    Handle* contended = nullptr;
+    Handle* secondLocked = nullptr;
+    if (r == 0) {
+        firstLocked = oldParentHandle;
+        secondLocked = newParentHandle;
+        if (secondLocked->inodeIndex() < firstLocked->inodeIndex())
+            std::swap(firstLocked, secondLocked);
+        if (secondLocked == firstLocked)
+            secondLocked = nullptr;
+        firstLocked->lockExclusive();
+        if (secondLocked && !secondLocked->tryLockExclusive()) {
+            firstLocked->unlockExclusive();
+            contended = secondLocked;
+            firstLocked = nullptr;
+            secondLocked = nullptr;
+            *retry = true;
+            r = -EAGAIN;
+        }
+    }
+    if (r == 0 && (oldParentHandle->removeOnceUnused() || newParentHandle->removeOnceUnused()))
+        r = -ENOENT; // a directory was removed while we looked it up
+    if (r == 0)
+        r = newParentHandle->renameHelperReserve();
+
     uint64_t oldDirentSlot;
     uint64_t oldDirentIndex;
     Dirent oldDirent;
     if (r == 0)
-        r = oldParentHandle->findDirent(oldPath + oldNameOffset, oldNameLen, &oldDirentSlot, &oldDirentIndex, &oldDirent);
+        r = oldParentHandle->findDirentNow(oldPath + oldNameOffset, oldNameLen, &oldDirentSlot, &oldDirentIndex, &oldDirent);
 
     uint64_t newDirentSlot = InvalidIndex;
     uint64_t newDirentIndex = InvalidIndex;
     Dirent newDirent;
     bool newPathExists = false;
     if (r == 0) {
-        r = newParentHandle->findDirent(newPath + newNameOffset, newNameLen, &newDirentSlot, &newDirentIndex, &newDirent);
+        r = newParentHandle->findDirentNow(newPath + newNameOffset, newNameLen, &newDirentSlot, &newDirentIndex, &newDirent);
         newPathExists = (r == 0);
         if (r == -ENOENT)
             r = 0;
     }
 
+    if (r == 0 && oldDirent.inodeIndex == newParentHandle->inodeIndex())
+        r = -EINVAL; // cannot move a directory into itself
+
     Inode oldInode;
     if (r == 0)
         r = _base->inodeRead(oldDirent.inodeIndex, &oldInode);
+
+    // Lock an existing target, too, so that e.g. an empty target directory
+    // cannot gain an entry before it is replaced.
+    Handle* newHandle = nullptr;
+    bool newHandleLocked = false;
     Inode newInode;
     if (r == 0 && newPathExists)
-        r = _base->inodeRead(newDirent.inodeIndex, &newInode);
+        r = getHandle(newDirent.inodeIndex, &newHandle);
+    if (r == 0 && newPathExists) {
+        if (newHandle == oldParentHandle) {
+            r = -ENOTEMPTY; // it contains the old path
+        } else if (newHandle->tryLockExclusive()) {
+            newHandleLocked = true;
+            newInode = newHandle->inode();
+        } else {
+            contended = newHandle;
+            *retry = true;
+            r = -EAGAIN;
+        }
+    }
 
     if (r == 0 && newPathExists && oldInode.type() == TypeDIR && newInode.type() != TypeDIR)
         r = -ENOTDIR;
-    if (r == 0 && newPathExists && oldInode.type() == TypeDIR && newInode.type() != TypeDIR && newInode.size > 0)
+    if (r == 0 && newPathExists && mode != RenameExchange && newInode.type() == TypeDIR && newInode.size > 0)
         r = -ENOTEMPTY;
     if (r == 0 && newPathExists && oldInode.type() != TypeDIR && newInode.type() == TypeDIR)
         r = -EISDIR;
@@ -495,8 +584,8 @@ int SixFS::rename(const char* oldPath, const char* newPath, RenameMode mode)
         r = -ENOENT;
 
     if (r == 0) {
-        if (newPathExists && oldInode.type() == TypeREG && (oldDirent.inodeIndex == newDirent.inodeIndex)) {
-            // both are hard links to the same file; do nothing
+        if (newPathExists && oldDirent.inodeIndex == newDirent.inodeIndex) {
+            // both are hard links to the same file, or it is the same entry; do nothing
         } else {
             bool undo = false;
             switch (mode) {
@@ -516,30 +605,22 @@ int SixFS::rename(const char* oldPath, const char* newPath, RenameMode mode)
                             if (r2 < 0) {
                                 logger.log(Logger::Error, "SixFS::rename(): cannot remove old directory entry; it remains: %s", strerror(-r2));
                             }
-                            Handle* handle = nullptr;
-                            int r3 = getHandle(newDirent.inodeIndex, &handle);
+                            // we hold a reference, so this only marks it for removal
+                            int r3 = newHandle->remove();
                             if (r3 < 0) {
-                                logger.log(Logger::Error, "SixFS::rename(): cannot get handle for old inode; it remains: %s", strerror(-r3));
-                            } else {
-                                int r4 = handle->remove();
-                                if (r4 < 0) {
-                                    logger.log(Logger::Error, "SixFS::rename(): cannot remove old inode; it remains: %s", strerror(-r4));
-                                }
-                                int r5 = releaseHandle(handle);
-                                if (r5 < 0) {
-                                    logger.log(Logger::Error, "SixFS::rename(): removing old inode might have failed: %s", strerror(-r5));
-                                }
+                                logger.log(Logger::Error, "SixFS::rename(): cannot remove old inode; it remains: %s", strerror(-r3));
                             }
                         }
                         if (r < 0)
                             undo = true;
                     } else {
-                        r = newParentHandle->renameHelperAdd(newDirentSlot, oldDirentIndex);
+                        r = newParentHandle->renameHelperAdd(newDirentSlot, oldDirentIndex, newPath + newNameOffset, newNameLen);
                         if (r < 0)
                             undo = true;
                         if (r == 0) {
-                            if (oldParentHandle->inodeIndex() == newParentHandle->inodeIndex()) {
-                                // special case: same parent directory
+                            if (oldParentHandle->inodeIndex() == newParentHandle->inodeIndex()
+                                    && oldParentHandle->inode().dirFormat() == DirFormatSorted) {
+                                // special case: same sorted parent directory
                                 if (oldDirentSlot >= newDirentSlot)
                                     oldDirentSlot++;
                             }
@@ -547,7 +628,7 @@ int SixFS::rename(const char* oldPath, const char* newPath, RenameMode mode)
                     }
                 }
                 if (r == 0) {
-                    r = oldParentHandle->renameHelperRemove(oldDirentSlot);
+                    r = oldParentHandle->renameHelperRemove(oldDirentSlot, oldPath + oldNameOffset, oldNameLen);
                     if (r < 0)
                         undo = true;
                 }
@@ -564,11 +645,20 @@ int SixFS::rename(const char* oldPath, const char* newPath, RenameMode mode)
                 }
                 break;
             case RenameExchange:
-                r = oldParentHandle->renameHelperReplace(oldDirentSlot, newDirentIndex);
+            {
+                uint64_t oldInodeIndex = oldDirent.inodeIndex;
+                uint64_t newInodeIndex = newDirent.inodeIndex;
+                // swap the inodes that the two entries refer to; names and slots stay the same
+                oldDirent.inodeIndex = newInodeIndex;
+                newDirent.inodeIndex = oldInodeIndex;
+                oldParentHandle->renameHelperChanged();
+                newParentHandle->renameHelperChanged();
+                r = _base->direntWrite(oldDirentIndex, &oldDirent);
                 if (r == 0) {
-                    r = newParentHandle->renameHelperReplace(newDirentSlot, oldDirentIndex);
+                    r = _base->direntWrite(newDirentIndex, &newDirent);
                     if (r < 0) {
-                        int r2 = oldParentHandle->renameHelperReplace(oldDirentSlot, oldDirentIndex);
+                        oldDirent.inodeIndex = oldInodeIndex;
+                        int r2 = _base->direntWrite(oldDirentIndex, &oldDirent);
                         if (r2 < 0) {
                             logger.log(Logger::Error, "SixFS::rename(): cannot recover from failure: %s", strerror(-r2));
                             emergency(EmergencySystemFailure);
@@ -578,27 +668,63 @@ int SixFS::rename(const char* oldPath, const char* newPath, RenameMode mode)
                 }
                 break;
             }
+            }
         }
     }
+    if (newHandleLocked)
+        newHandle->unlockExclusive();
+    if (secondLocked)
+        secondLocked->unlockExclusive();
+    if (firstLocked)
+        firstLocked->unlockExclusive();
+    if (contended) {
+        // we still hold a reference to it, so the handle stays valid
+        contended->lockExclusive();
+        contended->unlockExclusive();
+    }
+
+    // Cached entries must be removed before the replaced inode can be destroyed
+    if (oldParentHandle)
+        forgetDentry(oldParentHandle->inodeIndex(), oldPath + oldNameOffset, oldNameLen);
+    if (newParentHandle)
+        forgetDentry(newParentHandle->inodeIndex(), newPath + newNameOffset, newNameLen);
+    if (r == 0 && newPathExists && mode != RenameExchange && newInode.type() == TypeDIR)
+        forgetDir(newHandle->inodeIndex());
+    if (newHandle) {
+        int r2 = releaseHandle(newHandle);
+        if (r2 < 0)
+            logger.log(Logger::Error, "sixfs::rename(): removing old inode might have failed: %s", strerror(-r2));
+    }
     if (oldParentHandle) {
         int r2 = releaseHandle(oldParentHandle);
         if (r2 < 0)
             logger.log(Logger::Error, "sixfs::rename(): error on old parent handle (ignored): %s", strerror(-r2));
     }
-    if (newParentHandle && newParentHandle != oldParentHandle) {
+    if (newParentHandle) {
         int r2 = releaseHandle(newParentHandle);
         if (r2 < 0)
             logger.log(Logger::Error, "sixfs::rename(): error on new parent handle (ignored): %s", strerror(-r2));
     }
 
-    logger.log(Logger::Debug, "  SixFS::rename(\"%s\", \"%s\"): %s", oldPath, newPath, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+    return r;
+}
+
+int SixFS::rename(const char* oldPath, const char* newPath, RenameMode mode)
+{
+    int r;
+    bool retry;
+    for (;;) {
+        r = renameTry(oldPath, newPath, mode, &retry);
+        if (!retry)
+            break;
+    }
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::rename(\"%s\", \"%s\"): %s", oldPath, newPath, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::chmod(Handle* handle, const char* path, uint16_t mode)
 {
-    structureLockShared();
     int r = 0;
     Handle* h = handle;
     if (!h)
@@ -610,15 +736,14 @@ int SixFS::chmod(Handle* handle, const char* path, uint16_t mode)
         if (r == 0 && r2 < 0)
             r = r2;
     }
-    logger.log(Logger::Debug, "  SixFS::chmod(\"%s\", 0%ho): %s", path, mode,
-            (r == 0 ? "success" : strerror(-r)));
-    structureUnlockShared();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::chmod(\"%s\", 0%ho): %s", path, mode,
+                (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::chown(Handle* handle, const char* path, uint32_t uid, uint32_t gid)
 {
-    structureLockShared();
     int r = 0;
     Handle* h = handle;
     if (!h)
@@ -630,15 +755,14 @@ int SixFS::chown(Handle* handle, const char* path, uint32_t uid, uint32_t gid)
         if (r == 0 && r2 < 0)
             r = r2;
     }
-    logger.log(Logger::Debug, "  SixFS::chown(\"%s\", %u, %u): %s", path, uid, gid,
-            (r == 0 ? "success" : strerror(-r)));
-    structureUnlockShared();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::chown(\"%s\", %u, %u): %s", path, uid, gid,
+                (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::utimens(Handle* handle, const char* path, bool updateAtime, const Time& atime, bool updateMtime, const Time& mtime, bool updateCtime, const Time& ctime)
 {
-    structureLockShared();
     int r = 0;
     Handle* h = handle;
     if (!h)
@@ -650,14 +774,13 @@ int SixFS::utimens(Handle* handle, const char* path, bool updateAtime, const Tim
         if (r == 0 && r2 < 0)
             r = r2;
     }
-    logger.log(Logger::Debug, "  SixFS::utimens(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockShared();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::utimens(\"%s\"): %s", path, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::truncate(Handle* handle, const char* path, uint64_t length)
 {
-    structureLockShared();
     int r = 0;
     Handle* h = handle;
     if (!h)
@@ -671,15 +794,14 @@ int SixFS::truncate(Handle* handle, const char* path, uint64_t length)
         if (r == 0 && r2 < 0)
             r = r2;
     }
-    logger.log(Logger::Debug, "  SixFS::truncate(\"%s\", %lu): %s", path, length,
-            (r == 0 ? "success" : strerror(-r)));
-    structureUnlockShared();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::truncate(\"%s\", %lu): %s", path, length,
+                (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::open(const char* path, bool readOnly, bool trunc, bool append, Handle** handle)
 {
-    structureLockExclusive();
     *handle = nullptr;
     int r = getHandle(path, handle);
     if (r == 0)
@@ -691,38 +813,160 @@ int SixFS::open(const char* path, bool readOnly, bool trunc, bool append, Handle
         }
         *handle = nullptr;
     }
-    logger.log(Logger::Debug, "  SixFS::open(\"%s\", %s, %s, %s): inode=%lu: %s", path,
-            readOnly ? "ro" : "rw",
-            trunc ? "trunc" : "notrunc",
-            append ? "append" : "noappend",
-            (r == 0 ? (*handle)->inodeIndex() : InvalidIndex),
-            (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::open(\"%s\", %s, %s, %s): inode=%lu: %s", path,
+                readOnly ? "ro" : "rw",
+                trunc ? "trunc" : "notrunc",
+                append ? "append" : "noappend",
+                (r == 0 ? (*handle)->inodeIndex() : InvalidIndex),
+                (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::close(Handle* handle)
 {
-    structureLockExclusive(); // the file might be deleted, therefore we need the exclusive lock
     uint64_t inodeIndex = handle->inodeIndex();
     int r = releaseHandle(handle);
-    logger.log(Logger::Debug, "  SixFS::close(%lu): %s", inodeIndex, (r == 0 ? "success" : strerror(-r)));
-    structureUnlockExclusive();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::close(%lu): %s", inodeIndex, (r == 0 ? "success" : strerror(-r)));
     return r;
 }
 
 int SixFS::read(Handle* handle, uint64_t offset, unsigned char* buf, size_t count)
 {
     int r = handle->read(offset, buf, count);
-    logger.log(Logger::Debug, "  SixFS::read(%lu, offset=%lu, count=%zu): %d (%s)", handle->inodeIndex(), offset, count,
-            r, (r < 0 ? strerror(-r) : "success"));
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::read(%lu, offset=%lu, count=%zu): %d (%s)", handle->inodeIndex(), offset, count,
+                r, (r < 0 ? strerror(-r) : "success"));
     return r;
 }
 
 int SixFS::write(Handle* handle, uint64_t offset, const unsigned char* buf, size_t count)
 {
     int r = handle->write(offset, buf, count);
-    logger.log(Logger::Debug, "  SixFS::write(%lu, offset=%lu, count=%zu): %d (%s)", handle->inodeIndex(), offset, count,
-            r, (r < 0 ? strerror(-r) : "success"));
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::write(%lu, offset=%lu, count=%zu): %d (%s)", handle->inodeIndex(), offset, count,
+                r, (r < 0 ? strerror(-r) : "success"));
+    return r;
+}
+
+int SixFS::writeFrom(Handle* handle, uint64_t offset, size_t count, DataSource* source)
+{
+    int r = handle->writeFrom(offset, count, source);
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::writeFrom(%lu, offset=%lu, count=%zu): %d (%s)", handle->inodeIndex(), offset, count,
+                r, (r < 0 ? strerror(-r) : "success"));
+    return r;
+}
+
+int SixFS::fallocate(Handle* handle, uint64_t offset, uint64_t length, bool zero, bool keepSize)
+{
+    int r = 0;
+    if (handle->inode().type() != TypeREG)
+        r = -ENODEV;
+    else if (zero)
+        r = handle->zeroRange(offset, length, keepSize);
+    else
+        r = handle->allocate(offset, length, keepSize);
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::fallocate(%lu, offset=%lu, length=%lu, zero=%d, keepSize=%d): %s",
+                handle->inodeIndex(), offset, length, zero ? 1 : 0, keepSize ? 1 : 0, (r == 0 ? "success" : strerror(-r)));
+    return r;
+}
+
+int SixFS::seek(Handle* handle, uint64_t offset, bool data, uint64_t* result)
+{
+    int r = 0;
+    if (handle->inode().type() != TypeREG)
+        r = -EINVAL;
+    else
+        r = handle->seek(offset, data, result);
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::seek(%lu, offset=%lu, %s): %s", handle->inodeIndex(), offset,
+                data ? "data" : "hole", (r == 0 ? "success" : strerror(-r)));
+    return r;
+}
+
+int SixFS::copyData(Handle* inHandle, uint64_t inOffset, Handle* outHandle, uint64_t outOffset, size_t count,
+        std::vector<unsigned char>& buf)
+{
+    constexpr size_t MaxBufSize = 1 << 20;
+    int r = 0;
+    size_t done = 0;
+    while (done < count) {
+        size_t n = std::min(count - done, MaxBufSize);
+        if (buf.size() < n) {
+            try {
+                buf.resize(n);
+            }
+            catch (...) {
+                r = -ENOMEM;
+                break;
+            }
+        }
+        r = inHandle->read(inOffset + done, buf.data(), n);
+        if (r <= 0)
+            break;
+        n = r;
+        r = outHandle->write(outOffset + done, buf.data(), n);
+        if (r < 0)
+            break;
+        done += r;
+        if (size_t(r) < n)
+            break;
+    }
+    return (done > 0 ? done : r);
+}
+
+int SixFS::copyFileRange(Handle* inHandle, uint64_t inOffset, Handle* outHandle, uint64_t outOffset, size_t count)
+{
+    // our return value must fit into an int
+    constexpr size_t MaxCount = size_t(1) << 30;
+    if (count > MaxCount)
+        count = MaxCount;
+
+    std::vector<unsigned char> buf;
+    size_t done = 0;
+    int r = 0;
+    const size_t blockSize = _base->blockSize();
+    if (inHandle != outHandle && inOffset % blockSize == outOffset % blockSize) {
+        // copy the head up to the next block boundary, share the blocks
+        // after that, and copy what could not be shared
+        size_t head = std::min(count, (blockSize - inOffset % blockSize) % blockSize);
+        if (head > 0)
+            r = copyData(inHandle, inOffset, outHandle, outOffset, head, buf);
+        if (r >= 0) {
+            done = r;
+            if (done == head && done < count) {
+                uint64_t sharedBytes;
+                r = outHandle->shareBlocks(inHandle, inOffset + done, outOffset + done, count - done, &sharedBytes);
+                done += sharedBytes;
+            }
+        }
+    }
+    if (r >= 0 && done < count) {
+        r = copyData(inHandle, inOffset + done, outHandle, outOffset + done, count - done, buf);
+        if (r >= 0)
+            done += r;
+    }
+    if (done > 0)
+        r = done;
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::copyFileRange(%lu, offset=%lu, %lu, offset=%lu, count=%zu): %d (%s)",
+                inHandle->inodeIndex(), inOffset, outHandle->inodeIndex(), outOffset, count,
+                r, (r < 0 ? strerror(-r) : "success"));
+    return r;
+}
+
+int SixFS::fsync(Handle* handle)
+{
+    int r = handle->sync();
+    int r2 = _base->flushCaches(handle->inodeIndex());
+    if (r == 0)
+        r = r2;
+    if (r == 0)
+        r = _base->fsync();
+    if (logger.enabled(Logger::Debug))
+        logger.log(Logger::Debug, "  SixFS::fsync(%lu): %s", handle->inodeIndex(), (r == 0 ? "success" : strerror(-r)));
     return r;
 }
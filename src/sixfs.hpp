@@ -29,23 +29,26 @@
 #include "block.hpp"
 #include "handle.hpp"
 #include "base.hpp"
+#include "dentry_cache.hpp"
 
 
 class SixFS
 {
+public:
+    typedef enum { RenameNormal, RenameNoreplace, RenameExchange } RenameMode;
+
+    // The parameters of a SixFS in addition to those of its Base
+    class Options : public Base::Options
+    {
+    public:
+        size_t dentryCacheSize = 0;           // 0 disables the dentry cache
+        uint64_t dirFormat = DirFormatSorted; // for new directories
+    };
+
 private:
-    const Storage::Type _type;
-    const std::string _dirName;
-    const uint64_t _maxSize;
-    const std::vector<unsigned char> _key;
-    const bool _punchHoles;
+    const Options _options;
     Base* _base;
-
-    /* Helper functions for locking */
-    void structureLockExclusive();
-    void structureUnlockExclusive();
-    void structureLockShared();
-    void structureUnlockShared();
+    DentryCache* _dentryCache; // nullptr if disabled
 
     /* Helper functions to get a handle from the Base */
     int getHandle(uint64_t inodeIndex, Handle** handle);
@@ -53,21 +56,38 @@ private:
     int getHandle(const char* path, Handle** handle);
     int releaseHandle(Handle* handle); // might return errors associated with the inode
 
-    /* Lookup functions. The caller must hold the structure lock. */
+    /* Lookup functions. There is no global lock: a lookup holds a reference to
+     * each directory on its path while it looks up the next component, and
+     * gets the reference to that component while it holds the lock of the
+     * directory (or, for cached entries, while the cache entry cannot be
+     * removed). Since removed inodes are only destroyed when their last
+     * reference is released, every handle found this way is valid. */
     static void separate(const char* path, size_t len, size_t* parentLen, size_t* nameOffset, size_t* nameLen);
-    int recursiveFind(const char* path, size_t len, uint64_t* inodeIndex); // only to be called from findInode()!
-    int findInode(const char* path, size_t pathLen, uint64_t* inodeIndex);
+    int lookup(Handle* parentHandle, const char* name, size_t nameLen, Handle** handle);
+    int recursiveFind(const char* path, size_t len, Handle** handle); // only to be called from getHandle()!
+    void forgetDentry(uint64_t parentIndex, const char* name, size_t nameLen);
+    void forgetDir(uint64_t inodeIndex);
+
+    /* Helper function for copyFileRange(): copy data through a buffer */
+    int copyData(Handle* inHandle, uint64_t inOffset, Handle* outHandle, uint64_t outOffset, size_t count,
+            std::vector<unsigned char>& buf);
 
-    /* Helper functions to create or remove directory entries. The caller must hold the structure lock. */
+    /* Helper functions to create or remove directory entries. */
     int mkdirent(const char* path, uint64_t existingInodeIndex, std::function<Inode (const Inode& parentInode)> inodeCreator);
     int rmdirent(const char* path, std::function<int (const Inode& inode)> inodeChecker);
+    // One attempt at a rename; sets retry if it could not get all locks and needs to start over
+    int renameTry(const char* oldPath, const char* newPath, RenameMode mode, bool* retry);
 
 public:
-    SixFS(Storage::Type type, const std::string& dirName, uint64_t maxSize, const std::vector<unsigned char>& key, bool punchHoles);
+    SixFS(const Options& options);
     ~SixFS();
 
     int mount(std::string& errStr);
     int unmount();
+    // Start background threads; must be called after the process daemonized
+    void startThreads();
+    // Log operation statistics and cache hit rates, see Stats
+    void logStats();
 
     int statfs(size_t* blockSize, size_t* maxNameLen,
             uint64_t* maxBlockCount, uint64_t* freeBlockCount, uint64_t* maxInodeCount, uint64_t* freeInodeCount);
@@ -85,7 +105,6 @@ public:
 
     int link(const char* oldpath, const char* newpath);
 
-    typedef enum { RenameNormal, RenameNoreplace, RenameExchange } RenameMode;
     int rename(const char* oldpath, const char* newpath, RenameMode mode);
 
     int chmod(Handle* handle, const char* path, uint16_t mode);
@@ -95,11 +114,23 @@ public:
 
     int openDir(const char* path, Handle** handle);
     int closeDir(Handle* handle);
-    int readDirent(Handle* handle, uint64_t direntSlot, Dirent* dirent);
-    int readDirentPlus(Handle* handle, uint64_t direntSlot, Dirent* dirent, Inode* inode);
+    // Read the first entry in a slot >= *direntSlot; *direntSlot is set to its slot
+    int readDirent(Handle* handle, uint64_t* direntSlot, Dirent* dirent);
+    // continued: this call directly follows the previous one in the same readdir request
+    int readDirentPlus(Handle* handle, uint64_t* direntSlot, Dirent* dirent, Inode* inode, bool continued);
 
     int open(const char* path, bool readOnly, bool trunc, bool append, Handle** handle);
     int close(Handle* handle);
     int read(Handle* handle, uint64_t offset, unsigned char* buf, size_t count);
     int write(Handle* handle, uint64_t offset, const unsigned char* buf, size_t count);
+    int writeFrom(Handle* handle, uint64_t offset, size_t count, DataSource* source);
+    // Preallocate blocks, or zero the range and punch a hole, see fallocate(2)
+    int fallocate(Handle* handle, uint64_t offset, uint64_t length, bool zero, bool keepSize);
+    // Find data or holes, see lseek(2) with SEEK_DATA and SEEK_HOLE
+    int seek(Handle* handle, uint64_t offset, bool data, uint64_t* result);
+    // Copy data between files, sharing whole blocks instead of copying them where
+    // the offsets allow it; returns the number of bytes copied
+    int copyFileRange(Handle* inHandle, uint64_t inOffset, Handle* outHandle, uint64_t outOffset, size_t count);
+    // Write pending changes of an open file or directory; works for both
+    int fsync(Handle* handle);
 };
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2023, 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdio>
+
+#include <algorithm>
+
+#include "stats.hpp"
+#include "logger.hpp"
+
+
+static const char* eventName(Stats::Event e)
+{
+    static const char* names[Stats::EventCount] = {
+        "getattr", "readlink", "mknod", "mkdir", "unlink", "rmdir", "symlink",
+        "rename", "link", "chmod", "chown", "utimens", "truncate", "open",
+        "read", "write", "statfs", "release", "fsync", "opendir", "readdir",
+        "releasedir", "copy_file_range", "fallocate", "lseek",
+        "path lookup", "encrypt", "decrypt",
+        "handle lock wait", "handle map lock wait", "chunk lock wait"
+    };
+    return names[e];
+}
+
+// Format a duration in ns with a suitable unit
+static void formatDuration(double ns, char* buf, size_t bufSize)
+{
+    if (ns < 1e3)
+        snprintf(buf, bufSize, "%.0fns", ns);
+    else if (ns < 1e6)
+        snprintf(buf, bufSize, "%.1fus", ns / 1e3);
+    else if (ns < 1e9)
+        snprintf(buf, bufSize, "%.1fms", ns / 1e6);
+    else
+        snprintf(buf, bufSize, "%.1fs", ns / 1e9);
+}
+
+Stats::Slab::Slab()
+{
+    for (int e = 0; e < EventCount; e++) {
+        for (int b = 0; b < Buckets; b++)
+            counts[e][b] = 0;
+        sums[e] = 0;
+    }
+}
+
+Stats::SlabOwner::SlabOwner()
+{
+    std::lock_guard<std::mutex> lock(stats._mutex);
+    if (stats._freeSlabs.empty()) {
+        slab = new Slab;
+        stats._slabs.push_back(slab);
+    } else {
+        slab = stats._freeSlabs.back();
+        stats._freeSlabs.pop_back();
+    }
+}
+
+Stats::SlabOwner::~SlabOwner()
+{
+    std::lock_guard<std::mutex> lock(stats._mutex);
+    stats._freeSlabs.push_back(slab);
+}
+
+Stats::Slab* Stats::slab()
+{
+    thread_local SlabOwner owner;
+    return owner.slab;
+}
+
+Stats::Stats() : _reporterStop(false)
+{
+    sem_init(&_reportRequests, 0, 0);
+}
+
+Stats::~Stats()
+{
+    stopReporter();
+    sem_destroy(&_reportRequests);
+    for (size_t i = 0; i < _slabs.size(); i++)
+        delete _slabs[i];
+}
+
+void Stats::record(Event e, uint64_t ns)
+{
+    int b = 0;
+    if (ns > 1)
+        b = std::min(63 - __builtin_clzll(ns), Buckets - 1);
+    // only this thread writes to its slab, so no atomic read-modify-write is needed
+    Slab* s = slab();
+    s->counts[e][b].store(s->counts[e][b].load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    s->sums[e].store(s->sums[e].load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+}
+
+void Stats::log()
+{
+    uint64_t counts[EventCount][Buckets] = {};
+    uint64_t sums[EventCount] = {};
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        for (size_t i = 0; i < _slabs.size(); i++) {
+            for (int e = 0; e < EventCount; e++) {
+                for (int b = 0; b < Buckets; b++)
+                    counts[e][b] += _slabs[i]->counts[e][b].load(std::memory_order_relaxed);
+                sums[e] += _slabs[i]->sums[e].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    for (int e = 0; e < EventCount; e++) {
+        uint64_t n = 0;
+        for (int b = 0; b < Buckets; b++)
+            n += counts[e][b];
+        if (n == 0)
+            continue;
+        // percentiles are given as the upper bound of their bucket
+        const double quantiles[4] = { 0.5, 0.9, 0.99, 1.0 };
+        char q[4][16];
+        uint64_t cumulative = 0;
+        int b = 0;
+        for (int i = 0; i < 4; i++) {
+            while (b < Buckets - 1 && cumulative + counts[e][b] < quantiles[i] * n)
+                cumulative += counts[e][b++];
+            formatDuration(double(uint64_t(2) << b), q[i], sizeof(q[i]));
+        }
+        char mean[16];
+        char total[16];
+        formatDuration(double(sums[e]) / n, mean, sizeof(mean));
+        formatDuration(double(sums[e]), total, sizeof(total));
+        logger.log(Logger::Info, "stats: %-20s n=%lu total=%s mean=%s p50<%s p90<%s p99<%s max<%s",
+                eventName(Event(e)), n, total, mean, q[0], q[1], q[2], q[3]);
+    }
+}
+
+void Stats::startReporter(const std::function<void ()>& report)
+{
+    if (_reporter.joinable())
+        return;
+    try {
+        _reporter = std::thread([this, report]() {
+                for (;;) {
+                    while (sem_wait(&_reportRequests) != 0 && errno == EINTR)
+                        ;
+                    if (_reporterStop)
+                        break;
+                    report();
+                }
+            });
+    }
+    catch (...) {
+        logger.log(Logger::Error, "cannot start statistics thread; statistics are only reported on unmount");
+    }
+}
+
+void Stats::stopReporter()
+{
+    if (_reporter.joinable()) {
+        _reporterStop = true;
+        sem_post(&_reportRequests);
+        _reporter.join();
+    }
+}
+
+void Stats::requestReport()
+{
+    sem_post(&_reportRequests);
+}
+
+Stats stats;
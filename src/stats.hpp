@@ -0,0 +1,137 @@
+/*
+ * Copyright (C) 2023, 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <ctime>
+#include <cstdint>
+
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <semaphore.h>
+
+
+/* Latency histograms of FUSE operations, encryption and lock waits.
+ * Each thread records into its own slab of counters, so that recording
+ * needs no lock and shares no cache lines with other threads; a report sums
+ * the slabs of all threads. The slab of a finished thread is reused by the
+ * next new thread, so its counts are kept. */
+class Stats
+{
+public:
+    typedef enum {
+        // FUSE operations
+        OpGetattr, OpReadlink, OpMknod, OpMkdir, OpUnlink, OpRmdir, OpSymlink,
+        OpRename, OpLink, OpChmod, OpChown, OpUtimens, OpTruncate, OpOpen,
+        OpRead, OpWrite, OpStatfs, OpRelease, OpFsync, OpOpendir, OpReaddir,
+        OpReleasedir, OpCopyFileRange, OpFallocate, OpLseek,
+        // internal operations
+        PathLookup, Encrypt, Decrypt,
+        // waiting for locks; only contended acquisitions are recorded
+        WaitHandleLock, WaitHandleMapLock, WaitChunkLock,
+        EventCount
+    } Event;
+
+    // Bucket b counts durations from 2^b to 2^(b+1) ns; the last one also holds all longer ones
+    static constexpr int Buckets = 32;
+
+private:
+    class Slab
+    {
+    public:
+        std::atomic<uint64_t> counts[EventCount][Buckets];
+        std::atomic<uint64_t> sums[EventCount]; // ns
+        Slab();
+    };
+    class SlabOwner
+    {
+    public:
+        Slab* slab;
+        SlabOwner();
+        ~SlabOwner();
+    };
+
+    std::mutex _mutex; // protects the slab lists
+    std::vector<Slab*> _slabs;
+    std::vector<Slab*> _freeSlabs;
+
+    sem_t _reportRequests;
+    std::thread _reporter;
+    std::atomic<bool> _reporterStop;
+
+    static Slab* slab();
+
+public:
+    Stats();
+    ~Stats();
+
+    static uint64_t now()
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+    }
+
+    void record(Event e, uint64_t ns);
+
+    // Log the count, mean and approximate percentiles of all events that occurred
+    void log();
+
+    // Run report() whenever a report is requested, in a thread of its own
+    void startReporter(const std::function<void ()>& report);
+    void stopReporter();
+    // May be called from a signal handler
+    void requestReport();
+};
+
+extern Stats stats;
+
+// Records the lifetime of the object as an event
+class StatsTimer
+{
+private:
+    const Stats::Event _e;
+    const uint64_t _start;
+
+public:
+    StatsTimer(Stats::Event e) : _e(e), _start(Stats::now()) {}
+    ~StatsTimer() { stats.record(_e, Stats::now() - _start); }
+};
+
+// Lock m (a mutex or a lock object); if it is contended, record the wait
+template<typename M> void lockRecordingWait(M& m, Stats::Event e)
+{
+    if (!m.try_lock()) {
+        uint64_t start = Stats::now();
+        m.lock();
+        stats.record(e, Stats::now() - start);
+    }
+}
+
+template<typename M> void lockSharedRecordingWait(M& m, Stats::Event e)
+{
+    if (!m.try_lock_shared()) {
+        uint64_t start = Stats::now();
+        m.lock_shared();
+        stats.record(e, Stats::now() - start);
+    }
+}
@@ -22,12 +22,18 @@
 #include <cstring>
 #include <cerrno>
 
+#include <fcntl.h>
+
 
 Storage::Storage() :
     _chunkSize(1),
     _chunksIn(0),
     _chunksOut(0),
-    _chunksPunchedHole(0)
+    _chunksPunchedHole(0),
+    _syncRunning(false),
+    _syncsStarted(0),
+    _syncsFinished(0),
+    _lastSyncResult(0)
 {
 }
 
@@ -45,6 +51,18 @@ void Storage::setChunkSize(size_t chunkSize)
     _chunkSize = chunkSize;
 }
 
+int Storage::fileDescriptor() const
+{
+    return -1;
+}
+
+void Storage::adviseWillNeedBytes(uint64_t index, uint64_t size)
+{
+    int fd = fileDescriptor();
+    if (fd >= 0)
+        ::posix_fadvise(fd, index, size, POSIX_FADV_WILLNEED);
+}
+
 int Storage::size(uint64_t* s)
 {
     uint64_t bytes;
@@ -87,6 +105,69 @@ int Storage::setSize(uint64_t size)
     return setSizeBytes(size * _chunkSize);
 }
 
+int Storage::readBytesV(uint64_t index, size_t bufCount, size_t bufSize, void* const* bufs)
+{
+    for (size_t i = 0; i < bufCount; i++) {
+        int r = readBytes(index + i * bufSize, bufSize, bufs[i]);
+        if (r < 0)
+            return r;
+    }
+    return 0;
+}
+
+int Storage::writeBytesV(uint64_t index, size_t bufCount, size_t bufSize, const void* const* bufs)
+{
+    for (size_t i = 0; i < bufCount; i++) {
+        int r = writeBytes(index + i * bufSize, bufSize, bufs[i]);
+        if (r < 0)
+            return r;
+    }
+    return 0;
+}
+
+int Storage::syncBytes()
+{
+    return 0;
+}
+
+void Storage::syncBytesMany(Storage* const* storages, size_t count, int* results)
+{
+    for (size_t i = 0; i < count; i++)
+        results[i] = storages[i]->syncBytes();
+}
+
+int Storage::readv(uint64_t index, uint64_t size, void* const* bufs)
+{
+    int r = readBytesV(index * _chunkSize, size, _chunkSize, bufs);
+    if (r < 0)
+        return r;
+    _chunksIn += size;
+    return 0;
+}
+
+int Storage::writev(uint64_t index, uint64_t size, const void* const* bufs)
+{
+    int r = writeBytesV(index * _chunkSize, size, _chunkSize, bufs);
+    if (r < 0)
+        return r;
+    _chunksOut += size;
+    return 0;
+}
+
+int Storage::locate(uint64_t index, int* fd, uint64_t* pos)
+{
+    *fd = fileDescriptor();
+    if (*fd < 0)
+        return -ENOTSUP;
+    *pos = index * _chunkSize;
+    return 0;
+}
+
+void Storage::adviseWillNeed(uint64_t index, uint64_t size)
+{
+    adviseWillNeedBytes(index * _chunkSize, size * _chunkSize);
+}
+
 uint64_t Storage::chunksIn() const
 {
     return _chunksIn;
@@ -101,3 +182,84 @@ uint64_t Storage::chunksPunchedHole() const
 {
     return _chunksPunchedHole;
 }
+
+int Storage::sync()
+{
+    std::unique_lock<std::mutex> lock(_syncMutex);
+    // A sync that is already running might have started before our data was
+    // written, so we need the one after it. All callers that arrive while a
+    // sync is running are served by the same next sync.
+    uint64_t neededSync = _syncsStarted + 1;
+    for (;;) {
+        if (_syncsFinished >= neededSync)
+            return _lastSyncResult;
+        if (!_syncRunning)
+            break;
+        _syncFinishedCond.wait(lock);
+    }
+    _syncRunning = true;
+    uint64_t thisSync = ++_syncsStarted;
+    lock.unlock();
+    int r = syncBytes();
+    lock.lock();
+    _syncRunning = false;
+    _syncsFinished = thisSync;
+    _lastSyncResult = r;
+    _syncFinishedCond.notify_all();
+    return r;
+}
+
+int Storage::syncMany(const std::vector<Storage*>& storages)
+{
+    // Start a sync in each storage that has none running. Storages that have
+    // one running are handled by sync() afterwards, so that we never wait for
+    // another sync while the ones we started are still unfinished.
+    std::vector<Storage*> started;
+    std::vector<uint64_t> startedSyncs;
+    std::vector<Storage*> busy;
+    std::vector<int> results;
+    // allocate everything first, so that no sync is left marked as running
+    try {
+        started.reserve(storages.size());
+        startedSyncs.reserve(storages.size());
+        busy.reserve(storages.size());
+        results.resize(storages.size());
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    for (size_t i = 0; i < storages.size(); i++) {
+        Storage* s = storages[i];
+        std::lock_guard<std::mutex> lock(s->_syncMutex);
+        if (s->_syncRunning) {
+            busy.push_back(s);
+        } else {
+            s->_syncRunning = true;
+            startedSyncs.push_back(++s->_syncsStarted);
+            started.push_back(s);
+        }
+    }
+
+    int r = 0;
+    if (started.size() > 0) {
+        started[0]->syncBytesMany(started.data(), started.size(), results.data());
+        for (size_t i = 0; i < started.size(); i++) {
+            Storage* s = started[i];
+            {
+                std::lock_guard<std::mutex> lock(s->_syncMutex);
+                s->_syncRunning = false;
+                s->_syncsFinished = startedSyncs[i];
+                s->_lastSyncResult = results[i];
+            }
+            s->_syncFinishedCond.notify_all();
+            if (r == 0)
+                r = results[i];
+        }
+    }
+    for (size_t i = 0; i < busy.size(); i++) {
+        int rs = busy[i]->sync();
+        if (r == 0)
+            r = rs;
+    }
+    return r;
+}
@@ -19,6 +19,9 @@
 #pragma once
 
 #include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
 
 #include <cstdint>
 #include <cstddef>
@@ -29,8 +32,8 @@
  * The StorageFile and StorageMemory classes implement the byte-oriented interfaces;
  * the chunk stuff including encryption is handled by this class.
  *
- * Derived classes must be able to handle concurrent calls to readBytes() and writeBytes(),
- * but other calls don't need to be thread safe.
+ * Derived classes must be able to handle concurrent calls to readBytes(), writeBytes()
+ * and syncBytes(), but other calls don't need to be thread safe.
  */
 class Storage
 {
@@ -38,6 +41,7 @@ public:
     typedef enum {
         TypeMmap,
         TypeFile,
+        TypeUring,
         TypeMem
     } Type;
 
@@ -47,6 +51,14 @@ private:
     std::atomic<uint64_t> _chunksOut;
     std::atomic<uint64_t> _chunksPunchedHole;
 
+    // Group commit: concurrent sync() calls share syncBytes() calls
+    std::mutex _syncMutex;
+    std::condition_variable _syncFinishedCond;
+    bool _syncRunning;
+    uint64_t _syncsStarted;
+    uint64_t _syncsFinished;
+    int _lastSyncResult;
+
 public:
     Storage();
     virtual ~Storage();
@@ -67,6 +79,27 @@ public:
     virtual int writeBytes(uint64_t index, uint64_t size, const void* buf) = 0;
     virtual int punchHoleBytes(uint64_t index, uint64_t size) = 0;
     virtual int setSizeBytes(uint64_t size) = 0;
+    // Vectored byte-oriented input / output: bufCount buffers of bufSize bytes each
+    // are read from / written to consecutive bytes starting at index. The default
+    // implementation calls readBytes() / writeBytes() once per buffer; subclasses
+    // may override this if they can do better.
+    virtual int readBytesV(uint64_t index, size_t bufCount, size_t bufSize, void* const* bufs);
+    virtual int writeBytesV(uint64_t index, size_t bufCount, size_t bufSize, const void* const* bufs);
+    // Make all data written so far durable. The default implementation does
+    // nothing, which is right for storage that does not survive anyway.
+    virtual int syncBytes();
+    // Like syncBytes(), for this and several other storages at once; results[i]
+    // gets the result for storages[i] (storages[0] is this storage). The default
+    // implementation calls syncBytes() for each; subclasses may override this if
+    // they can do better.
+    virtual void syncBytesMany(Storage* const* storages, size_t count, int* results);
+
+    // File descriptor of the underlying file, or -1 if there is none
+    // (the default; subclasses may override this)
+    virtual int fileDescriptor() const;
+    // Hint that the given bytes will be read soon. The default implementation
+    // uses posix_fadvise() on the file descriptor if there is one.
+    virtual void adviseWillNeedBytes(uint64_t index, uint64_t size);
 
     // Chunk-oriented input / output (implemented by this class)
     int size(uint64_t* s);
@@ -74,6 +107,22 @@ public:
     int write(uint64_t index, uint64_t size, const void* buf);
     int punchHole(uint64_t index, uint64_t size);
     int setSize(uint64_t size);
+    // Vectored chunk-oriented input / output: size consecutive chunks starting
+    // at index, each from / to its own buffer
+    int readv(uint64_t index, uint64_t size, void* const* bufs);
+    int writev(uint64_t index, uint64_t size, const void* const* bufs);
+    // Locate a chunk in the underlying file so that callers can transfer its
+    // data themselves, e.g. via splice(). Returns -ENOTSUP if there is no file.
+    // Such transfers are not counted in the statistics.
+    int locate(uint64_t index, int* fd, uint64_t* pos);
+    // Hint that size chunks starting at index will be read soon
+    void adviseWillNeed(uint64_t index, uint64_t size);
+    // Make all data written before the call durable. Concurrent callers are
+    // served by a single syncBytes() call where possible (group commit).
+    int sync();
+    // Like sync() for several storages, with their syncBytes() calls combined
+    // into one syncBytesMany() call where possible. Returns the first error.
+    static int syncMany(const std::vector<Storage*>& storages);
 
     // Statistics
     uint64_t chunksIn() const;
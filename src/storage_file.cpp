@@ -23,6 +23,7 @@
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/statvfs.h>
+#include <sys/uio.h>
 
 #include "storage_file.hpp"
 #include "logger.hpp"
@@ -33,7 +34,7 @@
 volatile int dontPunchHoles;
 
 
-StorageFile::StorageFile(const std::string& name) : _name(name), _fd(0)
+StorageFile::StorageFile(const std::string& name, bool directIO) : _name(name), _fd(0), _directIO(directIO)
 {
 }
 
@@ -44,9 +45,12 @@ StorageFile::~StorageFile()
 
 int StorageFile::open()
 {
-    int r = ::open(_name.c_str(), O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
-    if (r < 0)
+    int r = ::open(_name.c_str(), O_RDWR | O_CREAT | (_directIO ? O_DIRECT : 0), S_IRUSR | S_IWUSR);
+    if (r < 0) {
+        if (_directIO && errno == EINVAL)
+            logger.log(Logger::Error, "%s: file system does not support direct I/O", _name.c_str());
         return -errno;
+    }
     _fd = r;
     return 0;
 }
@@ -62,6 +66,13 @@ int StorageFile::close()
     return 0;
 }
 
+int StorageFile::fileDescriptor() const
+{
+    // With direct I/O, callers cannot transfer data at arbitrary offsets,
+    // so we pretend there is no file and they use read() / write() instead
+    return (_directIO ? -1 : _fd);
+}
+
 int StorageFile::stat(uint64_t* maxBytes, uint64_t* availableBytes)
 {
     struct statvfs statfsbuf;
@@ -81,8 +92,36 @@ int StorageFile::sizeInBytes(uint64_t* s)
     return 0;
 }
 
+bool StorageFile::needsBounce(size_t bufCount, const void* const* bufs) const
+{
+    if (_directIO) {
+        for (size_t i = 0; i < bufCount; i++)
+            if (reinterpret_cast<uintptr_t>(bufs[i]) % DirectIOAlignment != 0)
+                return true;
+    }
+    return false;
+}
+
+static void* allocateBounceBuffer(size_t size)
+{
+    void* ptr = nullptr;
+    if (posix_memalign(&ptr, StorageFile::DirectIOAlignment, size) != 0)
+        return nullptr;
+    return ptr;
+}
+
 int StorageFile::readBytes(uint64_t index, uint64_t size, void* buf)
 {
+    if (needsBounce(1, &buf)) {
+        void* bounce = allocateBounceBuffer(size);
+        if (!bounce)
+            return -ENOMEM;
+        int r = readBytes(index, size, bounce);
+        if (r == 0)
+            memcpy(buf, bounce, size);
+        free(bounce);
+        return r;
+    }
     while (size > 0) {
         ssize_t r = ::pread(_fd, buf, size, index);
         if (r < 0)
@@ -95,6 +134,15 @@ int StorageFile::readBytes(uint64_t index, uint64_t size, void* buf)
 
 int StorageFile::writeBytes(uint64_t index, uint64_t size, const void* buf)
 {
+    if (needsBounce(1, &buf)) {
+        void* bounce = allocateBounceBuffer(size);
+        if (!bounce)
+            return -ENOMEM;
+        memcpy(bounce, buf, size);
+        int r = writeBytes(index, size, bounce);
+        free(bounce);
+        return r;
+    }
     while (size > 0) {
         ssize_t r = ::pwrite(_fd, buf, size, index);
         if (r < 0)
@@ -125,3 +173,87 @@ int StorageFile::setSizeBytes(uint64_t size)
         return -errno;
     return 0;
 }
+
+int StorageFile::syncBytes()
+{
+    if (fdatasync(_fd) != 0)
+        return -errno;
+    return 0;
+}
+
+// Maximum number of buffers passed to a single preadv() / pwritev() call
+static constexpr int MaxIovecs = 64;
+
+// Fill iov with the remaining parts of the buffers, starting with buffer
+// bufsDone of which the first bufOffset bytes were already transferred.
+static int fillIovecs(struct iovec* iov, size_t bufsDone, size_t bufOffset,
+        size_t bufCount, size_t bufSize, const void* const* bufs)
+{
+    int iovcnt = 0;
+    for (size_t i = bufsDone; i < bufCount && iovcnt < MaxIovecs; i++) {
+        size_t o = (i == bufsDone ? bufOffset : 0);
+        iov[iovcnt].iov_base = const_cast<unsigned char*>(static_cast<const unsigned char*>(bufs[i])) + o;
+        iov[iovcnt].iov_len = bufSize - o;
+        iovcnt++;
+    }
+    return iovcnt;
+}
+
+int StorageFile::readBytesV(uint64_t index, size_t bufCount, size_t bufSize, void* const* bufs)
+{
+    if (needsBounce(bufCount, bufs)) {
+        unsigned char* bounce = static_cast<unsigned char*>(allocateBounceBuffer(bufCount * bufSize));
+        if (!bounce)
+            return -ENOMEM;
+        int r = readBytes(index, bufCount * bufSize, bounce);
+        if (r == 0)
+            for (size_t i = 0; i < bufCount; i++)
+                memcpy(bufs[i], bounce + i * bufSize, bufSize);
+        free(bounce);
+        return r;
+    }
+    struct iovec iov[MaxIovecs];
+    size_t bufsDone = 0;
+    size_t bufOffset = 0;
+    while (bufsDone < bufCount) {
+        int iovcnt = fillIovecs(iov, bufsDone, bufOffset, bufCount, bufSize, bufs);
+        ssize_t r = ::preadv(_fd, iov, iovcnt, index);
+        if (r < 0)
+            return -errno;
+        if (r == 0)
+            return -EIO;
+        index += r;
+        bufOffset += r;
+        bufsDone += bufOffset / bufSize;
+        bufOffset %= bufSize;
+    }
+    return 0;
+}
+
+int StorageFile::writeBytesV(uint64_t index, size_t bufCount, size_t bufSize, const void* const* bufs)
+{
+    if (needsBounce(bufCount, bufs)) {
+        unsigned char* bounce = static_cast<unsigned char*>(allocateBounceBuffer(bufCount * bufSize));
+        if (!bounce)
+            return -ENOMEM;
+        for (size_t i = 0; i < bufCount; i++)
+            memcpy(bounce + i * bufSize, bufs[i], bufSize);
+        int r = writeBytes(index, bufCount * bufSize, bounce);
+        free(bounce);
+        return r;
+    }
+    struct iovec iov[MaxIovecs];
+    size_t bufsDone = 0;
+    size_t bufOffset = 0;
+    while (bufsDone < bufCount) {
+        int iovcnt = fillIovecs(iov, bufsDone, bufOffset, bufCount, bufSize, bufs);
+        ssize_t r = ::pwritev(_fd, iov, iovcnt, index);
+        if (r < 0)
+            return -errno;
+        index += r;
+        bufOffset += r;
+        bufsDone += bufOffset / bufSize;
+        bufOffset %= bufSize;
+    }
+    return 0;
+}
@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -22,23 +22,39 @@
 
 #include "storage.hpp"
 
-/* Storage in a file */
+/* Storage in a file.
+ *
+ * With directIO, the file is opened with O_DIRECT so that its data does not
+ * end up in the page cache. Offsets and sizes must then be multiples of
+ * DirectIOAlignment; buffers that are not aligned are copied through an
+ * aligned bounce buffer. */
 class StorageFile : public Storage
 {
-private:
+public:
+    static constexpr size_t DirectIOAlignment = 4096;
+
+protected:
     std::string _name;
     int _fd;
+    const bool _directIO;
+
+    // Whether one of the buffers must be copied through a bounce buffer
+    bool needsBounce(size_t bufCount, const void* const* bufs) const;
 
 public:
-    StorageFile(const std::string& name);
+    StorageFile(const std::string& name, bool directIO);
     ~StorageFile();
 
     virtual int open() override;
     virtual int close() override;
     virtual int stat(uint64_t* maxBytes, uint64_t* availableBytes) override;
+    virtual int fileDescriptor() const override;
     virtual int sizeInBytes(uint64_t* s) override;
     virtual int readBytes(uint64_t index, uint64_t size, void* buf) override;
     virtual int writeBytes(uint64_t index, uint64_t size, const void* buf) override;
     virtual int punchHoleBytes(uint64_t index, uint64_t size) override;
     virtual int setSizeBytes(uint64_t size) override;
+    virtual int syncBytes() override;
+    virtual int readBytesV(uint64_t index, size_t bufCount, size_t bufSize, void* const* bufs) override;
+    virtual int writeBytesV(uint64_t index, size_t bufCount, size_t bufSize, const void* const* bufs) override;
 };
@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -20,17 +20,37 @@
 
 #include <cstring>
 #include <cerrno>
+#include <algorithm>
 
+#include <unistd.h>
+#include <sys/mman.h>
 #include <sys/sysinfo.h>
 
 
+static unsigned char* allocateSlab()
+{
+    void* p = mmap(nullptr, StorageMemory::SlabSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return nullptr;
+    // Only a hint; whether huge pages are used depends on the system configuration
+    madvise(p, StorageMemory::SlabSize, MADV_HUGEPAGE);
+    return static_cast<unsigned char*>(p);
+}
+
+static void freeSlab(unsigned char* slab)
+{
+    munmap(slab, StorageMemory::SlabSize);
+}
+
 StorageMemory::StorageMemory() :
-    _fatalError(false)
+    _pagesize(sysconf(_SC_PAGE_SIZE)),
+    _size(0)
 {
 }
 
 StorageMemory::~StorageMemory()
 {
+    close();
 }
 
 int StorageMemory::open()
@@ -40,9 +60,10 @@ int StorageMemory::open()
 
 int StorageMemory::close()
 {
-    if (_fatalError)
-        return -EIO;
-    _storage.clear();
+    for (size_t i = 0; i < _slabs.size(); i++)
+        freeSlab(_slabs[i]);
+    _slabs.clear();
+    _size = 0;
     return 0;
 }
 
@@ -64,59 +85,99 @@ int StorageMemory::stat(uint64_t* maxBytes, uint64_t* availableBytes)
 
 int StorageMemory::sizeInBytes(uint64_t* s)
 {
-    if (_fatalError)
-        return -EIO;
-    *s = _storage.size();
+    *s = _size;
     return 0;
 }
 
 int StorageMemory::readBytes(uint64_t index, uint64_t size, void* buf)
 {
-    if (_fatalError)
+    if (index + size > _size)
         return -EIO;
-    if (index + size > _storage.size())
-        return -EIO;
-    ::memcpy(buf, _storage.data() + index, size);
+    unsigned char* dst = static_cast<unsigned char*>(buf);
+    while (size > 0) {
+        size_t offset = index % SlabSize;
+        size_t len = std::min(size, uint64_t(SlabSize - offset));
+        ::memcpy(dst, _slabs[index / SlabSize] + offset, len);
+        dst += len;
+        index += len;
+        size -= len;
+    }
     return 0;
 }
 
 int StorageMemory::writeBytes(uint64_t index, uint64_t size, const void* buf)
 {
-    if (_fatalError)
-        return -EIO;
-    if (index + size > _storage.size()) {
-        size_t newSize = index + size;
-        try {
-            _storage.resize(newSize);
-        }
-        catch (...) {
-            _fatalError = true;
-        }
-        if (_fatalError)
-            return -ENOMEM;
+    if (index + size > _size) {
+        int r = setSizeBytes(index + size);
+        if (r < 0)
+            return r;
+    }
+    const unsigned char* src = static_cast<const unsigned char*>(buf);
+    while (size > 0) {
+        size_t offset = index % SlabSize;
+        size_t len = std::min(size, uint64_t(SlabSize - offset));
+        ::memcpy(_slabs[index / SlabSize] + offset, src, len);
+        src += len;
+        index += len;
+        size -= len;
     }
-    ::memcpy(_storage.data() + index, buf, size);
     return 0;
 }
 
-int StorageMemory::punchHoleBytes(uint64_t /* index */, uint64_t /* size */)
+void StorageMemory::clear(unsigned char* slab, size_t from, size_t to)
 {
-    if (_fatalError)
-        return -EIO;
+    // Zero partial pages, and drop full pages: they read as zero afterwards
+    size_t firstPage = std::min((from + _pagesize - 1) / _pagesize * _pagesize, to);
+    size_t lastPage = std::max(to / _pagesize * _pagesize, firstPage);
+    ::memset(slab + from, 0, firstPage - from);
+    if (lastPage > firstPage)
+        ::madvise(slab + firstPage, lastPage - firstPage, MADV_DONTNEED);
+    ::memset(slab + lastPage, 0, to - lastPage);
+}
+
+int StorageMemory::punchHoleBytes(uint64_t index, uint64_t size)
+{
+    if (index + size > _size)
+        size = (index < _size ? _size - index : 0);
+    while (size > 0) {
+        size_t offset = index % SlabSize;
+        size_t len = std::min(size, uint64_t(SlabSize - offset));
+        clear(_slabs[index / SlabSize], offset, offset + len);
+        index += len;
+        size -= len;
+    }
     return 0;
 }
 
 int StorageMemory::setSizeBytes(uint64_t size)
 {
-    if (_fatalError)
-        return -EIO;
-    try {
-        _storage.resize(size, 0);
-    }
-    catch (...) {
-        _fatalError = true;
+    size_t slabCount = size / SlabSize + (size % SlabSize == 0 ? 0 : 1);
+    size_t oldSlabCount = _slabs.size();
+    if (slabCount > oldSlabCount) {
+        try {
+            _slabs.reserve(slabCount);
+        }
+        catch (...) {
+            return -ENOMEM;
+        }
+        for (size_t i = oldSlabCount; i < slabCount; i++) {
+            unsigned char* slab = allocateSlab();
+            if (!slab) {
+                for (size_t j = oldSlabCount; j < i; j++)
+                    freeSlab(_slabs[j]);
+                _slabs.resize(oldSlabCount);
+                return -ENOMEM;
+            }
+            _slabs.push_back(slab);
+        }
+    } else {
+        for (size_t i = slabCount; i < oldSlabCount; i++)
+            freeSlab(_slabs[i]);
+        _slabs.resize(slabCount);
     }
-    if (_fatalError)
-        return -ENOMEM;
+    // Bytes beyond the end must read as zero when the storage grows again
+    if (size < _size && size % SlabSize != 0)
+        clear(_slabs[size / SlabSize], size % SlabSize, std::min(uint64_t(SlabSize), _size - size / SlabSize * SlabSize));
+    _size = size;
     return 0;
 }
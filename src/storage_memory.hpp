@@ -1,5 +1,5 @@
 /*
- * Copyright (C) 2023
+ * Copyright (C) 2023, 2024
  * Martin Lambers <marlam@marlam.de>
  *
  *   This program is free software; you can redistribute it and/or modify
@@ -23,13 +23,27 @@
 #include "storage.hpp"
 
 
-/* Storage in memory */
+/* Storage in memory.
+ *
+ * The bytes are kept in fixed-size slabs of anonymous memory that are
+ * referenced by an index table, so growing and shrinking never copies data.
+ * Memory is only used for pages that were written to; punching a hole or
+ * shrinking gives the pages back to the system. */
 class StorageMemory : public Storage
 {
 public:
-    std::vector<unsigned char> _storage;
-    bool _fatalError;
+    // Same as the transparent huge page size on x86_64
+    static constexpr size_t SlabSize = 2 * 1024 * 1024;
+
+private:
+    const size_t _pagesize;
+    std::vector<unsigned char*> _slabs;
+    uint64_t _size;
 
+    // Make the given range of a slab read as zero and release its pages
+    void clear(unsigned char* slab, size_t from, size_t to);
+
+public:
     StorageMemory();
     ~StorageMemory();
 
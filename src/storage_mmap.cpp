@@ -24,15 +24,27 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/mman.h>
-#include <unistd.h>
+
+#include <algorithm>
 
 #include "storage_mmap.hpp"
+#include "logger.hpp"
+
+
+// defined in storage_file.cpp
+extern volatile int dontPunchHoles;
+
+// The mapping grows by doubling, but by at most this many bytes at once
+static constexpr size_t MaxGrowthStep = 1024 * 1024 * 1024;
+// Amount of data to prefetch when sequential reads are detected
+static constexpr size_t ReadaheadWindow = 2 * 1024 * 1024;
 
 
 StorageMmap::StorageMmap(const std::string& name) :
     _pagesize(sysconf(_SC_PAGE_SIZE)),
     _name(name), _fd(0),
-    _map(nullptr), _len(0), _size(0)
+    _map(nullptr), _len(0), _size(0),
+    _lastReadEnd(0), _readaheadEnd(0)
 {
 }
 
@@ -93,6 +105,10 @@ int StorageMmap::open()
         return -r;
     }
     _map = p;
+    // Only a hint; this is ignored for file systems that do not support it
+    ::madvise(_map, _len, MADV_HUGEPAGE);
+    _lastReadEnd = 0;
+    _readaheadEnd = 0;
 
     return 0;
 }
@@ -117,6 +133,11 @@ int StorageMmap::close()
     return 0;
 }
 
+int StorageMmap::fileDescriptor() const
+{
+    return _fd;
+}
+
 int StorageMmap::stat(uint64_t* maxBytes, uint64_t* availableBytes)
 {
     struct statvfs statfsbuf;
@@ -133,10 +154,37 @@ int StorageMmap::sizeInBytes(uint64_t* s)
     return 0;
 }
 
+void StorageMmap::adviseReadahead(uint64_t index, uint64_t size)
+{
+    // If this read continues the previous one, make sure the data that
+    // follows is being read in before we fault on it. Concurrent readers
+    // may confuse this, but that only costs a missed or extra hint.
+    uint64_t end = index + size;
+    uint64_t prevEnd = _lastReadEnd.exchange(end, std::memory_order_relaxed);
+    if (prevEnd == index && end + ReadaheadWindow / 2 > _readaheadEnd.load(std::memory_order_relaxed)) {
+        uint64_t from = end / _pagesize * _pagesize;
+        uint64_t to = std::min(uint64_t(from + ReadaheadWindow), uint64_t(_len));
+        if (from < to) {
+            _readaheadEnd.store(to, std::memory_order_relaxed);
+            ::madvise(static_cast<unsigned char*>(_map) + from, to - from, MADV_WILLNEED);
+        }
+    }
+}
+
+void StorageMmap::adviseWillNeedBytes(uint64_t index, uint64_t size)
+{
+    // the pages are read through the mapping, so the hint must go there
+    uint64_t from = index / _pagesize * _pagesize;
+    uint64_t to = std::min(index + size, uint64_t(_len));
+    if (from < to)
+        ::madvise(static_cast<unsigned char*>(_map) + from, to - from, MADV_WILLNEED);
+}
+
 int StorageMmap::readBytes(uint64_t index, uint64_t size, void* buf)
 {
     if (index + size > _size)
         return -EIO;
+    adviseReadahead(index, size);
     ::memcpy(buf, static_cast<unsigned char*>(_map) + index, size);
     return 0;
 }
@@ -152,24 +200,61 @@ int StorageMmap::writeBytes(uint64_t index, uint64_t size, const void* buf)
     return 0;
 }
 
-int StorageMmap::punchHoleBytes(uint64_t /* index */, uint64_t /* size */)
+int StorageMmap::punchHoleBytes(uint64_t index, uint64_t size)
+{
+    // This also drops the pages from the mapping
+    if (!dontPunchHoles) {
+        int r = fallocate(_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, index, size);
+        if (r != 0) {
+            // See StorageFile::punchHoleBytes()
+            dontPunchHoles = 1;
+            logger.log(Logger::Warning, "punching a hole failed, not trying again: %s", strerror(errno));
+        }
+    }
+    return 0;
+}
+
+int StorageMmap::syncBytes()
+{
+    // On Linux, this also writes back pages that were modified through the mapping.
+    // In contrast to msync(), it does not need the mapping, so it cannot race with mremap().
+    if (::fdatasync(_fd) != 0)
+        return -errno;
+    return 0;
+}
+
+int StorageMmap::remap(size_t newLen)
 {
+    int r = setFileSize(_fd, newLen);
+    if (r != 0)
+        return r;
+    void* p = ::mremap(_map, _len, newLen, MREMAP_MAYMOVE);
+    if (p == MAP_FAILED)
+        return -errno;
+    if (p != _map || newLen > _len)
+        ::madvise(p, newLen, MADV_HUGEPAGE);
+    _map = p;
+    _len = newLen;
     return 0;
 }
 
 int StorageMmap::setSizeBytes(uint64_t size)
 {
-    size_t newLen = sizeToMapLength(_pagesize, size);
-    if (newLen != _len) {
-        int r = setFileSize(_fd, newLen);
-        if (r != 0)
-            return r;
-        void* p = ::mremap(_map, _len, newLen, MREMAP_MAYMOVE);
-        if (p == MAP_FAILED)
-            return -errno;
-        _map = p;
-        _len = newLen;
+    size_t minLen = sizeToMapLength(_pagesize, size);
+    int r = 0;
+    if (minLen > _len) {
+        // grow geometrically so that appending is amortized O(1)
+        size_t newLen = std::max(minLen, _len + std::min(_len, MaxGrowthStep));
+        r = remap(sizeToMapLength(_pagesize, newLen));
+        if (r != 0 && newLen > minLen) {
+            // maybe there is enough space for what we actually need
+            r = remap(minLen);
+        }
+    } else if (minLen <= _len / 4) {
+        // shrink lazily, and leave room to grow again
+        r = remap(sizeToMapLength(_pagesize, 2 * size));
     }
-    _size = size;
-    return 0;
+    if (r == 0)
+        _size = size;
+    return r;
 }
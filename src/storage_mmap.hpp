@@ -19,10 +19,15 @@
 #pragma once
 
 #include <string>
+#include <atomic>
 
 #include "storage.hpp"
 
-/* Storage in a file via mmap */
+/* Storage in a file via mmap.
+ *
+ * The file and the mapping are larger than the storage size: they grow
+ * geometrically and shrink lazily, so that appending chunks rarely needs
+ * ftruncate() and mremap(). The file is cut to the storage size on close. */
 class StorageMmap : public Storage
 {
 private:
@@ -30,8 +35,14 @@ private:
     std::string _name;
     int _fd;
     void* _map;
-    size_t _len;
-    size_t _size;
+    size_t _len;  // length of the mapping and of the file
+    size_t _size; // size of the storage
+    // Sequential read detection for readahead hints
+    std::atomic<uint64_t> _lastReadEnd;
+    std::atomic<uint64_t> _readaheadEnd;
+
+    int remap(size_t newLen);
+    void adviseReadahead(uint64_t index, uint64_t size);
 
 public:
     StorageMmap(const std::string& name);
@@ -40,9 +51,12 @@ public:
     virtual int open() override;
     virtual int close() override;
     virtual int stat(uint64_t* maxBytes, uint64_t* availableBytes) override;
+    virtual int fileDescriptor() const override;
+    virtual void adviseWillNeedBytes(uint64_t index, uint64_t size) override;
     virtual int sizeInBytes(uint64_t* s) override;
     virtual int readBytes(uint64_t index, uint64_t size, void* buf) override;
     virtual int writeBytes(uint64_t index, uint64_t size, const void* buf) override;
     virtual int punchHoleBytes(uint64_t index, uint64_t size) override;
     virtual int setSizeBytes(uint64_t size) override;
+    virtual int syncBytes() override;
 };
@@ -0,0 +1,226 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "storage_uring.hpp"
+#include "uring.hpp"
+#include "logger.hpp"
+
+
+// defined in storage_file.cpp
+extern volatile int dontPunchHoles;
+
+// Maximum size of a single read or write operation (the SQE length field has 32 bits)
+static constexpr uint64_t MaxTransferSize = (1U << 30);
+
+
+StorageUring::StorageUring(const std::string& name, bool directIO) : StorageFile(name, directIO), _fileId(0), _fileSlot(-1)
+{
+}
+
+StorageUring::~StorageUring()
+{
+    close();
+}
+
+int StorageUring::open()
+{
+    if (!Uring::forThisThread()) {
+        logger.log(Logger::Error, "io_uring is not available");
+        return -ENOSYS;
+    }
+    int r = StorageFile::open();
+    if (r == 0) {
+        _fileId = Uring::newFileId();
+        _fileSlot = Uring::allocateFileSlot();
+    }
+    return r;
+}
+
+int StorageUring::close()
+{
+    Uring::releaseFileSlot(_fileSlot);
+    _fileSlot = -1;
+    return StorageFile::close();
+}
+
+int StorageUring::transfer(bool write, uint64_t index, size_t bufCount, size_t bufSize, void* const* bufs)
+{
+    Uring* uring = Uring::forThisThread();
+    if (!uring) {
+        return write ? StorageFile::writeBytesV(index, bufCount, bufSize, bufs)
+            : StorageFile::readBytesV(index, bufCount, bufSize, bufs);
+    }
+    size_t bufsDone = 0;
+    while (bufsDone < bufCount) {
+        size_t n = std::min(bufCount - bufsDone, size_t(Uring::Entries));
+        for (size_t i = 0; i < n; i++) {
+            struct io_uring_sqe* sqe = uring->getSqe();
+            sqe->opcode = (write ? IORING_OP_WRITE : IORING_OP_READ);
+            uring->prepareFile(sqe, _fileId, _fileSlot, _fd);
+            sqe->addr = reinterpret_cast<uint64_t>(bufs[bufsDone + i]);
+            sqe->len = bufSize;
+            sqe->off = index + (bufsDone + i) * bufSize;
+        }
+        int r = uring->submitAndWait();
+        if (r < 0)
+            return r;
+        for (size_t i = 0; i < n; i++) {
+            int res = uring->result(i);
+            if (res < 0)
+                return res;
+            if (size_t(res) < bufSize) {
+                // Short transfer: let StorageFile handle the rest
+                unsigned char* rest = static_cast<unsigned char*>(bufs[bufsDone + i]) + res;
+                uint64_t restIndex = index + (bufsDone + i) * bufSize + res;
+                r = write ? StorageFile::writeBytesV(restIndex, 1, bufSize - res, reinterpret_cast<void* const*>(&rest))
+                    : StorageFile::readBytesV(restIndex, 1, bufSize - res, reinterpret_cast<void* const*>(&rest));
+                if (r < 0)
+                    return r;
+            }
+        }
+        bufsDone += n;
+    }
+    return 0;
+}
+
+int StorageUring::readBytes(uint64_t index, uint64_t size, void* buf)
+{
+    if (needsBounce(1, &buf))
+        return StorageFile::readBytes(index, size, buf); // bounces and comes back here
+    unsigned char* p = static_cast<unsigned char*>(buf);
+    while (size > 0) {
+        uint64_t s = std::min(size, MaxTransferSize);
+        void* bufs[1] = { p };
+        int r = transfer(false, index, 1, s, bufs);
+        if (r < 0)
+            return r;
+        size -= s;
+        index += s;
+        p += s;
+    }
+    return 0;
+}
+
+int StorageUring::writeBytes(uint64_t index, uint64_t size, const void* buf)
+{
+    if (needsBounce(1, &buf))
+        return StorageFile::writeBytes(index, size, buf); // bounces and comes back here
+    const unsigned char* p = static_cast<const unsigned char*>(buf);
+    while (size > 0) {
+        uint64_t s = std::min(size, MaxTransferSize);
+        void* bufs[1] = { const_cast<unsigned char*>(p) };
+        int r = transfer(true, index, 1, s, bufs);
+        if (r < 0)
+            return r;
+        size -= s;
+        index += s;
+        p += s;
+    }
+    return 0;
+}
+
+int StorageUring::readBytesV(uint64_t index, size_t bufCount, size_t bufSize, void* const* bufs)
+{
+    if (bufSize > MaxTransferSize || needsBounce(bufCount, bufs))
+        return StorageFile::readBytesV(index, bufCount, bufSize, bufs);
+    return transfer(false, index, bufCount, bufSize, bufs);
+}
+
+int StorageUring::writeBytesV(uint64_t index, size_t bufCount, size_t bufSize, const void* const* bufs)
+{
+    if (bufSize > MaxTransferSize || needsBounce(bufCount, bufs))
+        return StorageFile::writeBytesV(index, bufCount, bufSize, bufs);
+    return transfer(true, index, bufCount, bufSize, const_cast<void* const*>(bufs));
+}
+
+int StorageUring::punchHoleBytes(uint64_t index, uint64_t size)
+{
+    Uring* uring = Uring::forThisThread();
+    if (!uring)
+        return StorageFile::punchHoleBytes(index, size);
+    if (!dontPunchHoles) {
+        struct io_uring_sqe* sqe = uring->getSqe();
+        sqe->opcode = IORING_OP_FALLOCATE;
+        uring->prepareFile(sqe, _fileId, _fileSlot, _fd);
+        sqe->off = index;
+        sqe->addr = size;
+        sqe->len = FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE;
+        int r = uring->submitAndWait();
+        if (r == 0)
+            r = uring->result(0);
+        if (r != 0) {
+            // See StorageFile::punchHoleBytes()
+            dontPunchHoles = 1;
+            logger.log(Logger::Warning, "punching a hole failed, not trying again: %s", strerror(-r));
+        }
+    }
+    return 0;
+}
+
+int StorageUring::syncBytes()
+{
+    Uring* uring = Uring::forThisThread();
+    if (!uring)
+        return StorageFile::syncBytes();
+    struct io_uring_sqe* sqe = uring->getSqe();
+    sqe->opcode = IORING_OP_FSYNC;
+    uring->prepareFile(sqe, _fileId, _fileSlot, _fd);
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    int r = uring->submitAndWait();
+    if (r == 0)
+        r = uring->result(0);
+    return r;
+}
+
+void StorageUring::syncBytesMany(Storage* const* storages, size_t count, int* results)
+{
+    Uring* uring = Uring::forThisThread();
+    if (!uring) {
+        Storage::syncBytesMany(storages, count, results);
+        return;
+    }
+    size_t done = 0;
+    while (done < count) {
+        // storages of other types are synced on their own
+        size_t batch[Uring::Entries];
+        size_t n = 0;
+        for (; done < count && n < Uring::Entries; done++) {
+            StorageUring* su = dynamic_cast<StorageUring*>(storages[done]);
+            if (!su) {
+                results[done] = storages[done]->syncBytes();
+                continue;
+            }
+            struct io_uring_sqe* sqe = uring->getSqe();
+            sqe->opcode = IORING_OP_FSYNC;
+            uring->prepareFile(sqe, su->_fileId, su->_fileSlot, su->_fd);
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            batch[n++] = done;
+        }
+        if (n == 0)
+            continue;
+        int r = uring->submitAndWait();
+        for (size_t i = 0; i < n; i++)
+            results[batch[i]] = (r < 0 ? r : uring->result(i));
+    }
+}
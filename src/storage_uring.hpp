@@ -0,0 +1,51 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include "storage_file.hpp"
+
+/* Storage in a file, with I/O done via io_uring.
+ *
+ * Multi-chunk transfers are submitted as one batch of operations with a
+ * single system call, instead of one pread()/pwrite() per chunk, and so are the
+ * data syncs of several files in syncBytesMany(). Each thread
+ * uses its own ring, see class Uring; threads that cannot get one fall back
+ * to the StorageFile implementation. */
+class StorageUring : public StorageFile
+{
+private:
+    uint64_t _fileId;
+    int _fileSlot;
+
+    int transfer(bool write, uint64_t index, size_t bufCount, size_t bufSize, void* const* bufs);
+
+public:
+    StorageUring(const std::string& name, bool directIO);
+    ~StorageUring();
+
+    virtual int open() override;
+    virtual int close() override;
+    virtual int readBytes(uint64_t index, uint64_t size, void* buf) override;
+    virtual int writeBytes(uint64_t index, uint64_t size, const void* buf) override;
+    virtual int punchHoleBytes(uint64_t index, uint64_t size) override;
+    virtual int syncBytes() override;
+    virtual void syncBytesMany(Storage* const* storages, size_t count, int* results) override;
+    virtual int readBytesV(uint64_t index, size_t bufCount, size_t bufSize, void* const* bufs) override;
+    virtual int writeBytesV(uint64_t index, size_t bufCount, size_t bufSize, const void* const* bufs) override;
+};
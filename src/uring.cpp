@@ -0,0 +1,249 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+#include "uring.hpp"
+
+
+static int uringSetup(unsigned int entries, struct io_uring_params* p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uringEnter(int fd, unsigned int toSubmit, unsigned int minComplete, unsigned int flags)
+{
+    return syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int uringRegister(int fd, unsigned int opcode, const void* arg, unsigned int nrArgs)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+static unsigned int* ringPtr(void* ring, unsigned int offset)
+{
+    return reinterpret_cast<unsigned int*>(static_cast<unsigned char*>(ring) + offset);
+}
+
+
+Uring::Uring() :
+    _fd(-1), _sqRing(MAP_FAILED), _cqRing(MAP_FAILED), _sqes(static_cast<struct io_uring_sqe*>(MAP_FAILED)),
+    _pending(0), _haveFileSlots(false)
+{
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = uringSetup(Entries, &p);
+    if (fd < 0)
+        return;
+    _fd = fd;
+    _sqEntries = std::min(p.sq_entries, Entries);
+    _cqEntries = p.cq_entries;
+
+    _sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    _cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = (p.features & IORING_FEAT_SINGLE_MMAP);
+    if (singleMmap)
+        _sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+    _sqRing = mmap(nullptr, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQ_RING);
+    if (_sqRing == MAP_FAILED) {
+        destroy();
+        return;
+    }
+    if (singleMmap) {
+        _cqRing = _sqRing;
+    } else {
+        _cqRing = mmap(nullptr, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_CQ_RING);
+        if (_cqRing == MAP_FAILED) {
+            destroy();
+            return;
+        }
+    }
+    _sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        destroy();
+        return;
+    }
+    _sqes = static_cast<struct io_uring_sqe*>(sqes);
+
+    _sqHead = ringPtr(_sqRing, p.sq_off.head);
+    _sqTail = ringPtr(_sqRing, p.sq_off.tail);
+    _sqMask = *ringPtr(_sqRing, p.sq_off.ring_mask);
+    _sqArray = ringPtr(_sqRing, p.sq_off.array);
+    _cqHead = ringPtr(_cqRing, p.cq_off.head);
+    _cqTail = ringPtr(_cqRing, p.cq_off.tail);
+    _cqMask = *ringPtr(_cqRing, p.cq_off.ring_mask);
+    _cqes = reinterpret_cast<struct io_uring_cqe*>(static_cast<unsigned char*>(_cqRing) + p.cq_off.cqes);
+
+    // Register an empty (sparse) file table; files are added on first use.
+    // If this fails we simply use plain file descriptors.
+    int fds[FileSlots];
+    for (unsigned int i = 0; i < FileSlots; i++) {
+        fds[i] = -1;
+        _fileSlotOwners[i] = 0;
+    }
+    _haveFileSlots = (uringRegister(_fd, IORING_REGISTER_FILES, fds, FileSlots) == 0);
+}
+
+void Uring::destroy()
+{
+    if (_sqes != MAP_FAILED)
+        munmap(_sqes, _sqesSize);
+    if (_cqRing != MAP_FAILED && _cqRing != _sqRing)
+        munmap(_cqRing, _cqRingSize);
+    if (_sqRing != MAP_FAILED)
+        munmap(_sqRing, _sqRingSize);
+    if (_fd >= 0)
+        ::close(_fd);
+    _sqes = static_cast<struct io_uring_sqe*>(MAP_FAILED);
+    _cqRing = MAP_FAILED;
+    _sqRing = MAP_FAILED;
+    _fd = -1;
+}
+
+Uring::~Uring()
+{
+    destroy();
+}
+
+Uring* Uring::forThisThread()
+{
+    static thread_local Uring uring;
+    return (uring._fd >= 0 ? &uring : nullptr);
+}
+
+static std::atomic<uint64_t> lastFileId(0);
+static std::mutex fileSlotMutex;
+static bool fileSlotUsed[Uring::FileSlots];
+
+uint64_t Uring::newFileId()
+{
+    return ++lastFileId;
+}
+
+int Uring::allocateFileSlot()
+{
+    std::lock_guard<std::mutex> lock(fileSlotMutex);
+    for (unsigned int i = 0; i < FileSlots; i++) {
+        if (!fileSlotUsed[i]) {
+            fileSlotUsed[i] = true;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void Uring::releaseFileSlot(int slot)
+{
+    if (slot >= 0) {
+        std::lock_guard<std::mutex> lock(fileSlotMutex);
+        fileSlotUsed[slot] = false;
+    }
+}
+
+struct io_uring_sqe* Uring::getSqe()
+{
+    if (_pending >= _sqEntries)
+        return nullptr;
+    struct io_uring_sqe* sqe = &(_sqes[_pending]);
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = _pending;
+    _pending++;
+    return sqe;
+}
+
+void Uring::prepareFile(struct io_uring_sqe* sqe, uint64_t fileId, int slot, int fd)
+{
+    if (_haveFileSlots && slot >= 0) {
+        if (_fileSlotOwners[slot] != fileId) {
+            // The slot is new to this ring or was used by a file that is now closed
+            int32_t fds[1] = { fd };
+            struct io_uring_files_update update;
+            memset(&update, 0, sizeof(update));
+            update.offset = slot;
+            update.fds = reinterpret_cast<uint64_t>(fds);
+            if (uringRegister(_fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1)
+                _fileSlotOwners[slot] = fileId;
+        }
+        if (_fileSlotOwners[slot] == fileId) {
+            sqe->fd = slot;
+            sqe->flags |= IOSQE_FIXED_FILE;
+            return;
+        }
+    }
+    sqe->fd = fd;
+}
+
+int Uring::submitAndWait()
+{
+    unsigned int count = _pending;
+    _pending = 0;
+
+    // The SQEs are consumed by the kernel during submission, so we can
+    // always put the batch into _sqes[0..count) and reuse them afterwards.
+    unsigned int tail = *_sqTail;
+    for (unsigned int i = 0; i < count; i++)
+        _sqArray[(tail + i) & _sqMask] = i;
+    __atomic_store_n(_sqTail, tail + count, __ATOMIC_RELEASE);
+
+    int ret = 0;
+    unsigned int submitted = 0;
+    while (submitted < count) {
+        int r = uringEnter(_fd, count - submitted, count - submitted, IORING_ENTER_GETEVENTS);
+        if (r < 0) {
+            if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+                continue;
+            ret = -errno;
+            break;
+        }
+        submitted += r;
+    }
+    if (submitted < count) {
+        // Take back what was not submitted so that the ring stays consistent
+        __atomic_store_n(_sqTail, tail + submitted, __ATOMIC_RELEASE);
+    }
+
+    unsigned int completed = 0;
+    while (completed < submitted) {
+        unsigned int head = *_cqHead;
+        unsigned int cqTail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+        if (head == cqTail) {
+            int r = uringEnter(_fd, 0, submitted - completed, IORING_ENTER_GETEVENTS);
+            if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+                return -errno; // the ring is unusable now; this should never happen
+            continue;
+        }
+        for (; head != cqTail; head++) {
+            const struct io_uring_cqe* cqe = &(_cqes[head & _cqMask]);
+            if (cqe->user_data < count)
+                _results[cqe->user_data] = cqe->res;
+            completed++;
+        }
+        __atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+    }
+    return ret;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include <linux/io_uring.h>
+
+
+/* A minimal io_uring instance that uses the kernel interface directly.
+ *
+ * Each thread gets its own ring (see forThisThread()), shared by all storage
+ * files, so no locking is needed. A caller prepares a batch of operations with
+ * getSqe(), submits them all and waits for all completions in a single call of
+ * submitAndWait(), and then gets the results with result().
+ *
+ * Files can be registered in fixed slots to avoid looking up the file for every
+ * operation, see prepareFile(). Slots are allocated process-wide with
+ * allocateFileSlot(); each ring registers a file in its slot on first use. */
+class Uring
+{
+public:
+    static constexpr unsigned int Entries = 64;  // max number of operations per batch
+    static constexpr unsigned int FileSlots = 64; // max number of registered files
+
+private:
+    int _fd;
+    unsigned int _sqEntries;
+    unsigned int _cqEntries;
+    void* _sqRing;
+    size_t _sqRingSize;
+    void* _cqRing;
+    size_t _cqRingSize;
+    struct io_uring_sqe* _sqes;
+    size_t _sqesSize;
+    unsigned int* _sqHead;
+    unsigned int* _sqTail;
+    unsigned int _sqMask;
+    unsigned int* _sqArray;
+    unsigned int* _cqHead;
+    unsigned int* _cqTail;
+    unsigned int _cqMask;
+    struct io_uring_cqe* _cqes;
+
+    unsigned int _pending;         // prepared, not yet submitted
+    int _results[Entries];
+    bool _haveFileSlots;
+    uint64_t _fileSlotOwners[FileSlots]; // file ids registered in our slots
+
+    void destroy();
+
+public:
+    Uring();
+    ~Uring();
+
+    // The ring of the calling thread, or nullptr if io_uring is not available
+    static Uring* forThisThread();
+
+    // Get a unique file id and a registration slot (or -1 if none are left)
+    static uint64_t newFileId();
+    static int allocateFileSlot();
+    static void releaseFileSlot(int slot);
+
+    // Get the next SQE of the current batch; returns nullptr if the batch is full.
+    // The SQE is zeroed and its user_data set so that result() works.
+    struct io_uring_sqe* getSqe();
+    // Set the file of an SQE, using the registered slot if possible
+    void prepareFile(struct io_uring_sqe* sqe, uint64_t fileId, int slot, int fd);
+    // Number of SQEs in the current batch
+    unsigned int pending() const { return _pending; }
+    // Submit the current batch and wait until all its operations completed.
+    // Returns an error only if the submission itself failed.
+    int submitAndWait();
+    // The result (cqe res) of operation i of the last batch
+    int result(unsigned int i) const { return _results[i]; }
+};
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+
+#include "worker_pool.hpp"
+
+
+WorkerPool::WorkerPool(unsigned int threadCount) :
+    _threadCount(threadCount), _threadsStarted(false), _stop(false)
+{
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _workAvailable.notify_all();
+    for (size_t i = 0; i < _threads.size(); i++)
+        _threads[i].join();
+}
+
+void WorkerPool::startThreads()
+{
+    _threadsStarted = true;
+    try {
+        for (unsigned int i = 0; i < _threadCount; i++)
+            _threads.emplace_back(&WorkerPool::work, this);
+    }
+    catch (...) {
+        // continue with the threads we have; the calling threads do the rest of the work
+    }
+}
+
+bool WorkerPool::claimTask(Job** job, size_t* task)
+{
+    if (_jobs.empty())
+        return false;
+    *job = _jobs.front();
+    *task = (*job)->nextTask++;
+    if ((*job)->nextTask == (*job)->taskCount)
+        _jobs.erase(_jobs.begin());
+    return true;
+}
+
+void WorkerPool::finishTask(Job* job, int r)
+{
+    if (job->result == 0)
+        job->result = r;
+    job->unfinishedTasks--;
+    if (job->unfinishedTasks == 0)
+        _jobFinished.notify_all();
+}
+
+void WorkerPool::work()
+{
+    std::unique_lock<std::mutex> lock(_mutex);
+    for (;;) {
+        Job* job;
+        size_t task;
+        if (claimTask(&job, &task)) {
+            lock.unlock();
+            int r = (*(job->f))(task);
+            lock.lock();
+            finishTask(job, r);
+        } else if (_stop) {
+            break;
+        } else {
+            _workAvailable.wait(lock);
+        }
+    }
+}
+
+int WorkerPool::run(size_t taskCount, const std::function<int (size_t task)>& f)
+{
+    if (taskCount == 0)
+        return 0;
+    if (taskCount == 1 || _threadCount == 0) {
+        int r = 0;
+        for (size_t i = 0; r == 0 && i < taskCount; i++)
+            r = f(i);
+        return r;
+    }
+
+    Job job = { &f, taskCount, 0, taskCount, 0 };
+    std::unique_lock<std::mutex> lock(_mutex);
+    if (!_threadsStarted)
+        startThreads();
+    try {
+        _jobs.push_back(&job);
+    }
+    catch (...) {
+        return -ENOMEM;
+    }
+    _workAvailable.notify_all();
+    // work on our own job while it has unclaimed tasks, then wait for the workers
+    while (job.nextTask < job.taskCount) {
+        Job* j;
+        size_t task;
+        claimTask(&j, &task);
+        lock.unlock();
+        int r = (*(j->f))(task);
+        lock.lock();
+        finishTask(j, r);
+    }
+    _jobFinished.wait(lock, [&job] { return job.unfinishedTasks == 0; });
+    return job.result;
+}
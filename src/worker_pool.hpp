@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2024
+ * Martin Lambers <marlam@marlam.de>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+
+// A fixed set of worker threads that process the tasks of a job in parallel.
+// The thread that runs a job works on its tasks, too, so a pool without
+// worker threads simply runs all tasks serially on the calling thread.
+// The worker threads are started when the first job is run, so that the pool
+// can be created before the process daemonizes.
+class WorkerPool
+{
+private:
+    class Job
+    {
+    public:
+        const std::function<int (size_t task)>* f;
+        size_t taskCount;
+        size_t nextTask;
+        size_t unfinishedTasks;
+        int result;
+    };
+
+    const unsigned int _threadCount;
+    std::mutex _mutex; // protects everything below and the state of all queued jobs
+    bool _threadsStarted;
+    std::vector<std::thread> _threads;
+    std::condition_variable _workAvailable;
+    std::condition_variable _jobFinished;
+    std::vector<Job*> _jobs; // jobs that still have unclaimed tasks
+    bool _stop;
+
+    // Claim the next task of the first queued job; returns false if there is none
+    bool claimTask(Job** job, size_t* task);
+    void finishTask(Job* job, int r);
+    void startThreads();
+    void work();
+
+public:
+    WorkerPool(unsigned int threadCount);
+    ~WorkerPool();
+
+    // Run f(0), ..., f(taskCount - 1) in parallel and wait until all of them finished.
+    // Returns the first error reported by a task, or 0.
+    int run(size_t taskCount, const std::function<int (size_t task)>& f);
+};